@@ -0,0 +1,331 @@
+/*
+ * archive_map.c: cached, validated read-only mappings of session .BIN files
+ */
+
+#define _GNU_SOURCE
+#include "archive_map.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Cache entry; the public part comes first so the pointers convert */
+struct map_entry
+{
+    struct archive_map pub;
+    struct timespec mtime;
+    unsigned refs;
+    unsigned long last_use; /* LRU tick for idle eviction */
+    struct map_entry *next;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct map_entry *cache_head;
+static unsigned long cache_tick;
+
+/* ============================ MAPPING ============================ */
+
+static void entry_free(struct map_entry *e)
+{
+    if (e->pub.data)
+    {
+        munmap((void *)e->pub.data, e->pub.size);
+    }
+    free(e);
+}
+
+/* Framing check done once per mapping: whole records + timestamp order */
+static void validate(struct archive_map *m)
+{
+    m->records = m->size / RECORD_SIZE;
+    m->trailing = m->size % RECORD_SIZE;
+    m->ts_monotonic = 1;
+
+    if (m->records == 0)
+    {
+        return;
+    }
+
+    const struct raw_record *r = (const struct raw_record *)m->data;
+    uint32_t prev = r[0].timestamp_ms;
+    m->first_ts = prev;
+
+    for (size_t i = 1; i < m->records; i++)
+    {
+        uint32_t ts = r[i].timestamp_ms;
+        if (ts < prev)
+        {
+            m->ts_monotonic = 0;
+        }
+        prev = ts;
+    }
+    m->last_ts = prev;
+}
+
+static struct map_entry *entry_create(const char *path, int fd, const struct stat *st)
+{
+    struct map_entry *e = calloc(1, sizeof(*e));
+    if (!e)
+    {
+        return NULL;
+    }
+
+    e->pub.size = (size_t)st->st_size;
+    e->pub.dev = st->st_dev;
+    e->pub.ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    snprintf(e->pub.path, sizeof(e->pub.path), "%s", path);
+
+    if (e->pub.size > 0)
+    {
+        void *p = mmap(NULL, e->pub.size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            free(e);
+            return NULL;
+        }
+        madvise(p, e->pub.size, MADV_SEQUENTIAL);
+        e->pub.data = p;
+    }
+
+    validate(&e->pub);
+    if (e->pub.trailing)
+    {
+        fprintf(stderr, "%s: %zu trailing byte(s) after %zu records ignored\n",
+                path, e->pub.trailing, e->pub.records);
+    }
+    return e;
+}
+
+/* Unmap idle entries beyond ARCHIVE_MAP_CACHE_MAX (cache_lock held) */
+static void evict_idle(unsigned keep)
+{
+    for (;;)
+    {
+        unsigned idle = 0;
+        struct map_entry **victim = NULL;
+
+        for (struct map_entry **pp = &cache_head; *pp; pp = &(*pp)->next)
+        {
+            if ((*pp)->refs == 0)
+            {
+                ++idle;
+                if (!victim || (*pp)->last_use < (*victim)->last_use)
+                {
+                    victim = pp;
+                }
+            }
+        }
+        if (idle <= keep || !victim)
+        {
+            return;
+        }
+
+        struct map_entry *e = *victim;
+        *victim = e->next;
+        entry_free(e);
+    }
+}
+
+const struct archive_map *archive_map_open(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        int e = errno;
+        close(fd);
+        errno = e;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+
+    for (struct map_entry **pp = &cache_head; *pp; pp = &(*pp)->next)
+    {
+        struct map_entry *e = *pp;
+        if (e->pub.dev != st.st_dev || e->pub.ino != st.st_ino)
+        {
+            continue;
+        }
+
+        if (e->pub.size == (size_t)st.st_size &&
+            e->mtime.tv_sec == st.st_mtim.tv_sec &&
+            e->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            e->refs++;
+            e->last_use = ++cache_tick;
+            pthread_mutex_unlock(&cache_lock);
+            close(fd);
+            return &e->pub;
+        }
+
+        /* File changed: drop the stale entry once nobody uses it */
+        if (e->refs == 0)
+        {
+            *pp = e->next;
+            entry_free(e);
+        }
+        break;
+    }
+
+    struct map_entry *e = entry_create(path, fd, &st);
+    int err = errno;
+    close(fd);
+
+    if (!e)
+    {
+        pthread_mutex_unlock(&cache_lock);
+        errno = err;
+        return NULL;
+    }
+
+    e->refs = 1;
+    e->last_use = ++cache_tick;
+    e->next = cache_head;
+    cache_head = e;
+
+    pthread_mutex_unlock(&cache_lock);
+    return &e->pub;
+}
+
+void archive_map_release(const struct archive_map *m)
+{
+    if (!m)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    struct map_entry *e = (struct map_entry *)m;
+    if (e->refs > 0)
+    {
+        e->refs--;
+    }
+    evict_idle(ARCHIVE_MAP_CACHE_MAX);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void archive_map_trim(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    evict_idle(0);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* ============================= VIEWS ============================= */
+
+static size_t clamp_range(const struct archive_map *m, size_t first, size_t n)
+{
+    if (first >= m->records)
+    {
+        return 0;
+    }
+    return n > m->records - first ? m->records - first : n;
+}
+
+struct record_span archive_map_span(const struct archive_map *m, size_t first, size_t n)
+{
+    struct record_span s = {0};
+    s.n = clamp_range(m, first, n);
+    if (s.n)
+    {
+        s.rec = (const struct raw_record *)m->data + first;
+    }
+    return s;
+}
+
+void archive_map_columns(const struct archive_map *m, size_t first, size_t n,
+                         struct record_columns *out)
+{
+    n = clamp_range(m, first, n);
+    const uint8_t *base = n ? m->data + first * RECORD_SIZE : NULL;
+
+    out->timestamp_ms = (struct column_view){base, RECORD_SIZE, n};
+    out->pressure_raw = (struct column_view){base ? base + 4 : NULL, RECORD_SIZE, n};
+    out->label = (struct column_view){base ? base + 8 : NULL, RECORD_SIZE, n};
+    for (int c = 0; c < IMU_CHANNELS; c++)
+    {
+        out->imu[c] = (struct column_view){base ? base + 9 + 2 * c : NULL, RECORD_SIZE, n};
+    }
+}
+
+size_t archive_map_lower_bound(const struct archive_map *m, uint32_t ts)
+{
+    const struct raw_record *r = (const struct raw_record *)m->data;
+    size_t lo = 0, hi = m->records;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (r[mid].timestamp_ms < ts)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* ============================ LISTING ============================ */
+
+static int is_bin(const struct dirent *de)
+{
+    const char *dot = strrchr(de->d_name, '.');
+    return de->d_name[0] != '.' && dot &&
+           (strcmp(dot, ".BIN") == 0 || strcmp(dot, ".bin") == 0);
+}
+
+int archive_list_bins(const char *dir, char ***names)
+{
+    struct dirent **ents;
+    int n = scandir(dir, &ents, is_bin, alphasort);
+    if (n < 0)
+    {
+        return -1;
+    }
+
+    char **out = calloc((size_t)n + 1, sizeof(*out));
+    for (int i = 0; i < n; i++)
+    {
+        if (out && !(out[i] = strdup(ents[i]->d_name)))
+        {
+            archive_free_list(out, i);
+            out = NULL;
+        }
+        free(ents[i]);
+    }
+    free(ents);
+
+    if (!out)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    *names = out;
+    return n;
+}
+
+void archive_free_list(char **names, int n)
+{
+    for (int i = 0; names && i < n; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+}
@@ -0,0 +1,107 @@
+/*
+ * archive_map.h: zero-copy read access to session .BIN files
+ *
+ * Files are mmap'd read-only and validated once; the mapping is cached
+ * (keyed by device/inode) and shared by every reader in the process, so
+ * replay, query and export tools read records straight from page cache.
+ */
+
+#ifndef WEARABLE_ARCHIVE_MAP_H
+#define WEARABLE_ARCHIVE_MAP_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "record.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/* Idle mappings kept around after their last release */
+#ifndef ARCHIVE_MAP_CACHE_MAX
+#define ARCHIVE_MAP_CACHE_MAX 16
+#endif
+
+struct archive_map
+{
+    const uint8_t *data; /* NULL for an empty file */
+    size_t size;
+    size_t records;  /* whole records */
+    size_t trailing; /* bytes of a torn last record, not part of records */
+    uint32_t first_ts;
+    uint32_t last_ts;
+    int ts_monotonic; /* timestamps never decrease: binary search is valid */
+    dev_t dev;
+    ino_t ino;
+    char path[PATH_MAX]; /* as opened first; informational */
+};
+
+/* Typed span over consecutive records of a mapping */
+struct record_span
+{
+    const struct raw_record *rec;
+    size_t n;
+};
+
+/* Strided column over the mapping: element i lives at base + i * stride */
+struct column_view
+{
+    const uint8_t *base;
+    size_t stride;
+    size_t n;
+};
+
+/* SoA view of a record range, every column backed by the mapping */
+struct record_columns
+{
+    struct column_view timestamp_ms; /* uint32_t */
+    struct column_view pressure_raw; /* uint32_t, Pa * 100 */
+    struct column_view label;        /* uint8_t */
+    struct column_view imu[IMU_CHANNELS]; /* int16_t, raw / IMU_SCALE */
+};
+
+/* Map (or reuse) a .BIN file; NULL with errno set on failure */
+const struct archive_map *archive_map_open(const char *path);
+
+/* Drop a reference returned by archive_map_open */
+void archive_map_release(const struct archive_map *m);
+
+/* Unmap every idle cached mapping */
+void archive_map_trim(void);
+
+/* Records [first, first + n) clamped to the mapping */
+struct record_span archive_map_span(const struct archive_map *m, size_t first, size_t n);
+void archive_map_columns(const struct archive_map *m, size_t first, size_t n,
+                         struct record_columns *out);
+
+/* First record with timestamp >= ts (requires ts_monotonic) */
+size_t archive_map_lower_bound(const struct archive_map *m, uint32_t ts);
+
+/* Sorted *.BIN / *.bin names in dir. Returns the count or -1;
+ * free the list with archive_free_list. */
+int archive_list_bins(const char *dir, char ***names);
+void archive_free_list(char **names, int n);
+
+static inline uint32_t column_u32(const struct column_view *v, size_t i)
+{
+    uint32_t x;
+    __builtin_memcpy(&x, v->base + i * v->stride, sizeof(x));
+    return x;
+}
+
+static inline int16_t column_i16(const struct column_view *v, size_t i)
+{
+    int16_t x;
+    __builtin_memcpy(&x, v->base + i * v->stride, sizeof(x));
+    return x;
+}
+
+static inline uint8_t column_u8(const struct column_view *v, size_t i)
+{
+    return v->base[i * v->stride];
+}
+
+#endif /* WEARABLE_ARCHIVE_MAP_H */
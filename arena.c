@@ -0,0 +1,240 @@
+/*
+ * arena.c: per-session arenas and size-classed buffer pools
+ */
+
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POOL_LARGE 0xffu
+#define POOL_MAGIC 0x504f4f4cu /* "POOL" */
+#define ARENA_CHUNK (64 * 1024)
+
+static const size_t class_size[POOL_CLASSES] = {4096, 64 * 1024, 256 * 1024, 1024 * 1024};
+
+/* Idle buffers kept per class: bounds the footprint at ~13 MiB */
+static const unsigned class_cap[POOL_CLASSES] = {64, 32, 16, 8};
+
+/* Sits in front of every buffer; 16 bytes keeps the payload aligned */
+struct pool_hdr
+{
+    uint32_t cls;
+    uint32_t magic;
+    uint64_t size; /* usable bytes */
+};
+
+struct free_node
+{
+    struct free_node *next;
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    struct free_node *head;
+    unsigned long cached;
+    unsigned long reused;
+    unsigned long allocated;
+} pools[POOL_CLASSES] = {
+    {.lock = PTHREAD_MUTEX_INITIALIZER},
+    {.lock = PTHREAD_MUTEX_INITIALIZER},
+    {.lock = PTHREAD_MUTEX_INITIALIZER},
+    {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+static unsigned long large_allocs;
+
+/* ============================== POOLS ============================ */
+
+void *pool_get(size_t size)
+{
+    unsigned cls = 0;
+    while (cls < POOL_CLASSES && class_size[cls] < size)
+    {
+        cls++;
+    }
+
+    struct pool_hdr *h = NULL;
+
+    if (cls < POOL_CLASSES)
+    {
+        pthread_mutex_lock(&pools[cls].lock);
+        struct free_node *n = pools[cls].head;
+        if (n)
+        {
+            pools[cls].head = n->next;
+            pools[cls].cached--;
+            pools[cls].reused++;
+        }
+        else
+        {
+            pools[cls].allocated++;
+        }
+        pthread_mutex_unlock(&pools[cls].lock);
+
+        if (n)
+        {
+            return n;
+        }
+        size = class_size[cls];
+    }
+    else
+    {
+        __atomic_add_fetch(&large_allocs, 1, __ATOMIC_RELAXED);
+        cls = POOL_LARGE;
+    }
+
+    h = malloc(sizeof(*h) + size);
+    if (!h)
+    {
+        return NULL;
+    }
+    h->cls = cls;
+    h->magic = POOL_MAGIC;
+    h->size = size;
+    return h + 1;
+}
+
+void pool_put(void *buf)
+{
+    if (!buf)
+    {
+        return;
+    }
+
+    struct pool_hdr *h = (struct pool_hdr *)buf - 1;
+    if (h->magic != POOL_MAGIC)
+    {
+        fprintf(stderr, "pool_put: %p is not a pool buffer\n", buf);
+        abort();
+    }
+
+    if (h->cls < POOL_CLASSES)
+    {
+        unsigned cls = h->cls;
+        pthread_mutex_lock(&pools[cls].lock);
+        if (pools[cls].cached < class_cap[cls])
+        {
+            struct free_node *n = buf;
+            n->next = pools[cls].head;
+            pools[cls].head = n;
+            pools[cls].cached++;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&pools[cls].lock);
+    }
+
+    if (buf)
+    {
+        h->magic = 0;
+        free(h);
+    }
+}
+
+size_t pool_size(const void *buf)
+{
+    return (size_t)((const struct pool_hdr *)buf - 1)->size;
+}
+
+void pool_get_stats(struct pool_stats *out)
+{
+    for (unsigned c = 0; c < POOL_CLASSES; c++)
+    {
+        pthread_mutex_lock(&pools[c].lock);
+        out->reused[c] = pools[c].reused;
+        out->allocated[c] = pools[c].allocated;
+        out->cached[c] = pools[c].cached;
+        pthread_mutex_unlock(&pools[c].lock);
+    }
+    out->large = __atomic_load_n(&large_allocs, __ATOMIC_RELAXED);
+}
+
+void pool_trim(void)
+{
+    for (unsigned c = 0; c < POOL_CLASSES; c++)
+    {
+        pthread_mutex_lock(&pools[c].lock);
+        struct free_node *n = pools[c].head;
+        pools[c].head = NULL;
+        pools[c].cached = 0;
+        pthread_mutex_unlock(&pools[c].lock);
+
+        while (n)
+        {
+            struct free_node *next = n->next;
+            struct pool_hdr *h = (struct pool_hdr *)n - 1;
+            h->magic = 0;
+            free(h);
+            n = next;
+        }
+    }
+}
+
+/* ============================== ARENA ============================ */
+
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t used;
+    size_t cap;
+    _Alignas(16) unsigned char data[];
+};
+
+void arena_init(struct arena *a)
+{
+    a->head = NULL;
+    a->bytes = 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+
+    struct arena_chunk *c = a->head;
+    if (!c || c->cap - c->used < size)
+    {
+        size_t want = sizeof(*c) + size;
+        c = pool_get(want < ARENA_CHUNK ? ARENA_CHUNK : want);
+        if (!c)
+        {
+            return NULL;
+        }
+        c->cap = pool_size(c) - sizeof(*c);
+        c->used = 0;
+
+        /* Oversized chunks go behind the current one so its space is kept */
+        if (a->head && size > ARENA_CHUNK / 2)
+        {
+            c->next = a->head->next;
+            a->head->next = c;
+        }
+        else
+        {
+            c->next = a->head;
+            a->head = c;
+        }
+    }
+
+    void *p = c->data + c->used;
+    c->used += size;
+    a->bytes += size;
+    memset(p, 0, size);
+    return p;
+}
+
+void arena_release(struct arena *a)
+{
+    struct arena_chunk *c = a->head;
+    while (c)
+    {
+        struct arena_chunk *next = c->next;
+        pool_put(c);
+        c = next;
+    }
+    a->head = NULL;
+    a->bytes = 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * arena.h: per-session arenas and size-classed buffer pools
+ *
+ * Buffers on the hot path (I/O, decode batches, payloads) come from
+ * process-wide pools of a few fixed sizes and go back there instead of to
+ * malloc; session-lifetime objects are bump-allocated from the session's
+ * arena, whose chunks are pool buffers too, and released in one step.
+ */
+
+#ifndef WEARABLE_ARENA_H
+#define WEARABLE_ARENA_H
+
+#include <stddef.h>
+
+/* Size classes: 4 KiB, 64 KiB, 256 KiB, 1 MiB; larger requests use malloc */
+#define POOL_CLASSES 4
+
+struct pool_stats
+{
+    unsigned long reused[POOL_CLASSES];    /* served from a free list */
+    unsigned long allocated[POOL_CLASSES]; /* had to call malloc */
+    unsigned long cached[POOL_CLASSES];    /* idle buffers held */
+    unsigned long large;                   /* bypassed the pools */
+};
+
+/* Buffer of at least size bytes, 16-byte aligned, contents undefined */
+void *pool_get(size_t size);
+
+/* Return a pool_get buffer (NULL is ignored) */
+void pool_put(void *buf);
+
+/* Usable size of a pool_get buffer */
+size_t pool_size(const void *buf);
+
+void pool_get_stats(struct pool_stats *out);
+
+/* Free every idle buffer */
+void pool_trim(void);
+
+struct arena_chunk;
+
+struct arena
+{
+    struct arena_chunk *head;
+    size_t bytes; /* handed out so far */
+};
+
+void arena_init(struct arena *a);
+
+/* 16-byte aligned, zeroed; NULL on allocation failure */
+void *arena_alloc(struct arena *a, size_t size);
+
+/* Give every chunk back to the pools; the arena is empty afterwards */
+void arena_release(struct arena *a);
+
+#endif /* WEARABLE_ARENA_H */
@@ -0,0 +1,287 @@
+/*
+ * block_cache.c: shared LRU cache of decoded record blocks
+ *
+ * Each shard has a small chained hash table and an LRU list, both under
+ * the shard lock. A miss decodes outside the lock and inserts afterwards;
+ * if another reader inserted the same block meanwhile, its copy wins and
+ * ours goes back to the pool. Hits copy out under the lock, so a block is
+ * never freed while someone reads it and no reference counts are needed.
+ */
+
+#include "block_cache.h"
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SHARD_BUCKETS 256 /* hash chains per shard, a power of two */
+
+struct block_key
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t block;
+};
+
+struct cached_block
+{
+    struct block_key key;
+    struct cached_block *hnext;       /* hash chain */
+    struct cached_block *prev, *next; /* LRU, head = most recently used */
+    struct record_batch batch;
+};
+
+struct shard
+{
+    pthread_mutex_t lock;
+    struct cached_block *bucket[SHARD_BUCKETS];
+    struct cached_block *head, *tail;
+    size_t blocks;
+    size_t bytes;
+    unsigned long long hits, misses, evictions;
+};
+
+static struct shard shards[BLOCK_CACHE_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+#define SHARD_BUDGET ((size_t)BLOCK_CACHE_MB * 1024 * 1024 / BLOCK_CACHE_SHARDS)
+
+static void shards_init(void)
+{
+    for (int s = 0; s < BLOCK_CACHE_SHARDS; s++)
+    {
+        pthread_mutex_init(&shards[s].lock, NULL);
+    }
+}
+
+static uint64_t key_hash(const struct block_key *k)
+{
+    uint64_t h = k->dev * 0x9e3779b97f4a7c15ULL;
+    h ^= k->ino + 0x632be59bd9b4e019ULL + (h << 6) + (h >> 2);
+    h ^= k->size + (h << 6) + (h >> 2);
+    h ^= k->block * 0xbf58476d1ce4e5b9ULL + (h << 6) + (h >> 2);
+    return h ^ (h >> 31);
+}
+
+/* ============================== LRU ============================== */
+
+static void lru_unlink(struct shard *sh, struct cached_block *b)
+{
+    if (b->prev)
+    {
+        b->prev->next = b->next;
+    }
+    else
+    {
+        sh->head = b->next;
+    }
+    if (b->next)
+    {
+        b->next->prev = b->prev;
+    }
+    else
+    {
+        sh->tail = b->prev;
+    }
+}
+
+static void lru_push(struct shard *sh, struct cached_block *b)
+{
+    b->prev = NULL;
+    b->next = sh->head;
+    if (sh->head)
+    {
+        sh->head->prev = b;
+    }
+    sh->head = b;
+    if (!sh->tail)
+    {
+        sh->tail = b;
+    }
+}
+
+static struct cached_block *shard_find(struct shard *sh, const struct block_key *k, uint64_t h)
+{
+    for (struct cached_block *b = sh->bucket[h & (SHARD_BUCKETS - 1)]; b; b = b->hnext)
+    {
+        if (memcmp(&b->key, k, sizeof(*k)) == 0)
+        {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void shard_remove(struct shard *sh, struct cached_block *b)
+{
+    struct cached_block **pp = &sh->bucket[key_hash(&b->key) & (SHARD_BUCKETS - 1)];
+    while (*pp != b)
+    {
+        pp = &(*pp)->hnext;
+    }
+    *pp = b->hnext;
+    lru_unlink(sh, b);
+    sh->blocks--;
+    sh->bytes -= pool_size(b);
+    pool_put(b);
+}
+
+/* ============================= COPIES ============================ */
+
+/* Records [off, off + n) of a cached block to out at index at */
+static void copy_out(const struct record_batch *src, size_t off, size_t n,
+                     struct record_batch *out, size_t at)
+{
+    memcpy(&out->timestamp_ms[at], &src->timestamp_ms[off], n * sizeof(src->timestamp_ms[0]));
+    memcpy(&out->pressure_pa[at], &src->pressure_pa[off], n * sizeof(src->pressure_pa[0]));
+    memcpy(&out->pressure_raw[at], &src->pressure_raw[off], n * sizeof(src->pressure_raw[0]));
+    memcpy(&out->label[at], &src->label[off], n);
+    for (int c = 0; c < IMU_CHANNELS; c++)
+    {
+        memcpy(&out->imu_raw[c][at], &src->imu_raw[c][off], n * sizeof(src->imu_raw[c][0]));
+        memcpy(&out->imu[c][at], &src->imu[c][off], n * sizeof(src->imu[c][0]));
+    }
+}
+
+/* Copy part of block blk of am to out, decoding it on a miss */
+static int read_block(const struct archive_map *am, size_t blk, size_t off, size_t n,
+                      struct record_batch *out, size_t at)
+{
+    struct block_key k = {(uint64_t)am->dev, (uint64_t)am->ino, am->size, blk};
+    uint64_t h = key_hash(&k);
+    struct shard *sh = &shards[(h >> 32) % BLOCK_CACHE_SHARDS];
+
+    pthread_mutex_lock(&sh->lock);
+    struct cached_block *b = shard_find(sh, &k, h);
+    if (b)
+    {
+        sh->hits++;
+        lru_unlink(sh, b);
+        lru_push(sh, b);
+        copy_out(&b->batch, off, n, out, at);
+        pthread_mutex_unlock(&sh->lock);
+        return 0;
+    }
+    sh->misses++;
+    pthread_mutex_unlock(&sh->lock);
+
+    struct cached_block *fresh = pool_get(sizeof(*fresh));
+    if (!fresh)
+    {
+        return -1;
+    }
+    size_t first = blk * BATCH_RECORDS;
+    size_t count = am->records - first < BATCH_RECORDS ? am->records - first : BATCH_RECORDS;
+    decode_batch(am->data + first * RECORD_SIZE, count, &fresh->batch);
+    fresh->key = k;
+
+    pthread_mutex_lock(&sh->lock);
+    b = shard_find(sh, &k, h);
+    if (b)
+    {
+        /* Decoded by another reader meanwhile */
+        copy_out(&b->batch, off, n, out, at);
+        pthread_mutex_unlock(&sh->lock);
+        pool_put(fresh);
+        return 0;
+    }
+
+    size_t slot = h & (SHARD_BUCKETS - 1);
+    fresh->hnext = sh->bucket[slot];
+    sh->bucket[slot] = fresh;
+    lru_push(sh, fresh);
+    sh->blocks++;
+    sh->bytes += pool_size(fresh);
+    while (sh->bytes > SHARD_BUDGET && sh->tail != fresh)
+    {
+        shard_remove(sh, sh->tail);
+        sh->evictions++;
+    }
+    copy_out(&fresh->batch, off, n, out, at);
+    pthread_mutex_unlock(&sh->lock);
+    return 0;
+}
+
+/* ============================= PUBLIC ============================ */
+
+size_t block_cache_read(const struct archive_map *am, size_t first, size_t n,
+                        struct record_batch *out)
+{
+    pthread_once(&shards_once, shards_init);
+
+    if (first >= am->records)
+    {
+        return 0;
+    }
+    if (n > BATCH_RECORDS)
+    {
+        n = BATCH_RECORDS;
+    }
+    if (n > am->records - first)
+    {
+        n = am->records - first;
+    }
+
+    /* At most two blocks, as n <= BATCH_RECORDS */
+    for (size_t done = 0; done < n;)
+    {
+        size_t rec = first + done;
+        size_t off = rec % BATCH_RECORDS;
+        size_t take = BATCH_RECORDS - off < n - done ? BATCH_RECORDS - off : n - done;
+        if (read_block(am, rec / BATCH_RECORDS, off, take, out, done) != 0)
+        {
+            return 0;
+        }
+        done += take;
+    }
+
+    /* Same padding as decode_batch, for the vector loops downstream */
+    size_t nv = (n + 15) & ~(size_t)15;
+    for (int c = 0; c < IMU_CHANNELS; c++)
+    {
+        for (size_t i = n; i < nv; i++)
+        {
+            out->imu_raw[c][i] = 0;
+            out->imu[c][i] = 0;
+        }
+    }
+    out->n = n;
+    return n;
+}
+
+void block_cache_stats(struct block_cache_stats *out)
+{
+    pthread_once(&shards_once, shards_init);
+
+    memset(out, 0, sizeof(*out));
+    out->budget = SHARD_BUDGET * BLOCK_CACHE_SHARDS;
+    for (int s = 0; s < BLOCK_CACHE_SHARDS; s++)
+    {
+        struct shard *sh = &shards[s];
+        pthread_mutex_lock(&sh->lock);
+        out->hits += sh->hits;
+        out->misses += sh->misses;
+        out->evictions += sh->evictions;
+        out->blocks += sh->blocks;
+        out->bytes += sh->bytes;
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+void block_cache_trim(void)
+{
+    pthread_once(&shards_once, shards_init);
+
+    for (int s = 0; s < BLOCK_CACHE_SHARDS; s++)
+    {
+        struct shard *sh = &shards[s];
+        pthread_mutex_lock(&sh->lock);
+        while (sh->tail)
+        {
+            shard_remove(sh, sh->tail);
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
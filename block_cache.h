@@ -0,0 +1,52 @@
+/*
+ * block_cache.h: shared LRU cache of decoded record blocks
+ *
+ * Readers that come back to the same records (range queries, re-publish
+ * and gap-fill requests) read through this cache instead of calling
+ * decode_batch themselves. A block is BATCH_RECORDS records of one file,
+ * aligned to a multiple of BATCH_RECORDS, decoded into a struct
+ * record_batch and keyed by (device, inode, size, block index). The cache
+ * is split into BLOCK_CACHE_SHARDS independently locked LRU lists and
+ * holds at most BLOCK_CACHE_MB of blocks in total; a hit costs a copy of
+ * the requested columns.
+ */
+
+#ifndef WEARABLE_BLOCK_CACHE_H
+#define WEARABLE_BLOCK_CACHE_H
+
+#include "archive_map.h"
+#include "record.h"
+
+#include <stddef.h>
+
+/* Memory for cached blocks, all shards together */
+#ifndef BLOCK_CACHE_MB
+#define BLOCK_CACHE_MB 16
+#endif
+
+#ifndef BLOCK_CACHE_SHARDS
+#define BLOCK_CACHE_SHARDS 8
+#endif
+
+struct block_cache_stats
+{
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    size_t blocks;
+    size_t bytes;
+    size_t budget;
+};
+
+/* Records [first, first + n) of am (n <= BATCH_RECORDS, clamped to the
+ * file) decoded into out, exactly as decode_batch would; out->quality is
+ * not filled. Returns the record count, 0 past the end or out of memory. */
+size_t block_cache_read(const struct archive_map *am, size_t first, size_t n,
+                        struct record_batch *out);
+
+void block_cache_stats(struct block_cache_stats *out);
+
+/* Drop every cached block */
+void block_cache_trim(void);
+
+#endif /* WEARABLE_BLOCK_CACHE_H */
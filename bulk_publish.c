@@ -0,0 +1,1271 @@
+/*
+ * bulk_publish.c: deferred, link-aware publishing of per-record samples
+ *
+ * A publisher thread replays queued sessions from the archive, one batch
+ * at a time, over its own broker connection. Before each batch it asks the
+ * scheduler whether bulk data may move: only inside BULK_WINDOWS, while the
+ * rest of the traffic on BULK_LINK_IFACE stays under BULK_LINK_BUSY_BPS and,
+ * if BULK_RTT_MAX_MS is set, while the broker answers within it. The link is
+ * probed at most every BULK_CHECK_S. Progress is saved after every batch, so a batch
+ * cut short by a lost connection is sent again (at least once delivery).
+ *
+ * With CANARY_INTERVAL_S set, latency probes (see canary.h) follow the
+ * samples on the same connection.
+ *
+ * Built with WITH_IO_URING, samples go out through mqtt_uring instead of
+ * libmosquitto: batched sends from registered buffers, connected on demand
+ * from this thread.
+ */
+
+#define _GNU_SOURCE
+#include "bulk_publish.h"
+#include "archive_map.h"
+#include "arena.h"
+#include "canary.h"
+#include "decoder.h"
+#include "fidelity.h"
+#include "filter.h"
+#include "mqtt_uring.h"
+#include "quant.h"
+#include "record.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mosquitto.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BULK_QUEUE_DIR ".publish"
+#define RTT_PROBE_TIMEOUT_MS 2000
+#define MQTT_OVERHEAD 8 /* fixed header + topic length, per QoS 0 PUBLISH */
+
+static struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;
+    bool kicked;
+    volatile bool quit;
+    volatile bool connected;
+
+    char archive_base[PATH_MAX];
+    char queue_dir[PATH_MAX];
+    char host[256];
+    int port;
+    char topic[256];
+    struct time_windows window;
+    struct decoder *decoder;
+#ifdef WITH_IO_URING
+    struct mqtt_uring *ring;
+#else
+    struct mosquitto *mqtt;
+#endif
+
+    /* selection, fidelity + projection */
+    struct filter filter;
+    struct fidelity_state fidelity;
+    uint8_t sel[BATCH_RECORDS];
+    uint8_t keep[BATCH_RECORDS];
+    uint8_t trig[2][BATCH_RECORDS];
+    size_t (*plan[FIELD_COUNT])(char *, const struct record_batch *, size_t);
+    int plan_len;
+    struct quant quant;
+
+    /* scheduler */
+    long long next_check; /* CLOCK_MONOTONIC seconds */
+    bool allowed;
+    unsigned rate; /* bytes/s, 0 = unlimited */
+    char verdict[320];
+
+    /* link estimate */
+    bool have_if;
+    unsigned long long if_bytes;
+    struct timespec if_at;
+    unsigned long long sent; /* our bytes since if_at */
+
+    struct timespec pace; /* budget clock */
+} bp = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+/* ============================= TIMING ============================ */
+
+static double elapsed_s(const struct timespec *a, const struct timespec *b)
+{
+    return (double)(b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/* Sleep up to seconds; returns false if asked to quit */
+static bool bulk_sleep(double seconds)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += (time_t)seconds;
+    ts.tv_nsec += (long)((seconds - (double)(time_t)seconds) * 1e9);
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&bp.lock);
+    while (!bp.quit && pthread_cond_timedwait(&bp.wake, &bp.lock, &ts) != ETIMEDOUT)
+        ;
+    bool keep_going = !bp.quit;
+    pthread_mutex_unlock(&bp.lock);
+    return keep_going;
+}
+
+/* Pace publishing to the rate the scheduler picked */
+static bool throttle(size_t bytes)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (bp.rate == 0 || elapsed_s(&bp.pace, &now) > 0)
+    {
+        bp.pace = now;
+    }
+    if (bp.rate == 0)
+    {
+        return !bp.quit;
+    }
+
+    long long ns = (long long)((double)bytes * 1e9 / bp.rate);
+    bp.pace.tv_sec += (time_t)(ns / 1000000000LL);
+    bp.pace.tv_nsec += (long)(ns % 1000000000LL);
+    if (bp.pace.tv_nsec >= 1000000000L)
+    {
+        bp.pace.tv_sec++;
+        bp.pace.tv_nsec -= 1000000000L;
+    }
+
+    double wait = elapsed_s(&now, &bp.pace);
+    return wait > 0 ? bulk_sleep(wait) : !bp.quit;
+}
+
+/* ============================ LINK PROBES ======================== */
+
+/* rx + tx byte counters of BULK_LINK_IFACE from /proc/net/dev */
+static int iface_bytes(unsigned long long *out)
+{
+    FILE *f = fopen("/proc/net/dev", "re");
+    if (!f)
+    {
+        return -1;
+    }
+
+    char line[512];
+    int rc = -1;
+    size_t len = strlen(BULK_LINK_IFACE);
+
+    while (fgets(line, sizeof(line), f))
+    {
+        const char *p = line + strspn(line, " ");
+        unsigned long long rx, tx;
+        if (strncmp(p, BULK_LINK_IFACE, len) == 0 && p[len] == ':' &&
+            sscanf(p + len + 1, "%llu %*u %*u %*u %*u %*u %*u %*u %llu", &rx, &tx) == 2)
+        {
+            *out = rx + tx;
+            rc = 0;
+            break;
+        }
+    }
+    fclose(f);
+    return rc;
+}
+
+/* Traffic on the interface that is not ours, bytes/s since the last look */
+static double other_traffic_bps(void)
+{
+    unsigned long long bytes;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (iface_bytes(&bytes) != 0)
+    {
+        return 0;
+    }
+    if (!bp.have_if)
+    {
+        /* First look after idling: take a one second baseline */
+        bp.have_if = true;
+        bp.if_bytes = bytes;
+        bp.if_at = now;
+        bp.sent = 0;
+        if (!bulk_sleep(1))
+        {
+            return 0;
+        }
+        return other_traffic_bps();
+    }
+
+    double bps = 0;
+    double dt = elapsed_s(&bp.if_at, &now);
+    if (dt > 0 && bytes >= bp.if_bytes)
+    {
+        unsigned long long delta = bytes - bp.if_bytes;
+        delta = delta > bp.sent ? delta - bp.sent : 0;
+        bps = (double)delta / dt;
+    }
+
+    bp.if_bytes = bytes;
+    bp.if_at = now;
+    bp.sent = 0;
+    return bps;
+}
+
+/* Time to complete a TCP handshake with the broker, -1 if unreachable */
+static long broker_rtt_ms(void)
+{
+    char port[16];
+    snprintf(port, sizeof(port), "%d", bp.port);
+
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    struct addrinfo *ai;
+    if (getaddrinfo(bp.host, port, &hints, &ai) != 0)
+    {
+        return -1;
+    }
+
+    long rtt = -1;
+    int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0)
+    {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        int rc = connect(fd, ai->ai_addr, ai->ai_addrlen);
+        if (rc != 0 && errno == EINPROGRESS)
+        {
+            struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+            int err = 0;
+            socklen_t len = sizeof(err);
+            rc = (poll(&pfd, 1, RTT_PROBE_TIMEOUT_MS) == 1 &&
+                  getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)
+                     ? 0
+                     : -1;
+        }
+        if (rc == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            rtt = (long)(elapsed_s(&t0, &t1) * 1000);
+        }
+        close(fd);
+    }
+    freeaddrinfo(ai);
+    return rtt;
+}
+
+/* ============================== MQTT ============================= */
+
+#ifdef WITH_IO_URING
+
+static bool broker_connected(void)
+{
+    if (!bp.ring)
+    {
+        char id[32];
+        snprintf(id, sizeof(id), "wearable_dock-%d", (int)getpid());
+        bp.ring = mqtt_uring_connect(bp.host, bp.port, id);
+        bp.connected = bp.ring != NULL;
+    }
+    return bp.connected;
+}
+
+static void broker_drop(void)
+{
+    mqtt_uring_close(bp.ring);
+    bp.ring = NULL;
+    bp.connected = false;
+}
+
+/* Returns the bytes queued for the wire, 0 if the message was dropped, -1
+ * if the broker connection is gone */
+static long publish_one(const char *topic, const char *payload, size_t len)
+{
+    long rc = mqtt_uring_publish(bp.ring, topic, payload, len);
+    if (rc < 0)
+    {
+        broker_drop();
+    }
+    return rc;
+}
+
+/* Wait until everything published is on the wire; -1 if the connection
+ * went */
+static int publish_flush(void)
+{
+    if (mqtt_uring_flush(bp.ring) != 0)
+    {
+        broker_drop();
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+static bool broker_connected(void)
+{
+    return bp.connected;
+}
+
+static void on_connect(struct mosquitto *m, void *ud, int rc)
+{
+    (void)m;
+    (void)ud;
+    bp.connected = rc == 0;
+    if (rc == 0)
+    {
+        bp.next_check = 0; /* re-evaluate right away */
+    }
+}
+
+static void on_disconnect(struct mosquitto *m, void *ud, int rc)
+{
+    (void)m;
+    (void)ud;
+    (void)rc;
+    bp.connected = false;
+}
+
+/* Returns the bytes put on the wire, 0 if the message was dropped, -1 if
+ * the broker connection is gone */
+static long publish_one(const char *topic, const char *payload, size_t len)
+{
+    int rc = mosquitto_publish(bp.mqtt, NULL, topic, (int)len, payload, 0, false);
+    if (rc == MOSQ_ERR_NO_CONN || rc == MOSQ_ERR_CONN_LOST)
+    {
+        bp.connected = false;
+        return -1;
+    }
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+        fprintf(stderr, "mosquitto_publish failed: %s\n", mosquitto_strerror(rc));
+        return 0;
+    }
+    return (long)(len + strlen(topic)) + MQTT_OVERHEAD;
+}
+
+/* The network loop owns the socket, nothing to wait for */
+static int publish_flush(void)
+{
+    return 0;
+}
+
+#endif /* WITH_IO_URING */
+
+/* =========================== SCHEDULER =========================== */
+
+/* May bulk data move now, and at what rate (bp.rate)? Re-evaluated at
+ * most every BULK_CHECK_S; logs whenever the verdict changes. */
+static bool schedule_allows(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec < bp.next_check)
+    {
+        return bp.allowed;
+    }
+    bp.next_check = now.tv_sec + BULK_CHECK_S;
+
+    char verdict[sizeof(bp.verdict)];
+    bool allowed = false;
+    unsigned rate = BULK_MAX_BYTES_PER_SEC;
+    long rtt = 0;
+    double other = BULK_LINK_IFACE[0] ? other_traffic_bps() : 0;
+
+    if (!time_windows_contains(&bp.window, time(NULL)))
+    {
+        snprintf(verdict, sizeof(verdict), "waiting for window %s", BULK_WINDOWS);
+    }
+    else if (!broker_connected())
+    {
+        snprintf(verdict, sizeof(verdict), "waiting for broker %s:%d", bp.host, bp.port);
+    }
+    else if (BULK_RTT_MAX_MS > 0 &&
+             ((rtt = broker_rtt_ms()) < 0 || rtt > BULK_RTT_MAX_MS))
+    {
+        snprintf(verdict, sizeof(verdict), "waiting, broker rtt %ld ms", rtt);
+    }
+    else if (other >= BULK_LINK_BUSY_BPS)
+    {
+        snprintf(verdict, sizeof(verdict), "waiting, %s busy (%.0f KiB/s)",
+                 BULK_LINK_IFACE, other / 1024);
+    }
+    else
+    {
+        allowed = true;
+        if (other >= BULK_LINK_BUSY_BPS / 2)
+        {
+            rate = BULK_THROTTLED_BYTES_PER_SEC;
+        }
+        if (rate)
+        {
+            snprintf(verdict, sizeof(verdict), "publishing at %u KiB/s", rate / 1024);
+        }
+        else
+        {
+            snprintf(verdict, sizeof(verdict), "publishing");
+        }
+    }
+
+    if (strcmp(verdict, bp.verdict) != 0)
+    {
+        printf("bulk: %s\n", verdict);
+        snprintf(bp.verdict, sizeof(bp.verdict), "%s", verdict);
+    }
+    bp.allowed = allowed;
+    bp.rate = rate;
+    return allowed;
+}
+
+/* Block until the scheduler lets bulk data through; false if asked to quit */
+static bool wait_for_schedule(void)
+{
+    while (!schedule_allows())
+    {
+        if (!bulk_sleep(BULK_CHECK_S))
+        {
+            return false;
+        }
+    }
+    return !bp.quit;
+}
+
+/* ============================ ENCODERS =========================== */
+
+/* One projected field of record i as a JSON member; returns its length */
+typedef size_t (*field_encoder)(char *out, const struct record_batch *b, size_t i);
+
+static size_t enc_timestamp(char *out, const struct record_batch *b, size_t i)
+{
+    return (size_t)sprintf(out, "\"timestamp_ms\":%u", b->timestamp_ms[i]);
+}
+
+static size_t enc_pressure(char *out, const struct record_batch *b, size_t i)
+{
+    return (size_t)sprintf(out, "\"pressure_pa\":%.2f", b->pressure_pa[i]);
+}
+
+static size_t enc_label(char *out, const struct record_batch *b, size_t i)
+{
+    return (size_t)sprintf(out, "\"predicted\":%u", b->label[i]);
+}
+
+static size_t enc_acc(char *out, const struct record_batch *b, size_t i)
+{
+    return (size_t)sprintf(out, "\"acceleration\":[%.2f,%.2f,%.2f]",
+                           b->imu[0][i], b->imu[1][i], b->imu[2][i]);
+}
+
+static size_t enc_gyr(char *out, const struct record_batch *b, size_t i)
+{
+    return (size_t)sprintf(out, "\"gyroscope\":[%.2f,%.2f,%.2f]",
+                           b->imu[3][i], b->imu[4][i], b->imu[5][i]);
+}
+
+/* Indexed like the FIELD_* bits */
+static const field_encoder field_encoders[FIELD_COUNT] = {
+    enc_timestamp, enc_pressure, enc_label, enc_acc, enc_gyr};
+
+/* The full record in one call, the common case */
+static size_t enc_all(char *out, const struct record_batch *b, size_t i)
+{
+    return (size_t)sprintf(out,
+                           "\"timestamp_ms\":%u,"
+                           "\"pressure_pa\":%.2f,"
+                           "\"predicted\":%u,"
+                           "\"acceleration\":[%.2f,%.2f,%.2f],"
+                           "\"gyroscope\":[%.2f,%.2f,%.2f]",
+                           b->timestamp_ms[i], b->pressure_pa[i], b->label[i],
+                           b->imu[0][i], b->imu[1][i], b->imu[2][i],
+                           b->imu[3][i], b->imu[4][i], b->imu[5][i]);
+}
+
+/* Resolve the projection to its encoders once, at start-up */
+static void plan_encoders(unsigned fields)
+{
+    bp.plan_len = 0;
+    if (fields == (1u << FIELD_COUNT) - 1)
+    {
+        bp.plan[bp.plan_len++] = enc_all;
+        return;
+    }
+    for (int k = 0; k < FIELD_COUNT; k++)
+    {
+        if (fields & (1u << k))
+        {
+            bp.plan[bp.plan_len++] = field_encoders[k];
+        }
+    }
+}
+
+/* TOPIC_LAYOUT_FLAT: one JSON message per selected record */
+static long publish_records(const struct record_batch *b, const uint8_t *sel)
+{
+    long bytes = 0;
+
+    for (size_t i = 0; i < b->n; i++)
+    {
+        if (!sel[i])
+        {
+            continue;
+        }
+
+        /* Every field at its widest fits, so no per-field checks */
+        char payload[256];
+        size_t len = 0;
+        payload[len++] = '{';
+        for (int k = 0; k < bp.plan_len; k++)
+        {
+            if (k)
+            {
+                payload[len++] = ',';
+            }
+            len += bp.plan[k](payload + len, b, i);
+        }
+        payload[len++] = '}';
+        payload[len] = '\0';
+
+        /* Print the JSON we are about to publish */
+        printf("MQTT JSON -> %s\n", payload);
+        fflush(stdout); /* helpful if running under systemd */
+
+        long sent = publish_one(bp.topic, payload, len);
+        if (sent < 0)
+        {
+            return -1;
+        }
+        bytes += sent;
+    }
+    return bytes;
+}
+
+/* Worst case per record: timestamp, six IMU values, pressure, label */
+#define GROUP_PAYLOAD_CAP (512 + BATCH_RECORDS * (11 + IMU_CHANNELS * 8 + 13 + 4))
+
+enum channel_group
+{
+    GROUP_IMU,
+    GROUP_PRESSURE,
+    GROUP_LABEL,
+    GROUP_COUNT
+};
+
+static const char *const group_names[GROUP_COUNT] = {"imu", "pressure", "label"};
+static const unsigned group_fields[GROUP_COUNT] = {
+    FIELD_ACC | FIELD_GYR, FIELD_PRESSURE, FIELD_LABEL};
+
+static size_t encode_u32_column(char *out, const char *name, const uint32_t *v,
+                                const uint8_t *sel, size_t n)
+{
+    size_t len = (size_t)sprintf(out, ",\"%s\":[", name);
+    const char *sep = "";
+    for (size_t i = 0; i < n; i++)
+    {
+        if (sel[i])
+        {
+            len += (size_t)sprintf(out + len, "%s%u", sep, v[i]);
+            sep = ",";
+        }
+    }
+    out[len++] = ']';
+    return len;
+}
+
+static size_t encode_u8_column(char *out, const char *name, const uint8_t *v,
+                               const uint8_t *sel, size_t n)
+{
+    size_t len = (size_t)sprintf(out, ",\"%s\":[", name);
+    const char *sep = "";
+    for (size_t i = 0; i < n; i++)
+    {
+        if (sel[i])
+        {
+            len += (size_t)sprintf(out + len, "%s%u", sep, v[i]);
+            sep = ",";
+        }
+    }
+    out[len++] = ']';
+    return len;
+}
+
+static size_t encode_float_column(char *out, const char *name, const float *v,
+                                  const uint8_t *sel, size_t n)
+{
+    size_t len = (size_t)sprintf(out, ",\"%s\":[", name);
+    const char *sep = "";
+    for (size_t i = 0; i < n; i++)
+    {
+        if (sel[i])
+        {
+            len += (size_t)sprintf(out + len, "%s%.2f", sep, v[i]);
+            sep = ",";
+        }
+    }
+    out[len++] = ']';
+    return len;
+}
+
+/* Column-wise JSON of the selected records of one channel group:
+ *   {"session":..,"records":n,"timestamp_ms":[..],"<column>":[..],...}
+ * Only projected columns are included. Returns the length, 0 if it does
+ * not fit. */
+static size_t encode_group(const struct record_batch *b, const uint8_t *sel,
+                           size_t kept, enum channel_group g,
+                           const char *session, char *out, size_t cap)
+{
+    unsigned fields = bp.filter.fields;
+    int n = snprintf(out, cap, "{\"session\":\"%s\",\"records\":%zu", session, kept);
+    if (n < 0 || (size_t)n >= cap)
+    {
+        return 0;
+    }
+    size_t len = (size_t)n;
+
+    /* cap covers every value at its widest, so only the header is checked */
+    if (fields & FIELD_TIMESTAMP)
+    {
+        len += encode_u32_column(out + len, "timestamp_ms", b->timestamp_ms, sel, b->n);
+    }
+
+    switch (g)
+    {
+    case GROUP_IMU:
+        for (int c = 0; c < IMU_CHANNELS; c++)
+        {
+            if (fields & (c < 3 ? FIELD_ACC : FIELD_GYR))
+            {
+                len += encode_float_column(out + len, imu_channel_names[c], b->imu[c], sel, b->n);
+            }
+        }
+        break;
+    case GROUP_PRESSURE:
+        len += encode_float_column(out + len, "pressure_pa", b->pressure_pa, sel, b->n);
+        break;
+    case GROUP_LABEL:
+        len += encode_u8_column(out + len, "predicted", b->label, sel, b->n);
+        break;
+    default:
+        break;
+    }
+    out[len++] = '}';
+    return len;
+}
+
+/* TOPIC_LAYOUT_SPLIT: one message per projected channel group on
+ * <topic>/<serial>/<group> */
+static long publish_groups(const struct record_batch *b, const uint8_t *sel, size_t kept,
+                           const char *session, const char *serial)
+{
+    char *payload = pool_get(GROUP_PAYLOAD_CAP);
+    if (!payload)
+    {
+        fprintf(stderr, "bulk: out of memory\n");
+        return 0;
+    }
+
+    long bytes = 0;
+    for (int g = 0; g < GROUP_COUNT && bytes >= 0; g++)
+    {
+        if (!(bp.filter.fields & group_fields[g]))
+        {
+            continue;
+        }
+
+        char topic[512];
+        if (snprintf(topic, sizeof(topic), "%s/%s/%s", bp.topic, serial, group_names[g]) >= (int)sizeof(topic))
+        {
+            continue;
+        }
+
+        size_t len = encode_group(b, sel, kept, (enum channel_group)g, session,
+                                  payload, GROUP_PAYLOAD_CAP);
+        if (len == 0)
+        {
+            fprintf(stderr, "Payload truncated for %s\n", topic);
+            continue;
+        }
+
+        printf("MQTT %s -> %zu records, %zu bytes\n", topic, kept, len);
+        fflush(stdout);
+
+        long sent = publish_one(topic, payload, len);
+        bytes = sent < 0 ? -1 : bytes + sent;
+    }
+
+    pool_put(payload);
+    return bytes;
+}
+
+/* TOPIC_LAYOUT_PACKED: the whole batch as one quantised binary message on
+ * <topic>/<serial>/packed */
+static long publish_packed(const struct record_batch *b, const uint8_t *sel, size_t kept,
+                           const char *session, const char *serial)
+{
+    char topic[512];
+    if (snprintf(topic, sizeof(topic), "%s/%s/packed", bp.topic, serial) >= (int)sizeof(topic))
+    {
+        return 0;
+    }
+
+    uint8_t *payload = pool_get(QUANT_PAYLOAD_CAP);
+    if (!payload)
+    {
+        fprintf(stderr, "bulk: out of memory\n");
+        return 0;
+    }
+
+    size_t len = quant_encode(&bp.quant, b, sel, bp.filter.fields, session, payload);
+    printf("MQTT %s -> %zu records, %zu bytes\n", topic, kept, len);
+    fflush(stdout);
+
+    long sent = publish_one(topic, (const char *)payload, len);
+    pool_put(payload);
+    return sent;
+}
+
+/* Select, reduce, project and publish one decoded batch in the configured
+ * layout. trig holds the batch's triggers, next_trig those of the batch
+ * after it (NULL at the end of a file). Returns the bytes put on the wire,
+ * -1 if the broker connection is gone. */
+static long publish_batch(struct record_batch *b, const uint8_t *trig,
+                          const uint8_t *next_trig, size_t next_n,
+                          const char *session, const char *serial)
+{
+    size_t kept = filter_run(&bp.filter, b, bp.sel);
+    if (fidelity_apply(&bp.fidelity, b, trig, next_trig, next_n, bp.keep) < b->n)
+    {
+        kept = 0;
+        for (size_t i = 0; i < b->n; i++)
+        {
+            bp.sel[i] &= bp.keep[i];
+            kept += bp.sel[i];
+        }
+    }
+    if (kept == 0)
+    {
+        return 0;
+    }
+
+    long bytes;
+    switch (BULK_TOPIC_LAYOUT)
+    {
+    case TOPIC_LAYOUT_SPLIT:
+        bytes = publish_groups(b, bp.sel, kept, session, serial);
+        break;
+    case TOPIC_LAYOUT_PACKED:
+        bytes = publish_packed(b, bp.sel, kept, session, serial);
+        break;
+    default:
+        bytes = publish_records(b, bp.sel);
+        break;
+    }
+    if (bytes >= 0 && publish_flush() != 0)
+    {
+        return -1;
+    }
+    return bytes;
+}
+
+/* ============================== QUEUE ============================ */
+
+/* Queue entry <queue_dir>/<session> holds "<file> <record>": everything
+ * before that record of that file has been published. Empty = not started. */
+static int cursor_load(const char *path, char *file, size_t file_sz, size_t *record)
+{
+    FILE *f = fopen(path, "re");
+    if (!f)
+    {
+        return -1;
+    }
+
+    char line[NAME_MAX + 32];
+    file[0] = '\0';
+    *record = 0;
+    if (fgets(line, sizeof(line), f))
+    {
+        char name[NAME_MAX + 1];
+        size_t rec;
+        if (sscanf(line, "%255s %zu", name, &rec) == 2)
+        {
+            snprintf(file, file_sz, "%s", name);
+            *record = rec;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static int cursor_save(const char *path, const char *file, size_t record)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    {
+        return -1;
+    }
+
+    FILE *f = fopen(tmp, "we");
+    if (!f)
+    {
+        return -1;
+    }
+    fprintf(f, "%s %zu\n", file, record);
+    if (fclose(f) != 0 || rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void session_serial(const char *session_dir, char *out, size_t sz)
+{
+    char path[PATH_MAX];
+    FILE *f = NULL;
+
+    snprintf(out, sz, "unknown");
+    if (join_path(session_dir, SESSION_SERIAL_FILE, path, sizeof(path)) == 0)
+    {
+        f = fopen(path, "re");
+    }
+    if (f)
+    {
+        if (fgets(out, (int)sz, f))
+        {
+            out[strcspn(out, "\r\n")] = '\0';
+        }
+        fclose(f);
+    }
+    if (!out[0])
+    {
+        snprintf(out, sz, "unknown");
+    }
+}
+
+/* When the session's wearable was plugged in; false for sessions that
+ * predate SESSION_PLUGGED_FILE */
+static bool session_plugged(const char *session_dir, struct timespec *out)
+{
+    char path[PATH_MAX];
+    if (join_path(session_dir, SESSION_PLUGGED_FILE, path, sizeof(path)) != 0)
+    {
+        return false;
+    }
+    FILE *f = fopen(path, "re");
+    if (!f)
+    {
+        return false;
+    }
+    long long sec;
+    long nsec;
+    bool ok = fscanf(f, "%lld.%ld", &sec, &nsec) == 2;
+    fclose(f);
+    out->tv_sec = (time_t)sec;
+    out->tv_nsec = nsec;
+    return ok;
+}
+
+/* Canary probe right behind the batch just sent, on the same connection */
+static void publish_probe(const struct timespec *plugged)
+{
+    char probe[CANARY_PROBE_CAP];
+    const char *topic;
+    size_t len = canary_probe(plugged, &topic, probe, sizeof(probe));
+    if (len && publish_one(topic, probe, len) > 0)
+    {
+        publish_flush();
+    }
+}
+
+/* Publish one queued session from its cursor on.
+ * Returns 0 when done, 1 if interrupted or the broker went away, -1 on error. */
+static int publish_session(const char *name)
+{
+    char entry[PATH_MAX], session_dir[PATH_MAX], logs_dir[PATH_MAX];
+    if (join_path(bp.queue_dir, name, entry, sizeof(entry)) != 0 ||
+        join_path(bp.archive_base, name, session_dir, sizeof(session_dir)) != 0 ||
+        join_path(session_dir, "logs", logs_dir, sizeof(logs_dir)) != 0)
+    {
+        return -1;
+    }
+
+    char cur_file[NAME_MAX + 1];
+    size_t cur_record;
+    if (cursor_load(entry, cur_file, sizeof(cur_file), &cur_record) != 0)
+    {
+        return -1;
+    }
+
+    char serial[64];
+    session_serial(session_dir, serial, sizeof(serial));
+
+    /* Plug-to-broker is measured on the first samples of a session */
+    struct timespec plugged;
+    bool plug_pending = cur_file[0] == '\0' && session_plugged(session_dir, &plugged);
+
+    filter_reset(&bp.filter);
+    fidelity_reset(&bp.fidelity);
+
+    char **names;
+    int nfiles = archive_list_bins(logs_dir, &names);
+    if (nfiles < 0)
+    {
+        fprintf(stderr, "bulk: %s no longer archived, dropping\n", name);
+        unlink(entry);
+        return 0;
+    }
+
+    int rc = 0;
+    size_t published = 0;
+    struct timespec cpu0, cpu1;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+
+    for (int f = 0; f < nfiles && rc == 0; f++)
+    {
+        int cmp = strcmp(names[f], cur_file);
+        if (cmp < 0)
+        {
+            continue;
+        }
+        size_t first = cmp == 0 ? cur_record : 0;
+
+        char file_path[PATH_MAX];
+        if (join_path(logs_dir, names[f], file_path, sizeof(file_path)) != 0)
+        {
+            continue;
+        }
+        const struct archive_map *am = archive_map_open(file_path);
+        if (!am)
+        {
+            fprintf(stderr, "bulk: cannot open %s: %s\n", file_path, strerror(errno));
+            continue;
+        }
+
+        /* Each batch is published once the next one is decoded, so a
+         * trigger early in the next batch can widen its window back */
+        decoder_open(bp.decoder, am, first);
+        struct record_batch *held = NULL;
+        int cur = 0;
+        size_t held_off = first, off = first;
+
+        while (rc == 0)
+        {
+            struct record_batch *b = decoder_next(bp.decoder);
+            int nxt = held ? cur ^ 1 : cur;
+            if (b)
+            {
+                fidelity_triggers(&bp.fidelity, b, bp.trig[nxt]);
+            }
+
+            if (held)
+            {
+                if (!wait_for_schedule())
+                {
+                    rc = 1;
+                    break;
+                }
+
+                long bytes = publish_batch(held, bp.trig[cur], b ? bp.trig[nxt] : NULL,
+                                           b ? b->n : 0, name, serial);
+                if (bytes < 0)
+                {
+                    printf("bulk: broker connection lost, %s paused\n", name);
+                    rc = 1;
+                    break;
+                }
+                bp.sent += (unsigned long long)bytes;
+                published += held->n;
+                if (bytes > 0)
+                {
+                    publish_probe(plug_pending ? &plugged : NULL);
+                    plug_pending = false;
+                }
+
+                if (cursor_save(entry, names[f], held_off + held->n) != 0)
+                {
+                    fprintf(stderr, "bulk: cannot save progress of %s\n", name);
+                }
+                decoder_release(bp.decoder);
+                if (!throttle((size_t)bytes))
+                {
+                    rc = 1;
+                    break;
+                }
+            }
+
+            if (!b)
+            {
+                break;
+            }
+            held = b;
+            held_off = off;
+            off += b->n;
+            cur = nxt;
+        }
+        decoder_close(bp.decoder);
+        archive_map_release(am);
+    }
+
+    archive_free_list(names, nfiles);
+
+    if (rc == 0)
+    {
+        unlink(entry);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+        printf("bulk: published %zu records of %s (%.3f s CPU)\n", published, name,
+               elapsed_s(&cpu0, &cpu1));
+#ifdef WITH_IO_URING
+        struct mqtt_uring_stats st;
+        if (bp.ring)
+        {
+            mqtt_uring_stats(bp.ring, &st);
+            printf("bulk: io_uring %llu messages, %llu bytes in %llu sends "
+                   "(%llu zero copy, %llu of them copied)\n",
+                   st.messages, st.bytes, st.sends, st.zc_sends, st.zc_copied);
+        }
+#endif
+    }
+    return rc;
+}
+
+static int is_entry(const struct dirent *de)
+{
+    return de->d_name[0] != '.' && !strstr(de->d_name, ".tmp");
+}
+
+/* One pass over the queue, oldest session first; returns the number of
+ * sessions left queued */
+static int drain_queue(void)
+{
+    struct dirent **list;
+    int n = scandir(bp.queue_dir, &list, is_entry, alphasort);
+    if (n < 0)
+    {
+        return 1;
+    }
+
+    int left = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (bp.quit || publish_session(list[i]->d_name) != 0)
+        {
+            ++left;
+        }
+        free(list[i]);
+    }
+    free(list);
+    return left;
+}
+
+static void *publisher_main(void *arg)
+{
+    (void)arg;
+
+    while (!bp.quit)
+    {
+        int left = drain_queue();
+        if (!left)
+        {
+            /* Link samples from before an idle spell say nothing */
+            bp.have_if = false;
+            bp.next_check = 0;
+        }
+
+        pthread_mutex_lock(&bp.lock);
+        if (!bp.kicked && !bp.quit)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += left ? BULK_CHECK_S : 24 * 3600;
+            pthread_cond_timedwait(&bp.wake, &bp.lock, &ts);
+        }
+        bp.kicked = false;
+        pthread_mutex_unlock(&bp.lock);
+    }
+    return NULL;
+}
+
+/* ============================= PUBLIC ============================ */
+
+int bulk_publisher_start(const char *archive_base,
+                         const char *host, int port, const char *topic)
+{
+    if (snprintf(bp.archive_base, sizeof(bp.archive_base), "%s", archive_base) >= (int)sizeof(bp.archive_base) ||
+        snprintf(bp.host, sizeof(bp.host), "%s", host) >= (int)sizeof(bp.host) ||
+        snprintf(bp.topic, sizeof(bp.topic), "%s", topic) >= (int)sizeof(bp.topic) ||
+        join_path(archive_base, BULK_QUEUE_DIR, bp.queue_dir, sizeof(bp.queue_dir)) != 0)
+    {
+        fprintf(stderr, "bulk: configuration too long\n");
+        return -1;
+    }
+    bp.port = port;
+
+    if (time_windows_parse(BULK_WINDOWS, &bp.window) != 0)
+    {
+        fprintf(stderr, "bulk: bad BULK_WINDOWS \"%s\"\n", BULK_WINDOWS);
+        return -1;
+    }
+    if (filter_parse(FILTER_SELECT, FILTER_FIELDS, &bp.filter) != 0)
+    {
+        fprintf(stderr, "bulk: bad FILTER_SELECT \"%s\" or FILTER_FIELDS \"%s\"\n",
+                FILTER_SELECT, FILTER_FIELDS);
+        return -1;
+    }
+    plan_encoders(bp.filter.fields);
+    if (quant_parse(QUANT_MAX_ERR, &bp.quant) != 0)
+    {
+        fprintf(stderr, "bulk: bad QUANT_MAX_ERR \"%s\"\n", QUANT_MAX_ERR);
+        return -1;
+    }
+    if (ensure_dir(archive_base) != 0 || ensure_dir(bp.queue_dir) != 0)
+    {
+        return -1;
+    }
+    bp.decoder = decoder_new();
+    if (!bp.decoder)
+    {
+        fprintf(stderr, "bulk: cannot start decoder\n");
+        return -1;
+    }
+
+#ifdef WITH_IO_URING
+    /* The publisher thread connects when there is something to send */
+    sigset_t old;
+    block_signals(&old);
+
+    bp.quit = false;
+    int rc = pthread_create(&bp.thread, NULL, publisher_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0)
+    {
+        fprintf(stderr, "bulk: cannot start publisher\n");
+        decoder_free(bp.decoder);
+        bp.decoder = NULL;
+        return -1;
+    }
+#else
+    bp.mqtt = mosquitto_new(NULL, true, NULL);
+    if (!bp.mqtt)
+    {
+        fprintf(stderr, "bulk: mosquitto_new failed\n");
+        decoder_free(bp.decoder);
+        bp.decoder = NULL;
+        return -1;
+    }
+    mosquitto_connect_callback_set(bp.mqtt, on_connect);
+    mosquitto_disconnect_callback_set(bp.mqtt, on_disconnect);
+    mosquitto_reconnect_delay_set(bp.mqtt, 1, 60, true);
+
+    /* An unreachable broker is retried by the network loop */
+    int rc = mosquitto_connect_async(bp.mqtt, bp.host, bp.port, 60);
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+        fprintf(stderr, "bulk: connect to %s:%d: %s\n", bp.host, bp.port,
+                mosquitto_strerror(rc));
+    }
+
+    /* Signals stay with the main thread's poll loop */
+    sigset_t old;
+    block_signals(&old);
+
+    bp.quit = false;
+    rc = mosquitto_loop_start(bp.mqtt);
+    if (rc == MOSQ_ERR_SUCCESS)
+    {
+        rc = pthread_create(&bp.thread, NULL, publisher_main, NULL);
+        if (rc != 0)
+        {
+            mosquitto_loop_stop(bp.mqtt, true);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0)
+    {
+        fprintf(stderr, "bulk: cannot start publisher\n");
+        mosquitto_destroy(bp.mqtt);
+        bp.mqtt = NULL;
+        decoder_free(bp.decoder);
+        bp.decoder = NULL;
+        return -1;
+    }
+#endif
+    bp.running = true;
+
+    if (CANARY_INTERVAL_S > 0 && canary_start(bp.host, bp.port, bp.topic) != 0)
+    {
+        fprintf(stderr, "bulk: latency canary not started\n");
+    }
+    return 0;
+}
+
+void bulk_publisher_enqueue(const char *session_name)
+{
+    if (!bp.running)
+    {
+        return;
+    }
+
+    /* An empty entry starts at the first record */
+    char entry[PATH_MAX];
+    if (join_path(bp.queue_dir, session_name, entry, sizeof(entry)) != 0)
+    {
+        return;
+    }
+    int fd = open(entry, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "bulk: cannot queue %s: %s\n", session_name, strerror(errno));
+        return;
+    }
+    close(fd);
+
+    pthread_mutex_lock(&bp.lock);
+    bp.kicked = true;
+    pthread_cond_signal(&bp.wake);
+    pthread_mutex_unlock(&bp.lock);
+}
+
+void bulk_publisher_stop(void)
+{
+    if (!bp.running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&bp.lock);
+    bp.quit = true;
+    pthread_cond_broadcast(&bp.wake);
+    pthread_mutex_unlock(&bp.lock);
+
+    pthread_join(bp.thread, NULL);
+    canary_stop();
+
+#ifdef WITH_IO_URING
+    mqtt_uring_close(bp.ring);
+    bp.ring = NULL;
+    bp.connected = false;
+#else
+    mosquitto_disconnect(bp.mqtt);
+    mosquitto_loop_stop(bp.mqtt, false);
+    mosquitto_destroy(bp.mqtt);
+    bp.mqtt = NULL;
+#endif
+    decoder_free(bp.decoder);
+    bp.decoder = NULL;
+    bp.running = false;
+}
@@ -0,0 +1,91 @@
+/*
+ * bulk_publish.h: deferred, link-aware publishing of per-record samples
+ *
+ * Session summaries and quality events are published as soon as a session
+ * is decoded. The per-record sample stream is queued on disk instead and
+ * replayed from the archive when the schedule and the link allow it.
+ */
+
+#ifndef WEARABLE_BULK_PUBLISH_H
+#define WEARABLE_BULK_PUBLISH_H
+
+#include <stddef.h>
+
+/* Device serial, written into the session directory at offload time */
+#define SESSION_SERIAL_FILE "SERIAL"
+
+/* When the wearable was plugged in, "<sec>.<nsec>" of CLOCK_REALTIME; the
+ * latency canary measures plug-to-broker from it */
+#define SESSION_PLUGGED_FILE "PLUGGED"
+
+/* Sample topic layout:
+ *   FLAT   - one JSON message per record on <topic>
+ *   SPLIT  - one column-wise JSON message per batch and channel group on
+ *            <topic>/<serial>/imu, <topic>/<serial>/pressure and
+ *            <topic>/<serial>/label, so subscribers only get what they need
+ *   PACKED - one binary message per batch on <topic>/<serial>/packed, IMU
+ *            quantised within QUANT_MAX_ERR and bit-packed (see quant.h) */
+#define TOPIC_LAYOUT_FLAT 0
+#define TOPIC_LAYOUT_SPLIT 1
+#define TOPIC_LAYOUT_PACKED 2
+#ifndef BULK_TOPIC_LAYOUT
+#define BULK_TOPIC_LAYOUT TOPIC_LAYOUT_FLAT
+#endif
+
+/* Local time windows "HH:MM-HH:MM[,...]" for bulk data, "" = any time */
+#ifndef BULK_WINDOWS
+#define BULK_WINDOWS ""
+#endif
+
+/* Interface whose /proc/net/dev counters show competing traffic,
+ * "" = do not look at throughput */
+#ifndef BULK_LINK_IFACE
+#define BULK_LINK_IFACE "wlan0"
+#endif
+
+/* Other traffic (bytes/s, rx + tx) above which bulk data waits; above
+ * half of it bulk data is throttled to BULK_THROTTLED_BYTES_PER_SEC */
+#ifndef BULK_LINK_BUSY_BPS
+#define BULK_LINK_BUSY_BPS (1024u * 1024)
+#endif
+
+/* TCP connect time to the broker above which bulk data waits, 0 = no probe.
+ * The probe is a bare handshake that is closed without an MQTT CONNECT,
+ * once per BULK_CHECK_S, which brokers may log or rate-limit: opt in only
+ * where that is acceptable. */
+#ifndef BULK_RTT_MAX_MS
+#define BULK_RTT_MAX_MS 0
+#endif
+
+/* Publish rate on a quiet link (0 = unlimited) and on a busy one */
+#ifndef BULK_MAX_BYTES_PER_SEC
+#define BULK_MAX_BYTES_PER_SEC 0
+#endif
+#ifndef BULK_THROTTLED_BYTES_PER_SEC
+#define BULK_THROTTLED_BYTES_PER_SEC (64u * 1024)
+#endif
+
+/* How often the window and link are re-evaluated */
+#ifndef BULK_CHECK_S
+#define BULK_CHECK_S 30
+#endif
+
+/* Start the publisher thread for sessions under archive_base. Queue and
+ * progress live in <archive_base>/.publish, so a restart resumes at the
+ * last published batch. Samples go to topic on host:port, laid out as
+ * BULK_TOPIC_LAYOUT says.
+ * Returns 0, -1 on error. */
+int bulk_publisher_start(const char *archive_base,
+                         const char *host, int port, const char *topic);
+
+/* Queue the samples of an archived session (directory name under archive_base) */
+void bulk_publisher_enqueue(const char *session_name);
+
+/* Serial the session in session_dir was offloaded from; "unknown" for
+ * sessions that predate SESSION_SERIAL_FILE or came from the inbox */
+void session_serial(const char *session_dir, char *out, size_t sz);
+
+/* Stop at the next batch boundary (progress is kept) and join the thread */
+void bulk_publisher_stop(void);
+
+#endif /* WEARABLE_BULK_PUBLISH_H */
@@ -0,0 +1,494 @@
+/*
+ * calibrate.c: per-host self-benchmark of the copy and decode engines
+ *
+ * Every candidate is run CALIBRATE_REPS times and its best time counts,
+ * which filters out a stray page fault or a preempted run. The copy source
+ * is dropped from the page cache before each run so the storage is really
+ * read, as it is for a card. Worker counts within CALIBRATE_TIE of the
+ * fastest lose to fewer workers, leaving cores to the other services.
+ */
+
+#define _GNU_SOURCE
+#include "calibrate.h"
+#include "archive_map.h"
+#include "arena.h"
+#include "decoder.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CALIBRATION_VERSION 1
+#define CALIBRATE_REPS 3
+#define CALIBRATE_TIE 0.05
+#define SCRATCH_FILE ".calibration.scratch"
+#define SCRATCH_COPY ".calibration.copy"
+
+static const size_t copy_buffers[] = {64 * 1024, 256 * 1024, 1024 * 1024};
+#define COPY_BUFFERS (sizeof(copy_buffers) / sizeof(copy_buffers[0]))
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ========================== FINGERPRINT ========================== */
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t n)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < n; i++)
+    {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Lines of a /proc file that start with one of the keys */
+static uint64_t hash_lines(uint64_t h, const char *path, const char *const *keys)
+{
+    FILE *f = fopen(path, "re");
+    if (!f)
+    {
+        return h;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        for (const char *const *k = keys; *k; k++)
+        {
+            if (strncmp(line, *k, strlen(*k)) == 0)
+            {
+                h = fnv1a(h, line, strlen(line));
+                break;
+            }
+        }
+    }
+    fclose(f);
+    return h;
+}
+
+/* CPU model (and Pi board revision), core count, memory size and the
+ * device dir lives on */
+static uint64_t hardware_fingerprint(const char *dir)
+{
+    static const char *const cpu_keys[] = {"model name", "Hardware", "Revision", "Model",
+                                           "CPU implementer", "CPU part", NULL};
+    static const char *const mem_keys[] = {"MemTotal", NULL};
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int version = CALIBRATION_VERSION;
+    h = fnv1a(h, &version, sizeof(version));
+    h = hash_lines(h, "/proc/cpuinfo", cpu_keys);
+    h = hash_lines(h, "/proc/meminfo", mem_keys);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    h = fnv1a(h, &cpus, sizeof(cpus));
+
+    struct stat st;
+    if (stat(dir, &st) == 0)
+    {
+        unsigned long long dev = (unsigned long long)st.st_dev;
+        h = fnv1a(h, &dev, sizeof(dev));
+    }
+    return h;
+}
+
+/* ============================= CACHE ============================= */
+
+static int lookup(const char *name, const char *const *names, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (strcmp(name, names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int cache_load(const char *path, struct calibration *c)
+{
+    FILE *f = fopen(path, "re");
+    if (!f)
+    {
+        return -1;
+    }
+
+    char line[256], key[64], value[64];
+    int seen = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "%63s %63s", key, value) != 2 || key[0] == '#')
+        {
+            continue;
+        }
+        if (strcmp(key, "fingerprint") == 0)
+        {
+            c->fingerprint = strtoull(value, NULL, 16);
+            seen |= 1;
+        }
+        else if (strcmp(key, "copy_engine") == 0)
+        {
+            int e = lookup(value, copy_engine_names, COPY_ENGINES);
+            c->copy_engine = (enum copy_engine)e;
+            seen |= e >= 0 ? 2 : 0;
+        }
+        else if (strcmp(key, "copy_buffer") == 0)
+        {
+            c->copy_buf = strtoul(value, NULL, 10);
+            seen |= c->copy_buf > 0 ? 4 : 0;
+        }
+        else if (strcmp(key, "decoder") == 0)
+        {
+            int v = lookup(value, decode_variant_names, DECODE_VARIANTS);
+            c->decoder = (enum decode_variant)v;
+            seen |= v >= 0 ? 8 : 0;
+        }
+        else if (strcmp(key, "decode_threads") == 0)
+        {
+            c->decode_threads = atoi(value);
+            seen |= c->decode_threads >= 0 ? 16 : 0;
+        }
+    }
+    fclose(f);
+    return seen == 31 ? 0 : -1;
+}
+
+static int cache_save(const char *path, const struct calibration *c, double seconds)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    {
+        return -1;
+    }
+    FILE *f = fopen(tmp, "we");
+    if (!f)
+    {
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(f, "# wearable_dock self-calibration, measured %s in %.1f s; delete to rerun\n",
+            stamp, seconds);
+    fprintf(f, "fingerprint %016llx\n", (unsigned long long)c->fingerprint);
+    fprintf(f, "copy_engine %s\n", copy_engine_names[c->copy_engine]);
+    fprintf(f, "copy_buffer %zu\n", c->copy_buf);
+    fprintf(f, "decoder %s\n", decode_variant_names[c->decoder]);
+    fprintf(f, "decode_threads %d\n", c->decode_threads);
+
+    if (fclose(f) != 0 || rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* =========================== BENCHMARKS ========================== */
+
+/* Synthetic records in firmware format: increasing timestamps, noisy IMU */
+static int write_scratch(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    size_t per_buf = COPY_BUF_SIZE / RECORD_SIZE;
+    size_t total = (size_t)CALIBRATE_SCRATCH_MB * 1024 * 1024 / RECORD_SIZE;
+    uint8_t *buf = pool_get(per_buf * RECORD_SIZE);
+    uint32_t seed = 12345;
+    int rc = buf ? 0 : -1;
+
+    for (size_t done = 0; rc == 0 && done < total;)
+    {
+        size_t n = total - done < per_buf ? total - done : per_buf;
+        for (size_t i = 0; i < n; i++)
+        {
+            struct raw_record r = {.timestamp_ms = (uint32_t)((done + i) * 10),
+                                   .pressure_pa = 10132500u + (uint32_t)(i & 255),
+                                   .label = (uint8_t)(i % 5)};
+            for (int c = 0; c < IMU_CHANNELS; c++)
+            {
+                seed = seed * 1664525u + 1013904223u;
+                r.imu[c] = (int16_t)((int32_t)(seed >> 16) % 4000);
+            }
+            memcpy(buf + i * RECORD_SIZE, &r, RECORD_SIZE);
+        }
+        if (write(fd, buf, n * RECORD_SIZE) != (ssize_t)(n * RECORD_SIZE))
+        {
+            rc = -1;
+        }
+        done += n;
+    }
+
+    pool_put(buf);
+    if (fsync(fd) != 0)
+    {
+        rc = -1;
+    }
+    close(fd);
+    return rc;
+}
+
+static void drop_cache(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static double time_copy(const char *src, const char *dst)
+{
+    double best = -1;
+    for (int r = 0; r < CALIBRATE_REPS; r++)
+    {
+        char sha[65];
+        drop_cache(src);
+        double t0 = now_s();
+        int rc = copy_file(src, dst, sha);
+        double t = now_s() - t0;
+        unlink(dst);
+        if (rc != 0)
+        {
+            return -1;
+        }
+        if (best < 0 || t < best)
+        {
+            best = t;
+        }
+    }
+    return best;
+}
+
+static double time_decode(const struct archive_map *am, struct record_batch *b)
+{
+    double best = -1;
+    for (int r = 0; r < CALIBRATE_REPS; r++)
+    {
+        double t0 = now_s();
+        for (size_t off = 0; off < am->records; off += BATCH_RECORDS)
+        {
+            size_t n = am->records - off < BATCH_RECORDS ? am->records - off : BATCH_RECORDS;
+            decode_batch(am->data + off * RECORD_SIZE, n, b);
+        }
+        double t = now_s() - t0;
+        if (best < 0 || t < best)
+        {
+            best = t;
+        }
+    }
+    return best;
+}
+
+static double time_workers(const struct archive_map *am, int threads)
+{
+    decoder_set_threads(threads);
+    struct decoder *d = decoder_new();
+    if (!d)
+    {
+        return -1;
+    }
+
+    double best = -1;
+    volatile uint32_t sink = 0;
+    for (int r = 0; r < CALIBRATE_REPS; r++)
+    {
+        double t0 = now_s();
+        decoder_open(d, am, 0);
+        struct record_batch *b;
+        while ((b = decoder_next(d)) != NULL)
+        {
+            sink += b->timestamp_ms[0];
+            decoder_release(d);
+        }
+        decoder_close(d);
+        double t = now_s() - t0;
+        if (best < 0 || t < best)
+        {
+            best = t;
+        }
+    }
+    decoder_free(d);
+    return best;
+}
+
+static int measure(const char *dir, struct calibration *c)
+{
+    char scratch[PATH_MAX], copy[PATH_MAX];
+    if (join_path(dir, SCRATCH_FILE, scratch, sizeof(scratch)) != 0 ||
+        join_path(dir, SCRATCH_COPY, copy, sizeof(copy)) != 0)
+    {
+        return -1;
+    }
+    if (write_scratch(scratch) != 0)
+    {
+        fprintf(stderr, "calibration: cannot write %s: %s\n", scratch, strerror(errno));
+        unlink(scratch);
+        return -1;
+    }
+
+    /* Copy engine x buffer size */
+    double best = -1;
+    for (int e = 0; e < COPY_ENGINES; e++)
+    {
+        for (size_t i = 0; i < COPY_BUFFERS; i++)
+        {
+            copy_configure((enum copy_engine)e, copy_buffers[i]);
+            double t = time_copy(scratch, copy);
+            if (t >= 0 && (best < 0 || t < best))
+            {
+                best = t;
+                c->copy_engine = (enum copy_engine)e;
+                c->copy_buf = copy_buffers[i];
+            }
+        }
+    }
+
+    int rc = best < 0 ? -1 : 0;
+    const struct archive_map *am = archive_map_open(scratch);
+    struct record_batch *b = pool_get(sizeof(*b));
+    if (!am || !b)
+    {
+        rc = -1;
+    }
+
+    /* decode_batch variant */
+    best = -1;
+    for (int v = 0; rc == 0 && v < DECODE_VARIANTS; v++)
+    {
+        decode_select((enum decode_variant)v);
+        double t = time_decode(am, b);
+        if (best < 0 || t < best)
+        {
+            best = t;
+            c->decoder = (enum decode_variant)v;
+        }
+    }
+    decode_select(c->decoder);
+
+    /* Decode workers: 1, 2, 4, ... up to the online CPUs */
+    c->decode_threads = 0;
+    if (rc == 0 && DECODE_THREADS == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int max = cpus > 0 ? (int)cpus : 1;
+        best = -1;
+        for (int t = 1;; t = t * 2 < max ? t * 2 : max)
+        {
+            double s = time_workers(am, t);
+            if (s >= 0 && (best < 0 || s < best * (1 - CALIBRATE_TIE)))
+            {
+                best = s;
+                c->decode_threads = t;
+            }
+            if (t == max)
+            {
+                break;
+            }
+        }
+    }
+
+    pool_put(b);
+    if (am)
+    {
+        archive_map_release(am);
+        archive_map_trim();
+    }
+    unlink(scratch);
+    return rc;
+}
+
+/* ============================= PUBLIC ============================ */
+
+static void apply(const struct calibration *c)
+{
+    copy_configure(c->copy_engine, c->copy_buf);
+    decode_select(c->decoder);
+    if (c->decode_threads > 0)
+    {
+        decoder_set_threads(c->decode_threads);
+    }
+}
+
+int calibrate(const char *dir, struct calibration *out)
+{
+    char path[PATH_MAX];
+    if (join_path(dir, CALIBRATION_FILE, path, sizeof(path)) != 0)
+    {
+        return -1;
+    }
+
+    struct calibration c = {.copy_engine = COPY_STDIO,
+                            .copy_buf = COPY_BUF_SIZE,
+                            .decoder = DECODE_ROWS};
+    uint64_t fp = hardware_fingerprint(dir);
+    double seconds = 0;
+
+    if (cache_load(path, &c) == 0 && c.fingerprint == fp)
+    {
+        c.cached = 1;
+    }
+    else
+    {
+        printf("calibration: benchmarking copy and decode engines ...\n");
+        struct calibration m = {.fingerprint = fp};
+        double t0 = now_s();
+        int rc = measure(dir, &m);
+        seconds = now_s() - t0;
+        if (rc != 0)
+        {
+            fprintf(stderr, "calibration: failed, keeping the built-in defaults\n");
+            copy_configure(COPY_STDIO, COPY_BUF_SIZE);
+            decode_select(DECODE_ROWS);
+            decoder_set_threads(0);
+            return -1;
+        }
+        c = m;
+        if (cache_save(path, &c, seconds) != 0)
+        {
+            fprintf(stderr, "calibration: cannot save %s\n", path);
+        }
+    }
+
+    apply(&c);
+    char threads[32];
+    if (c.decode_threads > 0)
+    {
+        snprintf(threads, sizeof(threads), "%d", c.decode_threads);
+    }
+    else
+    {
+        snprintf(threads, sizeof(threads), "%d (fixed)", DECODE_THREADS);
+    }
+    printf("calibration: %s copy with %zu KiB buffers, %s decode, %s decode threads (%s)\n",
+           copy_engine_names[c.copy_engine], c.copy_buf / 1024,
+           decode_variant_names[c.decoder], threads,
+           c.cached ? "cached" : "measured");
+    if (!c.cached)
+    {
+        printf("calibration: took %.1f s, saved to %s\n", seconds, path);
+    }
+    if (out)
+    {
+        *out = c;
+    }
+    return 0;
+}
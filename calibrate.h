@@ -0,0 +1,49 @@
+/*
+ * calibrate.h: per-host self-benchmark of the copy and decode engines
+ *
+ * The same binary runs on boards with very different cores and card
+ * readers. At startup the dock times every copy engine and buffer size on
+ * a scratch file, every decode_batch variant on synthetic records and the
+ * decoder with a few worker counts, and configures the fastest of each.
+ * The choices are cached in <dir>/CALIBRATION_FILE with a fingerprint of
+ * the CPU, memory and storage device; a cache from other hardware is
+ * ignored and the benchmark runs again. Delete the file to force a rerun.
+ */
+
+#ifndef WEARABLE_CALIBRATE_H
+#define WEARABLE_CALIBRATE_H
+
+#include "filecopy.h"
+#include "record.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 0 = keep the built-in defaults, never benchmark */
+#ifndef CALIBRATE
+#define CALIBRATE 1
+#endif
+
+#define CALIBRATION_FILE ".calibration"
+
+/* Scratch file size for the copy and decode runs */
+#ifndef CALIBRATE_SCRATCH_MB
+#define CALIBRATE_SCRATCH_MB 4
+#endif
+
+struct calibration
+{
+    enum copy_engine copy_engine;
+    size_t copy_buf;
+    enum decode_variant decoder;
+    int decode_threads; /* 0 = DECODE_THREADS is fixed at build time */
+    uint64_t fingerprint;
+    int cached; /* loaded, not measured */
+};
+
+/* Load the choices cached in dir for this hardware, or measure them there
+ * (a few seconds), then apply them. Call before any worker thread starts.
+ * Returns 0, -1 if nothing could be measured (the defaults stay). */
+int calibrate(const char *dir, struct calibration *out);
+
+#endif /* WEARABLE_CALIBRATE_H */
@@ -0,0 +1,449 @@
+/*
+ * canary.c: end-to-end latency canary over a loopback subscription
+ *
+ * The libmosquitto network thread receives probes and folds their latency
+ * into log-scale histograms; the canary thread sends a probe whenever
+ * CANARY_INTERVAL_S passed without one and publishes the metrics. Probe
+ * timestamps are CLOCK_REALTIME, so a plug time carried over an upgrade
+ * stays comparable; probes that come back "before" they were sent (clock
+ * step) are counted as delivered but not measured.
+ */
+
+#define _GNU_SOURCE
+#include "canary.h"
+#include "arena.h"
+#include "block_cache.h"
+#include "util.h"
+
+#include <mosquitto.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CANARY_JSON_CAP (16 * 1024)
+
+/* Four buckets per power of two of microseconds, up to ~25 days */
+#define HIST_SUB 4
+#define HIST_BUCKETS (40 * HIST_SUB)
+
+struct histogram
+{
+    uint64_t count;
+    uint64_t max_us;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+static struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock; /* everything below */
+    pthread_cond_t wake;
+    bool running;
+    bool quit;
+    bool connected;
+    struct mosquitto *mqtt;
+
+    char host[64];
+    char topic[320];   /* probes */
+    char metrics[320]; /* retained metrics */
+
+    unsigned long long seq;
+    unsigned long long sent;
+    unsigned long long delivered;
+    struct timespec last_probe; /* CLOCK_MONOTONIC */
+    struct histogram delivery;
+    struct histogram plug;
+} cn = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+/* =========================== HISTOGRAMS ========================== */
+
+static int hist_index(uint64_t us)
+{
+    if (us < HIST_SUB)
+    {
+        return (int)us;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    int k = (msb - 1) * HIST_SUB + (int)((us >> (msb - 2)) & (HIST_SUB - 1));
+    return k < HIST_BUCKETS ? k : HIST_BUCKETS - 1;
+}
+
+/* Exclusive upper bound of bucket k, in microseconds */
+static uint64_t hist_upper(int k)
+{
+    if (k < HIST_SUB)
+    {
+        return (uint64_t)k + 1;
+    }
+    int msb = k / HIST_SUB + 1;
+    return (uint64_t)(HIST_SUB + k % HIST_SUB + 1) << (msb - 2);
+}
+
+static void hist_add(struct histogram *h, uint64_t us)
+{
+    h->count++;
+    h->bucket[hist_index(us)]++;
+    if (us > h->max_us)
+    {
+        h->max_us = us;
+    }
+}
+
+static uint64_t hist_quantile(const struct histogram *h, double q)
+{
+    uint64_t want = (uint64_t)(q * (double)h->count + 0.999999);
+    uint64_t seen = 0;
+    for (int k = 0; k < HIST_BUCKETS; k++)
+    {
+        seen += h->bucket[k];
+        if (seen >= want && seen > 0)
+        {
+            uint64_t up = hist_upper(k);
+            return up < h->max_us ? up : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+/* {"count":..,"p50":..,...,"buckets":[[le,count],...]} in units of unit_us */
+static size_t hist_json(const struct histogram *h, double unit_us, char *out, size_t cap)
+{
+    int n = snprintf(out, cap, "{\"count\":%llu,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,"
+                               "\"max\":%.3f,\"buckets\":[",
+                     (unsigned long long)h->count, hist_quantile(h, 0.5) / unit_us,
+                     hist_quantile(h, 0.9) / unit_us, hist_quantile(h, 0.99) / unit_us,
+                     h->max_us / unit_us);
+    size_t len = n > 0 && (size_t)n < cap ? (size_t)n : cap;
+
+    const char *sep = "";
+    for (int k = 0; k < HIST_BUCKETS && len < cap; k++)
+    {
+        if (!h->bucket[k])
+        {
+            continue;
+        }
+        n = snprintf(out + len, cap - len, "%s[%.3f,%llu]", sep, hist_upper(k) / unit_us,
+                     (unsigned long long)h->bucket[k]);
+        len = n > 0 && (size_t)n < cap - len ? len + (size_t)n : cap;
+        sep = ",";
+    }
+    n = snprintf(out + len, cap - len, "]}");
+    return n > 0 && (size_t)n < cap - len ? len + (size_t)n : 0;
+}
+
+/* ============================= PROBES ============================ */
+
+static long long timespec_ns(const struct timespec *t)
+{
+    return (long long)t->tv_sec * 1000000000LL + t->tv_nsec;
+}
+
+/* Called with the lock held */
+static size_t encode_probe(const struct timespec *plugged, char *out, size_t cap)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    clock_gettime(CLOCK_MONOTONIC, &cn.last_probe);
+
+    int n = snprintf(out, cap, "{\"seq\":%llu,\"sent_ns\":%lld,\"plugged_ns\":%lld}",
+                     ++cn.seq, timespec_ns(&now), plugged ? timespec_ns(plugged) : 0LL);
+    if (n < 0 || (size_t)n >= cap)
+    {
+        return 0;
+    }
+    cn.sent++;
+    return (size_t)n;
+}
+
+size_t canary_probe(const struct timespec *plugged, const char **topic,
+                    char *out, size_t cap)
+{
+    size_t len = 0;
+    pthread_mutex_lock(&cn.lock);
+    if (cn.running)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (plugged || now.tv_sec - cn.last_probe.tv_sec >= CANARY_INTERVAL_S)
+        {
+            len = encode_probe(plugged, out, cap);
+            *topic = cn.topic;
+        }
+    }
+    pthread_mutex_unlock(&cn.lock);
+    return len;
+}
+
+static void on_connect(struct mosquitto *m, void *ud, int rc)
+{
+    (void)ud;
+    if (rc == 0)
+    {
+        mosquitto_subscribe(m, NULL, cn.topic, 0);
+    }
+    pthread_mutex_lock(&cn.lock);
+    cn.connected = rc == 0;
+    pthread_mutex_unlock(&cn.lock);
+}
+
+static void on_disconnect(struct mosquitto *m, void *ud, int rc)
+{
+    (void)m;
+    (void)ud;
+    (void)rc;
+    pthread_mutex_lock(&cn.lock);
+    cn.connected = false;
+    pthread_mutex_unlock(&cn.lock);
+}
+
+static void on_message(struct mosquitto *m, void *ud, const struct mosquitto_message *msg)
+{
+    (void)m;
+    (void)ud;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    char buf[CANARY_PROBE_CAP];
+    unsigned long long seq;
+    long long sent, plugged;
+    if (msg->payloadlen <= 0 || (size_t)msg->payloadlen >= sizeof(buf))
+    {
+        return;
+    }
+    memcpy(buf, msg->payload, (size_t)msg->payloadlen);
+    buf[msg->payloadlen] = '\0';
+    if (sscanf(buf, "{\"seq\":%llu,\"sent_ns\":%lld,\"plugged_ns\":%lld}", &seq, &sent,
+               &plugged) != 3)
+    {
+        return;
+    }
+
+    long long at = timespec_ns(&now);
+    pthread_mutex_lock(&cn.lock);
+    cn.delivered++;
+    if (at >= sent)
+    {
+        hist_add(&cn.delivery, (uint64_t)(at - sent) / 1000);
+    }
+    if (plugged > 0 && at >= plugged)
+    {
+        hist_add(&cn.plug, (uint64_t)(at - plugged) / 1000);
+    }
+    pthread_mutex_unlock(&cn.lock);
+}
+
+/* ============================= METRICS =========================== */
+
+/* Called with the lock held */
+static size_t encode_metrics(char *out, size_t cap)
+{
+    int n = snprintf(out, cap, "{\"host\":\"%s\",\"probes\":{\"sent\":%llu,\"delivered\":%llu},"
+                               "\"publish_to_delivery_ms\":",
+                     cn.host, cn.sent, cn.delivered);
+    if (n < 0 || (size_t)n >= cap)
+    {
+        return 0;
+    }
+    size_t len = (size_t)n;
+    size_t h = hist_json(&cn.delivery, 1e3, out + len, cap - len);
+    if (!h)
+    {
+        return 0;
+    }
+    len += h;
+
+    n = snprintf(out + len, cap - len, ",\"plug_to_broker_s\":");
+    if (n < 0 || (size_t)n >= cap - len)
+    {
+        return 0;
+    }
+    len += (size_t)n;
+    h = hist_json(&cn.plug, 1e6, out + len, cap - len);
+    if (!h)
+    {
+        return 0;
+    }
+    len += h;
+
+    struct block_cache_stats bc;
+    block_cache_stats(&bc);
+    n = snprintf(out + len, cap - len,
+                 ",\"block_cache\":{\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,"
+                 "\"blocks\":%zu,\"bytes\":%zu,\"budget\":%zu}}",
+                 bc.hits, bc.misses, bc.evictions, bc.blocks, bc.bytes, bc.budget);
+    if (n < 0 || (size_t)n >= cap - len)
+    {
+        return 0;
+    }
+    return len + (size_t)n;
+}
+
+static void report(void)
+{
+    char *payload = pool_get(CANARY_JSON_CAP);
+    if (!payload)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&cn.lock);
+    size_t len = encode_metrics(payload, CANARY_JSON_CAP);
+    printf("canary: %llu/%llu probes back, delivery p50 %.1f ms p99 %.1f ms, "
+           "plug to broker p50 %.0f s (%llu sessions)\n",
+           cn.delivered, cn.sent, hist_quantile(&cn.delivery, 0.5) / 1e3,
+           hist_quantile(&cn.delivery, 0.99) / 1e3, hist_quantile(&cn.plug, 0.5) / 1e6,
+           (unsigned long long)cn.plug.count);
+    pthread_mutex_unlock(&cn.lock);
+
+    if (len)
+    {
+        int rc = mosquitto_publish(cn.mqtt, NULL, cn.metrics, (int)len, payload, 0, true);
+        if (rc != MOSQ_ERR_SUCCESS && rc != MOSQ_ERR_NO_CONN)
+        {
+            fprintf(stderr, "canary: publish metrics: %s\n", mosquitto_strerror(rc));
+        }
+    }
+    pool_put(payload);
+}
+
+static void *canary_main(void *arg)
+{
+    (void)arg;
+    struct timespec now, next_report;
+    clock_gettime(CLOCK_MONOTONIC, &next_report);
+    next_report.tv_sec += CANARY_REPORT_S;
+
+    pthread_mutex_lock(&cn.lock);
+    while (!cn.quit)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (cn.connected && now.tv_sec - cn.last_probe.tv_sec >= CANARY_INTERVAL_S)
+        {
+            char probe[CANARY_PROBE_CAP];
+            size_t len = encode_probe(NULL, probe, sizeof(probe));
+            pthread_mutex_unlock(&cn.lock);
+            if (len)
+            {
+                mosquitto_publish(cn.mqtt, NULL, cn.topic, (int)len, probe, 0, false);
+            }
+            pthread_mutex_lock(&cn.lock);
+        }
+        if (now.tv_sec >= next_report.tv_sec)
+        {
+            pthread_mutex_unlock(&cn.lock);
+            report();
+            pthread_mutex_lock(&cn.lock);
+            next_report.tv_sec = now.tv_sec + CANARY_REPORT_S;
+        }
+
+        /* Wake for whichever is due first; the wait runs on CLOCK_REALTIME */
+        time_t due = cn.last_probe.tv_sec + CANARY_INTERVAL_S;
+        if (due > next_report.tv_sec)
+        {
+            due = next_report.tv_sec;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += due > now.tv_sec ? due - now.tv_sec : 1;
+        pthread_cond_timedwait(&cn.wake, &cn.lock, &ts);
+    }
+    pthread_mutex_unlock(&cn.lock);
+    return NULL;
+}
+
+/* ============================= PUBLIC ============================ */
+
+int canary_start(const char *host, int port, const char *topic)
+{
+    if (gethostname(cn.host, sizeof(cn.host)) != 0)
+    {
+        snprintf(cn.host, sizeof(cn.host), "dock");
+    }
+    cn.host[sizeof(cn.host) - 1] = '\0';
+    for (char *p = cn.host; *p; p++)
+    {
+        if (*p == '/' || *p == '+' || *p == '#' || *p == '"')
+        {
+            *p = '_';
+        }
+    }
+    if (snprintf(cn.topic, sizeof(cn.topic), "%s/canary/%s", topic, cn.host) >= (int)sizeof(cn.topic) ||
+        snprintf(cn.metrics, sizeof(cn.metrics), "%s/metrics/%s", topic, cn.host) >= (int)sizeof(cn.metrics))
+    {
+        fprintf(stderr, "canary: topic too long\n");
+        return -1;
+    }
+
+    cn.mqtt = mosquitto_new(NULL, true, NULL);
+    if (!cn.mqtt)
+    {
+        fprintf(stderr, "canary: mosquitto_new failed\n");
+        return -1;
+    }
+    mosquitto_connect_callback_set(cn.mqtt, on_connect);
+    mosquitto_disconnect_callback_set(cn.mqtt, on_disconnect);
+    mosquitto_message_callback_set(cn.mqtt, on_message);
+    mosquitto_reconnect_delay_set(cn.mqtt, 1, 60, true);
+
+    /* An unreachable broker is retried by the network loop */
+    int rc = mosquitto_connect_async(cn.mqtt, host, port, 60);
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+        fprintf(stderr, "canary: connect to %s:%d: %s\n", host, port, mosquitto_strerror(rc));
+    }
+
+    /* Signals stay with the main thread's poll loop */
+    sigset_t old;
+    block_signals(&old);
+
+    cn.quit = false;
+    rc = mosquitto_loop_start(cn.mqtt);
+    if (rc == MOSQ_ERR_SUCCESS)
+    {
+        rc = pthread_create(&cn.thread, NULL, canary_main, NULL);
+        if (rc != 0)
+        {
+            mosquitto_loop_stop(cn.mqtt, true);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0)
+    {
+        fprintf(stderr, "canary: cannot start\n");
+        mosquitto_destroy(cn.mqtt);
+        cn.mqtt = NULL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&cn.lock);
+    cn.running = true;
+    pthread_mutex_unlock(&cn.lock);
+    return 0;
+}
+
+void canary_stop(void)
+{
+    pthread_mutex_lock(&cn.lock);
+    bool running = cn.running;
+    cn.running = false;
+    cn.quit = true;
+    pthread_cond_broadcast(&cn.wake);
+    pthread_mutex_unlock(&cn.lock);
+    if (!running)
+    {
+        return;
+    }
+
+    pthread_join(cn.thread, NULL);
+    report();
+    mosquitto_disconnect(cn.mqtt);
+    mosquitto_loop_stop(cn.mqtt, false);
+    mosquitto_destroy(cn.mqtt);
+    cn.mqtt = NULL;
+}
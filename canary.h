@@ -0,0 +1,57 @@
+/*
+ * canary.h: end-to-end latency canary over a loopback subscription
+ *
+ * Probes are timestamped messages on <topic>/canary/<host>. The canary
+ * subscribes to that topic on its own broker connection, so every probe
+ * that comes back measures the full path through the broker. Publishers
+ * inject probes behind their own data (canary_probe), and the canary sends
+ * one itself every CANARY_INTERVAL_S when nobody else did.
+ *
+ * Two latency distributions are kept since start:
+ *   publish_to_delivery - probe sent until it came back
+ *   plug_to_broker      - wearable plugged in until the first samples of
+ *                         its session were delivered
+ * and published, retained, on <topic>/metrics/<host> every CANARY_REPORT_S:
+ *   {"host":"dock1","probes":{"sent":120,"delivered":119},
+ *    "publish_to_delivery_ms":{"count":119,"p50":..,"p90":..,"p99":..,"max":..,
+ *                              "buckets":[[le,count],...]},
+ *    "plug_to_broker_s":{...},
+ *    "block_cache":{"hits":..,"misses":..,"evictions":..,"blocks":..,
+ *                   "bytes":..,"budget":..}}
+ * Quantiles are bucket upper bounds, four buckets per power of two. The
+ * block_cache counters are block_cache_stats(), also counted since start.
+ */
+
+#ifndef WEARABLE_CANARY_H
+#define WEARABLE_CANARY_H
+
+#include <stddef.h>
+#include <time.h>
+
+/* Seconds between probes, 0 = no canary */
+#ifndef CANARY_INTERVAL_S
+#define CANARY_INTERVAL_S 0
+#endif
+
+/* Seconds between metrics messages */
+#ifndef CANARY_REPORT_S
+#define CANARY_REPORT_S 60
+#endif
+
+/* Room for one probe payload */
+#define CANARY_PROBE_CAP 96
+
+/* Connect and start probing. Returns 0, -1 on error. */
+int canary_start(const char *host, int port, const char *topic);
+
+void canary_stop(void);
+
+/* A probe to publish on the caller's own connection, right behind the
+ * data it just sent. Fills *topic and out and returns the payload length;
+ * 0 if the canary is off or no probe is due. plugged, if not NULL, is when
+ * the wearable those samples came from was plugged in: such a probe is
+ * always due and also feeds plug_to_broker. */
+size_t canary_probe(const struct timespec *plugged, const char **topic,
+                    char *out, size_t cap);
+
+#endif /* WEARABLE_CANARY_H */
@@ -0,0 +1,368 @@
+/*
+ * control.c: local control socket for on-dock diagnostics
+ *
+ * One thread polls the listening socket and a wake pipe; clients are served
+ * one at a time, with a receive timeout so a silent one cannot wedge it.
+ */
+
+#define _GNU_SOURCE
+#include "control.h"
+#include "arena.h"
+#include "profiler.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CONTROL_LINE_MAX 256
+#define CONTROL_TIMEOUT_S 2
+
+static struct
+{
+    pthread_t thread;
+    bool running;
+    int listen_fd;
+    int wake[2]; /* control_stop writes, the thread polls */
+    char path[108];
+    char profile_dir[PATH_MAX];
+} ctl = {.listen_fd = -1, .wake = {-1, -1}};
+
+/* ============================ COMMANDS =========================== */
+
+/* Profile names are plain file names inside profile_dir */
+static bool valid_name(const char *s)
+{
+    if (!*s || *s == '.' || strlen(s) > 128)
+    {
+        return false;
+    }
+    for (; *s; s++)
+    {
+        if (!((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') ||
+              (*s >= '0' && *s <= '9') || *s == '-' || *s == '_' || *s == '.'))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int profile_path(const char *name, char *out, size_t out_sz)
+{
+    char def[64];
+    if (!name)
+    {
+        time_t now = time(NULL);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(def, sizeof(def), "profile-%Y%m%d_%H%M%S.folded", &tm);
+        name = def;
+    }
+    if (ensure_dir(ctl.profile_dir) != 0)
+    {
+        return -1;
+    }
+    return join_path(ctl.profile_dir, name, out, out_sz);
+}
+
+static void cmd_profile(char *args, char *reply, size_t cap)
+{
+    char *save = NULL;
+    char *verb = strtok_r(args, " \t", &save);
+    char *arg = strtok_r(NULL, " \t", &save);
+
+    if (verb && strcmp(verb, "start") == 0)
+    {
+        char *end = NULL;
+        long hz = arg ? strtol(arg, &end, 10) : 0;
+        if (arg && (*end || hz < 1 || hz > 1000))
+        {
+            snprintf(reply, cap, "error hz must be 1..1000\n");
+        }
+        else if (profiler_start((int)hz) != 0)
+        {
+            snprintf(reply, cap, "error profiler already running or failed to start\n");
+        }
+        else
+        {
+            snprintf(reply, cap, "ok\n");
+        }
+    }
+    else if (verb && strcmp(verb, "stop") == 0)
+    {
+        char path[PATH_MAX];
+        int stacks;
+        if (arg && !valid_name(arg))
+        {
+            snprintf(reply, cap, "error bad profile name\n");
+        }
+        else if (profile_path(arg, path, sizeof(path)) != 0)
+        {
+            snprintf(reply, cap, "error cannot use %s\n", ctl.profile_dir);
+        }
+        else if ((stacks = profiler_stop(path)) < 0)
+        {
+            snprintf(reply, cap, "error profiler not running or output failed\n");
+        }
+        else
+        {
+            snprintf(reply, cap, "ok %s %d stacks\n", path, stacks);
+        }
+    }
+    else if (verb && strcmp(verb, "status") == 0)
+    {
+        struct profiler_stats st;
+        profiler_get_stats(&st);
+        if (st.running)
+        {
+            snprintf(reply, cap,
+                     "ok running hz=%d threads=%d samples=%llu dropped=%llu seconds=%.1f\n",
+                     st.hz, st.threads, st.samples, st.dropped, st.seconds);
+        }
+        else
+        {
+            snprintf(reply, cap, "ok stopped\n");
+        }
+    }
+    else
+    {
+        snprintf(reply, cap, "error usage: profile start [hz] | stop [name] | status\n");
+    }
+}
+
+static void cmd_pools(char *args, char *reply, size_t cap)
+{
+    char *save = NULL;
+    char *verb = strtok_r(args, " \t", &save);
+    if (verb && strcmp(verb, "trim") != 0)
+    {
+        snprintf(reply, cap, "error usage: pools [trim]\n");
+        return;
+    }
+    if (verb)
+    {
+        pool_trim();
+    }
+
+    /* One "reused/allocated/cached" triple per size class */
+    struct pool_stats st;
+    pool_get_stats(&st);
+    size_t len = (size_t)snprintf(reply, cap, "ok");
+    for (unsigned c = 0; c < POOL_CLASSES && len < cap; c++)
+    {
+        len += (size_t)snprintf(reply + len, cap - len, " %lu/%lu/%lu", st.reused[c],
+                                st.allocated[c], st.cached[c]);
+    }
+    if (len < cap)
+    {
+        snprintf(reply + len, cap - len, " large=%lu\n", st.large);
+    }
+}
+
+static void serve(int fd)
+{
+    char line[CONTROL_LINE_MAX];
+    char reply[PATH_MAX + 64];
+    size_t len = 0;
+
+    /* One line; the client may half-close instead of sending '\n' */
+    while (len < sizeof(line) - 1)
+    {
+        ssize_t n = recv(fd, line + len, sizeof(line) - 1 - len, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        len += (size_t)n;
+        if (memchr(line, '\n', len))
+        {
+            break;
+        }
+    }
+    line[len] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (strncmp(line, "profile", 7) == 0 && (line[7] == '\0' || line[7] == ' '))
+    {
+        cmd_profile(line + 7, reply, sizeof(reply));
+    }
+    else if (strncmp(line, "pools", 5) == 0 && (line[5] == '\0' || line[5] == ' '))
+    {
+        cmd_pools(line + 5, reply, sizeof(reply));
+    }
+    else if (strcmp(line, "help") == 0)
+    {
+        snprintf(reply, sizeof(reply),
+                 "ok commands: help, profile start [hz], profile stop [name], profile status, "
+                 "pools [trim]\n");
+    }
+    else
+    {
+        snprintf(reply, sizeof(reply), "error unknown command, try help\n");
+    }
+
+    /* Best effort, the client may be gone */
+    if (send(fd, reply, strlen(reply), MSG_NOSIGNAL) < 0)
+    {
+        fprintf(stderr, "control: reply not sent: %s\n", strerror(errno));
+    }
+}
+
+/* ============================= THREAD ============================ */
+
+static void *control_main(void *arg)
+{
+    (void)arg;
+    struct pollfd pfd[2] = {{ctl.listen_fd, POLLIN, 0}, {ctl.wake[0], POLLIN, 0}};
+
+    for (;;)
+    {
+        /* Threads started during a profile are picked up here */
+        struct profiler_stats st;
+        profiler_get_stats(&st);
+        int ready = poll(pfd, 2, st.running ? PROFILE_RESCAN_MS : -1);
+        profiler_poll();
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("control: poll");
+            break;
+        }
+        if (pfd[1].revents)
+        {
+            break;
+        }
+        if (!(pfd[0].revents & POLLIN))
+        {
+            continue;
+        }
+
+        int fd = accept4(ctl.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            continue;
+        }
+        struct timeval tv = {CONTROL_TIMEOUT_S, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* ============================= PUBLIC ============================ */
+
+int control_start(const char *path, const char *profile_dir)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path) ||
+        strlen(profile_dir) >= sizeof(ctl.profile_dir))
+    {
+        fprintf(stderr, "control: path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(ctl.path, path);
+    strcpy(ctl.profile_dir, profile_dir);
+
+    ctl.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ctl.listen_fd < 0)
+    {
+        perror("control: socket");
+        return -1;
+    }
+
+    /* A socket left by the previous process (or an upgrade) */
+    unlink(path);
+    /* Not umask: it is per process and other threads create files. The
+     * socket is root only before anyone can connect, as listen comes
+     * after the chmod. */
+    int rc = bind(ctl.listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (rc != 0 || chmod(path, 0600) != 0 || listen(ctl.listen_fd, 4) != 0)
+    {
+        fprintf(stderr, "control: cannot listen on %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    if (pipe2(ctl.wake, O_CLOEXEC) != 0)
+    {
+        perror("control: pipe");
+        goto fail;
+    }
+
+    sigset_t old;
+    block_signals(&old);
+    rc = pthread_create(&ctl.thread, NULL, control_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0)
+    {
+        fprintf(stderr, "control: cannot start\n");
+        goto fail;
+    }
+
+    ctl.running = true;
+    printf("Control socket on %s\n", path);
+    return 0;
+
+fail:
+    if (ctl.wake[0] >= 0)
+    {
+        close(ctl.wake[0]);
+        close(ctl.wake[1]);
+        ctl.wake[0] = ctl.wake[1] = -1;
+    }
+    close(ctl.listen_fd);
+    ctl.listen_fd = -1;
+    unlink(path);
+    return -1;
+}
+
+void control_stop(void)
+{
+    if (!ctl.running)
+    {
+        return;
+    }
+    ctl.running = false;
+
+    if (write(ctl.wake[1], "q", 1) != 1)
+    {
+        perror("control: wake");
+    }
+    pthread_join(ctl.thread, NULL);
+
+    close(ctl.wake[0]);
+    close(ctl.wake[1]);
+    ctl.wake[0] = ctl.wake[1] = -1;
+    close(ctl.listen_fd);
+    ctl.listen_fd = -1;
+    unlink(ctl.path);
+
+    struct profiler_stats st;
+    profiler_get_stats(&st);
+    char path[PATH_MAX];
+    if (st.running && profile_path(NULL, path, sizeof(path)) == 0)
+    {
+        profiler_stop(path);
+    }
+}
@@ -0,0 +1,35 @@
+/*
+ * control.h: local control socket for on-dock diagnostics
+ *
+ * A Unix stream socket (mode 0600, so root only) taking one command per
+ * line and answering one line, then closing:
+ *
+ *   help
+ *   profile start [hz]     start the sampling profiler (profiler.h)
+ *   profile stop [name]    stop it and write <profile_dir>/<name>, default
+ *                          profile-YYYYmmdd_HHMMSS.folded
+ *   profile status
+ *   pools [trim]           buffer pool counters (arena.h), per size class
+ *                          "reused/allocated/cached", then large=; trim
+ *                          frees the idle buffers first
+ *
+ * Answers start with "ok" or "error". For example
+ *   echo 'profile start' | socat - UNIX-CONNECT:/run/wearable_dock.sock
+ */
+
+#ifndef WEARABLE_CONTROL_H
+#define WEARABLE_CONTROL_H
+
+#ifndef CONTROL_SOCKET
+#define CONTROL_SOCKET "/run/wearable_dock.sock"
+#endif
+
+/* Listen on path; profiles are written under profile_dir.
+ * Returns 0, -1 on error. */
+int control_start(const char *path, const char *profile_dir);
+
+/* Close the socket and join the thread. A running profile is stopped and
+ * written first, so an upgrade does not lose it. */
+void control_stop(void);
+
+#endif /* WEARABLE_CONTROL_H */
@@ -0,0 +1,264 @@
+/*
+ * decoder.c: parallel, in-order batch decode of mapped .BIN files
+ *
+ * Chunk k of the open file always lands in slot k % nslots. A worker may
+ * claim chunk k only once chunk k - nslots has been released, so a slot is
+ * never reused while the caller still holds it, and the caller waits on
+ * exactly one slot for the next batch in order: no reordering step needed.
+ */
+
+#define _GNU_SOURCE
+#include "decoder.h"
+#include "arena.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DECODE_MAX_THREADS 16
+#define DECODE_MAX_SLOTS (2 * DECODE_MAX_THREADS + DECODE_HELD)
+
+enum slot_state
+{
+    SLOT_FREE,
+    SLOT_BUSY,  /* a worker is decoding into it */
+    SLOT_READY, /* decoded, possibly handed to the caller */
+};
+
+struct decoder
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work; /* workers: a chunk can be claimed, or quit */
+    pthread_cond_t done; /* caller: a chunk is ready, or a worker is idle */
+    bool quit;
+
+    int nthreads;
+    pthread_t thread[DECODE_MAX_THREADS];
+    int nslots;
+    struct record_batch *slot[DECODE_MAX_SLOTS];
+    enum slot_state state[DECODE_MAX_SLOTS];
+
+    /* open file */
+    const uint8_t *data; /* first record to decode */
+    size_t records;
+    size_t chunks;
+    size_t claimed;  /* chunks started */
+    size_t taken;    /* chunks handed to the caller */
+    size_t released; /* chunks given back */
+    int busy;        /* workers decoding */
+    bool parallel;
+};
+
+static int default_threads;
+
+static size_t chunk_records(const struct decoder *d, size_t k)
+{
+    size_t left = d->records - k * BATCH_RECORDS;
+    return left < BATCH_RECORDS ? left : BATCH_RECORDS;
+}
+
+static void *decode_worker(void *arg)
+{
+    struct decoder *d = arg;
+
+    pthread_mutex_lock(&d->lock);
+    while (!d->quit)
+    {
+        if (d->parallel && d->claimed < d->chunks && d->claimed < d->released + (size_t)d->nslots)
+        {
+            size_t k = d->claimed++;
+            int s = (int)(k % (size_t)d->nslots);
+            const uint8_t *src = d->data + k * BATCH_RECORDS * RECORD_SIZE;
+            size_t n = chunk_records(d, k);
+            d->state[s] = SLOT_BUSY;
+            d->busy++;
+            pthread_mutex_unlock(&d->lock);
+
+            decode_batch(src, n, d->slot[s]);
+
+            pthread_mutex_lock(&d->lock);
+            d->state[s] = SLOT_READY;
+            d->busy--;
+            pthread_cond_broadcast(&d->done);
+            continue;
+        }
+        pthread_cond_wait(&d->work, &d->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+static void reset_file(struct decoder *d)
+{
+    d->data = NULL;
+    d->records = d->chunks = d->claimed = d->taken = d->released = 0;
+    d->parallel = false;
+    for (int s = 0; s < d->nslots; s++)
+    {
+        d->state[s] = SLOT_FREE;
+    }
+}
+
+void decoder_set_threads(int threads)
+{
+    default_threads = threads;
+}
+
+struct decoder *decoder_new(void)
+{
+    int threads = DECODE_THREADS > 0 ? DECODE_THREADS : default_threads;
+    if (threads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (threads > DECODE_MAX_THREADS)
+    {
+        threads = DECODE_MAX_THREADS;
+    }
+
+    struct decoder *d = calloc(1, sizeof(*d));
+    if (!d)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->work, NULL);
+    pthread_cond_init(&d->done, NULL);
+
+    d->nslots = 2 * threads + DECODE_HELD;
+    for (int s = 0; s < d->nslots; s++)
+    {
+        d->slot[s] = pool_get(sizeof(struct record_batch));
+        if (!d->slot[s])
+        {
+            decoder_free(d);
+            return NULL;
+        }
+    }
+    reset_file(d);
+
+    /* Signals stay with the main thread's poll loop */
+    sigset_t old;
+    block_signals(&old);
+    for (; d->nthreads < threads; d->nthreads++)
+    {
+        if (pthread_create(&d->thread[d->nthreads], NULL, decode_worker, d) != 0)
+        {
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (d->nthreads == 0)
+    {
+        fprintf(stderr, "decoder: no worker threads, decoding inline\n");
+    }
+    return d;
+}
+
+/* Stop handing out chunks of the open file and wait for the workers to
+ * leave it; called with the lock held */
+static void quiesce(struct decoder *d)
+{
+    d->chunks = d->claimed;
+    while (d->busy)
+    {
+        pthread_cond_wait(&d->done, &d->lock);
+    }
+    reset_file(d);
+}
+
+void decoder_open(struct decoder *d, const struct archive_map *am, size_t first)
+{
+    pthread_mutex_lock(&d->lock);
+    quiesce(d);
+    if (am->data && first < am->records)
+    {
+        d->data = am->data + first * RECORD_SIZE;
+        d->records = am->records - first;
+        d->chunks = (d->records + BATCH_RECORDS - 1) / BATCH_RECORDS;
+        d->parallel = d->nthreads > 0 && d->records >= DECODE_PARALLEL_MIN;
+    }
+    pthread_cond_broadcast(&d->work);
+    pthread_mutex_unlock(&d->lock);
+}
+
+struct record_batch *decoder_next(struct decoder *d)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->taken == d->chunks)
+    {
+        pthread_mutex_unlock(&d->lock);
+        return NULL;
+    }
+
+    size_t k = d->taken;
+    int s = (int)(k % (size_t)d->nslots);
+    if (!d->parallel)
+    {
+        d->claimed = k + 1;
+        pthread_mutex_unlock(&d->lock);
+        decode_batch(d->data + k * BATCH_RECORDS * RECORD_SIZE, chunk_records(d, k), d->slot[s]);
+        pthread_mutex_lock(&d->lock);
+        d->state[s] = SLOT_READY;
+    }
+    while (d->state[s] != SLOT_READY)
+    {
+        pthread_cond_wait(&d->done, &d->lock);
+    }
+    d->taken++;
+    pthread_mutex_unlock(&d->lock);
+    return d->slot[s];
+}
+
+void decoder_release(struct decoder *d)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->released < d->taken)
+    {
+        d->state[d->released % (size_t)d->nslots] = SLOT_FREE;
+        d->released++;
+        pthread_cond_broadcast(&d->work);
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+void decoder_close(struct decoder *d)
+{
+    pthread_mutex_lock(&d->lock);
+    quiesce(d);
+    pthread_mutex_unlock(&d->lock);
+}
+
+void decoder_free(struct decoder *d)
+{
+    if (!d)
+    {
+        return;
+    }
+    decoder_close(d);
+
+    pthread_mutex_lock(&d->lock);
+    d->quit = true;
+    pthread_cond_broadcast(&d->work);
+    pthread_mutex_unlock(&d->lock);
+    for (int t = 0; t < d->nthreads; t++)
+    {
+        pthread_join(d->thread[t], NULL);
+    }
+
+    for (int s = 0; s < d->nslots; s++)
+    {
+        pool_put(d->slot[s]);
+    }
+    pthread_cond_destroy(&d->done);
+    pthread_cond_destroy(&d->work);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
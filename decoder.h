@@ -0,0 +1,55 @@
+/*
+ * decoder.h: parallel, in-order batch decode of mapped .BIN files
+ *
+ * A decoder owns a few worker threads and a ring of record batches. A
+ * file (already framed by archive_map_open, so its records are whole) is
+ * cut into BATCH_RECORDS-record chunks that the workers decode
+ * concurrently; the caller still receives the batches strictly in record
+ * order, so stateful stages after decode see the same stream as before.
+ */
+
+#ifndef WEARABLE_DECODER_H
+#define WEARABLE_DECODER_H
+
+#include "archive_map.h"
+#include "record.h"
+
+#include <stddef.h>
+
+/* Worker threads, 0 = one per online CPU */
+#ifndef DECODE_THREADS
+#define DECODE_THREADS 0
+#endif
+
+/* Files with fewer records are decoded on the caller's thread */
+#ifndef DECODE_PARALLEL_MIN
+#define DECODE_PARALLEL_MIN (16 * BATCH_RECORDS)
+#endif
+
+/* Batches a caller may hold (taken and not yet released) at once */
+#define DECODE_HELD 2
+
+struct decoder;
+
+/* Worker threads for decoders created from now on, 0 = one per online
+ * CPU; only used when DECODE_THREADS is 0 */
+void decoder_set_threads(int threads);
+
+/* Start the workers and allocate the ring; NULL on error */
+struct decoder *decoder_new(void);
+
+/* Decode records [first, am->records) of am, abandoning any previous file */
+void decoder_open(struct decoder *d, const struct archive_map *am, size_t first);
+
+/* Next batch in record order, NULL after the last one. It stays valid
+ * until released; release in the order taken. */
+struct record_batch *decoder_next(struct decoder *d);
+void decoder_release(struct decoder *d);
+
+/* Abandon the rest of the file; returns once no worker touches it, so
+ * the mapping may be released */
+void decoder_close(struct decoder *d);
+
+void decoder_free(struct decoder *d);
+
+#endif /* WEARABLE_DECODER_H */
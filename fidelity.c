@@ -0,0 +1,212 @@
+/*
+ * fidelity.c: event-triggered sample fidelity
+ *
+ * Trigger detection runs over whole 16-record groups of the SoA batch with
+ * branch-free loops so it vectorises at -O2. Windows are then marked with
+ * a forward sweep (after each trigger, carried into the next batch) and a
+ * backward sweep (before each trigger, seeded from the next batch's
+ * triggers: the caller holds one batch back so its look-back is complete).
+ */
+
+#include "fidelity.h"
+
+#include <string.h>
+
+#define GRAVITY 9.81f
+
+void fidelity_reset(struct fidelity_state *st)
+{
+    memset(st, 0, sizeof(*st));
+}
+
+/* ============================ TRIGGERS =========================== */
+
+/* |acc| outside [1 g - dev, 1 g + dev], compared squared */
+static void trigger_acc(const float *restrict x, const float *restrict y,
+                        const float *restrict z, uint8_t *restrict t, size_t nv)
+{
+    float hi = (GRAVITY + TRIGGER_ACC_DEV) * (GRAVITY + TRIGGER_ACC_DEV);
+    float lo = GRAVITY > TRIGGER_ACC_DEV ? (GRAVITY - TRIGGER_ACC_DEV) * (GRAVITY - TRIGGER_ACC_DEV) : 0.0f;
+
+    for (size_t i = 0; i < nv; i++)
+    {
+        float m2 = x[i] * x[i] + y[i] * y[i] + z[i] * z[i];
+        t[i] |= (uint8_t)((m2 > hi) | (m2 < lo));
+    }
+}
+
+/* v[i] != v[i - 1], v[-1] = prev. The first group is done on its own so
+ * the rest runs over whole groups. */
+static void trigger_label(const uint8_t *restrict v, uint8_t *restrict t, size_t nv, uint8_t prev)
+{
+    t[0] |= (uint8_t)(v[0] != prev);
+    for (size_t i = 1; i < 16; i++)
+    {
+        t[i] |= (uint8_t)(v[i] != v[i - 1]);
+    }
+    for (size_t i = 16; i < nv; i++)
+    {
+        t[i] |= (uint8_t)(v[i] != v[i - 1]);
+    }
+}
+
+/* |v[i] - v[i - 1]| > step, v[-1] = prev */
+static void trigger_step(const float *restrict v, uint8_t *restrict t, size_t nv,
+                         float prev, float step)
+{
+    t[0] |= (uint8_t)((v[0] - prev > step) | (prev - v[0] > step));
+    for (size_t i = 1; i < 16; i++)
+    {
+        float d = v[i] - v[i - 1];
+        t[i] |= (uint8_t)((d > step) | (-d > step));
+    }
+    for (size_t i = 16; i < nv; i++)
+    {
+        float d = v[i] - v[i - 1];
+        t[i] |= (uint8_t)((d > step) | (-d > step));
+    }
+}
+
+size_t fidelity_triggers(struct fidelity_state *st, const struct record_batch *b,
+                         uint8_t *trig)
+{
+    size_t n = b->n;
+    size_t nv = (n + 15) & ~(size_t)15;
+
+    memset(trig, 0, nv);
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    if (TRIGGER_ACC_DEV > 0)
+    {
+        trigger_acc(b->imu[0], b->imu[1], b->imu[2], trig, nv);
+    }
+    if (TRIGGER_ON_LABEL)
+    {
+        trigger_label(b->label, trig, nv, st->have_last ? st->last_label : b->label[0]);
+    }
+    if (TRIGGER_PRESSURE_STEP > 0)
+    {
+        trigger_step(b->pressure_pa, trig, nv,
+                     st->have_last ? st->last_pressure : b->pressure_pa[0],
+                     TRIGGER_PRESSURE_STEP);
+    }
+    memset(trig + n, 0, nv - n);
+
+    st->last_label = b->label[n - 1];
+    st->last_pressure = b->pressure_pa[n - 1];
+    st->have_last = 1;
+
+    size_t count = 0;
+    for (size_t i = 0; i < nv; i++)
+    {
+        count += trig[i];
+    }
+    return count;
+}
+
+/* ============================ REDUCTION ========================== */
+
+/* Overwrite record s with the mean of records [s, e). Means are rounded
+ * to the sensor's resolution so the raw columns stay in step with the
+ * scaled ones. */
+static void aggregate_block(struct record_batch *b, size_t s, size_t e)
+{
+    uint64_t p = 0;
+    for (size_t i = s; i < e; i++)
+    {
+        p += b->pressure_raw[i];
+    }
+    b->pressure_raw[s] = (uint32_t)((p + (e - s) / 2) / (e - s));
+    b->pressure_pa[s] = b->pressure_raw[s] / 100.0f;
+
+    for (int c = 0; c < IMU_CHANNELS; c++)
+    {
+        long sum = 0;
+        for (size_t i = s; i < e; i++)
+        {
+            sum += b->imu_raw[c][i];
+        }
+        long half = (long)(e - s) / 2;
+        long mean = (sum + (sum < 0 ? -half : half)) / (long)(e - s);
+        b->imu_raw[c][s] = (int16_t)mean;
+        b->imu[c][s] = (float)mean / IMU_SCALE;
+    }
+}
+
+size_t fidelity_apply(struct fidelity_state *st, struct record_batch *b,
+                      const uint8_t *trig, const uint8_t *next_trig, size_t next_n,
+                      uint8_t *keep)
+{
+    size_t n = b->n;
+
+    if (FIDELITY_MODE == FIDELITY_FULL)
+    {
+        memset(keep, 1, n);
+        return n;
+    }
+
+    /* After each trigger, continuing a window from the previous batch */
+    size_t run = st->post_left;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (trig[i])
+        {
+            run = TRIGGER_POST + 1;
+        }
+        keep[i] = run > 0;
+        run -= run > 0;
+    }
+    st->post_left = run;
+
+    /* Before each trigger, starting with one early in the next batch */
+    run = 0;
+    for (size_t j = 0; next_trig && j < next_n && j < TRIGGER_PRE; j++)
+    {
+        if (next_trig[j])
+        {
+            run = TRIGGER_PRE - j;
+            break;
+        }
+    }
+    for (size_t i = n; i-- > 0;)
+    {
+        if (trig[i])
+        {
+            run = TRIGGER_PRE + 1;
+        }
+        keep[i] |= run > 0;
+        run -= run > 0;
+    }
+
+    /* Quiet stretches: one record per block */
+    size_t kept = 0;
+    size_t start = 0, len = 0;
+    for (size_t i = 0; i <= n; i++)
+    {
+        int quiet = i < n && !keep[i];
+        if (quiet && len == 0)
+        {
+            start = i;
+        }
+        len += quiet;
+
+        if (len && (!quiet || len == TRIGGER_DECIMATE))
+        {
+            if (FIDELITY_MODE == FIDELITY_AGGREGATE)
+            {
+                aggregate_block(b, start, start + len);
+            }
+            keep[start] = 1;
+            len = 0;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        kept += keep[i];
+    }
+    return kept;
+}
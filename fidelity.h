@@ -0,0 +1,79 @@
+/*
+ * fidelity.h: event-triggered sample fidelity
+ *
+ * Full-rate samples are kept only in windows around trigger events (label
+ * change, acceleration magnitude away from 1 g, pressure step); the quiet
+ * stretches in between are cut to one record per TRIGGER_DECIMATE.
+ */
+
+#ifndef WEARABLE_FIDELITY_H
+#define WEARABLE_FIDELITY_H
+
+#include "record.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* What happens outside trigger windows */
+#define FIDELITY_FULL 0      /* nothing, every record is kept */
+#define FIDELITY_DECIMATE 1  /* every TRIGGER_DECIMATE-th record */
+#define FIDELITY_AGGREGATE 2 /* the mean of each TRIGGER_DECIMATE records */
+#ifndef FIDELITY_MODE
+#define FIDELITY_MODE FIDELITY_FULL
+#endif
+
+/* Trigger thresholds; a threshold of 0 disables that trigger */
+#ifndef TRIGGER_ON_LABEL
+#define TRIGGER_ON_LABEL 1 /* any change of the predicted label */
+#endif
+#ifndef TRIGGER_ACC_DEV
+#define TRIGGER_ACC_DEV 3.0f /* | |acc| - 1 g | in m/s^2 */
+#endif
+#ifndef TRIGGER_PRESSURE_STEP
+#define TRIGGER_PRESSURE_STEP 10.0f /* Pa between consecutive records */
+#endif
+
+/* Full-rate window around each trigger, in records */
+#ifndef TRIGGER_PRE
+#define TRIGGER_PRE 256
+#endif
+#ifndef TRIGGER_POST
+#define TRIGGER_POST 512
+#endif
+
+#ifndef TRIGGER_DECIMATE
+#define TRIGGER_DECIMATE 32
+#endif
+
+#if TRIGGER_PRE > BATCH_RECORDS
+#error "TRIGGER_PRE must not exceed BATCH_RECORDS (one batch of look-back)"
+#endif
+
+/* Carried across the batches of one session */
+struct fidelity_state
+{
+    uint8_t last_label;
+    float last_pressure;
+    int have_last;
+    size_t post_left; /* records still inside the last trigger's window */
+};
+
+void fidelity_reset(struct fidelity_state *st);
+
+/* trig[i] = 1 where record i of b fires a trigger (trig holds
+ * BATCH_RECORDS). Batches must be passed in order. Returns the count. */
+size_t fidelity_triggers(struct fidelity_state *st, const struct record_batch *b,
+                         uint8_t *trig);
+
+/* Reduce b to what should be published: keep[i] = 1 for records inside a
+ * trigger window and for one record per quiet block (blocks end at window
+ * edges and at the end of the batch). The window of a
+ * trigger early in the following batch reaches back into b through
+ * next_trig (NULL if b is the last batch). In FIDELITY_AGGREGATE mode the
+ * kept quiet records are overwritten with their block means.
+ * Returns the number of kept records. */
+size_t fidelity_apply(struct fidelity_state *st, struct record_batch *b,
+                      const uint8_t *trig, const uint8_t *next_trig, size_t next_n,
+                      uint8_t *keep);
+
+#endif /* WEARABLE_FIDELITY_H */
@@ -0,0 +1,200 @@
+/*
+ * filecopy.c: copying log files off the card, hashing on the fly
+ */
+
+#define _GNU_SOURCE
+#include "filecopy.h"
+#include "arena.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+const char *const copy_engine_names[COPY_ENGINES] = {"stdio", "syscall"};
+
+static enum copy_engine engine = COPY_STDIO;
+static size_t buf_size = COPY_BUF_SIZE;
+
+void copy_configure(enum copy_engine e, size_t size)
+{
+    engine = e;
+    buf_size = size;
+}
+
+void copy_get_config(enum copy_engine *e, size_t *size)
+{
+    *e = engine;
+    *size = buf_size;
+}
+
+/* ============================ ENGINES ============================ */
+
+static int copy_stdio(const char *src, const char *dst, uint8_t *buf, size_t size,
+                      EVP_MD_CTX *md)
+{
+    FILE *in = fopen(src, "rb");
+    if (!in)
+    {
+        fprintf(stderr, "Failed to open %s for read: %s\n", src, strerror(errno));
+        return -1;
+    }
+
+    FILE *out = fopen(dst, "wb");
+    if (!out)
+    {
+        fprintf(stderr, "Failed to open %s for write: %s\n", dst, strerror(errno));
+        fclose(in);
+        return -1;
+    }
+
+    size_t n;
+    int rc = 0;
+    while ((n = fread(buf, 1, size, in)) > 0)
+    {
+        if (fwrite(buf, 1, n, out) != n)
+        {
+            fprintf(stderr, "Write error to %s: %s\n", dst, strerror(errno));
+            rc = -1;
+            break;
+        }
+        if (md)
+        {
+            EVP_DigestUpdate(md, buf, n);
+        }
+    }
+
+    if (ferror(in))
+    {
+        fprintf(stderr, "Read error from %s\n", src);
+        rc = -1;
+    }
+
+    fclose(in);
+    if (fclose(out) != 0)
+    {
+        fprintf(stderr, "Close error on %s: %s\n", dst, strerror(errno));
+        rc = -1;
+    }
+    return rc;
+}
+
+static int write_all(int fd, const uint8_t *p, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (w <= 0)
+        {
+            return -1;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+static int copy_syscall(const char *src, const char *dst, uint8_t *buf, size_t size,
+                        EVP_MD_CTX *md)
+{
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        fprintf(stderr, "Failed to open %s for read: %s\n", src, strerror(errno));
+        return -1;
+    }
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out < 0)
+    {
+        fprintf(stderr, "Failed to open %s for write: %s\n", dst, strerror(errno));
+        close(in);
+        return -1;
+    }
+
+    int rc = 0;
+    for (;;)
+    {
+        ssize_t n = read(in, buf, size);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            fprintf(stderr, "Read error from %s: %s\n", src, strerror(errno));
+            rc = -1;
+            break;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        if (write_all(out, buf, (size_t)n) != 0)
+        {
+            fprintf(stderr, "Write error to %s: %s\n", dst, strerror(errno));
+            rc = -1;
+            break;
+        }
+        if (md)
+        {
+            EVP_DigestUpdate(md, buf, (size_t)n);
+        }
+    }
+
+    close(in);
+    if (close(out) != 0)
+    {
+        fprintf(stderr, "Close error on %s: %s\n", dst, strerror(errno));
+        rc = -1;
+    }
+    return rc;
+}
+
+/* ============================= PUBLIC ============================ */
+
+int copy_file(const char *src, const char *dst, char sha_hex[65])
+{
+    size_t size = buf_size;
+    uint8_t *buf = pool_get(size);
+    if (!buf)
+    {
+        fprintf(stderr, "copy_file: out of memory\n");
+        return -1;
+    }
+
+    EVP_MD_CTX *md = sha_hex ? EVP_MD_CTX_new() : NULL;
+    if (md && !EVP_DigestInit_ex(md, EVP_sha256(), NULL))
+    {
+        EVP_MD_CTX_free(md);
+        md = NULL;
+    }
+
+    int rc = engine == COPY_SYSCALL ? copy_syscall(src, dst, buf, size, md)
+                                    : copy_stdio(src, dst, buf, size, md);
+
+    if (sha_hex)
+    {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len = 0;
+        if (!md || !EVP_DigestFinal_ex(md, digest, &digest_len))
+        {
+            fprintf(stderr, "SHA-256 of %s failed\n", src);
+            rc = -1;
+        }
+        hex_encode(digest, digest_len, sha_hex);
+        EVP_MD_CTX_free(md);
+    }
+
+    pool_put(buf);
+    return rc;
+}
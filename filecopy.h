@@ -0,0 +1,37 @@
+/*
+ * filecopy.h: copying log files off the card, hashing on the fly
+ *
+ * Two copy engines move the same bytes: buffered stdio, and plain
+ * read/write with sequential read-ahead advice. Which one is faster, and
+ * with what buffer, depends on the board and the card reader, so both are
+ * selectable at run time (see calibrate.h).
+ */
+
+#ifndef WEARABLE_FILECOPY_H
+#define WEARABLE_FILECOPY_H
+
+#include <stddef.h>
+
+/* Default copy buffer, one pool size class */
+#ifndef COPY_BUF_SIZE
+#define COPY_BUF_SIZE (256 * 1024)
+#endif
+
+enum copy_engine
+{
+    COPY_STDIO,
+    COPY_SYSCALL,
+    COPY_ENGINES
+};
+
+extern const char *const copy_engine_names[COPY_ENGINES];
+
+/* Engine and buffer size for later copies; set before other threads copy */
+void copy_configure(enum copy_engine engine, size_t buf_size);
+void copy_get_config(enum copy_engine *engine, size_t *buf_size);
+
+/* Copy src to dst; if sha_hex is given, it receives the SHA-256 of the
+ * bytes written, computed on the fly. Returns 0, -1 on error (logged). */
+int copy_file(const char *src, const char *dst, char sha_hex[65]);
+
+#endif /* WEARABLE_FILECOPY_H */
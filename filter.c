@@ -0,0 +1,340 @@
+/*
+ * filter.c: record selection and field projection ahead of encoding
+ *
+ * A predicate is an OR of AND-ed clauses. Every clause is evaluated over a
+ * whole SoA batch into a 0/1 selection mask with one branch-free compare
+ * loop per operator, so each vectorises at -O2; masks are then combined
+ * with byte-wise AND / OR.
+ */
+
+#include "filter.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const field_names[FIELD_COUNT] = {
+    "timestamp_ms", "pressure_pa", "predicted", "acceleration", "gyroscope"};
+
+/* ============================= PARSING =========================== */
+
+static const char *skip_space(const char *p)
+{
+    while (*p == ' ' || *p == '\t')
+    {
+        p++;
+    }
+    return p;
+}
+
+static int parse_column(const char *name, size_t len, struct filter_clause *c)
+{
+    if ((len == 9 && !strncmp(name, "predicted", len)) ||
+        (len == 5 && !strncmp(name, "label", len)))
+    {
+        c->column = COL_LABEL;
+        return 0;
+    }
+    if (len == 11 && !strncmp(name, "pressure_pa", len))
+    {
+        c->column = COL_PRESSURE;
+        return 0;
+    }
+    if (len == 14 && !strncmp(name, "pressure_delta", len))
+    {
+        c->column = COL_PRESSURE_DELTA;
+        return 0;
+    }
+    for (int ch = 0; ch < IMU_CHANNELS; ch++)
+    {
+        if (strlen(imu_channel_names[ch]) == len && !strncmp(name, imu_channel_names[ch], len))
+        {
+            c->column = COL_IMU;
+            c->channel = ch;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* "<column> <op> <number>" between p and end */
+static int parse_clause(const char *p, const char *end, struct filter_clause *c)
+{
+    static const struct
+    {
+        const char *text;
+        enum filter_op op;
+    } ops[] = {{"==", OP_EQ}, {"!=", OP_NE}, {"<=", OP_LE}, {">=", OP_GE}, {"<", OP_LT}, {">", OP_GT}};
+
+    p = skip_space(p);
+    const char *name = p;
+    while (p < end && (isalnum((unsigned char)*p) || *p == '_'))
+    {
+        p++;
+    }
+    if (parse_column(name, (size_t)(p - name), c) != 0)
+    {
+        return -1;
+    }
+
+    p = skip_space(p);
+    size_t k;
+    for (k = 0; k < sizeof(ops) / sizeof(ops[0]); k++)
+    {
+        size_t len = strlen(ops[k].text);
+        if (p + len <= end && !strncmp(p, ops[k].text, len))
+        {
+            c->op = ops[k].op;
+            p += len;
+            break;
+        }
+    }
+    if (k == sizeof(ops) / sizeof(ops[0]))
+    {
+        return -1;
+    }
+
+    char *num_end;
+    c->value = strtof(p, &num_end);
+    if (num_end == p || skip_space(num_end) != end)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_select(const char *spec, struct filter *f)
+{
+    f->terms = 0;
+    if (!*skip_space(spec))
+    {
+        return 0;
+    }
+
+    const char *term = spec;
+    for (;;)
+    {
+        const char *term_end = strstr(term, "||");
+        if (!term_end)
+        {
+            term_end = term + strlen(term);
+        }
+        if (f->terms == FILTER_MAX_TERMS)
+        {
+            return -1;
+        }
+
+        int t = f->terms++;
+        f->clauses[t] = 0;
+        const char *cl = term;
+        for (;;)
+        {
+            const char *cl_end = strstr(cl, "&&");
+            if (!cl_end || cl_end > term_end)
+            {
+                cl_end = term_end;
+            }
+            if (f->clauses[t] == FILTER_MAX_CLAUSES ||
+                parse_clause(cl, cl_end, &f->clause[t][f->clauses[t]]) != 0)
+            {
+                return -1;
+            }
+            f->clauses[t]++;
+            if (cl_end == term_end)
+            {
+                break;
+            }
+            cl = cl_end + 2;
+        }
+
+        if (!*term_end)
+        {
+            return 0;
+        }
+        term = term_end + 2;
+    }
+}
+
+static int parse_fields(const char *spec, struct filter *f)
+{
+    f->fields = 0;
+    const char *p = spec;
+    while (*p)
+    {
+        p = skip_space(p);
+        size_t len = strcspn(p, ", \t");
+        int k;
+        for (k = 0; k < FIELD_COUNT; k++)
+        {
+            if (strlen(field_names[k]) == len && !strncmp(p, field_names[k], len))
+            {
+                f->fields |= 1u << k;
+                break;
+            }
+        }
+        if (k == FIELD_COUNT)
+        {
+            return -1;
+        }
+        p = skip_space(p + len);
+        if (*p == ',')
+        {
+            p++;
+        }
+    }
+    return f->fields ? 0 : -1;
+}
+
+int filter_parse(const char *select, const char *fields, struct filter *f)
+{
+    memset(f, 0, sizeof(*f));
+    if (parse_select(select, f) != 0 || parse_fields(fields, f) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void filter_reset(struct filter *f)
+{
+    f->have_last = 0;
+}
+
+/* ============================ SELECTION ========================== */
+
+#define COMPARE_LOOP(OP)                 \
+    for (size_t i = 0; i < nv; i++)      \
+    {                                    \
+        m[i] = (uint8_t)(v[i] OP x);     \
+    }
+
+static void compare(const float *restrict v, uint8_t *restrict m, size_t nv,
+                    enum filter_op op, float x)
+{
+    switch (op)
+    {
+    case OP_EQ:
+        COMPARE_LOOP(==)
+        break;
+    case OP_NE:
+        COMPARE_LOOP(!=)
+        break;
+    case OP_LT:
+        COMPARE_LOOP(<)
+        break;
+    case OP_LE:
+        COMPARE_LOOP(<=)
+        break;
+    case OP_GT:
+        COMPARE_LOOP(>)
+        break;
+    case OP_GE:
+        COMPARE_LOOP(>=)
+        break;
+    }
+}
+
+static void and_mask(uint8_t *restrict a, const uint8_t *restrict b, size_t nv)
+{
+    for (size_t i = 0; i < nv; i++)
+    {
+        a[i] &= b[i];
+    }
+}
+
+static void or_mask(uint8_t *restrict a, const uint8_t *restrict b, size_t nv)
+{
+    for (size_t i = 0; i < nv; i++)
+    {
+        a[i] |= b[i];
+    }
+}
+
+static void widen_u8(const uint8_t *restrict v, float *restrict out, size_t nv)
+{
+    for (size_t i = 0; i < nv; i++)
+    {
+        out[i] = v[i];
+    }
+}
+
+/* |v[i] - v[i - 1]|, v[-1] = prev */
+static void abs_delta(const float *restrict v, float *restrict out, size_t nv, float prev)
+{
+    out[0] = v[0] - prev;
+    for (size_t i = 1; i < nv; i++)
+    {
+        out[i] = v[i] - v[i - 1];
+    }
+    for (size_t i = 0; i < nv; i++)
+    {
+        out[i] = out[i] < 0 ? -out[i] : out[i];
+    }
+}
+
+/* Column a clause compares against; derived columns go to f->column */
+static const float *clause_column(struct filter *f, const struct record_batch *b,
+                                  const struct filter_clause *c, size_t nv)
+{
+    float *col = f->column;
+
+    switch (c->column)
+    {
+    case COL_LABEL:
+        widen_u8(b->label, col, nv);
+        return col;
+    case COL_PRESSURE:
+        return b->pressure_pa;
+    case COL_PRESSURE_DELTA:
+        abs_delta(b->pressure_pa, col, nv,
+                  f->have_last ? f->last_pressure : b->pressure_pa[0]);
+        return col;
+    case COL_IMU:
+    default:
+        return b->imu[c->channel];
+    }
+}
+
+size_t filter_run(struct filter *f, const struct record_batch *b, uint8_t *sel)
+{
+    size_t n = b->n;
+    size_t nv = (n + 15) & ~(size_t)15;
+
+    if (f->terms == 0)
+    {
+        memset(sel, 1, n);
+        memset(sel + n, 0, nv - n);
+    }
+    else
+    {
+        memset(sel, 0, nv);
+        for (int t = 0; t < f->terms; t++)
+        {
+            for (int k = 0; k < f->clauses[t]; k++)
+            {
+                const struct filter_clause *c = &f->clause[t][k];
+                const float *v = clause_column(f, b, c, nv);
+                compare(v, k ? f->clause_mask : f->term_mask, nv, c->op, c->value);
+                if (k)
+                {
+                    and_mask(f->term_mask, f->clause_mask, nv);
+                }
+            }
+            or_mask(sel, f->term_mask, nv);
+        }
+        memset(sel + n, 0, nv - n);
+    }
+
+    if (n)
+    {
+        f->last_pressure = b->pressure_pa[n - 1];
+        f->have_last = 1;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < nv; i++)
+    {
+        count += sel[i];
+    }
+    return count;
+}
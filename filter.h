@@ -0,0 +1,92 @@
+/*
+ * filter.h: record selection and field projection ahead of encoding
+ */
+
+#ifndef WEARABLE_FILTER_H
+#define WEARABLE_FILTER_H
+
+#include "record.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Records to publish, "" = all. Clauses "<column> <op> <number>" joined by
+ * "&&", alternatives joined by "||" ("&&" binds tighter), e.g.
+ *   "predicted != 0 || pressure_delta > 0.5"
+ * Columns: predicted, pressure_pa, pressure_delta (|change| from the
+ * previous record), acc_x .. gyr_z (physical units).
+ * Ops: == != < <= > >= */
+#ifndef FILTER_SELECT
+#define FILTER_SELECT ""
+#endif
+
+/* Fields to publish, comma-separated:
+ *   timestamp_ms, pressure_pa, predicted, acceleration, gyroscope */
+#ifndef FILTER_FIELDS
+#define FILTER_FIELDS "timestamp_ms,pressure_pa,predicted,acceleration,gyroscope"
+#endif
+
+#define FIELD_TIMESTAMP 0x01
+#define FIELD_PRESSURE 0x02
+#define FIELD_LABEL 0x04
+#define FIELD_ACC 0x08
+#define FIELD_GYR 0x10
+#define FIELD_COUNT 5
+
+#define FILTER_MAX_TERMS 8 /* "||" alternatives */
+#define FILTER_MAX_CLAUSES 4 /* "&&" clauses per alternative */
+
+enum filter_column
+{
+    COL_LABEL,
+    COL_PRESSURE,
+    COL_PRESSURE_DELTA,
+    COL_IMU, /* + channel */
+};
+
+enum filter_op
+{
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+};
+
+struct filter_clause
+{
+    enum filter_column column;
+    int channel; /* COL_IMU only */
+    enum filter_op op;
+    float value;
+};
+
+struct filter
+{
+    unsigned fields; /* FIELD_* */
+    int terms;
+    int clauses[FILTER_MAX_TERMS];
+    struct filter_clause clause[FILTER_MAX_TERMS][FILTER_MAX_CLAUSES];
+
+    /* carried across the batches of one session */
+    float last_pressure;
+    int have_last;
+
+    /* per-batch scratch */
+    float column[BATCH_RECORDS];
+    uint8_t clause_mask[BATCH_RECORDS];
+    uint8_t term_mask[BATCH_RECORDS];
+};
+
+/* Parse a FILTER_SELECT / FILTER_FIELDS pair; -1 on a malformed spec */
+int filter_parse(const char *select, const char *fields, struct filter *f);
+
+/* Forget per-session state before the first batch of a session */
+void filter_reset(struct filter *f);
+
+/* sel[i] = 1 for each record of b to publish, 0 otherwise (sel holds
+ * BATCH_RECORDS). Returns the number of selected records. */
+size_t filter_run(struct filter *f, const struct record_batch *b, uint8_t *sel);
+
+#endif /* WEARABLE_FILTER_H */
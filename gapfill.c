@@ -0,0 +1,1298 @@
+/*
+ * gapfill.c: MQTT request/response replay of a time range from the archive
+ *
+ * Requests arrive on the libmosquitto network thread and are queued; the
+ * gap-fill thread serves them one at a time. Sessions are matched by
+ * SERIAL, files are skipped on their first/last timestamps and, when a
+ * file's timestamps never decrease, the range inside it is found by binary
+ * search; only files that are out of order are scanned. Records are read
+ * through the block cache, so repeated requests for a recent session do
+ * not decode it again.
+ */
+
+#define _GNU_SOURCE
+#include "gapfill.h"
+#include "archive_map.h"
+#include "arena.h"
+#include "block_cache.h"
+#include "bulk_publish.h"
+#include "filter.h"
+#include "merkle.h"
+#include "pyramid.h"
+#include "quant.h"
+#include "record.h"
+#include "util.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <mosquitto.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define REQUEST_CAP 1024
+/* Room for GAPFILL_MAX_NODES hashes, more than any audit path */
+#define STATUS_CAP (1024 + GAPFILL_MAX_NODES * (2 * MERKLE_HASH + 3))
+
+/* Every value at its widest: u32 timestamp, pressure, label, six IMU */
+#define JSON_PAYLOAD_CAP (1024 + BATCH_RECORDS * (11 + 14 + 4 + IMU_CHANNELS * 9))
+/* Raw records (BATCH_RECORDS * RECORD_SIZE) need less than either */
+#define PAYLOAD_CAP (JSON_PAYLOAD_CAP > QUANT_PAYLOAD_CAP ? JSON_PAYLOAD_CAP : QUANT_PAYLOAD_CAP)
+/* GAPFILL_MAX_BUCKETS pyramid buckets, as PYRAMID_JSON_CAP counts them */
+#define PYRAMID_PAYLOAD_CAP (4096 + PYRAMID_CHANNELS * 48 * GAPFILL_MAX_BUCKETS)
+
+enum encoding
+{
+    ENC_JSON,
+    ENC_PACKED,
+    ENC_RAW,
+    ENC_COUNT
+};
+
+static const char *const encoding_names[ENC_COUNT] = {"json", "packed", "raw"};
+
+enum op
+{
+    OP_RANGE,
+    OP_PROOF,
+    OP_NODES,
+    OP_BLOCKS,
+    OP_PYRAMID,
+    OP_COUNT
+};
+
+static const char *const op_names[OP_COUNT] = {"range", "proof", "nodes", "blocks", "pyramid"};
+
+/* Where a truncated range stopped: timestamps repeat across sessions and
+ * files, so it resumes by position, not by time */
+struct cursor
+{
+    char session[NAME_MAX + 1];
+    char file[NAME_MAX + 1];
+    uint64_t record;
+};
+
+struct request
+{
+    char id[64];
+    enum op op;
+    char device[64];
+    uint64_t from_ms, to_ms; /* [from, to), to may be 2^32 */
+    enum encoding enc;
+    struct cursor after; /* resume point of a truncated range, if any */
+
+    /* proof, nodes, blocks and pyramid */
+    char session[64];
+    uint64_t first; /* the block of a proof, the first node of nodes or
+                     * record of pyramid */
+    uint64_t records; /* pyramid */
+    int level;
+    unsigned count; /* nodes, or pyramid buckets */
+    uint32_t blocks[GAPFILL_MAX_BLOCKS];
+    unsigned nblocks;
+};
+
+/* One reply in progress */
+struct reply
+{
+    const struct request *rq;
+    long block; /* Merkle block being re-sent, -1 for a range */
+    char topic[512];
+    struct record_batch *batch;
+    uint8_t sel[BATCH_RECORDS];
+    char *payload;
+    unsigned long long records;
+    unsigned long long messages;
+    int sessions;
+    bool truncated;
+    struct cursor next;
+};
+
+static struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock; /* everything up to mqtt */
+    pthread_cond_t wake;  /* request queued, or quit */
+    pthread_cond_t acked; /* in-flight message done, or connection gone */
+    bool running;
+    bool quit;
+    bool connected;
+    int inflight;
+    struct request queue[GAPFILL_QUEUE];
+    int head, count;
+
+    struct mosquitto *mqtt;
+    char archive_base[PATH_MAX];
+    char request_topic[320];
+    char reply_base[320];
+    struct quant quant; /* gap-fill thread only */
+} gf = {.lock = PTHREAD_MUTEX_INITIALIZER,
+        .wake = PTHREAD_COND_INITIALIZER,
+        .acked = PTHREAD_COND_INITIALIZER};
+
+/* ============================= REQUESTS ========================== */
+
+/* Start of the value of "key" in a flat JSON object, NULL if absent. The
+ * same text as a value ("op":"blocks") is skipped. */
+static const char *json_member(const char *json, const char *key)
+{
+    char pat[40];
+    snprintf(pat, sizeof(pat), "\"%s\"", key);
+    for (const char *p = strstr(json, pat); p; p = strstr(p, pat))
+    {
+        p += strlen(pat);
+        p += strspn(p, " \t\r\n");
+        if (*p == ':')
+        {
+            p++;
+            return p + strspn(p, " \t\r\n");
+        }
+    }
+    return NULL;
+}
+
+/* String member without escapes */
+static int json_string(const char *json, const char *key, char *out, size_t sz)
+{
+    const char *p = json_member(json, key);
+    if (!p || *p != '"')
+    {
+        return -1;
+    }
+    p++;
+    size_t n = strcspn(p, "\"\\");
+    if (p[n] != '"' || n >= sz)
+    {
+        return -1;
+    }
+    memcpy(out, p, n);
+    out[n] = '\0';
+    return 0;
+}
+
+static int json_u64(const char *json, const char *key, uint64_t *out)
+{
+    const char *p = json_member(json, key);
+    if (!p || !isdigit((unsigned char)*p))
+    {
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(p, &end, 10);
+    if (errno != 0)
+    {
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+/* Array of up to max unsigned 32-bit numbers */
+static int json_u32_list(const char *json, const char *key, uint32_t *out, unsigned max,
+                         unsigned *n)
+{
+    const char *p = json_member(json, key);
+    if (!p || *p != '[')
+    {
+        return -1;
+    }
+    p++;
+    p += strspn(p, " \t\r\n");
+    *n = 0;
+    while (*p != ']')
+    {
+        if (*n == max || !isdigit((unsigned char)*p))
+        {
+            return -1;
+        }
+        char *end;
+        errno = 0;
+        unsigned long long v = strtoull(p, &end, 10);
+        if (errno != 0 || v > UINT32_MAX)
+        {
+            return -1;
+        }
+        out[(*n)++] = (uint32_t)v;
+        p = end + strspn(end, " \t\r\n");
+        if (*p == ',')
+        {
+            p++;
+            p += strspn(p, " \t\r\n");
+        }
+        else if (*p != ']')
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Usable as one topic level */
+static bool id_valid(const char *id)
+{
+    if (!id[0])
+    {
+        return false;
+    }
+    for (const char *p = id; *p; p++)
+    {
+        if (!isalnum((unsigned char)*p) && *p != '-' && *p != '_' && *p != '.')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static const char *parse_encoding(const char *json, struct request *rq)
+{
+    char enc[16] = "json";
+    if (json_member(json, "encoding") && json_string(json, "encoding", enc, sizeof(enc)) != 0)
+    {
+        return "bad encoding";
+    }
+    for (int e = 0; e < ENC_COUNT; e++)
+    {
+        if (strcmp(enc, encoding_names[e]) == 0)
+        {
+            rq->enc = (enum encoding)e;
+            return NULL;
+        }
+    }
+    return "bad encoding";
+}
+
+/* "cursor":"<session>/<file>/<record>", as a truncated reply gives it */
+static int parse_cursor(const char *json, struct cursor *c)
+{
+    char s[sizeof(c->session) + sizeof(c->file) + 24];
+    if (json_string(json, "cursor", s, sizeof(s)) != 0)
+    {
+        return -1;
+    }
+    char *save = NULL;
+    char *session = strtok_r(s, "/", &save);
+    char *file = strtok_r(NULL, "/", &save);
+    char *record = strtok_r(NULL, "/", &save);
+    char *end = NULL;
+    if (!record || strtok_r(NULL, "/", &save) || !id_valid(session) || !id_valid(file) ||
+        strlen(session) >= sizeof(c->session) || strlen(file) >= sizeof(c->file) ||
+        !isdigit((unsigned char)*record))
+    {
+        return -1;
+    }
+    errno = 0;
+    c->record = strtoull(record, &end, 10);
+    if (errno != 0 || *end)
+    {
+        return -1;
+    }
+    strcpy(c->session, session);
+    strcpy(c->file, file);
+    return 0;
+}
+
+/* proof, nodes, blocks and pyramid name an archived session rather than a
+ * device */
+static const char *parse_tree_request(const char *json, struct request *rq)
+{
+    if (json_string(json, "session", rq->session, sizeof(rq->session)) != 0 ||
+        !id_valid(rq->session) || rq->session[0] == '.')
+    {
+        return "bad session";
+    }
+
+    uint64_t v;
+    switch (rq->op)
+    {
+    case OP_PROOF:
+        return json_u64(json, "block", &rq->first) != 0 ? "bad block" : NULL;
+
+    case OP_NODES:
+        if (json_u64(json, "level", &v) != 0 || v >= MERKLE_MAX_LEVELS)
+        {
+            return "bad level";
+        }
+        rq->level = (int)v;
+        if (json_u64(json, "first", &rq->first) != 0)
+        {
+            return "bad first";
+        }
+        rq->count = GAPFILL_MAX_NODES;
+        if (json_member(json, "count"))
+        {
+            if (json_u64(json, "count", &v) != 0 || v == 0)
+            {
+                return "bad count";
+            }
+            rq->count = v < GAPFILL_MAX_NODES ? (unsigned)v : GAPFILL_MAX_NODES;
+        }
+        return NULL;
+
+    case OP_PYRAMID:
+        if (json_u64(json, "first", &rq->first) != 0)
+        {
+            return "bad first";
+        }
+        if (json_u64(json, "records", &rq->records) != 0 || rq->records == 0)
+        {
+            return "bad records";
+        }
+        rq->count = GAPFILL_MAX_BUCKETS;
+        if (json_member(json, "buckets"))
+        {
+            if (json_u64(json, "buckets", &v) != 0 || v == 0)
+            {
+                return "bad buckets";
+            }
+            rq->count = v < GAPFILL_MAX_BUCKETS ? (unsigned)v : GAPFILL_MAX_BUCKETS;
+        }
+        return NULL;
+
+    default:
+        if (json_u32_list(json, "blocks", rq->blocks, GAPFILL_MAX_BLOCKS, &rq->nblocks) != 0 ||
+            rq->nblocks == 0)
+        {
+            return "bad blocks";
+        }
+        return parse_encoding(json, rq);
+    }
+}
+
+/* Fills rq from a request payload. rq->id is set first, so an error can
+ * still be answered when it is valid. Returns NULL or the error. */
+static const char *parse_request(const char *json, struct request *rq)
+{
+    memset(rq, 0, sizeof(*rq));
+    if (json_string(json, "id", rq->id, sizeof(rq->id)) != 0 || !id_valid(rq->id))
+    {
+        rq->id[0] = '\0';
+        return "bad id";
+    }
+
+    char op[16] = "range";
+    if (json_member(json, "op") && json_string(json, "op", op, sizeof(op)) != 0)
+    {
+        return "bad op";
+    }
+    rq->op = OP_COUNT;
+    for (int o = 0; o < OP_COUNT; o++)
+    {
+        if (strcmp(op, op_names[o]) == 0)
+        {
+            rq->op = (enum op)o;
+        }
+    }
+    if (rq->op == OP_COUNT)
+    {
+        return "bad op";
+    }
+    if (rq->op != OP_RANGE)
+    {
+        return parse_tree_request(json, rq);
+    }
+
+    if (json_string(json, "device", rq->device, sizeof(rq->device)) != 0 || !rq->device[0])
+    {
+        return "bad device";
+    }
+    if (json_u64(json, "from_ms", &rq->from_ms) != 0 ||
+        json_u64(json, "to_ms", &rq->to_ms) != 0 ||
+        rq->from_ms >= rq->to_ms || rq->from_ms > UINT32_MAX)
+    {
+        return "bad range";
+    }
+    if (json_member(json, "cursor") && parse_cursor(json, &rq->after) != 0)
+    {
+        return "bad cursor";
+    }
+    return parse_encoding(json, rq);
+}
+
+/* ============================== MQTT ============================= */
+
+/* Publish one reply message, waiting while GAPFILL_WINDOW are in flight
+ * unless called from a callback. Returns 0, -1 if the connection is gone
+ * or we are stopping. */
+static int send_message(const char *topic, const void *payload, size_t len, bool wait)
+{
+    pthread_mutex_lock(&gf.lock);
+    while (wait && !gf.quit && gf.connected && gf.inflight >= GAPFILL_WINDOW)
+    {
+        pthread_cond_wait(&gf.acked, &gf.lock);
+    }
+    bool ok = !gf.quit && gf.connected;
+    if (ok)
+    {
+        gf.inflight++;
+    }
+    pthread_mutex_unlock(&gf.lock);
+    if (!ok)
+    {
+        return -1;
+    }
+
+    int rc = mosquitto_publish(gf.mqtt, NULL, topic, (int)len, payload, GAPFILL_QOS, false);
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+        fprintf(stderr, "gapfill: publish %s: %s\n", topic, mosquitto_strerror(rc));
+        pthread_mutex_lock(&gf.lock);
+        gf.inflight--;
+        pthread_mutex_unlock(&gf.lock);
+        return -1;
+    }
+    return 0;
+}
+
+/* {"id":..,"status":..} on <reply>/<id>/done, extra members appended */
+static void send_status(const char *id, const char *status, const char *extra, bool wait)
+{
+    char topic[512], payload[STATUS_CAP];
+    if (snprintf(topic, sizeof(topic), "%s/%s/done", gf.reply_base, id) >= (int)sizeof(topic))
+    {
+        return;
+    }
+    int n = snprintf(payload, sizeof(payload), "{\"id\":\"%s\",\"status\":\"%s\"%s}", id,
+                     status, extra);
+    if (n > 0 && (size_t)n < sizeof(payload))
+    {
+        send_message(topic, payload, (size_t)n, wait);
+    }
+}
+
+static void on_connect(struct mosquitto *m, void *ud, int rc)
+{
+    (void)ud;
+    if (rc == 0)
+    {
+        mosquitto_subscribe(m, NULL, gf.request_topic, 1);
+    }
+    pthread_mutex_lock(&gf.lock);
+    gf.connected = rc == 0;
+    pthread_mutex_unlock(&gf.lock);
+}
+
+static void on_disconnect(struct mosquitto *m, void *ud, int rc)
+{
+    (void)m;
+    (void)ud;
+    (void)rc;
+    pthread_mutex_lock(&gf.lock);
+    gf.connected = false;
+    gf.inflight = 0;
+    pthread_cond_broadcast(&gf.acked);
+    pthread_mutex_unlock(&gf.lock);
+}
+
+static void on_publish(struct mosquitto *m, void *ud, int mid)
+{
+    (void)m;
+    (void)ud;
+    (void)mid;
+    pthread_mutex_lock(&gf.lock);
+    if (gf.inflight > 0) /* reset by a reconnect */
+    {
+        gf.inflight--;
+    }
+    pthread_cond_signal(&gf.acked);
+    pthread_mutex_unlock(&gf.lock);
+}
+
+static void on_message(struct mosquitto *m, void *ud, const struct mosquitto_message *msg)
+{
+    (void)m;
+    (void)ud;
+    char buf[REQUEST_CAP];
+    if (msg->payloadlen <= 0 || (size_t)msg->payloadlen >= sizeof(buf))
+    {
+        return;
+    }
+    memcpy(buf, msg->payload, (size_t)msg->payloadlen);
+    buf[msg->payloadlen] = '\0';
+
+    struct request rq;
+    const char *err = parse_request(buf, &rq);
+    if (err)
+    {
+        fprintf(stderr, "gapfill: %s in request %.80s\n", err, buf);
+        if (rq.id[0])
+        {
+            char extra[64];
+            snprintf(extra, sizeof(extra), ",\"error\":\"%s\"", err);
+            send_status(rq.id, "error", extra, false);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&gf.lock);
+    bool queued = gf.count < GAPFILL_QUEUE;
+    if (queued)
+    {
+        gf.queue[(gf.head + gf.count) % GAPFILL_QUEUE] = rq;
+        gf.count++;
+        pthread_cond_signal(&gf.wake);
+    }
+    pthread_mutex_unlock(&gf.lock);
+
+    if (!queued)
+    {
+        send_status(rq.id, "busy", ",\"error\":\"queue full\"", false);
+    }
+}
+
+/* ============================= REPLIES =========================== */
+
+static size_t json_u32_column(char *out, const char *name, const uint32_t *v,
+                              const uint8_t *sel, size_t n)
+{
+    size_t len = (size_t)sprintf(out, ",\"%s\":[", name);
+    const char *sep = "";
+    for (size_t i = 0; i < n; i++)
+    {
+        if (sel[i])
+        {
+            len += (size_t)sprintf(out + len, "%s%u", sep, v[i]);
+            sep = ",";
+        }
+    }
+    out[len++] = ']';
+    return len;
+}
+
+static size_t json_u8_column(char *out, const char *name, const uint8_t *v,
+                             const uint8_t *sel, size_t n)
+{
+    size_t len = (size_t)sprintf(out, ",\"%s\":[", name);
+    const char *sep = "";
+    for (size_t i = 0; i < n; i++)
+    {
+        if (sel[i])
+        {
+            len += (size_t)sprintf(out + len, "%s%u", sep, v[i]);
+            sep = ",";
+        }
+    }
+    out[len++] = ']';
+    return len;
+}
+
+static size_t json_float_column(char *out, const char *name, const float *v,
+                                const uint8_t *sel, size_t n)
+{
+    size_t len = (size_t)sprintf(out, ",\"%s\":[", name);
+    const char *sep = "";
+    for (size_t i = 0; i < n; i++)
+    {
+        if (sel[i])
+        {
+            len += (size_t)sprintf(out + len, "%s%.2f", sep, v[i]);
+            sep = ",";
+        }
+    }
+    out[len++] = ']';
+    return len;
+}
+
+/* Encode the selected records of [first, first + n) of am, as decoded in
+ * r->batch for json and packed. Returns the length, 0 on error. */
+static size_t encode(struct reply *r, const struct archive_map *am, size_t first, size_t n,
+                     size_t kept, const char *session, const char *file)
+{
+    const struct record_batch *b = r->batch;
+    char *out = r->payload;
+
+    switch (r->rq->enc)
+    {
+    case ENC_RAW:
+    {
+        size_t len = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (r->sel[i])
+            {
+                memcpy(out + len, am->data + (first + i) * RECORD_SIZE, RECORD_SIZE);
+                len += RECORD_SIZE;
+            }
+        }
+        return len;
+    }
+
+    case ENC_PACKED:
+        return quant_encode(&gf.quant, b, r->sel, (1u << FIELD_COUNT) - 1, session,
+                            (uint8_t *)out);
+
+    default:
+        break;
+    }
+
+    int h = snprintf(out, JSON_PAYLOAD_CAP,
+                     "{\"session\":\"%s\",\"file\":\"%s\",\"first\":%zu,\"records\":%zu",
+                     session, file, first, kept);
+    if (h >= 0 && r->block >= 0)
+    {
+        h += snprintf(out + h, JSON_PAYLOAD_CAP - (size_t)h, ",\"block\":%ld", r->block);
+    }
+    if (h < 0 || (size_t)h >= 1024)
+    {
+        return 0;
+    }
+    /* The cap covers every value at its widest past a 1 KiB header */
+    size_t len = (size_t)h;
+    len += json_u32_column(out + len, "timestamp_ms", b->timestamp_ms, r->sel, b->n);
+    len += json_float_column(out + len, "pressure_pa", b->pressure_pa, r->sel, b->n);
+    len += json_u8_column(out + len, "predicted", b->label, r->sel, b->n);
+    for (int c = 0; c < IMU_CHANNELS; c++)
+    {
+        len += json_float_column(out + len, imu_channel_names[c], b->imu[c], r->sel, b->n);
+    }
+    out[len++] = '}';
+    return len;
+}
+
+/* Send the records of one file from record start on that fall in the
+ * range. Returns 0, 1 once GAPFILL_MAX_RECORDS are sent, -1 if the reply
+ * was abandoned. */
+static int serve_file(struct reply *r, const char *session, const char *file, const char *path,
+                      uint64_t start)
+{
+    const struct archive_map *am = archive_map_open(path);
+    if (!am)
+    {
+        fprintf(stderr, "gapfill: cannot open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    uint64_t from = r->rq->from_ms, to = r->rq->to_ms;
+    size_t lo = 0, hi = am->records;
+    if (am->ts_monotonic)
+    {
+        if (am->records == 0 || am->last_ts < from || am->first_ts >= to)
+        {
+            archive_map_release(am);
+            return 0;
+        }
+        lo = archive_map_lower_bound(am, (uint32_t)from);
+        hi = to > UINT32_MAX ? am->records : archive_map_lower_bound(am, (uint32_t)to);
+    }
+    if (lo < start)
+    {
+        lo = start < hi ? (size_t)start : hi;
+    }
+
+    struct record_columns cols;
+    int rc = 0;
+    for (size_t pos = lo; pos < hi && rc == 0;)
+    {
+        size_t n = hi - pos < BATCH_RECORDS ? hi - pos : BATCH_RECORDS;
+        archive_map_columns(am, pos, n, &cols);
+
+        size_t kept = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            uint32_t ts = column_u32(&cols.timestamp_ms, i);
+            r->sel[i] = ts >= from && ts < to;
+            kept += r->sel[i];
+        }
+        if (kept == 0)
+        {
+            pos += n;
+            continue;
+        }
+        if (r->records >= GAPFILL_MAX_RECORDS)
+        {
+            /* Nothing from pos on has gone out */
+            r->truncated = true;
+            snprintf(r->next.session, sizeof(r->next.session), "%s", session);
+            snprintf(r->next.file, sizeof(r->next.file), "%s", file);
+            r->next.record = pos;
+            rc = 1;
+            break;
+        }
+
+        if (r->rq->enc != ENC_RAW && block_cache_read(am, pos, n, r->batch) != n)
+        {
+            fprintf(stderr, "gapfill: out of memory\n");
+            rc = -1;
+            break;
+        }
+        size_t len = encode(r, am, pos, n, kept, session, file);
+        if (len == 0 || send_message(r->topic, r->payload, len, true) != 0)
+        {
+            rc = -1;
+            break;
+        }
+        r->records += kept;
+        r->messages++;
+        pos += n;
+    }
+
+    archive_map_release(am);
+    return rc;
+}
+
+static int serve_session(struct reply *r, const char *name)
+{
+    char session_dir[PATH_MAX], logs_dir[PATH_MAX], serial[64];
+    if (join_path(gf.archive_base, name, session_dir, sizeof(session_dir)) != 0 ||
+        join_path(session_dir, "logs", logs_dir, sizeof(logs_dir)) != 0)
+    {
+        return 0;
+    }
+    session_serial(session_dir, serial, sizeof(serial));
+    if (strcmp(serial, r->rq->device) != 0)
+    {
+        return 0;
+    }
+
+    char **names;
+    int nfiles = archive_list_bins(logs_dir, &names);
+    if (nfiles < 0)
+    {
+        return 0;
+    }
+
+    /* Files sort like names, as sessions do: the cursor's session starts
+     * at its file and record */
+    const struct cursor *after = &r->rq->after;
+    bool resume = after->session[0] && strcmp(name, after->session) == 0;
+
+    unsigned long long before = r->records;
+    int rc = 0;
+    for (int f = 0; f < nfiles && rc == 0; f++)
+    {
+        int cmp = resume ? strcmp(names[f], after->file) : 1;
+        char path[PATH_MAX];
+        if (cmp >= 0 && join_path(logs_dir, names[f], path, sizeof(path)) == 0)
+        {
+            rc = serve_file(r, name, names[f], path, cmp == 0 ? after->record : 0);
+        }
+    }
+    archive_free_list(names, nfiles);
+
+    if (r->records > before)
+    {
+        r->sessions++;
+    }
+    return rc;
+}
+
+static int is_session(const struct dirent *de)
+{
+    return de->d_name[0] != '.' && (de->d_type == DT_DIR || de->d_type == DT_UNKNOWN);
+}
+
+static void serve_range(const struct request *rq)
+{
+    struct reply r = {.rq = rq, .block = -1};
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (snprintf(r.topic, sizeof(r.topic), "%s/%s/data", gf.reply_base, rq->id) >= (int)sizeof(r.topic))
+    {
+        return;
+    }
+    r.batch = pool_get(sizeof(*r.batch));
+    r.payload = pool_get(PAYLOAD_CAP);
+    if (!r.batch || !r.payload)
+    {
+        pool_put(r.batch);
+        pool_put(r.payload);
+        send_status(rq->id, "error", ",\"error\":\"out of memory\"", true);
+        return;
+    }
+
+    /* Session names are timestamps, so this is archive order */
+    struct dirent **list;
+    int n = scandir(gf.archive_base, &list, is_session, alphasort);
+    int rc = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (rc == 0 && strcmp(list[i]->d_name, rq->after.session) >= 0)
+        {
+            rc = serve_session(&r, list[i]->d_name);
+        }
+        free(list[i]);
+    }
+    if (n >= 0)
+    {
+        free(list);
+    }
+    pool_put(r.batch);
+    pool_put(r.payload);
+
+    if (rc < 0)
+    {
+        printf("gapfill: %s abandoned after %llu records\n", rq->id, r.records);
+        return;
+    }
+
+    char extra[STATUS_CAP - 128];
+    int len = snprintf(extra, sizeof(extra), ",\"records\":%llu,\"messages\":%llu,\"sessions\":%d",
+                       r.records, r.messages, r.sessions);
+    if (r.truncated)
+    {
+        snprintf(extra + len, sizeof(extra) - (size_t)len, ",\"cursor\":\"%s/%s/%llu\"",
+                 r.next.session, r.next.file, (unsigned long long)r.next.record);
+    }
+    send_status(rq->id, r.truncated ? "truncated" : "ok", extra, true);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("gapfill: %s %s [%llu, %llu) -> %llu records in %llu %s messages (%.3f s)\n",
+           rq->id, rq->device, (unsigned long long)rq->from_ms, (unsigned long long)rq->to_ms,
+           r.records, r.messages, encoding_names[rq->enc],
+           (double)(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+}
+
+/* ============================ MERKLE TREE ======================== */
+
+/* A file in an archived session's directory */
+static int session_file(const char *session, const char *name, char *out, size_t sz)
+{
+    char session_dir[PATH_MAX];
+    if (join_path(gf.archive_base, session, session_dir, sizeof(session_dir)) != 0)
+    {
+        return -1;
+    }
+    return join_path(session_dir, name, out, sz);
+}
+
+/* ,"session":..,"blocks":..,"levels":..,"root":.. */
+static int tree_members(char *out, size_t cap, const char *session, const struct merkle_header *h)
+{
+    char root[2 * MERKLE_HASH + 1];
+    hex_encode(h->root, MERKLE_HASH, root);
+    return snprintf(out, cap,
+                    ",\"session\":\"%s\",\"blocks\":%llu,\"block_records\":%u,"
+                    "\"levels\":%u,\"root\":\"%s\"",
+                    session, (unsigned long long)h->blocks, h->block_records, h->levels, root);
+}
+
+/* ,"key":["hex",...] */
+static size_t hash_list(char *out, const char *key, const uint8_t (*hash)[MERKLE_HASH], long n)
+{
+    size_t len = (size_t)sprintf(out, ",\"%s\":[", key);
+    for (long i = 0; i < n; i++)
+    {
+        len += (size_t)sprintf(out + len, "%s\"", i ? "," : "");
+        hex_encode(hash[i], MERKLE_HASH, out + len);
+        len += 2 * MERKLE_HASH;
+        out[len++] = '"';
+    }
+    out[len++] = ']';
+    out[len] = '\0';
+    return len;
+}
+
+/* File names of a session's logs, in the order block file indices use */
+static int session_bins(const char *session, char ***names)
+{
+    char session_dir[PATH_MAX], logs_dir[PATH_MAX];
+    if (join_path(gf.archive_base, session, session_dir, sizeof(session_dir)) != 0 ||
+        join_path(session_dir, "logs", logs_dir, sizeof(logs_dir)) != 0)
+    {
+        return -1;
+    }
+    return archive_list_bins(logs_dir, names);
+}
+
+static void serve_proof(const struct request *rq)
+{
+    char path[PATH_MAX];
+    struct merkle_header h;
+    struct merkle_block bk;
+    uint8_t leaf[1][MERKLE_HASH], sib[MERKLE_MAX_LEVELS][MERKLE_HASH];
+
+    long got = session_file(rq->session, MERKLE_FILE, path, sizeof(path)) == 0
+                   ? merkle_read_blocks(path, rq->first, 1, &bk, &h)
+                   : -1;
+    if (got < 0)
+    {
+        send_status(rq->id, "error", ",\"error\":\"no tree for session\"", true);
+        return;
+    }
+    int n;
+    if (got == 0 || merkle_read_nodes(path, 0, rq->first, 1, leaf, NULL) != 1 ||
+        (n = merkle_proof(path, rq->first, sib, NULL)) < 0)
+    {
+        send_status(rq->id, "error", ",\"error\":\"no such block\"", true);
+        return;
+    }
+
+    char **names;
+    int nfiles = session_bins(rq->session, &names);
+    const char *file = bk.file < (uint32_t)(nfiles > 0 ? nfiles : 0) ? names[bk.file] : "";
+
+    char extra[STATUS_CAP - 128];
+    size_t len = (size_t)tree_members(extra, sizeof(extra), rq->session, &h);
+    len += (size_t)snprintf(extra + len, sizeof(extra) - len,
+                            ",\"block\":%llu,\"file\":\"%s\",\"first\":%u,\"records\":%u,"
+                            "\"from_ms\":%u,\"to_ms\":%llu",
+                            (unsigned long long)rq->first, file, bk.first, bk.records, bk.t_first,
+                            (unsigned long long)bk.t_last + 1);
+    len += hash_list(extra + len, "leaf", (const uint8_t(*)[MERKLE_HASH])leaf, 1);
+    hash_list(extra + len, "path", (const uint8_t(*)[MERKLE_HASH])sib, n);
+    if (nfiles >= 0)
+    {
+        archive_free_list(names, nfiles);
+    }
+    send_status(rq->id, "ok", extra, true);
+}
+
+static void serve_nodes(const struct request *rq)
+{
+    char path[PATH_MAX];
+    struct merkle_header h;
+    uint8_t hash[GAPFILL_MAX_NODES][MERKLE_HASH];
+
+    long got = session_file(rq->session, MERKLE_FILE, path, sizeof(path)) == 0
+                   ? merkle_read_nodes(path, rq->level, rq->first, rq->count, hash, &h)
+                   : -1;
+    if (got < 0)
+    {
+        send_status(rq->id, "error", ",\"error\":\"no tree for session or no such level\"",
+                    true);
+        return;
+    }
+
+    char extra[STATUS_CAP - 128];
+    size_t len = (size_t)tree_members(extra, sizeof(extra), rq->session, &h);
+    len += (size_t)snprintf(extra + len, sizeof(extra) - len, ",\"level\":%d,\"first\":%llu",
+                            rq->level, (unsigned long long)rq->first);
+    hash_list(extra + len, "hashes", (const uint8_t(*)[MERKLE_HASH])hash, got);
+    send_status(rq->id, "ok", extra, true);
+}
+
+/* Re-send whole blocks, one data message each in request order. A block
+ * whose archived records no longer hash to its leaf is not sent but listed
+ * under "corrupt". Returns -1 if the reply was abandoned. */
+static int send_blocks(struct reply *r, const char *path, char **names, int nfiles,
+                       unsigned *corrupt, unsigned *ncorrupt)
+{
+    const struct request *rq = r->rq;
+    const struct archive_map *am = NULL;
+    uint32_t am_file = 0;
+    int rc = 0;
+
+    for (unsigned i = 0; i < rq->nblocks && rc == 0; i++)
+    {
+        struct merkle_block bk;
+        uint8_t leaf[1][MERKLE_HASH], got[MERKLE_HASH];
+        if (merkle_read_blocks(path, rq->blocks[i], 1, &bk, NULL) != 1 ||
+            merkle_read_nodes(path, 0, rq->blocks[i], 1, leaf, NULL) != 1 ||
+            bk.file >= (uint32_t)nfiles || bk.records == 0)
+        {
+            corrupt[(*ncorrupt)++] = rq->blocks[i];
+            continue;
+        }
+
+        if (!am || am_file != bk.file)
+        {
+            char file_path[PATH_MAX], logs_dir[PATH_MAX], session_dir[PATH_MAX];
+            if (am)
+            {
+                archive_map_release(am);
+            }
+            am = NULL;
+            if (join_path(gf.archive_base, rq->session, session_dir, sizeof(session_dir)) == 0 &&
+                join_path(session_dir, "logs", logs_dir, sizeof(logs_dir)) == 0 &&
+                join_path(logs_dir, names[bk.file], file_path, sizeof(file_path)) == 0)
+            {
+                am = archive_map_open(file_path);
+            }
+            am_file = bk.file;
+        }
+        if (!am || (size_t)bk.first + bk.records > am->records)
+        {
+            corrupt[(*ncorrupt)++] = rq->blocks[i];
+            continue;
+        }
+        merkle_leaf(am->data + (size_t)bk.first * RECORD_SIZE, bk.records, got);
+        if (memcmp(got, leaf[0], MERKLE_HASH) != 0)
+        {
+            fprintf(stderr, "gapfill: block %u of %s does not match its leaf\n", rq->blocks[i],
+                    rq->session);
+            corrupt[(*ncorrupt)++] = rq->blocks[i];
+            continue;
+        }
+
+        memset(r->sel, 1, bk.records);
+        if (rq->enc != ENC_RAW && block_cache_read(am, bk.first, bk.records, r->batch) != bk.records)
+        {
+            fprintf(stderr, "gapfill: out of memory\n");
+            rc = -1;
+            break;
+        }
+        r->block = rq->blocks[i];
+        size_t len = encode(r, am, bk.first, bk.records, bk.records, rq->session, names[bk.file]);
+        if (len == 0 || send_message(r->topic, r->payload, len, true) != 0)
+        {
+            rc = -1;
+            break;
+        }
+        r->records += bk.records;
+        r->messages++;
+    }
+
+    if (am)
+    {
+        archive_map_release(am);
+    }
+    return rc;
+}
+
+static void serve_blocks(const struct request *rq)
+{
+    struct reply r = {.rq = rq, .block = -1};
+    char path[PATH_MAX];
+    struct merkle_header h;
+    struct merkle_block bk;
+
+    if (snprintf(r.topic, sizeof(r.topic), "%s/%s/data", gf.reply_base, rq->id) >= (int)sizeof(r.topic))
+    {
+        return;
+    }
+    if (session_file(rq->session, MERKLE_FILE, path, sizeof(path)) != 0 ||
+        merkle_read_blocks(path, 0, 1, &bk, &h) < 0)
+    {
+        send_status(rq->id, "error", ",\"error\":\"no tree for session\"", true);
+        return;
+    }
+    for (unsigned i = 0; i < rq->nblocks; i++)
+    {
+        if (rq->blocks[i] >= h.blocks)
+        {
+            send_status(rq->id, "error", ",\"error\":\"no such block\"", true);
+            return;
+        }
+    }
+
+    char **names;
+    int nfiles = session_bins(rq->session, &names);
+    r.batch = pool_get(sizeof(*r.batch));
+    r.payload = pool_get(PAYLOAD_CAP);
+    if (nfiles < 0 || !r.batch || !r.payload)
+    {
+        pool_put(r.batch);
+        pool_put(r.payload);
+        if (nfiles >= 0)
+        {
+            archive_free_list(names, nfiles);
+        }
+        send_status(rq->id, "error", ",\"error\":\"cannot read session\"", true);
+        return;
+    }
+
+    unsigned corrupt[GAPFILL_MAX_BLOCKS], ncorrupt = 0;
+    int rc = send_blocks(&r, path, names, nfiles, corrupt, &ncorrupt);
+    archive_free_list(names, nfiles);
+    pool_put(r.batch);
+    pool_put(r.payload);
+    if (rc < 0)
+    {
+        printf("gapfill: %s abandoned after %llu records\n", rq->id, r.records);
+        return;
+    }
+
+    char extra[STATUS_CAP - 128];
+    size_t len = (size_t)snprintf(extra, sizeof(extra),
+                                  ",\"session\":\"%s\",\"records\":%llu,\"messages\":%llu,"
+                                  "\"corrupt\":[",
+                                  rq->session, r.records, r.messages);
+    for (unsigned i = 0; i < ncorrupt; i++)
+    {
+        len += (size_t)sprintf(extra + len, "%s%u", i ? "," : "", corrupt[i]);
+    }
+    extra[len++] = ']';
+    extra[len] = '\0';
+    send_status(rq->id, "ok", extra, true);
+
+    printf("gapfill: %s %s re-sent %llu of %u blocks (%llu records, %s)\n", rq->id, rq->session,
+           r.messages, rq->nblocks, r.records, encoding_names[rq->enc]);
+}
+
+/* ============================== PYRAMID ========================== */
+
+static void serve_pyramid(const struct request *rq)
+{
+    char path[PATH_MAX], topic[512];
+    if (snprintf(topic, sizeof(topic), "%s/%s/data", gf.reply_base, rq->id) >= (int)sizeof(topic) ||
+        session_file(rq->session, PYRAMID_FILE, path, sizeof(path)) != 0)
+    {
+        return;
+    }
+
+    struct pyramid_bucket *bk = pool_get(GAPFILL_MAX_BUCKETS * sizeof(*bk));
+    char *payload = pool_get(PYRAMID_PAYLOAD_CAP);
+    if (!bk || !payload)
+    {
+        pool_put(bk);
+        pool_put(payload);
+        send_status(rq->id, "error", ",\"error\":\"out of memory\"", true);
+        return;
+    }
+
+    int level = 0;
+    uint64_t first = 0;
+    long got = pyramid_query(path, rq->first, rq->records, rq->count, bk, &level, &first);
+    size_t len = got > 0 ? pyramid_encode_buckets(bk, (size_t)got, level, first, rq->session,
+                                                  payload, PYRAMID_PAYLOAD_CAP)
+                         : 0;
+    if (got < 0)
+    {
+        send_status(rq->id, "error", ",\"error\":\"no pyramid for session\"", true);
+    }
+    else if (got > 0 && len == 0)
+    {
+        send_status(rq->id, "error", ",\"error\":\"reply too large\"", true);
+    }
+    else if (got == 0 || send_message(topic, payload, len, true) == 0)
+    {
+        char extra[128];
+        snprintf(extra, sizeof(extra), ",\"session\":\"%s\",\"level\":%d,\"buckets\":%ld",
+                 rq->session, level, got);
+        send_status(rq->id, "ok", extra, true);
+    }
+    pool_put(bk);
+    pool_put(payload);
+}
+
+static void serve(const struct request *rq)
+{
+    switch (rq->op)
+    {
+    case OP_PROOF:
+        serve_proof(rq);
+        break;
+    case OP_NODES:
+        serve_nodes(rq);
+        break;
+    case OP_BLOCKS:
+        serve_blocks(rq);
+        break;
+    case OP_PYRAMID:
+        serve_pyramid(rq);
+        break;
+    default:
+        serve_range(rq);
+        break;
+    }
+}
+
+static void *gapfill_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&gf.lock);
+    while (!gf.quit)
+    {
+        if (gf.count == 0)
+        {
+            pthread_cond_wait(&gf.wake, &gf.lock);
+            continue;
+        }
+        struct request rq = gf.queue[gf.head];
+        gf.head = (gf.head + 1) % GAPFILL_QUEUE;
+        gf.count--;
+        pthread_mutex_unlock(&gf.lock);
+
+        serve(&rq);
+
+        pthread_mutex_lock(&gf.lock);
+    }
+    pthread_mutex_unlock(&gf.lock);
+    return NULL;
+}
+
+/* ============================= PUBLIC ============================ */
+
+int gapfill_start(const char *archive_base, const char *host, int port, const char *topic)
+{
+    if (snprintf(gf.archive_base, sizeof(gf.archive_base), "%s", archive_base) >= (int)sizeof(gf.archive_base) ||
+        snprintf(gf.request_topic, sizeof(gf.request_topic), "%s/gapfill/request", topic) >= (int)sizeof(gf.request_topic) ||
+        snprintf(gf.reply_base, sizeof(gf.reply_base), "%s/gapfill/reply", topic) >= (int)sizeof(gf.reply_base))
+    {
+        fprintf(stderr, "gapfill: path or topic too long\n");
+        return -1;
+    }
+    if (quant_parse(QUANT_MAX_ERR, &gf.quant) != 0)
+    {
+        fprintf(stderr, "gapfill: bad QUANT_MAX_ERR \"%s\"\n", QUANT_MAX_ERR);
+        return -1;
+    }
+
+    gf.mqtt = mosquitto_new(NULL, true, NULL);
+    if (!gf.mqtt)
+    {
+        fprintf(stderr, "gapfill: mosquitto_new failed\n");
+        return -1;
+    }
+    mosquitto_connect_callback_set(gf.mqtt, on_connect);
+    mosquitto_disconnect_callback_set(gf.mqtt, on_disconnect);
+    mosquitto_publish_callback_set(gf.mqtt, on_publish);
+    mosquitto_message_callback_set(gf.mqtt, on_message);
+    mosquitto_reconnect_delay_set(gf.mqtt, 1, 60, true);
+
+    /* An unreachable broker is retried by the network loop */
+    int rc = mosquitto_connect_async(gf.mqtt, host, port, 60);
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+        fprintf(stderr, "gapfill: connect to %s:%d: %s\n", host, port, mosquitto_strerror(rc));
+    }
+
+    /* Signals stay with the main thread's poll loop */
+    sigset_t old;
+    block_signals(&old);
+
+    gf.quit = false;
+    gf.head = gf.count = 0;
+    rc = mosquitto_loop_start(gf.mqtt);
+    if (rc == MOSQ_ERR_SUCCESS)
+    {
+        rc = pthread_create(&gf.thread, NULL, gapfill_main, NULL);
+        if (rc != 0)
+        {
+            mosquitto_loop_stop(gf.mqtt, true);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0)
+    {
+        fprintf(stderr, "gapfill: cannot start\n");
+        mosquitto_destroy(gf.mqtt);
+        gf.mqtt = NULL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&gf.lock);
+    gf.running = true;
+    pthread_mutex_unlock(&gf.lock);
+    return 0;
+}
+
+void gapfill_stop(void)
+{
+    pthread_mutex_lock(&gf.lock);
+    bool running = gf.running;
+    gf.running = false;
+    gf.quit = true;
+    pthread_cond_broadcast(&gf.wake);
+    pthread_cond_broadcast(&gf.acked);
+    pthread_mutex_unlock(&gf.lock);
+    if (!running)
+    {
+        return;
+    }
+
+    pthread_join(gf.thread, NULL);
+    mosquitto_disconnect(gf.mqtt);
+    mosquitto_loop_stop(gf.mqtt, false);
+    mosquitto_destroy(gf.mqtt);
+    gf.mqtt = NULL;
+}
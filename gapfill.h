@@ -0,0 +1,104 @@
+/*
+ * gapfill.h: MQTT request/response replay of a time range from the archive
+ *
+ * A subscriber that missed samples asks for exactly the missing range:
+ *
+ *   <topic>/gapfill/request
+ *     {"id":"r42","device":"<serial>","from_ms":1200000,"to_ms":1260000,
+ *      "encoding":"json"}
+ *
+ * id names the reply (letters, digits, '-', '_' and '.'), device is the
+ * serial as in the split/packed topics, and the range [from_ms, to_ms) is
+ * in record timestamp_ms. The dock answers on
+ *
+ *   <topic>/gapfill/reply/<id>/data   the records, in archive order
+ *   <topic>/gapfill/reply/<id>/done   {"id":..,"status":"ok","records":n,
+ *                                      "messages":m,"sessions":s}
+ *
+ * so subscribing to <topic>/gapfill/reply/<id>/# before sending the
+ * request gets everything. A status of "truncated" carries a "cursor",
+ * "<session>/<file>/<record>": the same request with that "cursor" added
+ * goes on exactly where the reply stopped (timestamps restart with every
+ * session, so a time would not). "error" and "busy" carry "error".
+ * Encodings, one message per up to BATCH_RECORDS records:
+ *   json    column-wise JSON: "session", "file", "first" (record index in
+ *           the file), "records", then timestamp_ms, pressure_pa,
+ *           predicted and acc_x .. gyr_z arrays
+ *   packed  the quant.h message, as TOPIC_LAYOUT_PACKED
+ *   raw     the 21-byte records exactly as archived
+ * Replies are published at GAPFILL_QOS with at most GAPFILL_WINDOW
+ * messages in flight, one request at a time.
+ *
+ * An "op" other than the default "range" queries the Merkle tree of one
+ * archived session (merkle.h), named as in the summary, to verify it and
+ * re-sync only what differs:
+ *   {"id":..,"op":"proof","session":"20251118_102030","block":7}
+ *       done carries the block's "file", "first", "records", "from_ms",
+ *       "to_ms", its "leaf" hash and the audit "path" to "root"
+ *   {"id":..,"op":"nodes","session":..,"level":1,"first":0,"count":64}
+ *       done carries up to GAPFILL_MAX_NODES "hashes" of one level, level 0
+ *       being the leaves, to narrow a mismatch down level by level
+ *   {"id":..,"op":"blocks","session":..,"blocks":[7,9],"encoding":"raw"}
+ *       one data message per block, in request order (json adds "block");
+ *       done lists blocks whose archived records no longer match their
+ *       leaf under "corrupt", those are not sent
+ * The proof and nodes replies also carry "session", "blocks",
+ * "block_records", "levels" and "root". A blocks request names at most
+ * GAPFILL_MAX_BLOCKS blocks.
+ *
+ * "pyramid" reads a zoom window from the session's pyramid (pyramid.h):
+ *   {"id":..,"op":"pyramid","session":..,"first":0,"records":600000,
+ *    "buckets":200}
+ *       one data message with the buckets covering records [first,
+ *       first + records) at the finest level that needs at most "buckets"
+ *       (default and limit GAPFILL_MAX_BUCKETS) of them, in the layout of
+ *       the published levels, "first" being the index of its first bucket
+ *       in the level; done carries "session", "level" and "buckets", no
+ *       data message going out for 0 buckets
+ */
+
+#ifndef WEARABLE_GAPFILL_H
+#define WEARABLE_GAPFILL_H
+
+#ifndef GAPFILL_QOS
+#define GAPFILL_QOS 1
+#endif
+
+/* Unacknowledged reply messages before the server waits */
+#ifndef GAPFILL_WINDOW
+#define GAPFILL_WINDOW 32
+#endif
+
+/* Records per reply; more is "truncated" with a cursor */
+#ifndef GAPFILL_MAX_RECORDS
+#define GAPFILL_MAX_RECORDS (1u << 21)
+#endif
+
+/* Requests waiting behind the one being served */
+#ifndef GAPFILL_QUEUE
+#define GAPFILL_QUEUE 8
+#endif
+
+/* Blocks per "blocks" request */
+#ifndef GAPFILL_MAX_BLOCKS
+#define GAPFILL_MAX_BLOCKS 64
+#endif
+
+/* Buckets per "pyramid" reply */
+#ifndef GAPFILL_MAX_BUCKETS
+#define GAPFILL_MAX_BUCKETS 256
+#endif
+
+/* Hashes per "nodes" reply */
+#ifndef GAPFILL_MAX_NODES
+#define GAPFILL_MAX_NODES 64
+#endif
+
+/* Serve requests for sessions under archive_base on host:port.
+ * Returns 0, -1 on error. */
+int gapfill_start(const char *archive_base, const char *host, int port, const char *topic);
+
+/* Abandon the reply in progress and join the thread */
+void gapfill_stop(void);
+
+#endif /* WEARABLE_GAPFILL_H */
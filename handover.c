@@ -0,0 +1,272 @@
+/*
+ * handover.c: in-place upgrade by re-exec with state and fd handover
+ *
+ * libudev cannot adopt an existing monitor socket, so the new process opens
+ * its own monitor and drains the inherited one by hand: messages there use
+ * libudev's netlink wire format, a fixed header followed by NUL separated
+ * KEY=VALUE properties. Anything seen on both sockets is told apart by its
+ * SEQNUM.
+ */
+
+#define _GNU_SOURCE
+#include "handover.h"
+#include "util.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/netlink.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define HANDOVER_VERSION 1
+
+/* libudev's monitor message header (libudev-monitor.c), stable since 2009 */
+#define UDEV_WIRE_PREFIX "libudev"
+#define UDEV_WIRE_MAGIC 0xfeedcafe
+#define UDEV_MONITOR_GROUP 2 /* multicast group of udevd, 1 is the kernel's */
+
+struct udev_wire_header
+{
+    char prefix[8];
+    unsigned int magic; /* network byte order */
+    unsigned int header_size;
+    unsigned int properties_off;
+    unsigned int properties_len;
+    unsigned int filter_subsystem_hash;
+    unsigned int filter_devtype_hash;
+    unsigned int filter_tag_bloom_hi;
+    unsigned int filter_tag_bloom_lo;
+};
+
+static struct
+{
+    char exe[PATH_MAX];
+    char **argv;
+} self;
+
+void handover_init(char *argv[])
+{
+    self.argv = argv;
+
+    /* Resolved now: after an upgrade the path names the new binary */
+    ssize_t n = readlink("/proc/self/exe", self.exe, sizeof(self.exe) - 1);
+    self.exe[n > 0 ? n : 0] = '\0';
+}
+
+/* ============================== STATE ============================ */
+
+int handover_load(struct handover_state *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->phase = HANDOVER_WAIT_ADD;
+    st->udev_fd = -1;
+
+    const char *env = getenv(HANDOVER_ENV);
+    if (!env)
+    {
+        return 0;
+    }
+    int fd = atoi(env);
+    unsetenv(HANDOVER_ENV);
+
+    FILE *f = fdopen(fd, "r");
+    if (!f)
+    {
+        close(fd);
+        return 0;
+    }
+
+    char line[128];
+    int version = 0, phase = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        sscanf(line, "version=%d", &version);
+        sscanf(line, "phase=%d", &phase);
+        sscanf(line, "udev_fd=%d", &st->udev_fd);
+        sscanf(line, "events_received=%lu", &st->events_received);
+        sscanf(line, "events_matched=%lu", &st->events_matched);
+    }
+    fclose(f);
+
+    if (version != HANDOVER_VERSION)
+    {
+        fprintf(stderr, "handover: unknown state version %d, starting fresh\n", version);
+        if (st->udev_fd >= 0)
+        {
+            close(st->udev_fd);
+        }
+        memset(st, 0, sizeof(*st));
+        st->udev_fd = -1;
+        return 0;
+    }
+    st->phase = phase == HANDOVER_WAIT_REMOVE ? HANDOVER_WAIT_REMOVE : HANDOVER_WAIT_ADD;
+
+    if (st->udev_fd >= 0)
+    {
+        fcntl(st->udev_fd, F_SETFD, FD_CLOEXEC);
+        int fl = fcntl(st->udev_fd, F_GETFL);
+        fcntl(st->udev_fd, F_SETFL, fl | O_NONBLOCK);
+        /* libudev set it already; without it no message would pass the
+         * credential check below */
+        int on = 1;
+        setsockopt(st->udev_fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+    }
+    return 1;
+}
+
+int handover_exec(const struct handover_state *st, int udev_fd)
+{
+    if (!self.exe[0] || !self.argv)
+    {
+        fprintf(stderr, "handover: own executable unknown\n");
+        return -1;
+    }
+
+    int fd = memfd_create("wearable_dock-handover", 0);
+    if (fd < 0)
+    {
+        perror("memfd_create");
+        return -1;
+    }
+
+    dprintf(fd, "version=%d\nphase=%d\nudev_fd=%d\nevents_received=%lu\nevents_matched=%lu\n",
+            HANDOVER_VERSION, (int)st->phase, udev_fd,
+            st->events_received, st->events_matched);
+    lseek(fd, 0, SEEK_SET);
+
+    char num[16];
+    snprintf(num, sizeof(num), "%d", fd);
+    setenv(HANDOVER_ENV, num, 1);
+
+    /* libudev opens the monitor with SOCK_CLOEXEC */
+    int fl = fcntl(udev_fd, F_GETFD);
+    fcntl(udev_fd, F_SETFD, fl & ~FD_CLOEXEC);
+
+    printf("handover: exec %s\n", self.exe);
+    fflush(stdout);
+    fflush(stderr);
+    execv(self.exe, self.argv);
+
+    perror("execv");
+    fcntl(udev_fd, F_SETFD, fl);
+    unsetenv(HANDOVER_ENV);
+    close(fd);
+    return -1;
+}
+
+/* ============================ OLD MONITOR ======================== */
+
+int handover_next_event(struct handover_state *st, struct uevent *ev,
+                        char *buf, size_t buf_sz)
+{
+    while (st->udev_fd >= 0)
+    {
+        struct sockaddr_nl snl;
+        struct iovec iov = {.iov_base = buf, .iov_len = buf_sz - 1};
+        union
+        {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(struct ucred))];
+        } cred_msg;
+        struct msghdr msg = {
+            .msg_name = &snl,
+            .msg_namelen = sizeof(snl),
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = &cred_msg,
+            .msg_controllen = sizeof(cred_msg),
+        };
+
+        ssize_t n = recvmsg(st->udev_fd, &msg, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            close(st->udev_fd);
+            st->udev_fd = -1;
+            break;
+        }
+        buf[n] = '\0';
+
+        /* The checks libudev makes before it trusts a message: sent to
+         * udevd's group by a process (not the kernel, pid 0), with root
+         * credentials attached, and not cut short */
+        if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+            msg.msg_namelen != sizeof(snl) || snl.nl_family != AF_NETLINK ||
+            snl.nl_groups != UDEV_MONITOR_GROUP || snl.nl_pid == 0)
+        {
+            continue;
+        }
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        struct ucred cred;
+        if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_CREDENTIALS ||
+            cm->cmsg_len != CMSG_LEN(sizeof(cred)))
+        {
+            continue;
+        }
+        memcpy(&cred, CMSG_DATA(cm), sizeof(cred));
+        if (cred.uid != 0)
+        {
+            continue;
+        }
+
+        struct udev_wire_header h;
+        if ((size_t)n < sizeof(h))
+        {
+            continue;
+        }
+        memcpy(&h, buf, sizeof(h));
+        if (memcmp(h.prefix, UDEV_WIRE_PREFIX, sizeof(UDEV_WIRE_PREFIX)) != 0 ||
+            ntohl(h.magic) != UDEV_WIRE_MAGIC ||
+            h.properties_off >= (size_t)n ||
+            h.properties_len > (size_t)n - h.properties_off)
+        {
+            continue;
+        }
+
+        memset(ev, 0, sizeof(*ev));
+        char *p = buf + h.properties_off;
+        char *end = p + h.properties_len;
+        while (p < end && *p)
+        {
+            char *eq = strchr(p, '=');
+            size_t len = strlen(p);
+            if (eq)
+            {
+                *eq = '\0';
+                const char *v = eq + 1;
+                if (!strcmp(p, "ACTION"))
+                    ev->action = v;
+                else if (!strcmp(p, "SUBSYSTEM"))
+                    ev->subsystem = v;
+                else if (!strcmp(p, "DEVTYPE"))
+                    ev->devtype = v;
+                else if (!strcmp(p, "DEVNAME"))
+                    ev->devnode = v;
+                else if (!strcmp(p, "ID_VENDOR_ID"))
+                    ev->vendor_id = v;
+                else if (!strcmp(p, "ID_MODEL_ID"))
+                    ev->model_id = v;
+                else if (!strcmp(p, "ID_SERIAL_SHORT"))
+                    ev->serial = v;
+                else if (!strcmp(p, "SEQNUM"))
+                    ev->seqnum = strtoull(v, NULL, 10);
+            }
+            p += len + 1;
+        }
+
+        if (ev->seqnum > st->last_seqnum)
+        {
+            st->last_seqnum = ev->seqnum;
+        }
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * handover.h: in-place upgrade by re-exec with state and fd handover
+ *
+ * On SIGHUP the dock finishes the offload in progress, checkpoints its
+ * background queues and execs the (possibly replaced) binary. The udev
+ * monitor socket survives the exec, so no plug / unplug event between the
+ * two processes is lost; a small state blob travels in a memfd.
+ */
+
+#ifndef WEARABLE_HANDOVER_H
+#define WEARABLE_HANDOVER_H
+
+#include <stddef.h>
+
+/* Environment variable carrying the state memfd number */
+#define HANDOVER_ENV "WEARABLE_DOCK_HANDOVER"
+
+enum handover_phase
+{
+    HANDOVER_WAIT_ADD,    /* idle, waiting for a wearable */
+    HANDOVER_WAIT_REMOVE, /* offload done, waiting for it to be unplugged */
+};
+
+struct handover_state
+{
+    enum handover_phase phase;
+    int udev_fd; /* previous process's monitor socket, -1 if none */
+    unsigned long events_received;
+    unsigned long events_matched;
+    unsigned long long last_seqnum; /* newest event drained from udev_fd */
+};
+
+/* The udev event fields the dock looks at, from either source */
+struct uevent
+{
+    const char *action;
+    const char *subsystem;
+    const char *devtype;
+    const char *devnode;
+    const char *vendor_id;
+    const char *model_id;
+    const char *serial;
+    unsigned long long seqnum;
+};
+
+/* Remember how we were started; call first thing in main */
+void handover_init(char *argv[]);
+
+/* State handed over by the previous process. Returns 1 if there was one,
+ * 0 on a fresh start. */
+int handover_load(struct handover_state *st);
+
+/* Serialise st, keep udev_fd open across the exec and replace the process
+ * image with the binary we were started from. Only returns on failure. */
+int handover_exec(const struct handover_state *st, int udev_fd);
+
+/* Next event still queued on the previous process's monitor socket
+ * (st->udev_fd), parsed from libudev's netlink wire format into buf.
+ * Returns 1 with ev filled, 0 once the socket is drained (and closed). */
+int handover_next_event(struct handover_state *st, struct uevent *ev,
+                        char *buf, size_t buf_sz);
+
+#endif /* WEARABLE_HANDOVER_H */
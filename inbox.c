@@ -0,0 +1,272 @@
+/*
+ * inbox.c: ingest directory for logs that do not arrive on a wearable
+ *
+ * inotify tells us when a file in the inbox is complete; names are queued
+ * in arrival order and handed to the main loop one at a time. If the
+ * kernel queue overflows, or ours is full, the directory is scanned again
+ * once the queue has drained.
+ */
+
+#define _GNU_SOURCE
+#include "inbox.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct queued
+{
+    struct queued *next;
+    char name[];
+};
+
+static struct
+{
+    int fd;
+    char dir[PATH_MAX];
+    struct queued *head, *tail;
+    int count;
+    int rescan; /* names were dropped, scan when the queue is empty */
+} ib = {.fd = -1};
+
+static int ends_with(const char *s, const char *suffix)
+{
+    size_t n = strlen(s), m = strlen(suffix);
+    return n > m && strcmp(s + n - m, suffix) == 0;
+}
+
+static int classify(const char *name, enum inbox_kind *kind)
+{
+    static const char *const tarballs[] = {".tar", ".tgz", ".tar.gz", ".tar.xz", ".tar.bz2", ".tar.zst"};
+
+    if (name[0] == '.')
+    {
+        return -1;
+    }
+    if (ends_with(name, ".BIN") || ends_with(name, ".bin"))
+    {
+        *kind = INBOX_BIN;
+        return 0;
+    }
+    if (ends_with(name, ".img") || ends_with(name, ".IMG"))
+    {
+        *kind = INBOX_IMAGE;
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(tarballs) / sizeof(tarballs[0]); i++)
+    {
+        if (ends_with(name, tarballs[i]))
+        {
+            *kind = INBOX_TARBALL;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void queue_push(const char *name)
+{
+    enum inbox_kind kind;
+    if (classify(name, &kind) != 0)
+    {
+        return;
+    }
+    for (struct queued *q = ib.head; q; q = q->next)
+    {
+        if (strcmp(q->name, name) == 0)
+        {
+            return; /* rewritten before we got to it */
+        }
+    }
+    if (ib.count >= INBOX_QUEUE_MAX)
+    {
+        ib.rescan = 1;
+        return;
+    }
+
+    size_t len = strlen(name) + 1;
+    struct queued *q = malloc(sizeof(*q) + len);
+    if (!q)
+    {
+        ib.rescan = 1;
+        return;
+    }
+    memcpy(q->name, name, len);
+    q->next = NULL;
+    if (ib.tail)
+    {
+        ib.tail->next = q;
+    }
+    else
+    {
+        ib.head = q;
+    }
+    ib.tail = q;
+    ib.count++;
+}
+
+static void scan(void)
+{
+    DIR *d = opendir(ib.dir);
+    if (!d)
+    {
+        fprintf(stderr, "inbox: cannot open %s: %s\n", ib.dir, strerror(errno));
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        if (de->d_type == DT_REG || de->d_type == DT_UNKNOWN)
+        {
+            queue_push(de->d_name);
+        }
+    }
+    closedir(d);
+}
+
+/* ============================= PUBLIC ============================ */
+
+int inbox_open(const char *dir)
+{
+    if (snprintf(ib.dir, sizeof(ib.dir), "%s", dir) >= (int)sizeof(ib.dir))
+    {
+        fprintf(stderr, "inbox: path too long: %s\n", dir);
+        return -1;
+    }
+    if (ensure_dir(ib.dir) != 0)
+    {
+        fprintf(stderr, "inbox: cannot create %s: %s\n", ib.dir, strerror(errno));
+        return -1;
+    }
+
+    ib.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ib.fd < 0)
+    {
+        perror("inotify_init1");
+        return -1;
+    }
+    if (inotify_add_watch(ib.fd, ib.dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        fprintf(stderr, "inbox: cannot watch %s: %s\n", ib.dir, strerror(errno));
+        close(ib.fd);
+        ib.fd = -1;
+        return -1;
+    }
+
+    /* Dropped while we were not running */
+    scan();
+    return ib.fd;
+}
+
+void inbox_read(void)
+{
+    /* Aligned for struct inotify_event */
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;)
+    {
+        ssize_t n = read(ib.fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return; /* EAGAIN: drained */
+        }
+
+        for (char *p = buf; p < buf + n;)
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                ib.rescan = 1;
+            }
+            else if (ev->len && !(ev->mask & IN_ISDIR))
+            {
+                queue_push(ev->name);
+            }
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+}
+
+int inbox_next(struct inbox_item *out)
+{
+    for (;;)
+    {
+        if (!ib.head && ib.rescan)
+        {
+            ib.rescan = 0;
+            scan();
+        }
+        struct queued *q = ib.head;
+        if (!q)
+        {
+            return 0;
+        }
+        ib.head = q->next;
+        if (!ib.head)
+        {
+            ib.tail = NULL;
+        }
+        ib.count--;
+
+        struct stat st;
+        int ok = join_path(ib.dir, q->name, out->path, sizeof(out->path)) == 0 &&
+                 classify(q->name, &out->kind) == 0 &&
+                 lstat(out->path, &st) == 0 && S_ISREG(st.st_mode);
+        free(q);
+        if (ok)
+        {
+            out->name = strrchr(out->path, '/') + 1;
+            return 1;
+        }
+    }
+}
+
+void inbox_done(const struct inbox_item *item, int ok)
+{
+    if (ok)
+    {
+        if (unlink(item->path) != 0)
+        {
+            fprintf(stderr, "inbox: cannot remove %s: %s\n", item->path, strerror(errno));
+        }
+        return;
+    }
+
+    char failed[PATH_MAX];
+    char dst[PATH_MAX];
+    if (join_path(ib.dir, INBOX_FAILED_SUBDIR, failed, sizeof(failed)) != 0 ||
+        join_path(failed, item->name, dst, sizeof(dst)) != 0 ||
+        ensure_dir(failed) != 0 || rename(item->path, dst) != 0)
+    {
+        fprintf(stderr, "inbox: cannot move %s to %s/: %s\n",
+                item->path, INBOX_FAILED_SUBDIR, strerror(errno));
+        return;
+    }
+    printf("inbox: moved %s to %s\n", item->name, failed);
+}
+
+void inbox_close(void)
+{
+    while (ib.head)
+    {
+        struct queued *q = ib.head;
+        ib.head = q->next;
+        free(q);
+    }
+    ib.tail = NULL;
+    ib.count = 0;
+    if (ib.fd >= 0)
+    {
+        close(ib.fd);
+        ib.fd = -1;
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * inbox.h: ingest directory for logs that do not arrive on a wearable
+ *
+ * Files dropped into the inbox are offloaded like a docked wearable: a
+ * session is created, the logs are copied and hashed, decoded, published
+ * and archived. Recognised by name:
+ *   *.BIN, *.bin                       one raw log file
+ *   *.img, *.IMG                       exFAT card image, logs under logs/
+ *   *.tar, *.tgz, *.tar.gz, *.tar.xz,  tarball of .BIN files, at the top
+ *   *.tar.bz2, *.tar.zst               or under logs/
+ * A file is picked up once it is complete: closed after writing, moved or
+ * linked into the directory, or already there at start-up. Dot-files are
+ * ignored, so uploads can go to ".name" and be renamed when done. An item
+ * is deleted once its session is archived, or moved to failed/ when no log
+ * could be taken from it.
+ */
+
+#ifndef WEARABLE_INBOX_H
+#define WEARABLE_INBOX_H
+
+#include "util.h"
+
+/* Items waiting in memory; a longer backlog is picked up by a rescan */
+#ifndef INBOX_QUEUE_MAX
+#define INBOX_QUEUE_MAX 256
+#endif
+
+#define INBOX_FAILED_SUBDIR "failed"
+
+enum inbox_kind
+{
+    INBOX_BIN,
+    INBOX_IMAGE,
+    INBOX_TARBALL,
+};
+
+struct inbox_item
+{
+    char path[PATH_MAX];
+    const char *name; /* basename of path */
+    enum inbox_kind kind;
+};
+
+/* Watch dir (created if missing) and queue what is already there. Returns
+ * the descriptor to poll for POLLIN, -1 on error. */
+int inbox_open(const char *dir);
+
+/* Queue the items announced since the last call; call on POLLIN */
+void inbox_read(void);
+
+/* Next queued item that still exists. Returns 1, 0 if there is none. */
+int inbox_next(struct inbox_item *out);
+
+/* Done with an item: ok deletes it, otherwise it moves to failed/ */
+void inbox_done(const struct inbox_item *item, int ok);
+
+void inbox_close(void);
+
+#endif /* WEARABLE_INBOX_H */
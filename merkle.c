@@ -0,0 +1,412 @@
+/*
+ * merkle.c: per-session Merkle tree over fixed-size record blocks
+ *
+ * Leaves are hashed incrementally from the file mappings as batches are
+ * decoded, so a block may span batches and the records are read once. The
+ * levels above are built from the leaves when the session is done.
+ */
+
+#define _GNU_SOURCE
+#include "merkle.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void merkle_init(struct merkle *mk)
+{
+    memset(mk, 0, sizeof(*mk));
+}
+
+void merkle_free(struct merkle *mk)
+{
+    for (int k = 0; k < MERKLE_MAX_LEVELS; k++)
+    {
+        free(mk->level[k]);
+    }
+    free(mk->block);
+    EVP_MD_CTX_free(mk->ctx);
+    memset(mk, 0, sizeof(*mk));
+}
+
+/* ============================== LEAVES =========================== */
+
+/* RFC 6962 domain separation: leaves and nodes never hash alike */
+static const uint8_t leaf_prefix = 0x00;
+
+static uint32_t record_ts(const uint8_t *rec)
+{
+    uint32_t ts;
+    memcpy(&ts, rec, sizeof(ts));
+    return ts;
+}
+
+static int close_block(struct merkle *mk)
+{
+    if (mk->nodes[0] == mk->cap)
+    {
+        size_t cap = mk->cap ? 2 * mk->cap : 1024;
+        struct merkle_block *blocks = realloc(mk->block, cap * sizeof(*blocks));
+        if (!blocks)
+        {
+            return -1;
+        }
+        mk->block = blocks;
+        uint8_t(*leaves)[MERKLE_HASH] = realloc(mk->level[0], cap * sizeof(*leaves));
+        if (!leaves)
+        {
+            return -1;
+        }
+        mk->level[0] = leaves;
+        mk->cap = cap;
+    }
+
+    if (!EVP_DigestFinal_ex(mk->ctx, mk->level[0][mk->nodes[0]], NULL))
+    {
+        return -1;
+    }
+    mk->block[mk->nodes[0]++] = mk->fill;
+    mk->fill.records = 0;
+    return 0;
+}
+
+int merkle_add(struct merkle *mk, uint32_t file, size_t first, const uint8_t *data, size_t n)
+{
+    if (!mk->ctx && !(mk->ctx = EVP_MD_CTX_new()))
+    {
+        return -1;
+    }
+
+    while (n > 0)
+    {
+        /* Blocks never span files or gaps */
+        if (mk->fill.records &&
+            (mk->fill.file != file || mk->fill.first + mk->fill.records != first) &&
+            close_block(mk) != 0)
+        {
+            return -1;
+        }
+        if (!mk->fill.records)
+        {
+            if (!EVP_DigestInit_ex(mk->ctx, EVP_sha256(), NULL) ||
+                !EVP_DigestUpdate(mk->ctx, &leaf_prefix, 1))
+            {
+                return -1;
+            }
+            mk->fill.file = file;
+            mk->fill.first = (uint32_t)first;
+            mk->fill.t_first = record_ts(data);
+        }
+
+        /* Up to the next multiple of MERKLE_BLOCK_RECORDS in the file */
+        size_t end = (first / MERKLE_BLOCK_RECORDS + 1) * MERKLE_BLOCK_RECORDS;
+        size_t take = end - first < n ? end - first : n;
+        if (!EVP_DigestUpdate(mk->ctx, data, take * RECORD_SIZE))
+        {
+            return -1;
+        }
+        mk->fill.records += (uint32_t)take;
+        mk->fill.t_last = record_ts(data + (take - 1) * RECORD_SIZE);
+        mk->records += take;
+
+        first += take;
+        data += take * RECORD_SIZE;
+        n -= take;
+        if (first == end && close_block(mk) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void merkle_leaf(const uint8_t *data, size_t n, uint8_t *out)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) ||
+        !EVP_DigestUpdate(ctx, &leaf_prefix, 1) ||
+        !EVP_DigestUpdate(ctx, data, n * RECORD_SIZE) ||
+        !EVP_DigestFinal_ex(ctx, out, NULL))
+    {
+        memset(out, 0, MERKLE_HASH); /* matches no leaf */
+    }
+    EVP_MD_CTX_free(ctx);
+}
+
+/* ============================== LEVELS =========================== */
+
+static void hash_node(const uint8_t *left, const uint8_t *right, uint8_t *out)
+{
+    uint8_t buf[1 + 2 * MERKLE_HASH];
+    buf[0] = 0x01; /* node prefix */
+    memcpy(buf + 1, left, MERKLE_HASH);
+    memcpy(buf + 1 + MERKLE_HASH, right, MERKLE_HASH);
+    EVP_Digest(buf, sizeof(buf), out, NULL, EVP_sha256(), NULL);
+}
+
+int merkle_finish(struct merkle *mk)
+{
+    if (mk->fill.records && close_block(mk) != 0)
+    {
+        return -1;
+    }
+    if (mk->nodes[0] == 0)
+    {
+        mk->levels = 0;
+        EVP_Digest("", 0, mk->root, NULL, EVP_sha256(), NULL);
+        return 0;
+    }
+
+    int k = 0;
+    while (mk->nodes[k] > 1)
+    {
+        if (k + 1 == MERKLE_MAX_LEVELS)
+        {
+            return -1;
+        }
+        size_t n = mk->nodes[k], up = (n + 1) / 2;
+        free(mk->level[k + 1]);
+        mk->level[k + 1] = malloc(up * MERKLE_HASH);
+        if (!mk->level[k + 1])
+        {
+            return -1;
+        }
+        for (size_t i = 0; i + 1 < n; i += 2)
+        {
+            hash_node(mk->level[k][i], mk->level[k][i + 1], mk->level[k + 1][i / 2]);
+        }
+        if (n % 2)
+        {
+            memcpy(mk->level[k + 1][up - 1], mk->level[k][n - 1], MERKLE_HASH);
+        }
+        mk->nodes[k + 1] = up;
+        k++;
+    }
+    mk->levels = k + 1;
+    memcpy(mk->root, mk->level[k][0], MERKLE_HASH);
+    return 0;
+}
+
+int merkle_path_root(const uint8_t *leaf, uint64_t block, uint64_t blocks,
+                     const uint8_t (*path)[MERKLE_HASH], int n, uint8_t *root)
+{
+    if (block >= blocks)
+    {
+        return -1;
+    }
+    uint8_t h[MERKLE_HASH];
+    memcpy(h, leaf, MERKLE_HASH);
+
+    int used = 0;
+    for (uint64_t idx = block, count = blocks; count > 1; idx /= 2, count = (count + 1) / 2)
+    {
+        if (idx % 2 == 0 && idx + 1 == count)
+        {
+            continue; /* carried up */
+        }
+        if (used == n)
+        {
+            return -1;
+        }
+        if (idx % 2)
+        {
+            hash_node(path[used], h, h);
+        }
+        else
+        {
+            hash_node(h, path[used], h);
+        }
+        used++;
+    }
+    memcpy(root, h, MERKLE_HASH);
+    return used == n ? 0 : -1;
+}
+
+/* ============================== FILE ============================= */
+
+int merkle_write(const struct merkle *mk, const char *dir)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    if (join_path(dir, MERKLE_FILE, path, sizeof(path)) != 0 ||
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    {
+        return -1;
+    }
+
+    struct merkle_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MERKLE_MAGIC, sizeof(h.magic));
+    h.version = MERKLE_VERSION;
+    h.block_records = MERKLE_BLOCK_RECORDS;
+    h.levels = (uint32_t)mk->levels;
+    h.blocks = mk->nodes[0];
+    h.records = mk->records;
+    memcpy(h.root, mk->root, MERKLE_HASH);
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "merkle: cannot create %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             (h.blocks == 0 || fwrite(mk->block, sizeof(*mk->block), h.blocks, f) == h.blocks);
+    for (int k = 0; ok && k < mk->levels; k++)
+    {
+        ok = fwrite(mk->level[k], MERKLE_HASH, mk->nodes[k], f) == mk->nodes[k];
+    }
+    if (fclose(f) != 0 || !ok || rename(tmp, path) != 0)
+    {
+        fprintf(stderr, "merkle: cannot write %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Header of an open MERKLE_FILE and where level k starts, -1 if it is
+ * not one of ours */
+static int read_header(int fd, struct merkle_header *h, uint64_t off[MERKLE_MAX_LEVELS],
+                       uint64_t nodes[MERKLE_MAX_LEVELS])
+{
+    if (pread(fd, h, sizeof(*h), 0) != (ssize_t)sizeof(*h) ||
+        memcmp(h->magic, MERKLE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != MERKLE_VERSION || h->levels > MERKLE_MAX_LEVELS ||
+        (h->blocks == 0) != (h->levels == 0))
+    {
+        return -1;
+    }
+
+    uint64_t pos = sizeof(*h) + h->blocks * sizeof(struct merkle_block);
+    uint64_t n = h->blocks;
+    for (uint32_t k = 0; k < h->levels; k++)
+    {
+        off[k] = pos;
+        nodes[k] = n;
+        pos += n * MERKLE_HASH;
+        n = (n + 1) / 2;
+    }
+    /* The top level must be the root alone */
+    return h->levels && nodes[h->levels - 1] != 1 ? -1 : 0;
+}
+
+long merkle_read_nodes(const char *path, int level, uint64_t first, size_t max,
+                       uint8_t (*out)[MERKLE_HASH], struct merkle_header *h)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    long got = -1;
+    struct merkle_header hdr;
+    uint64_t off[MERKLE_MAX_LEVELS], nodes[MERKLE_MAX_LEVELS];
+    if (read_header(fd, &hdr, off, nodes) != 0 || level < 0 || (uint32_t)level >= hdr.levels)
+    {
+        goto out;
+    }
+    got = 0;
+    if (first < nodes[level])
+    {
+        uint64_t count = nodes[level] - first < max ? nodes[level] - first : max;
+        size_t bytes = (size_t)count * MERKLE_HASH;
+        if (pread(fd, out, bytes, (off_t)(off[level] + first * MERKLE_HASH)) != (ssize_t)bytes)
+        {
+            got = -1;
+            goto out;
+        }
+        got = (long)count;
+    }
+    if (h)
+    {
+        *h = hdr;
+    }
+out:
+    close(fd);
+    return got;
+}
+
+long merkle_read_blocks(const char *path, uint64_t first, size_t max,
+                        struct merkle_block *out, struct merkle_header *h)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    long got = -1;
+    struct merkle_header hdr;
+    uint64_t off[MERKLE_MAX_LEVELS], nodes[MERKLE_MAX_LEVELS];
+    if (read_header(fd, &hdr, off, nodes) != 0)
+    {
+        goto out;
+    }
+    got = 0;
+    if (first < hdr.blocks)
+    {
+        uint64_t count = hdr.blocks - first < max ? hdr.blocks - first : max;
+        size_t bytes = (size_t)count * sizeof(*out);
+        if (pread(fd, out, bytes, (off_t)(sizeof(hdr) + first * sizeof(*out))) != (ssize_t)bytes)
+        {
+            got = -1;
+            goto out;
+        }
+        got = (long)count;
+    }
+    if (h)
+    {
+        *h = hdr;
+    }
+out:
+    close(fd);
+    return got;
+}
+
+int merkle_proof(const char *path, uint64_t block, uint8_t (*out)[MERKLE_HASH],
+                 struct merkle_header *h)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int n = -1;
+    struct merkle_header hdr;
+    uint64_t off[MERKLE_MAX_LEVELS], nodes[MERKLE_MAX_LEVELS];
+    if (read_header(fd, &hdr, off, nodes) != 0 || block >= hdr.blocks)
+    {
+        goto out;
+    }
+    n = 0;
+    uint64_t idx = block;
+    for (uint32_t k = 0; k + 1 < hdr.levels; k++, idx /= 2)
+    {
+        uint64_t sib = idx ^ 1;
+        if (sib >= nodes[k])
+        {
+            continue; /* carried up */
+        }
+        if (pread(fd, out[n], MERKLE_HASH, (off_t)(off[k] + sib * MERKLE_HASH)) != MERKLE_HASH)
+        {
+            n = -1;
+            goto out;
+        }
+        n++;
+    }
+    if (h)
+    {
+        *h = hdr;
+    }
+out:
+    close(fd);
+    return n;
+}
@@ -0,0 +1,118 @@
+/*
+ * merkle.h: per-session Merkle tree over fixed-size record blocks
+ *
+ * Built while a session is decoded. Each .BIN file of the session (in
+ * logs/ order) is cut into blocks of MERKLE_BLOCK_RECORDS records from its
+ * start, only the last block of a file being short. Leaves hash the
+ * archived 21-byte records of a block, as the gap-fill "raw" encoding sends
+ * them; hashing follows RFC 6962 (SHA-256, leaf = H(0x00 || records),
+ * node = H(0x01 || left || right)), so a level with an odd count carries
+ * its last node up unchanged. The root goes out with the session summary.
+ *
+ * File layout (MERKLE_FILE in the session directory, little-endian):
+ *   struct merkle_header
+ *   struct merkle_block[blocks]
+ *   per level, leaves first, its nodes (MERKLE_HASH bytes each); a level
+ *   has half the nodes of the one below, rounded up, the last one is the
+ *   root alone
+ * so a proof is one pread per level.
+ */
+
+#ifndef WEARABLE_MERKLE_H
+#define WEARABLE_MERKLE_H
+
+#include "record.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MERKLE_FILE "merkle.bin"
+#define MERKLE_MAGIC "WDMERKL"
+#define MERKLE_VERSION 1
+#define MERKLE_HASH 32
+
+/* Records per block; at most BATCH_RECORDS, so a block is one message */
+#ifndef MERKLE_BLOCK_RECORDS
+#define MERKLE_BLOCK_RECORDS BATCH_RECORDS
+#endif
+
+#if MERKLE_BLOCK_RECORDS < 1 || MERKLE_BLOCK_RECORDS > BATCH_RECORDS
+#error "MERKLE_BLOCK_RECORDS must be 1..BATCH_RECORDS"
+#endif
+
+#define MERKLE_MAX_LEVELS 48
+
+struct merkle_block
+{
+    uint32_t file;    /* index in the session's sorted .BIN list */
+    uint32_t first;   /* record index in that file */
+    uint32_t records;
+    uint32_t t_first; /* timestamp_ms of the first and last record */
+    uint32_t t_last;
+};
+
+struct merkle_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t block_records;
+    uint32_t levels; /* leaves to root; 0 for an empty session */
+    uint32_t reserved;
+    uint64_t blocks;
+    uint64_t records;
+    uint8_t root[MERKLE_HASH]; /* SHA-256 of nothing for an empty session */
+};
+
+/* Builder state for one session */
+struct merkle
+{
+    struct merkle_block *block;
+    uint8_t (*level[MERKLE_MAX_LEVELS])[MERKLE_HASH]; /* level[0] = leaves */
+    size_t nodes[MERKLE_MAX_LEVELS];
+    size_t cap; /* allocated blocks and leaves */
+    int levels;
+    uint64_t records;
+    uint8_t root[MERKLE_HASH];
+
+    /* block being filled */
+    void *ctx; /* EVP_MD_CTX */
+    struct merkle_block fill;
+};
+
+void merkle_init(struct merkle *mk);
+
+/* Hash n archived records of file (RECORD_SIZE bytes each, starting at
+ * record first); calls must come in session order. Returns 0, -1 out of
+ * memory. */
+int merkle_add(struct merkle *mk, uint32_t file, size_t first, const uint8_t *data, size_t n);
+
+/* Close the last block and build the levels up to the root */
+int merkle_finish(struct merkle *mk);
+
+/* Write MERKLE_FILE into dir (via a temporary file + rename) */
+int merkle_write(const struct merkle *mk, const char *dir);
+
+void merkle_free(struct merkle *mk);
+
+/* Readers of a session's MERKLE_FILE; h may be NULL. Level 0 is the
+ * leaves. Return the count written to out, -1 on error. */
+long merkle_read_nodes(const char *path, int level, uint64_t first, size_t max,
+                       uint8_t (*out)[MERKLE_HASH], struct merkle_header *h);
+long merkle_read_blocks(const char *path, uint64_t first, size_t max,
+                        struct merkle_block *out, struct merkle_header *h);
+
+/* Audit path of a block: the sibling at each level, leaves first, levels
+ * where the node has none being skipped (RFC 6962). Returns its length,
+ * -1 on error or an unknown block. */
+int merkle_proof(const char *path, uint64_t block, uint8_t (*out)[MERKLE_HASH],
+                 struct merkle_header *h);
+
+/* Leaf hash of n archived records */
+void merkle_leaf(const uint8_t *data, size_t n, uint8_t *out);
+
+/* Recompute the root from a leaf hash and its audit path, as a consumer
+ * verifies a block. Returns 0, -1 if n does not fit block and blocks. */
+int merkle_path_root(const uint8_t *leaf, uint64_t block, uint64_t blocks,
+                     const uint8_t (*path)[MERKLE_HASH], int n, uint8_t *root);
+
+#endif /* WEARABLE_MERKLE_H */
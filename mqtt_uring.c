@@ -0,0 +1,598 @@
+/*
+ * mqtt_uring.c: MQTT 3.1.1 QoS 0 publishing over io_uring
+ *
+ * Talks to the ring through the raw syscalls and <linux/io_uring.h>, so
+ * nothing beyond the kernel headers is needed. One send is in flight at a
+ * time, which keeps the byte stream in order without linked requests,
+ * while the next buffer is filled. A zero copy send completes twice: once
+ * when the data is queued (IORING_CQE_F_MORE set) and once more with
+ * IORING_CQE_F_NOTIF when the kernel no longer needs the buffer.
+ */
+
+#define _GNU_SOURCE
+#include "mqtt_uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 16
+#define CONNACK_TIMEOUT_S 5
+
+/* ============================== RING ============================= */
+
+struct ring
+{
+    int fd;
+    unsigned entries;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_sz, cq_map_sz, sqes_sz;
+};
+
+static int ring_init(struct ring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+    {
+        return -1;
+    }
+    r->entries = p.sq_entries;
+
+    r->sq_map_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_map_sz > r->sq_map_sz)
+        {
+            r->sq_map_sz = r->cq_map_sz;
+        }
+        r->cq_map_sz = r->sq_map_sz;
+    }
+
+    r->sq_map = mmap(NULL, r->sq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED)
+    {
+        close(r->fd);
+        return -1;
+    }
+    r->cq_map = r->sq_map;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        r->cq_map = mmap(NULL, r->cq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED)
+        {
+            munmap(r->sq_map, r->sq_map_sz);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+    {
+        if (r->cq_map != r->sq_map)
+        {
+            munmap(r->cq_map, r->cq_map_sz);
+        }
+        munmap(r->sq_map, r->sq_map_sz);
+        close(r->fd);
+        return -1;
+    }
+
+    char *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void ring_exit(struct ring *r)
+{
+    munmap(r->sqes, r->sqes_sz);
+    if (r->cq_map != r->sq_map)
+    {
+        munmap(r->cq_map, r->cq_map_sz);
+    }
+    munmap(r->sq_map, r->sq_map_sz);
+    close(r->fd);
+}
+
+/* Queue and submit one SQE; at most one is ever pending, so there is
+ * always room */
+static int ring_submit(struct ring *r, const struct io_uring_sqe *sqe)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    r->sqes[idx] = *sqe;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    for (;;)
+    {
+        int rc = (int)syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0);
+        if (rc >= 0 || errno != EINTR)
+        {
+            return rc < 0 ? -1 : 0;
+        }
+    }
+}
+
+/* Wait for the next completion */
+static int ring_wait(struct ring *r, struct io_uring_cqe *out)
+{
+    for (;;)
+    {
+        unsigned head = *r->cq_head;
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            *out = r->cqes[head & *r->cq_mask];
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        int rc = (int)syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+/* ============================ BUFFERS ============================ */
+
+struct mqtt_uring
+{
+    int sock;
+    struct ring ring;
+    char *mem; /* URING_BUFS * URING_BUF_SIZE */
+    bool fixed; /* mem is registered with the ring */
+    bool zc;    /* the kernel does IORING_OP_SEND_ZC */
+    bool broken;
+
+    size_t fill[URING_BUFS];
+    unsigned notif_pending[URING_BUFS];
+    int cur;     /* buffer being filled, -1 if none */
+    int sending; /* buffer with a send in flight, -1 if none */
+    size_t sent; /* ... and how much of it is out */
+    bool sending_zc;
+
+    struct mqtt_uring_stats stats;
+};
+
+static char *buf_at(struct mqtt_uring *u, int b)
+{
+    return u->mem + (size_t)b * URING_BUF_SIZE;
+}
+
+static int submit_send(struct mqtt_uring *u)
+{
+    int b = u->sending;
+    size_t len = u->fill[b] - u->sent;
+
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.fd = u->sock;
+    sqe.addr = (uint64_t)(uintptr_t)(buf_at(u, b) + u->sent);
+    sqe.len = (uint32_t)len;
+    sqe.msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe.user_data = (uint64_t)b;
+
+    u->sending_zc = u->zc && len >= URING_ZC_MIN;
+    if (u->sending_zc)
+    {
+        sqe.opcode = IORING_OP_SEND_ZC;
+        /* Without REPORT_USAGE the notification's res is always 0 and a
+         * copied send cannot be told apart. Kernels before 6.2 reject the
+         * flag with EINVAL, which falls back to copying sends below. */
+        sqe.ioprio = IORING_SEND_ZC_REPORT_USAGE;
+        if (u->fixed)
+        {
+            sqe.ioprio |= IORING_RECVSEND_FIXED_BUF;
+            sqe.buf_index = (uint16_t)b;
+        }
+        u->stats.zc_sends++;
+    }
+    else
+    {
+        sqe.opcode = IORING_OP_SEND;
+    }
+    u->stats.sends++;
+
+    if (ring_submit(&u->ring, &sqe) != 0)
+    {
+        perror("io_uring_enter");
+        u->broken = true;
+        u->sending = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* Handle one completion */
+static int reap_one(struct mqtt_uring *u)
+{
+    struct io_uring_cqe cqe;
+    if (ring_wait(&u->ring, &cqe) != 0)
+    {
+        perror("io_uring_enter");
+        u->broken = true;
+        u->sending = -1;
+        return -1;
+    }
+    int b = (int)cqe.user_data;
+
+    if (cqe.flags & IORING_CQE_F_NOTIF)
+    {
+        u->notif_pending[b]--;
+        if ((unsigned)cqe.res & IORING_NOTIF_USAGE_ZC_COPIED)
+        {
+            u->stats.zc_copied++;
+        }
+        return 0;
+    }
+    if (cqe.flags & IORING_CQE_F_MORE)
+    {
+        u->notif_pending[b]++;
+    }
+
+    if (cqe.res < 0)
+    {
+        if (u->sending_zc && (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP))
+        {
+            fprintf(stderr, "uring: no zero copy send here, copying\n");
+            u->zc = false;
+            return submit_send(u);
+        }
+        if (cqe.res == -EINTR || cqe.res == -EAGAIN)
+        {
+            return submit_send(u);
+        }
+        fprintf(stderr, "uring: send: %s\n", strerror(-cqe.res));
+        u->broken = true;
+        u->sending = -1;
+        return -1;
+    }
+
+    if (cqe.res == 0)
+    {
+        fprintf(stderr, "uring: send: connection closed\n");
+        u->broken = true;
+        u->sending = -1;
+        return -1;
+    }
+    u->sent += (size_t)cqe.res;
+    if (u->sent < u->fill[b])
+    {
+        return submit_send(u); /* short send, the rest goes next */
+    }
+    u->fill[b] = 0;
+    u->sending = -1;
+    return 0;
+}
+
+/* Send the buffer being filled once the one before it is out */
+static int submit_current(struct mqtt_uring *u)
+{
+    if (u->cur < 0)
+    {
+        return u->broken ? -1 : 0;
+    }
+    while (u->sending >= 0)
+    {
+        if (reap_one(u) != 0)
+        {
+            return -1;
+        }
+    }
+    if (u->broken)
+    {
+        return -1;
+    }
+    u->sending = u->cur;
+    u->sent = 0;
+    u->cur = -1;
+    return submit_send(u);
+}
+
+static int next_buffer(struct mqtt_uring *u)
+{
+    for (;;)
+    {
+        for (int b = 0; b < URING_BUFS; b++)
+        {
+            if (b != u->sending && u->notif_pending[b] == 0)
+            {
+                u->fill[b] = 0;
+                return b;
+            }
+        }
+        if (reap_one(u) != 0 && u->broken)
+        {
+            return -1;
+        }
+    }
+}
+
+/* ============================== MQTT ============================= */
+
+static size_t put_remaining_length(unsigned char *p, size_t len)
+{
+    size_t n = 0;
+    do
+    {
+        unsigned char byte = len % 128;
+        len /= 128;
+        p[n++] = (unsigned char)(byte | (len ? 0x80 : 0));
+    } while (len);
+    return n;
+}
+
+static int connect_socket(const char *host, int port)
+{
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, port_str, &hints, &res);
+    if (rc != 0)
+    {
+        fprintf(stderr, "uring: %s: %s\n", host, gai_strerror(rc));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+        {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+    {
+        fprintf(stderr, "uring: connect to %s:%d: %s\n", host, port, strerror(errno));
+    }
+    return fd;
+}
+
+/* CONNECT with a clean session and no MQTT keep alive (nothing is ever
+ * read after CONNACK, so PINGRESPs would pile up); TCP keepalive notices a
+ * dead broker instead */
+static int mqtt_handshake(int fd, const char *client_id)
+{
+    size_t id_len = strlen(client_id);
+    if (id_len > 23)
+    {
+        id_len = 23;
+    }
+
+    unsigned char pkt[64];
+    size_t n = 0;
+    pkt[n++] = 0x10;
+    n += put_remaining_length(pkt + n, 10 + 2 + id_len);
+    static const unsigned char var_header[] = {0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, 0, 0};
+    memcpy(pkt + n, var_header, sizeof(var_header));
+    n += sizeof(var_header);
+    pkt[n++] = (unsigned char)(id_len >> 8);
+    pkt[n++] = (unsigned char)id_len;
+    memcpy(pkt + n, client_id, id_len);
+    n += id_len;
+
+    if (send(fd, pkt, n, MSG_NOSIGNAL) != (ssize_t)n)
+    {
+        fprintf(stderr, "uring: sending CONNECT: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct timeval tv = {.tv_sec = CONNACK_TIMEOUT_S};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    unsigned char ack[4];
+    size_t got = 0;
+    while (got < sizeof(ack))
+    {
+        ssize_t r = recv(fd, ack + got, sizeof(ack) - got, 0);
+        if (r <= 0)
+        {
+            fprintf(stderr, "uring: no CONNACK: %s\n", r == 0 ? "connection closed" : strerror(errno));
+            return -1;
+        }
+        got += (size_t)r;
+    }
+    if (ack[0] != 0x20 || ack[1] != 2 || ack[3] != 0)
+    {
+        fprintf(stderr, "uring: connection refused (return code %u)\n", ack[3]);
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    return 0;
+}
+
+/* ============================= PUBLIC ============================ */
+
+struct mqtt_uring *mqtt_uring_connect(const char *host, int port, const char *client_id)
+{
+    struct mqtt_uring *u = calloc(1, sizeof(*u));
+    if (!u)
+    {
+        return NULL;
+    }
+    u->cur = -1;
+    u->sending = -1;
+    u->zc = true;
+
+    if (ring_init(&u->ring, RING_ENTRIES) != 0)
+    {
+        perror("io_uring_setup");
+        free(u);
+        return NULL;
+    }
+
+    u->mem = mmap(NULL, (size_t)URING_BUFS * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (u->mem == MAP_FAILED)
+    {
+        perror("mmap");
+        ring_exit(&u->ring);
+        free(u);
+        return NULL;
+    }
+
+    /* Registering pins the pages once instead of on every send; it counts
+     * against RLIMIT_MEMLOCK on older kernels, so carry on without */
+    struct iovec iov[URING_BUFS];
+    for (int b = 0; b < URING_BUFS; b++)
+    {
+        iov[b].iov_base = buf_at(u, b);
+        iov[b].iov_len = URING_BUF_SIZE;
+    }
+    u->fixed = syscall(__NR_io_uring_register, u->ring.fd, IORING_REGISTER_BUFFERS,
+                       iov, URING_BUFS) == 0;
+    if (!u->fixed)
+    {
+        fprintf(stderr, "uring: cannot register buffers (%s), sending unregistered\n",
+                strerror(errno));
+    }
+
+    u->sock = connect_socket(host, port);
+    if (u->sock < 0 || mqtt_handshake(u->sock, client_id) != 0)
+    {
+        if (u->sock >= 0)
+        {
+            close(u->sock);
+        }
+        munmap(u->mem, (size_t)URING_BUFS * URING_BUF_SIZE);
+        ring_exit(&u->ring);
+        free(u);
+        return NULL;
+    }
+    return u;
+}
+
+long mqtt_uring_publish(struct mqtt_uring *u, const char *topic,
+                        const void *payload, size_t len)
+{
+    if (u->broken)
+    {
+        return -1;
+    }
+
+    size_t topic_len = strlen(topic);
+    size_t rem = 2 + topic_len + len;
+    unsigned char header[5];
+    header[0] = 0x30; /* PUBLISH, QoS 0 */
+    size_t header_len = 1 + put_remaining_length(header + 1, rem);
+    size_t pkt = header_len + rem;
+    if (topic_len > 0xffff || rem > 268435455u || pkt > URING_BUF_SIZE)
+    {
+        fprintf(stderr, "uring: %zu byte message on %s does not fit a buffer, dropped\n",
+                len, topic);
+        return 0;
+    }
+
+    if (u->cur >= 0 && u->fill[u->cur] + pkt > URING_BUF_SIZE && submit_current(u) != 0)
+    {
+        return -1;
+    }
+    if (u->cur < 0 && (u->cur = next_buffer(u)) < 0)
+    {
+        return -1;
+    }
+
+    char *p = buf_at(u, u->cur) + u->fill[u->cur];
+    memcpy(p, header, header_len);
+    p += header_len;
+    *p++ = (char)(topic_len >> 8);
+    *p++ = (char)topic_len;
+    memcpy(p, topic, topic_len);
+    memcpy(p + topic_len, payload, len);
+    u->fill[u->cur] += pkt;
+
+    u->stats.messages++;
+    u->stats.bytes += pkt;
+    return (long)pkt;
+}
+
+int mqtt_uring_flush(struct mqtt_uring *u)
+{
+    if (submit_current(u) != 0)
+    {
+        return -1;
+    }
+    while (u->sending >= 0)
+    {
+        if (reap_one(u) != 0)
+        {
+            return -1;
+        }
+    }
+    return u->broken ? -1 : 0;
+}
+
+void mqtt_uring_stats(const struct mqtt_uring *u, struct mqtt_uring_stats *out)
+{
+    *out = u->stats;
+}
+
+void mqtt_uring_close(struct mqtt_uring *u)
+{
+    if (!u)
+    {
+        return;
+    }
+    if (mqtt_uring_flush(u) == 0)
+    {
+        static const unsigned char disconnect[] = {0xe0, 0};
+        send(u->sock, disconnect, sizeof(disconnect), MSG_NOSIGNAL);
+    }
+
+    /* The kernel may still hold buffer pages until every notification */
+    for (int b = 0; b < URING_BUFS; b++)
+    {
+        while (u->notif_pending[b] && reap_one(u) == 0)
+            ;
+    }
+
+    close(u->sock);
+    ring_exit(&u->ring);
+    munmap(u->mem, (size_t)URING_BUFS * URING_BUF_SIZE);
+    free(u);
+}
@@ -0,0 +1,61 @@
+/*
+ * mqtt_uring.h: MQTT 3.1.1 QoS 0 publishing over io_uring
+ *
+ * Optional network backend for the bulk publisher (make WITH_IO_URING=1).
+ * PUBLISH packets are packed back to back into a small pool of buffers
+ * registered with the ring; each full buffer goes out as one send, with
+ * MSG_ZEROCOPY semantics (IORING_OP_SEND_ZC) once it is large enough, and
+ * is reused when the kernel says it is done with it. Zero copy needs
+ * Linux 6.2 or later (IORING_SEND_ZC_REPORT_USAGE); older kernels get
+ * plain sends.
+ */
+
+#ifndef WEARABLE_MQTT_URING_H
+#define WEARABLE_MQTT_URING_H
+
+#include <stddef.h>
+
+/* Registered payload buffers: count and size of each */
+#ifndef URING_BUFS
+#define URING_BUFS 8
+#endif
+#ifndef URING_BUF_SIZE
+#define URING_BUF_SIZE (256u * 1024)
+#endif
+
+/* Sends at least this large use zero copy, smaller ones are copied */
+#ifndef URING_ZC_MIN
+#define URING_ZC_MIN (16u * 1024)
+#endif
+
+struct mqtt_uring;
+
+struct mqtt_uring_stats
+{
+    unsigned long long messages;
+    unsigned long long bytes;
+    unsigned long long sends;     /* send operations submitted */
+    unsigned long long zc_sends;  /* ... of which zero copy */
+    unsigned long long zc_copied; /* ... that the kernel copied anyway, as
+                                   * reported on their notification */
+};
+
+/* Connect to host:port, send CONNECT and wait for CONNACK.
+ * Returns NULL on error. */
+struct mqtt_uring *mqtt_uring_connect(const char *host, int port, const char *client_id);
+
+/* Queue one QoS 0 PUBLISH. Returns the packet size, 0 if the message can
+ * never fit a buffer (dropped), -1 if the connection is gone. */
+long mqtt_uring_publish(struct mqtt_uring *u, const char *topic,
+                        const void *payload, size_t len);
+
+/* Hand everything queued to the kernel and wait until it is sent.
+ * Returns 0, -1 if the connection is gone. */
+int mqtt_uring_flush(struct mqtt_uring *u);
+
+void mqtt_uring_stats(const struct mqtt_uring *u, struct mqtt_uring_stats *out);
+
+/* Flush, send DISCONNECT and free everything */
+void mqtt_uring_close(struct mqtt_uring *u);
+
+#endif /* WEARABLE_MQTT_URING_H */
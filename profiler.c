@@ -0,0 +1,681 @@
+/*
+ * profiler.c: in-process sampling CPU profiler, folded-stack output
+ *
+ * Every thread gets its own timer on its own CPU-time clock, delivered to
+ * it alone (SIGEV_THREAD_ID). A single process CPU-time timer would do on
+ * Linux 6.4 and later, which signal the thread that used up the time;
+ * older kernels mostly pick the main thread, which sits in poll. Threads
+ * are found in /proc/self/task at start and by profiler_poll.
+ *
+ * The SIGPROF handler stays installed once the profiler has run, so a
+ * signal still pending after the timer is deleted is ignored rather than
+ * killing the process. The handler counts itself in and out (busy), and
+ * stop waits for it to drain before reading the buffer. Frames are read
+ * with process_vm_readv, so a bad frame pointer ends the walk instead of
+ * faulting.
+ */
+
+#define _GNU_SOURCE
+#include "profiler.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+/* A frame pointer further than this above the sampled stack pointer is
+ * taken as garbage */
+#define STACK_SPAN_MAX (8u * 1024 * 1024)
+
+#define FRAME_NAME_MAX 160
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+struct sample
+{
+    int ready; /* written last, with release */
+    int depth;
+    uintptr_t pc[PROFILE_DEPTH]; /* leaf first */
+};
+
+static struct
+{
+    pthread_mutex_t lock; /* start/stop */
+    bool running;
+    bool installed; /* handler in place, kept for stray signals */
+    int hz;
+    struct timespec started;
+    pid_t tid[PROFILE_THREADS]; /* threads with a timer, in timer order */
+    timer_t timer[PROFILE_THREADS];
+    int threads;
+    bool full_logged;
+
+    /* shared with the handler */
+    int active;
+    int busy;
+    unsigned next;
+    unsigned long long dropped;
+    struct sample *samples; /* PROFILE_SAMPLES, mmap'd: untouched pages cost nothing */
+} pf = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* ============================= HANDLER =========================== */
+
+static bool read_frame(uintptr_t fp, uintptr_t out[2])
+{
+    struct iovec local = {out, 2 * sizeof(uintptr_t)};
+    struct iovec remote = {(void *)fp, 2 * sizeof(uintptr_t)};
+    return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == (ssize_t)(2 * sizeof(uintptr_t));
+}
+
+static void on_sigprof(int sig, siginfo_t *si, void *ctx)
+{
+    (void)sig;
+    (void)si;
+    int saved_errno = errno;
+
+    __atomic_add_fetch(&pf.busy, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&pf.active, __ATOMIC_SEQ_CST))
+    {
+        goto out;
+    }
+
+    unsigned idx = __atomic_fetch_add(&pf.next, 1, __ATOMIC_RELAXED);
+    if (idx >= PROFILE_SAMPLES)
+    {
+        __atomic_add_fetch(&pf.dropped, 1, __ATOMIC_RELAXED);
+        goto out;
+    }
+    struct sample *s = &pf.samples[idx];
+    const ucontext_t *uc = ctx;
+    uintptr_t pc, fp = 0, sp = 0;
+
+#if defined(__x86_64__)
+    pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+    fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+    sp = (uintptr_t)uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    pc = (uintptr_t)uc->uc_mcontext.pc;
+    fp = (uintptr_t)uc->uc_mcontext.regs[29];
+    sp = (uintptr_t)uc->uc_mcontext.sp;
+#elif defined(__arm__)
+    pc = (uintptr_t)uc->uc_mcontext.arm_pc;
+#else
+    pc = 0;
+#endif
+
+    /* Frame records are {previous fp, return address} on both */
+    int n = 0;
+    s->pc[n++] = pc;
+    while (n < PROFILE_DEPTH && fp >= sp && fp - sp < STACK_SPAN_MAX &&
+           (fp & (sizeof(uintptr_t) - 1)) == 0)
+    {
+        uintptr_t frame[2];
+        if (!read_frame(fp, frame) || frame[1] == 0)
+        {
+            break;
+        }
+        s->pc[n++] = frame[1] - 1; /* inside the call, not after it */
+        if (frame[0] <= fp)
+        {
+            break;
+        }
+        fp = frame[0];
+    }
+    s->depth = n;
+    __atomic_store_n(&s->ready, 1, __ATOMIC_RELEASE);
+
+out:
+    __atomic_sub_fetch(&pf.busy, 1, __ATOMIC_SEQ_CST);
+    errno = saved_errno;
+}
+
+/* ============================= SYMBOLS =========================== */
+
+struct symbol
+{
+    uintptr_t addr;
+    size_t size;
+    const char *name;
+};
+
+/* Function symbols of our own executable */
+static struct
+{
+    void *map;
+    size_t map_len;
+    struct symbol *sym;
+    size_t n;
+    uintptr_t bias; /* subtracted from a pc: load base for PIE, 0 otherwise */
+    const void *base;
+} exe;
+
+static int symbol_cmp(const void *a, const void *b)
+{
+    const struct symbol *x = a, *y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static void exe_symbols_load(void)
+{
+    Dl_info self;
+    if (!dladdr((void *)profiler_start, &self))
+    {
+        return;
+    }
+    exe.base = self.dli_fbase;
+
+    int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ElfW(Ehdr)))
+    {
+        close(fd);
+        return;
+    }
+    exe.map_len = (size_t)st.st_size;
+    exe.map = mmap(NULL, exe.map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (exe.map == MAP_FAILED)
+    {
+        exe.map = NULL;
+        return;
+    }
+
+    const uint8_t *img = exe.map;
+    const ElfW(Ehdr) *eh = exe.map;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh->e_shoff + (size_t)eh->e_shnum * sizeof(ElfW(Shdr)) > exe.map_len)
+    {
+        return;
+    }
+    exe.bias = eh->e_type == ET_DYN ? (uintptr_t)exe.base : 0;
+
+    const ElfW(Shdr) *sh = (const ElfW(Shdr) *)(img + eh->e_shoff);
+    for (unsigned i = 0; i < eh->e_shnum; i++)
+    {
+        if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum)
+        {
+            continue;
+        }
+        const ElfW(Shdr) *strtab = &sh[sh[i].sh_link];
+        if (sh[i].sh_offset + sh[i].sh_size > exe.map_len ||
+            strtab->sh_offset + strtab->sh_size > exe.map_len)
+        {
+            break;
+        }
+        const ElfW(Sym) *sym = (const ElfW(Sym) *)(img + sh[i].sh_offset);
+        size_t count = sh[i].sh_size / sizeof(ElfW(Sym));
+        exe.sym = malloc(count * sizeof(*exe.sym));
+        if (!exe.sym)
+        {
+            break;
+        }
+        for (size_t k = 0; k < count; k++)
+        {
+            if ((sym[k].st_info & 0xf) == STT_FUNC && sym[k].st_value && sym[k].st_size &&
+                sym[k].st_name < strtab->sh_size)
+            {
+                exe.sym[exe.n++] = (struct symbol){
+                    sym[k].st_value, sym[k].st_size,
+                    (const char *)img + strtab->sh_offset + sym[k].st_name};
+            }
+        }
+        qsort(exe.sym, exe.n, sizeof(*exe.sym), symbol_cmp);
+        break;
+    }
+}
+
+static void exe_symbols_free(void)
+{
+    free(exe.sym);
+    if (exe.map)
+    {
+        munmap(exe.map, exe.map_len);
+    }
+    memset(&exe, 0, sizeof(exe));
+}
+
+static const char *exe_symbol(uintptr_t pc)
+{
+    uintptr_t addr = pc - exe.bias;
+    size_t lo = 0, hi = exe.n;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (exe.sym[mid].addr <= addr)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    if (lo > 0 && addr < exe.sym[lo - 1].addr + exe.sym[lo - 1].size)
+    {
+        return exe.sym[lo - 1].name;
+    }
+    return NULL;
+}
+
+static void frame_name(uintptr_t pc, char *out, size_t cap)
+{
+    Dl_info info;
+    if (!dladdr((void *)pc, &info))
+    {
+        snprintf(out, cap, "0x%lx", (unsigned long)pc);
+        return;
+    }
+
+    const char *name = info.dli_fbase == exe.base ? exe_symbol(pc) : NULL;
+    if (!name)
+    {
+        name = info.dli_sname;
+    }
+    if (name)
+    {
+        snprintf(out, cap, "%s", name);
+        return;
+    }
+    const char *file = info.dli_fname ? strrchr(info.dli_fname, '/') : NULL;
+    file = file ? file + 1 : (info.dli_fname ? info.dli_fname : "?");
+    snprintf(out, cap, "%s+0x%lx", file, (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+}
+
+/* ============================= OUTPUT ============================ */
+
+static int stack_cmp(const void *a, const void *b)
+{
+    const struct sample *x = *(const struct sample *const *)a;
+    const struct sample *y = *(const struct sample *const *)b;
+    if (x->depth != y->depth)
+    {
+        return x->depth < y->depth ? -1 : 1;
+    }
+    return memcmp(x->pc, y->pc, (size_t)x->depth * sizeof(x->pc[0]));
+}
+
+static int pc_cmp(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static char (*sort_names)[FRAME_NAME_MAX]; /* for name_cmp; stop holds pf.lock */
+
+static int name_cmp(const void *a, const void *b)
+{
+    return strcmp(sort_names[*(const size_t *)a], sort_names[*(const size_t *)b]);
+}
+
+/* Aggregate n ready samples into folded stacks in f. Returns the number
+ * of distinct stacks, -1 out of memory. */
+static int write_folded(FILE *f, unsigned n)
+{
+    struct sample **order = malloc((n ? n : 1) * sizeof(*order));
+    size_t npc = 0;
+    unsigned m = 0;
+    if (!order)
+    {
+        return -1;
+    }
+    for (unsigned i = 0; i < n; i++)
+    {
+        if (__atomic_load_n(&pf.samples[i].ready, __ATOMIC_ACQUIRE))
+        {
+            order[m++] = &pf.samples[i];
+            npc += (size_t)pf.samples[i].depth;
+        }
+    }
+    qsort(order, m, sizeof(*order), stack_cmp);
+
+    /* Every distinct pc named once */
+    uintptr_t *pcs = malloc((npc ? npc : 1) * sizeof(*pcs));
+    char(*names)[FRAME_NAME_MAX] = NULL;
+    size_t upc = 0;
+    if (pcs)
+    {
+        for (unsigned i = 0; i < m; i++)
+        {
+            memcpy(pcs + upc, order[i]->pc, (size_t)order[i]->depth * sizeof(*pcs));
+            upc += (size_t)order[i]->depth;
+        }
+        qsort(pcs, upc, sizeof(*pcs), pc_cmp);
+        size_t u = 0;
+        for (size_t i = 0; i < upc; i++)
+        {
+            if (u == 0 || pcs[i] != pcs[u - 1])
+            {
+                pcs[u++] = pcs[i];
+            }
+        }
+        upc = u;
+        names = malloc((upc ? upc : 1) * sizeof(*names));
+    }
+    if (!pcs || !names)
+    {
+        free(order);
+        free(pcs);
+        free(names);
+        return -1;
+    }
+
+    exe_symbols_load();
+    for (size_t i = 0; i < upc; i++)
+    {
+        frame_name(pcs[i], names[i], sizeof(names[i]));
+    }
+    exe_symbols_free();
+
+    /* Different pcs in one function are one frame: rewrite every pc as the
+     * index of the first pc with its name, then count equal stacks */
+    size_t *by_name = malloc((upc ? upc : 1) * sizeof(*by_name));
+    uintptr_t *frame = malloc((upc ? upc : 1) * sizeof(*frame));
+    if (!by_name || !frame)
+    {
+        free(order);
+        free(pcs);
+        free(names);
+        free(by_name);
+        free(frame);
+        return -1;
+    }
+    for (size_t i = 0; i < upc; i++)
+    {
+        by_name[i] = i;
+    }
+    sort_names = names;
+    qsort(by_name, upc, sizeof(*by_name), name_cmp);
+    for (size_t i = 0; i < upc; i++)
+    {
+        bool same = i > 0 && strcmp(names[by_name[i]], names[by_name[i - 1]]) == 0;
+        frame[by_name[i]] = same ? frame[by_name[i - 1]] : by_name[i];
+    }
+    for (unsigned i = 0; i < m; i++)
+    {
+        struct sample *s = order[i];
+        for (int d = 0; d < s->depth; d++)
+        {
+            const uintptr_t *hit = bsearch(&s->pc[d], pcs, upc, sizeof(*pcs), pc_cmp);
+            s->pc[d] = frame[hit - pcs];
+        }
+    }
+    qsort(order, m, sizeof(*order), stack_cmp);
+
+    int stacks = 0;
+    for (unsigned i = 0; i < m;)
+    {
+        unsigned j = i + 1;
+        while (j < m && stack_cmp(&order[i], &order[j]) == 0)
+        {
+            j++;
+        }
+        const struct sample *s = order[i];
+        for (int d = s->depth - 1; d >= 0; d--)
+        {
+            fprintf(f, "%s%s", names[s->pc[d]], d ? ";" : "");
+        }
+        fprintf(f, " %u\n", j - i);
+        stacks++;
+        i = j;
+    }
+
+    free(by_name);
+    free(frame);
+    free(order);
+    free(pcs);
+    free(names);
+    return stacks;
+}
+
+/* ============================= TIMERS ============================ */
+
+/* A timer on tid's CPU-time clock that signals tid. The clock id is
+ * glibc's pthread_getcpuclockid encoding, which works for any thread of
+ * the process. Returns 0, -1 if the thread is gone or on error. */
+static int watch_thread(pid_t tid)
+{
+    clockid_t clock = (clockid_t)((~(unsigned)tid << 3) | 6); /* per thread, sched */
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = tid;
+
+    timer_t timer;
+    if (timer_create(clock, &sev, &timer) != 0)
+    {
+        return -1;
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 1000000000L / pf.hz;
+    its.it_value = its.it_interval;
+    if (timer_settime(timer, 0, &its, NULL) != 0)
+    {
+        timer_delete(timer);
+        return -1;
+    }
+    pf.tid[pf.threads] = tid;
+    pf.timer[pf.threads] = timer;
+    pf.threads++;
+    return 0;
+}
+
+/* Give every thread not seen yet its timer; pf.lock held */
+static void watch_threads(void)
+{
+    DIR *d = opendir("/proc/self/task");
+    if (!d)
+    {
+        perror("profiler: /proc/self/task");
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        pid_t tid = (pid_t)atoi(de->d_name);
+        if (tid <= 0)
+        {
+            continue;
+        }
+        bool seen = false;
+        for (int i = 0; i < pf.threads && !seen; i++)
+        {
+            seen = pf.tid[i] == tid;
+        }
+        if (seen)
+        {
+            continue;
+        }
+        if (pf.threads == PROFILE_THREADS)
+        {
+            if (!pf.full_logged)
+            {
+                fprintf(stderr, "profiler: more than %d threads, later ones not sampled\n",
+                        PROFILE_THREADS);
+                pf.full_logged = true;
+            }
+            break;
+        }
+        watch_thread(tid);
+    }
+    closedir(d);
+}
+
+static void unwatch_threads(void)
+{
+    for (int i = 0; i < pf.threads; i++)
+    {
+        timer_delete(pf.timer[i]);
+    }
+    pf.threads = 0;
+}
+
+/* ============================= PUBLIC ============================ */
+
+int profiler_start(int hz)
+{
+    hz = hz > 0 ? hz : PROFILE_HZ;
+
+    pthread_mutex_lock(&pf.lock);
+    if (pf.running)
+    {
+        pthread_mutex_unlock(&pf.lock);
+        return -1;
+    }
+
+    pf.samples = mmap(NULL, PROFILE_SAMPLES * sizeof(struct sample), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pf.samples == MAP_FAILED)
+    {
+        pf.samples = NULL;
+        pthread_mutex_unlock(&pf.lock);
+        fprintf(stderr, "profiler: out of memory\n");
+        return -1;
+    }
+    pf.next = 0;
+    pf.dropped = 0;
+
+    if (!pf.installed)
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = on_sigprof;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGPROF, &sa, NULL) != 0)
+        {
+            perror("profiler: sigaction");
+            goto fail;
+        }
+        pf.installed = true;
+    }
+
+    pf.hz = hz;
+    pf.full_logged = false;
+    __atomic_store_n(&pf.active, 1, __ATOMIC_SEQ_CST);
+    watch_threads();
+    if (pf.threads == 0)
+    {
+        fprintf(stderr, "profiler: cannot create thread timers: %s\n", strerror(errno));
+        __atomic_store_n(&pf.active, 0, __ATOMIC_SEQ_CST);
+        goto fail;
+    }
+
+    pf.running = true;
+    clock_gettime(CLOCK_MONOTONIC, &pf.started);
+    pthread_mutex_unlock(&pf.lock);
+    printf("profiler: sampling %d threads at %d Hz\n", pf.threads, hz);
+    return 0;
+
+fail:
+    munmap(pf.samples, PROFILE_SAMPLES * sizeof(struct sample));
+    pf.samples = NULL;
+    pthread_mutex_unlock(&pf.lock);
+    return -1;
+}
+
+int profiler_stop(const char *path)
+{
+    pthread_mutex_lock(&pf.lock);
+    if (!pf.running)
+    {
+        pthread_mutex_unlock(&pf.lock);
+        return -1;
+    }
+
+    /* No handler is inside the buffer once busy reads zero */
+    __atomic_store_n(&pf.active, 0, __ATOMIC_SEQ_CST);
+    unwatch_threads();
+    while (__atomic_load_n(&pf.busy, __ATOMIC_SEQ_CST))
+    {
+        sched_yield();
+    }
+    pf.running = false;
+
+    unsigned n = pf.next < PROFILE_SAMPLES ? pf.next : PROFILE_SAMPLES;
+    int stacks = -1;
+    char tmp[PATH_MAX];
+    FILE *f = NULL;
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) < (int)sizeof(tmp))
+    {
+        f = fopen(tmp, "we");
+    }
+    if (!f)
+    {
+        fprintf(stderr, "profiler: cannot write %s: %s\n", path, strerror(errno));
+    }
+    else
+    {
+        stacks = write_folded(f, n);
+        if (fclose(f) != 0 || stacks < 0 || rename(tmp, path) != 0)
+        {
+            fprintf(stderr, "profiler: cannot write %s\n", path);
+            unlink(tmp);
+            stacks = -1;
+        }
+    }
+
+    munmap(pf.samples, PROFILE_SAMPLES * sizeof(struct sample));
+    pf.samples = NULL;
+    pthread_mutex_unlock(&pf.lock);
+
+    if (stacks >= 0)
+    {
+        printf("profiler: %u samples (%llu dropped), %d stacks -> %s\n", n, pf.dropped,
+               stacks, path);
+    }
+    return stacks;
+}
+
+void profiler_poll(void)
+{
+    pthread_mutex_lock(&pf.lock);
+    if (pf.running)
+    {
+        watch_threads();
+    }
+    pthread_mutex_unlock(&pf.lock);
+}
+
+void profiler_get_stats(struct profiler_stats *out)
+{
+    pthread_mutex_lock(&pf.lock);
+    memset(out, 0, sizeof(*out));
+    out->running = pf.running;
+    out->hz = pf.hz;
+    if (pf.running)
+    {
+        unsigned next = __atomic_load_n(&pf.next, __ATOMIC_RELAXED);
+        out->samples = next < PROFILE_SAMPLES ? next : PROFILE_SAMPLES;
+        out->dropped = __atomic_load_n(&pf.dropped, __ATOMIC_RELAXED);
+        out->threads = pf.threads;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        out->seconds = (double)(now.tv_sec - pf.started.tv_sec) +
+                       (now.tv_nsec - pf.started.tv_nsec) / 1e9;
+    }
+    pthread_mutex_unlock(&pf.lock);
+}
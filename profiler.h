@@ -0,0 +1,74 @@
+/*
+ * profiler.h: in-process sampling CPU profiler, folded-stack output
+ *
+ * A CPU-time timer per thread (timer_create) raises SIGPROF in that thread
+ * PROFILE_HZ times per CPU-second it uses; the thread walks its frame
+ * pointers in the signal handler and claims a slot in a preallocated sample buffer
+ * with one atomic add, so nothing in the handler locks or allocates. On
+ * stop, identical stacks are counted and written one per line, root first:
+ *
+ *   main;handle_device;convert_and_publish;decode_batch 412
+ *
+ * which flamegraph.pl and speedscope read as is. Frames are named from the
+ * executable's symbol table (keep it unstripped) and from the dynamic
+ * symbols of shared libraries, "lib.so+0x1f3a" otherwise. The dock is
+ * built with -fno-omit-frame-pointer; code without frame pointers (libc,
+ * libcrypto) ends a stack early or loses one caller, and so do leaf
+ * functions, which gcc leaves without a frame. Stacks are walked on
+ * x86-64 and AArch64; elsewhere only the sampled function is recorded.
+ */
+
+#ifndef WEARABLE_PROFILER_H
+#define WEARABLE_PROFILER_H
+
+/* Default sampling rate, per CPU-second */
+#ifndef PROFILE_HZ
+#define PROFILE_HZ 99
+#endif
+
+/* Frames kept per sample */
+#ifndef PROFILE_DEPTH
+#define PROFILE_DEPTH 48
+#endif
+
+/* Samples per run; later ones are counted as dropped */
+#ifndef PROFILE_SAMPLES
+#define PROFILE_SAMPLES (1u << 15)
+#endif
+
+/* Threads sampled per run, counting ones that have exited since */
+#ifndef PROFILE_THREADS
+#define PROFILE_THREADS 256
+#endif
+
+/* How often a running profile looks for new threads (profiler_poll) */
+#ifndef PROFILE_RESCAN_MS
+#define PROFILE_RESCAN_MS 1000
+#endif
+
+struct profiler_stats
+{
+    int running;
+    int hz;
+    unsigned long long samples;
+    unsigned long long dropped;
+    int threads; /* with a timer */
+    double seconds; /* wall time since start */
+};
+
+/* Start sampling at hz (0 = PROFILE_HZ). Returns 0, -1 if already running
+ * or on error. */
+int profiler_start(int hz);
+
+/* Stop sampling and write the folded stacks to path (tmp + rename).
+ * Returns the number of distinct stacks, -1 if not running or on error;
+ * sampling is stopped either way. */
+int profiler_stop(const char *path);
+
+/* Start sampling threads created since the last look; a no-op unless
+ * running. Called every PROFILE_RESCAN_MS while a profile runs. */
+void profiler_poll(void);
+
+void profiler_get_stats(struct profiler_stats *out);
+
+#endif /* WEARABLE_PROFILER_H */
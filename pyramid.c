@@ -0,0 +1,500 @@
+/*
+ * pyramid.c: per-session multi-resolution summary for zoomable dashboards
+ *
+ * Level 0 is accumulated while batches stream past, in 16 lanes per
+ * channel so the min / max / sum loop vectorises whatever the alignment of
+ * a bucket within a batch; lanes are folded when a bucket closes. The
+ * upper levels and the LTTB preview (largest triangle three buckets, run
+ * over the level 0 means) are derived from level 0 once the session is
+ * done, so the records themselves are only read once.
+ */
+
+#define _GNU_SOURCE
+#include "pyramid.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+const char *const pyramid_channel_names[PYRAMID_CHANNELS] = {
+    "pressure_pa", "acc_x", "acc_y", "acc_z", "gyr_x", "gyr_y", "gyr_z"};
+
+void pyramid_init(struct pyramid *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+void pyramid_free(struct pyramid *p)
+{
+    for (int k = 0; k < PYRAMID_MAX_LEVELS; k++)
+    {
+        free(p->level[k]);
+    }
+    for (int c = 0; c < PYRAMID_CHANNELS; c++)
+    {
+        free(p->preview[c]);
+    }
+    memset(p, 0, sizeof(*p));
+}
+
+/* ============================= LEVEL 0 =========================== */
+
+static void reset_lanes(struct pyramid *p)
+{
+    for (int c = 0; c < PYRAMID_CHANNELS; c++)
+    {
+        for (int l = 0; l < 16; l++)
+        {
+            p->lane_min[c][l] = FLT_MAX;
+            p->lane_max[c][l] = -FLT_MAX;
+            p->lane_sum[c][l] = 0;
+        }
+    }
+}
+
+/* Fold v[0..n) into the lanes, 16 values at a time */
+static void fold_lanes(const float *restrict v, size_t n, float *restrict mn,
+                       float *restrict mx, float *restrict sum)
+{
+    size_t groups = n & ~(size_t)15;
+    for (size_t j = 0; j < groups; j += 16)
+    {
+        for (size_t l = 0; l < 16; l++)
+        {
+            float x = v[j + l];
+            mn[l] = x < mn[l] ? x : mn[l];
+            mx[l] = x > mx[l] ? x : mx[l];
+            sum[l] += x;
+        }
+    }
+    for (size_t j = groups; j < n; j++)
+    {
+        float x = v[j];
+        mn[0] = x < mn[0] ? x : mn[0];
+        mx[0] = x > mx[0] ? x : mx[0];
+        sum[0] += x;
+    }
+}
+
+static int close_bucket(struct pyramid *p)
+{
+    if (p->buckets[0] == p->cap0)
+    {
+        size_t cap = p->cap0 ? 2 * p->cap0 : 1024;
+        struct pyramid_bucket *grown = realloc(p->level[0], cap * sizeof(*grown));
+        if (!grown)
+        {
+            return -1;
+        }
+        p->level[0] = grown;
+        p->cap0 = cap;
+    }
+
+    struct pyramid_bucket *bk = &p->level[0][p->buckets[0]++];
+    bk->t_first = p->t_first;
+    bk->t_last = p->t_last;
+    bk->count = (uint32_t)p->fill;
+    for (int c = 0; c < PYRAMID_CHANNELS; c++)
+    {
+        float mn = FLT_MAX, mx = -FLT_MAX, sum = 0;
+        for (int l = 0; l < 16; l++)
+        {
+            mn = p->lane_min[c][l] < mn ? p->lane_min[c][l] : mn;
+            mx = p->lane_max[c][l] > mx ? p->lane_max[c][l] : mx;
+            sum += p->lane_sum[c][l];
+        }
+        bk->min[c] = mn;
+        bk->max[c] = mx;
+        bk->mean[c] = sum / (float)p->fill;
+    }
+    p->fill = 0;
+    return 0;
+}
+
+int pyramid_add(struct pyramid *p, const struct record_batch *b)
+{
+    size_t i = 0;
+    while (i < b->n)
+    {
+        if (p->fill == 0)
+        {
+            reset_lanes(p);
+            p->t_first = b->timestamp_ms[i];
+        }
+
+        size_t take = PYRAMID_BASE - p->fill;
+        if (take > b->n - i)
+        {
+            take = b->n - i;
+        }
+        fold_lanes(b->pressure_pa + i, take, p->lane_min[0], p->lane_max[0], p->lane_sum[0]);
+        for (int c = 0; c < IMU_CHANNELS; c++)
+        {
+            fold_lanes(b->imu[c] + i, take, p->lane_min[1 + c], p->lane_max[1 + c],
+                       p->lane_sum[1 + c]);
+        }
+
+        p->fill += take;
+        p->t_last = b->timestamp_ms[i + take - 1];
+        i += take;
+
+        if (p->fill == PYRAMID_BASE && close_bucket(p) != 0)
+        {
+            return -1;
+        }
+    }
+    p->records += b->n;
+    return 0;
+}
+
+/* ========================== UPPER LEVELS ========================= */
+
+static void merge(const struct pyramid_bucket *a, const struct pyramid_bucket *b,
+                  struct pyramid_bucket *out)
+{
+    float wa = (float)a->count / (float)(a->count + b->count);
+    out->t_first = a->t_first;
+    out->t_last = b->t_last;
+    out->count = a->count + b->count;
+    for (int c = 0; c < PYRAMID_CHANNELS; c++)
+    {
+        out->min[c] = a->min[c] < b->min[c] ? a->min[c] : b->min[c];
+        out->max[c] = a->max[c] > b->max[c] ? a->max[c] : b->max[c];
+        out->mean[c] = a->mean[c] * wa + b->mean[c] * (1.0f - wa);
+    }
+}
+
+/* Largest triangle three buckets over the level 0 means of channel c */
+static void lttb(const struct pyramid_bucket *in, size_t n, int c,
+                 struct pyramid_point *out, size_t points)
+{
+    if (points >= n || points < 3)
+    {
+        for (size_t i = 0; i < n && i < points; i++)
+        {
+            out[i].t = in[i].t_first;
+            out[i].v = in[i].mean[c];
+        }
+        return;
+    }
+
+    double every = (double)(n - 2) / (double)(points - 2);
+    size_t a = 0;
+    out[0].t = in[0].t_first;
+    out[0].v = in[0].mean[c];
+
+    for (size_t k = 0; k < points - 2; k++)
+    {
+        /* Average of the next bucket is the third corner */
+        size_t s = (size_t)((double)(k + 1) * every) + 1;
+        size_t e = (size_t)((double)(k + 2) * every) + 1;
+        e = e < n ? e : n;
+        double avg_t = 0, avg_v = 0;
+        for (size_t j = s; j < e; j++)
+        {
+            avg_t += in[j].t_first;
+            avg_v += in[j].mean[c];
+        }
+        if (e > s)
+        {
+            avg_t /= (double)(e - s);
+            avg_v /= (double)(e - s);
+        }
+
+        size_t rs = (size_t)((double)k * every) + 1;
+        size_t re = s;
+        double at = in[a].t_first, av = in[a].mean[c];
+        double best = -1;
+        size_t pick = rs;
+        for (size_t j = rs; j < re; j++)
+        {
+            double area = (at - avg_t) * ((double)in[j].mean[c] - av) -
+                          (at - (double)in[j].t_first) * (avg_v - av);
+            area = area < 0 ? -area : area;
+            if (area > best)
+            {
+                best = area;
+                pick = j;
+            }
+        }
+        out[k + 1].t = in[pick].t_first;
+        out[k + 1].v = in[pick].mean[c];
+        a = pick;
+    }
+    out[points - 1].t = in[n - 1].t_first;
+    out[points - 1].v = in[n - 1].mean[c];
+}
+
+int pyramid_finish(struct pyramid *p)
+{
+    if (p->fill && close_bucket(p) != 0)
+    {
+        return -1;
+    }
+    p->levels = p->buckets[0] ? 1 : 0;
+
+    while (p->levels > 0 && p->levels < PYRAMID_MAX_LEVELS && p->buckets[p->levels - 1] > 1)
+    {
+        int k = p->levels;
+        size_t below = p->buckets[k - 1];
+        size_t n = (below + 1) / 2;
+        p->level[k] = malloc(n * sizeof(*p->level[k]));
+        if (!p->level[k])
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            const struct pyramid_bucket *lo = &p->level[k - 1][2 * i];
+            if (2 * i + 1 < below)
+            {
+                merge(lo, lo + 1, &p->level[k][i]);
+            }
+            else
+            {
+                p->level[k][i] = *lo;
+            }
+        }
+        p->buckets[k] = n;
+        p->levels++;
+    }
+
+    size_t points = p->buckets[0] < PYRAMID_PREVIEW ? p->buckets[0] : PYRAMID_PREVIEW;
+    for (int c = 0; c < PYRAMID_CHANNELS && points; c++)
+    {
+        p->preview[c] = malloc(points * sizeof(*p->preview[c]));
+        if (!p->preview[c])
+        {
+            return -1;
+        }
+        lttb(p->level[0], p->buckets[0], c, p->preview[c], points);
+    }
+    p->preview_points = points;
+    return 0;
+}
+
+/* ============================== FILE ============================= */
+
+int pyramid_write(const struct pyramid *p, const char *dir)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    if (join_path(dir, PYRAMID_FILE, path, sizeof(path)) != 0 ||
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    {
+        return -1;
+    }
+
+    struct pyramid_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PYRAMID_MAGIC, sizeof(h.magic));
+    h.version = PYRAMID_VERSION;
+    h.channels = PYRAMID_CHANNELS;
+    h.base = PYRAMID_BASE;
+    h.levels = (uint32_t)p->levels;
+    h.records = p->records;
+    h.preview_points = (uint32_t)p->preview_points;
+
+    struct pyramid_level table[PYRAMID_MAX_LEVELS];
+    uint64_t off = sizeof(h) + (uint64_t)p->levels * sizeof(table[0]);
+    for (int k = 0; k < p->levels; k++)
+    {
+        table[k].offset = off;
+        table[k].buckets = p->buckets[k];
+        off += p->buckets[k] * sizeof(struct pyramid_bucket);
+    }
+    h.preview_offset = off;
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "pyramid: cannot create %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             (p->levels == 0 || fwrite(table, sizeof(table[0]), (size_t)p->levels, f) == (size_t)p->levels);
+    for (int k = 0; ok && k < p->levels; k++)
+    {
+        ok = fwrite(p->level[k], sizeof(struct pyramid_bucket), p->buckets[k], f) == p->buckets[k];
+    }
+    for (int c = 0; ok && p->preview_points && c < PYRAMID_CHANNELS; c++)
+    {
+        ok = fwrite(p->preview[c], sizeof(struct pyramid_point), p->preview_points, f) ==
+             p->preview_points;
+    }
+    if (fclose(f) != 0 || !ok || rename(tmp, path) != 0)
+    {
+        fprintf(stderr, "pyramid: cannot write %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+long pyramid_query(const char *path, uint64_t first, uint64_t n, size_t max_buckets,
+                   struct pyramid_bucket *out, int *level, uint64_t *first_bucket)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    long got = -1;
+    struct pyramid_header h;
+    if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+        memcmp(h.magic, PYRAMID_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != PYRAMID_VERSION || h.channels != PYRAMID_CHANNELS ||
+        h.base == 0 || h.levels > PYRAMID_MAX_LEVELS || max_buckets == 0)
+    {
+        goto out;
+    }
+    got = 0;
+    if (h.levels == 0 || n == 0 || first >= h.records)
+    {
+        goto out;
+    }
+    if (n > h.records - first)
+    {
+        n = h.records - first;
+    }
+
+    /* Finest level that answers in max_buckets */
+    int k = 0;
+    uint64_t lo, hi;
+    for (;; k++)
+    {
+        uint64_t span = (uint64_t)h.base << k;
+        lo = first / span;
+        hi = (first + n - 1) / span;
+        if (hi - lo + 1 <= max_buckets || k == (int)h.levels - 1)
+        {
+            break;
+        }
+    }
+
+    struct pyramid_level lv;
+    if (pread(fd, &lv, sizeof(lv), (off_t)(sizeof(h) + (size_t)k * sizeof(lv))) != (ssize_t)sizeof(lv) ||
+        lo >= lv.buckets)
+    {
+        got = -1;
+        goto out;
+    }
+    uint64_t count = hi - lo + 1;
+    count = count < max_buckets ? count : max_buckets;
+    count = count < lv.buckets - lo ? count : lv.buckets - lo;
+
+    size_t bytes = (size_t)count * sizeof(*out);
+    if (pread(fd, out, bytes, (off_t)(lv.offset + lo * sizeof(*out))) != (ssize_t)bytes)
+    {
+        got = -1;
+        goto out;
+    }
+    got = (long)count;
+    if (level)
+    {
+        *level = k;
+    }
+    if (first_bucket)
+    {
+        *first_bucket = lo;
+    }
+
+out:
+    close(fd);
+    return got;
+}
+
+/* ============================== JSON ============================= */
+
+/* Append to out[*len..cap); returns -1 once out is full */
+static int append(char *out, size_t cap, size_t *len, const char *fmt, ...)
+{
+    if (*len >= cap)
+    {
+        return -1;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(out + *len, cap - *len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= cap - *len)
+    {
+        *len = cap;
+        return -1;
+    }
+    *len += (size_t)n;
+    return 0;
+}
+
+size_t pyramid_encode_preview(const struct pyramid *p, const char *session,
+                              char *out, size_t cap)
+{
+    size_t len = 0;
+    int rc = append(out, cap, &len, "{\"session\":\"%s\",\"records\":%llu,\"preview\":{",
+                    session, (unsigned long long)p->records);
+
+    for (int c = 0; c < PYRAMID_CHANNELS && rc == 0; c++)
+    {
+        rc = append(out, cap, &len, "%s\"%s\":{\"t\":[", c ? "," : "", pyramid_channel_names[c]);
+        for (size_t i = 0; i < p->preview_points && rc == 0; i++)
+        {
+            rc = append(out, cap, &len, i ? ",%u" : "%u", p->preview[c][i].t);
+        }
+        rc = rc ? rc : append(out, cap, &len, "],\"v\":[");
+        for (size_t i = 0; i < p->preview_points && rc == 0; i++)
+        {
+            rc = append(out, cap, &len, i ? ",%.2f" : "%.2f", p->preview[c][i].v);
+        }
+        rc = rc ? rc : append(out, cap, &len, "]}");
+    }
+    rc = rc ? rc : append(out, cap, &len, "}}");
+    return rc == 0 ? len : 0;
+}
+
+size_t pyramid_encode_level(const struct pyramid *p, int level, const char *session,
+                            char *out, size_t cap)
+{
+    return pyramid_encode_buckets(p->level[level], p->buckets[level], level, 0, session, out,
+                                  cap);
+}
+
+size_t pyramid_encode_buckets(const struct pyramid_bucket *bk, size_t n, int level,
+                              uint64_t first, const char *session, char *out, size_t cap)
+{
+    size_t len = 0;
+    int rc = append(out, cap, &len,
+                    "{\"session\":\"%s\",\"level\":%d,\"records_per_bucket\":%llu,"
+                    "\"first\":%llu,\"t\":[",
+                    session, level, (unsigned long long)PYRAMID_BASE << level,
+                    (unsigned long long)first);
+    for (size_t i = 0; i < n && rc == 0; i++)
+    {
+        rc = append(out, cap, &len, i ? ",%u" : "%u", bk[i].t_first);
+    }
+    rc = rc ? rc : append(out, cap, &len, "]");
+
+    for (int c = 0; c < PYRAMID_CHANNELS && rc == 0; c++)
+    {
+        static const char *const stat[3] = {"min", "max", "mean"};
+        rc = append(out, cap, &len, ",\"%s\":{", pyramid_channel_names[c]);
+        for (int s = 0; s < 3 && rc == 0; s++)
+        {
+            rc = append(out, cap, &len, "%s\"%s\":[", s ? "," : "", stat[s]);
+            for (size_t i = 0; i < n && rc == 0; i++)
+            {
+                float v = s == 0 ? bk[i].min[c] : s == 1 ? bk[i].max[c] : bk[i].mean[c];
+                rc = append(out, cap, &len, i ? ",%.2f" : "%.2f", v);
+            }
+            rc = rc ? rc : append(out, cap, &len, "]");
+        }
+        rc = rc ? rc : append(out, cap, &len, "}");
+    }
+    rc = rc ? rc : append(out, cap, &len, "}");
+    return rc == 0 ? len : 0;
+}
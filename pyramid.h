@@ -0,0 +1,149 @@
+/*
+ * pyramid.h: per-session multi-resolution summary for zoomable dashboards
+ *
+ * Built while a session is decoded: level 0 holds min / max / mean of every
+ * PYRAMID_BASE records per channel, each level above halves the one below,
+ * up to a single bucket. An LTTB preview of PYRAMID_PREVIEW points per
+ * channel keeps the shape of the whole session for a first paint.
+ *
+ * File layout (PYRAMID_FILE in the session directory, little-endian):
+ *   struct pyramid_header
+ *   struct pyramid_level[levels]
+ *   per level, its buckets (struct pyramid_bucket)
+ *   PYRAMID_CHANNELS previews of preview_points struct pyramid_point
+ * Bucket i of level k covers records [i * (base << k), (i + 1) * (base << k)),
+ * so any record range is read at a suitable level with one pread.
+ */
+
+#ifndef WEARABLE_PYRAMID_H
+#define WEARABLE_PYRAMID_H
+
+#include "record.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PYRAMID_FILE "pyramid.bin"
+#define PYRAMID_MAGIC "WDPYRMD"
+#define PYRAMID_VERSION 1
+
+/* Records per level 0 bucket; a multiple of 16 */
+#ifndef PYRAMID_BASE
+#define PYRAMID_BASE 64
+#endif
+
+/* LTTB points per channel in the preview */
+#ifndef PYRAMID_PREVIEW
+#define PYRAMID_PREVIEW 512
+#endif
+
+/* Levels with at most this many buckets are published right after the
+ * session summary, coarsest first */
+#ifndef PYRAMID_PUBLISH_BUCKETS
+#define PYRAMID_PUBLISH_BUCKETS 256
+#endif
+
+/* JSON buffer for the preview or one published level */
+#define PYRAMID_JSON_CAP                                                       \
+    (4096 + PYRAMID_CHANNELS * 48 *                                            \
+                (PYRAMID_PREVIEW > PYRAMID_PUBLISH_BUCKETS ? PYRAMID_PREVIEW   \
+                                                           : PYRAMID_PUBLISH_BUCKETS))
+
+#if PYRAMID_BASE % 16 != 0
+#error "PYRAMID_BASE must be a multiple of 16"
+#endif
+
+/* pressure_pa, then the IMU channels in imu_channel_names order */
+#define PYRAMID_CHANNELS (1 + IMU_CHANNELS)
+#define PYRAMID_MAX_LEVELS 40
+
+extern const char *const pyramid_channel_names[PYRAMID_CHANNELS];
+
+struct pyramid_bucket
+{
+    uint32_t t_first; /* timestamp_ms of the first and last record */
+    uint32_t t_last;
+    uint32_t count; /* records; only the last bucket of a level is short */
+    float min[PYRAMID_CHANNELS];
+    float max[PYRAMID_CHANNELS];
+    float mean[PYRAMID_CHANNELS];
+};
+
+struct pyramid_point
+{
+    uint32_t t;
+    float v;
+};
+
+struct pyramid_level
+{
+    uint64_t offset; /* of the first bucket, from the start of the file */
+    uint64_t buckets;
+};
+
+struct pyramid_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t channels;
+    uint32_t base;
+    uint32_t levels;
+    uint64_t records;
+    uint64_t preview_offset;
+    uint32_t preview_points; /* per channel */
+    uint32_t reserved;
+};
+
+/* Builder state for one session */
+struct pyramid
+{
+    struct pyramid_bucket *level[PYRAMID_MAX_LEVELS];
+    size_t buckets[PYRAMID_MAX_LEVELS];
+    size_t cap0; /* allocated level 0 buckets */
+    int levels;
+    uint64_t records;
+    struct pyramid_point *preview[PYRAMID_CHANNELS];
+    size_t preview_points;
+
+    /* level 0 bucket being filled, 16 lanes per channel */
+    size_t fill;
+    uint32_t t_first, t_last;
+    float lane_min[PYRAMID_CHANNELS][16];
+    float lane_max[PYRAMID_CHANNELS][16];
+    float lane_sum[PYRAMID_CHANNELS][16];
+};
+
+void pyramid_init(struct pyramid *p);
+
+/* Fold a decoded batch in; batches must come in session order.
+ * Returns 0, -1 out of memory. */
+int pyramid_add(struct pyramid *p, const struct record_batch *b);
+
+/* Close the last bucket, build the upper levels and the preview */
+int pyramid_finish(struct pyramid *p);
+
+/* Write PYRAMID_FILE into dir (via a temporary file + rename) */
+int pyramid_write(const struct pyramid *p, const char *dir);
+
+void pyramid_free(struct pyramid *p);
+
+/* JSON for MQTT: the preview, and one level as column arrays.
+ * Return the length, 0 if cap is too small. */
+size_t pyramid_encode_preview(const struct pyramid *p, const char *session,
+                              char *out, size_t cap);
+size_t pyramid_encode_level(const struct pyramid *p, int level, const char *session,
+                            char *out, size_t cap);
+
+/* The same for n buckets of a level read back with pyramid_query; first is
+ * the index of the first one in the level */
+size_t pyramid_encode_buckets(const struct pyramid_bucket *bk, size_t n, int level,
+                              uint64_t first, const char *session, char *out, size_t cap);
+
+/* Read the buckets covering records [first, first + n) of a session's
+ * PYRAMID_FILE at the finest level that needs no more than max_buckets
+ * of them. Returns the bucket count (written to out), the level used and
+ * the index of the first bucket in it, -1 on error. */
+long pyramid_query(const char *path, uint64_t first, uint64_t n, size_t max_buckets,
+                   struct pyramid_bucket *out, int *level, uint64_t *first_bucket);
+
+#endif /* WEARABLE_PYRAMID_H */
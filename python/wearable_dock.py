@@ -0,0 +1,274 @@
+"""
+wearable_dock.py: numpy access to session .BIN files with the dock's own code
+
+    import wearable_dock as wd
+
+    with wd.Archive("extracted/archive/20240501_101500/logs/LOG0001.BIN") as a:
+        raw = a.records                 # structured array over the mapping, no copy
+        acc_x = a.column("acc_x")       # strided int16 view, no copy
+        d = a.decode(quality=True)      # float SoA exactly as decode_batch / quality_run
+
+The record layout comes from the schema registry in record.c and every
+conversion runs through the compiled decoder, so nothing here restates
+the firmware format. Build the extension first with ``make python``.
+"""
+
+import os
+import threading
+
+import numpy as np
+
+from _wearable_dock import ffi, lib
+
+__all__ = [
+    "Archive",
+    "dtype",
+    "schema",
+    "list_bins",
+    "session",
+    "merkle_leaf",
+    "merkle_path_root",
+    "SCHEMA_VERSION",
+]
+
+SCHEMA_VERSION = lib.RECORD_SCHEMA_VERSION
+RECORD_SIZE = lib.RECORD_SIZE
+IMU_CHANNELS = [ffi.string(lib.imu_channel_names[c]).decode() for c in range(lib.IMU_CHANNELS)]
+QUALITY_FLAGS = [ffi.string(lib.quality_flag_names[f]).decode() for f in range(lib.QUALITY_FLAGS)]
+
+_NUMPY_TYPE = {lib.RECORD_U8: "u1", lib.RECORD_I16: "<i2", lib.RECORD_U32: "<u4"}
+
+
+def schema():
+    """The record fields as (name, offset, numpy type, scale) tuples"""
+    return [
+        (ffi.string(f.name).decode(), f.offset, _NUMPY_TYPE[f.type], f.scale)
+        for f in (lib.record_fields[i] for i in range(lib.RECORD_FIELDS))
+    ]
+
+
+def _make_dtype():
+    fields = schema()
+    return np.dtype(
+        {
+            "names": [f[0] for f in fields],
+            "formats": [f[2] for f in fields],
+            "offsets": [f[1] for f in fields],
+            "itemsize": RECORD_SIZE,
+        }
+    )
+
+
+dtype = _make_dtype()
+_SCALE = {f[0]: f[3] for f in schema()}
+
+
+class _MappedBuffer:
+    """Exposes part of a mapping to numpy; arrays built on it keep it (and
+    so the mapping) alive through their .base"""
+
+    def __init__(self, owner, addr, shape, typestr, descr=None, strides=None):
+        self._owner = owner
+        self.__array_interface__ = {
+            "version": 3,
+            "data": (addr, True),
+            "shape": shape,
+            "typestr": typestr,
+            "strides": strides,
+        }
+        if descr is not None:
+            self.__array_interface__["descr"] = descr
+
+
+# One decoder (and its worker threads) for the process, used by one
+# Archive.decode at a time
+_decoder = None
+_decoder_lock = threading.Lock()
+
+
+def _get_decoder():
+    global _decoder
+    if _decoder is None:
+        d = lib.decoder_new()
+        if d == ffi.NULL:
+            raise MemoryError("decoder_new failed")
+        _decoder = ffi.gc(d, lib.decoder_free)
+    return _decoder
+
+
+class Archive:
+    """A read-only, validated mapping of one .BIN file (archive_map_open)"""
+
+    def __init__(self, path):
+        m = lib.archive_map_open(os.fsencode(path))
+        if m == ffi.NULL:
+            errno = ffi.errno
+            raise OSError(errno, os.strerror(errno), path)
+        self.path = path
+        self._map = ffi.gc(m, lib.archive_map_release)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def close(self):
+        """Drop this handle's reference; arrays already handed out keep the
+        mapping until they are gone"""
+        self._map = None
+
+    def __len__(self):
+        return self._map.records
+
+    @property
+    def trailing(self):
+        """Bytes of a torn last record, not part of the records"""
+        return self._map.trailing
+
+    @property
+    def first_ts(self):
+        return self._map.first_ts
+
+    @property
+    def last_ts(self):
+        return self._map.last_ts
+
+    @property
+    def ts_monotonic(self):
+        return bool(self._map.ts_monotonic)
+
+    @property
+    def records(self):
+        """Every record as a read-only structured array over the mapping"""
+        n = self._map.records
+        if n == 0:
+            return np.empty(0, dtype=dtype)
+        addr = int(ffi.cast("uintptr_t", self._map.data))
+        buf = _MappedBuffer(self._map, addr, (n,), "|V%d" % RECORD_SIZE, descr=dtype.descr)
+        arr = np.asarray(buf).view(dtype)
+        arr.flags.writeable = False
+        return arr
+
+    def column(self, name, scaled=False):
+        """One field as a strided, zero-copy view; scaled=True returns a
+        float32 copy in physical units (raw / scale, as the dock computes)"""
+        col = self.records[name]
+        if scaled:
+            return col.astype(np.float32) / np.float32(_SCALE[name])
+        return col
+
+    def lower_bound(self, ts):
+        """Index of the first record with timestamp_ms >= ts"""
+        if not self._map.ts_monotonic:
+            raise ValueError("%s: timestamps are not monotonic" % self.path)
+        return lib.archive_map_lower_bound(self._map, ts)
+
+    def decode(self, first=0, n=None, quality=False):
+        """Decode records [first, first + n) through the dock's parallel
+        decoder. Returns a dict of numpy arrays (timestamp_ms, pressure_pa,
+        label, imu_raw, imu and, with quality=True, quality plus
+        quality_score), shaped like struct record_batch."""
+        total = self._map.records
+        first = min(max(first, 0), total)
+        n = total - first if n is None else min(max(n, 0), total - first)
+
+        out = {
+            "timestamp_ms": np.empty(n, np.uint32),
+            "pressure_pa": np.empty(n, np.float32),
+            "label": np.empty(n, np.uint8),
+            "imu_raw": np.empty((lib.IMU_CHANNELS, n), np.int16),
+            "imu": np.empty((lib.IMU_CHANNELS, n), np.float32),
+        }
+        qs = None
+        if quality:
+            out["quality"] = np.empty((lib.IMU_CHANNELS, n), np.uint8)
+            qs = ffi.new("struct quality_state *")
+            lib.quality_init(qs)
+
+        if n:
+            with _decoder_lock:
+                self._decode_into(out, first, n, qs)
+        if quality:
+            out["quality_score"] = lib.quality_score(qs)
+        return out
+
+    def _decode_into(self, out, first, n, qs):
+        d = _get_decoder()
+        lib.decoder_open(d, self._map, first)
+        try:
+            done = 0
+            while done < n:
+                b = lib.decoder_next(d)
+                if b == ffi.NULL:
+                    break
+                k = min(b.n, n - done)
+                b.n = k
+                if qs is not None:
+                    lib.quality_run(qs, b)
+                _copy_batch(b, k, out, done)
+                lib.decoder_release(d)
+                done += k
+        finally:
+            lib.decoder_close(d)
+
+
+def _copy_batch(b, k, out, at):
+    s = slice(at, at + k)
+    out["timestamp_ms"][s] = np.frombuffer(ffi.buffer(b.timestamp_ms, 4 * k), np.uint32)
+    out["pressure_pa"][s] = np.frombuffer(ffi.buffer(b.pressure_pa, 4 * k), np.float32)
+    out["label"][s] = np.frombuffer(ffi.buffer(b.label, k), np.uint8)
+    for c in range(lib.IMU_CHANNELS):
+        out["imu_raw"][c, s] = np.frombuffer(ffi.buffer(b.imu_raw[c], 2 * k), np.int16)
+        out["imu"][c, s] = np.frombuffer(ffi.buffer(b.imu[c], 4 * k), np.float32)
+        if "quality" in out:
+            out["quality"][c, s] = np.frombuffer(ffi.buffer(b.quality[c], k), np.uint8)
+
+
+def list_bins(directory):
+    """Sorted .BIN names in a session's logs directory (archive_list_bins)"""
+    names = ffi.new("char ***")
+    n = lib.archive_list_bins(os.fsencode(directory), names)
+    if n < 0:
+        errno = ffi.errno
+        raise OSError(errno, os.strerror(errno), directory)
+    try:
+        return [ffi.string(names[0][i]).decode() for i in range(n)]
+    finally:
+        lib.archive_free_list(names[0], n)
+
+
+def merkle_leaf(records):
+    """Leaf hash of archived records (bytes, RECORD_SIZE each), as the
+    dock's tree and the gap-fill "raw" encoding hold them"""
+    records = bytes(records)
+    if len(records) % RECORD_SIZE:
+        raise ValueError("%d bytes are not whole records" % len(records))
+    out = ffi.new("uint8_t[]", lib.MERKLE_HASH)
+    lib.merkle_leaf(records, len(records) // RECORD_SIZE, out)
+    return bytes(ffi.buffer(out))
+
+
+def merkle_path_root(leaf, block, blocks, path):
+    """Root recomputed from a block's leaf hash and its audit path (hashes
+    as bytes or hex, leaves first), as a gap-fill "proof" reply gives them;
+    compare it with the session's root"""
+    hashes = [bytes.fromhex(h) if isinstance(h, str) else bytes(h) for h in path]
+    leaf = bytes.fromhex(leaf) if isinstance(leaf, str) else bytes(leaf)
+    if any(len(h) != lib.MERKLE_HASH for h in hashes + [leaf]):
+        raise ValueError("hashes must be %d bytes" % lib.MERKLE_HASH)
+    buf = ffi.new("uint8_t[][%d]" % lib.MERKLE_HASH, max(len(hashes), 1))
+    ffi.memmove(buf, b"".join(hashes), lib.MERKLE_HASH * len(hashes))
+    root = ffi.new("uint8_t[]", lib.MERKLE_HASH)
+    if lib.merkle_path_root(leaf, block, blocks, buf, len(hashes), root) != 0:
+        raise ValueError("path of %d does not fit block %d of %d" % (len(hashes), block, blocks))
+    return bytes(ffi.buffer(root))
+
+
+def session(directory):
+    """Archive for every .BIN file of a session directory, in order"""
+    logs = os.path.join(directory, "logs")
+    if os.path.isdir(logs):
+        directory = logs
+    for name in list_bins(directory):
+        yield Archive(os.path.join(directory, name))
@@ -0,0 +1,124 @@
+"""
+wearable_dock_build.py: cffi builder for the _wearable_dock extension
+
+Compiles the dock's own record decoder, archive reader, parallel decoder
+and Merkle hashing into a Python extension, so offline analysis decodes
+and verifies exactly as the dock does. Run from this directory (or ``make python`` at the top):
+
+    python3 wearable_dock_build.py
+
+Needs a C compiler, the Python headers, libcrypto, cffi and (to use it)
+numpy.
+"""
+
+import os
+
+from cffi import FFI
+
+TOP = os.path.normpath(os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+SOURCES = ["archive_map.c", "arena.c", "decoder.c", "merkle.c", "record.c", "util.c"]
+
+ffibuilder = FFI()
+
+ffibuilder.cdef(
+    """
+    #define RECORD_SIZE ...
+    #define IMU_CHANNELS ...
+    #define BATCH_RECORDS ...
+    #define RECORD_SCHEMA_VERSION ...
+    #define RECORD_FIELDS ...
+    #define QUALITY_FLAGS ...
+
+    enum record_type { RECORD_U8, RECORD_I16, RECORD_U32, ... };
+
+    struct record_field
+    {
+        const char *name;
+        unsigned offset;
+        enum record_type type;
+        float scale;
+    };
+
+    extern const struct record_field record_fields[];
+    extern const char *const imu_channel_names[];
+    extern const char *const quality_flag_names[];
+
+    struct record_batch
+    {
+        size_t n;
+        uint32_t timestamp_ms[...];
+        float pressure_pa[...];
+        uint32_t pressure_raw[...];
+        uint8_t label[...];
+        int16_t imu_raw[...][...];
+        float imu[...][...];
+        uint8_t quality[...][...];
+        ...;
+    };
+
+    struct quality_state
+    {
+        uint64_t records;
+        uint64_t clean;
+        uint64_t flagged[...][...];
+        ...;
+    };
+
+    void decode_batch(const uint8_t *buf, size_t n, struct record_batch *b);
+    void quality_init(struct quality_state *qs);
+    size_t quality_run(struct quality_state *qs, struct record_batch *b);
+    double quality_score(const struct quality_state *qs);
+
+    struct archive_map
+    {
+        const uint8_t *data;
+        size_t size;
+        size_t records;
+        size_t trailing;
+        uint32_t first_ts;
+        uint32_t last_ts;
+        int ts_monotonic;
+        ...;
+    };
+
+    const struct archive_map *archive_map_open(const char *path);
+    void archive_map_release(const struct archive_map *m);
+    void archive_map_trim(void);
+    size_t archive_map_lower_bound(const struct archive_map *m, uint32_t ts);
+    int archive_list_bins(const char *dir, char ***names);
+    void archive_free_list(char **names, int n);
+
+    struct decoder;
+    struct decoder *decoder_new(void);
+    void decoder_open(struct decoder *d, const struct archive_map *am, size_t first);
+    struct record_batch *decoder_next(struct decoder *d);
+    void decoder_release(struct decoder *d);
+    void decoder_close(struct decoder *d);
+    void decoder_free(struct decoder *d);
+
+    #define MERKLE_HASH ...
+    #define MERKLE_BLOCK_RECORDS ...
+
+    void merkle_leaf(const uint8_t *data, size_t n, uint8_t *out);
+    int merkle_path_root(const uint8_t *leaf, uint64_t block, uint64_t blocks,
+                         const uint8_t (*path)[32], int n, uint8_t *root);
+    """
+)
+
+ffibuilder.set_source(
+    "_wearable_dock",
+    """
+    #include "archive_map.h"
+    #include "decoder.h"
+    #include "merkle.h"
+    #include "record.h"
+    """,
+    sources=[os.path.join(TOP, s) for s in SOURCES],
+    include_dirs=[TOP],
+    extra_compile_args=["-std=gnu11", "-O2", "-pthread"],
+    extra_link_args=["-pthread"],
+    libraries=["crypto"],
+)
+
+if __name__ == "__main__":
+    ffibuilder.compile(tmpdir="build", target="../_wearable_dock.*", verbose=True)
@@ -0,0 +1,64 @@
+/*
+ * quant.h: bounded-error quantised, bit-packed batch encoding
+ *
+ * Used by TOPIC_LAYOUT_PACKED. IMU channels are quantised to the coarsest
+ * step that stays within QUANT_MAX_ERR of the 0.01-unit samples; every
+ * column is then delta coded and packed at the narrowest bit width that
+ * holds the batch.
+ *
+ * Message layout (little-endian):
+ *   u8  version (QUANT_VERSION)
+ *   u8  fields  (FIELD_* bits of the columns that follow)
+ *   u16 records
+ *   u8  session name length, then the name
+ *   per column, in order timestamp_ms, pressure (Pa * 100), label,
+ *   acc x y z, gyr x y z (IMU in raw 1 / IMU_SCALE units):
+ *     u16 step   quantisation step, 1 = lossless
+ *     u8  width  bits per delta, 0..32
+ *     i32 first  first quantised value
+ *     (records - 1) zig-zag coded deltas of width bits, LSB first,
+ *     padded to a whole byte
+ *   A value is (first + sum of the deltas so far) * step.
+ */
+
+#ifndef WEARABLE_QUANT_H
+#define WEARABLE_QUANT_H
+
+#include "record.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define QUANT_VERSION 1
+
+/* Maximum absolute error per IMU channel in physical units, acc x,y,z
+ * (m/s^2) then gyr x,y,z; 0 keeps that channel lossless */
+#ifndef QUANT_MAX_ERR
+#define QUANT_MAX_ERR "0.05,0.05,0.05,0.5,0.5,0.5"
+#endif
+
+/* Worst case: header, session name and nine 32-bit columns */
+#define QUANT_COLUMNS (3 + IMU_CHANNELS)
+#define QUANT_PAYLOAD_CAP (5 + 255 + QUANT_COLUMNS * (7 + BATCH_RECORDS * 4))
+
+struct quant
+{
+    int32_t step[IMU_CHANNELS]; /* odd, in raw units */
+
+    /* scratch for one column of one batch */
+    uint16_t idx[BATCH_RECORDS];
+    int32_t x[BATCH_RECORDS];
+    int32_t q[BATCH_RECORDS];
+    uint32_t z[BATCH_RECORDS];
+};
+
+/* Parse a comma-separated QUANT_MAX_ERR. Returns 0, -1 if malformed. */
+int quant_parse(const char *spec, struct quant *qt);
+
+/* Encode the records of b with sel[i] = 1 and the columns in fields into
+ * out, which holds QUANT_PAYLOAD_CAP bytes. Returns the message length,
+ * 0 if no record is selected. */
+size_t quant_encode(struct quant *qt, const struct record_batch *b, const uint8_t *sel,
+                    unsigned fields, const char *session, uint8_t *out);
+
+#endif /* WEARABLE_QUANT_H */
@@ -0,0 +1,238 @@
+/*
+ * record.c: firmware record decode into SoA batches + sample quality stage
+ *
+ * The quality stage flags, per IMU channel, samples that are pinned at the
+ * int16 limits (saturated), unchanged for too long (stuck) or outside the
+ * sensor's physical range. Loops run over whole 16-sample groups of the
+ * fixed-size batch arrays so the compiler vectorises them at -O2.
+ */
+
+#include "record.h"
+
+#include <stddef.h>
+#include <string.h>
+
+const char *const imu_channel_names[IMU_CHANNELS] = {
+    "acc_x", "acc_y", "acc_z", "gyr_x", "gyr_y", "gyr_z"};
+
+const char *const quality_flag_names[QUALITY_FLAGS] = {
+    "saturated", "stuck", "range"};
+
+const struct record_field record_fields[RECORD_FIELDS] = {
+    {"timestamp_ms", offsetof(struct raw_record, timestamp_ms), RECORD_U32, 1.0f},
+    {"pressure_pa", offsetof(struct raw_record, pressure_pa), RECORD_U32, 100.0f},
+    {"label", offsetof(struct raw_record, label), RECORD_U8, 1.0f},
+    {"acc_x", offsetof(struct raw_record, imu[0]), RECORD_I16, IMU_SCALE},
+    {"acc_y", offsetof(struct raw_record, imu[1]), RECORD_I16, IMU_SCALE},
+    {"acc_z", offsetof(struct raw_record, imu[2]), RECORD_I16, IMU_SCALE},
+    {"gyr_x", offsetof(struct raw_record, imu[3]), RECORD_I16, IMU_SCALE},
+    {"gyr_y", offsetof(struct raw_record, imu[4]), RECORD_I16, IMU_SCALE},
+    {"gyr_z", offsetof(struct raw_record, imu[5]), RECORD_I16, IMU_SCALE}};
+
+#if BATCH_RECORDS % 16 != 0
+#error "BATCH_RECORDS must be a multiple of 16"
+#endif
+
+/* ============================= DECODE ============================ */
+
+/* Pad to whole vector groups and scale the IMU channels */
+static void decode_finish(size_t n, struct record_batch *b)
+{
+    size_t nv = (n + 15) & ~(size_t)15;
+    for (size_t i = n; i < nv; i++)
+    {
+        for (int c = 0; c < IMU_CHANNELS; c++)
+        {
+            b->imu_raw[c][i] = 0;
+        }
+    }
+
+    for (int c = 0; c < IMU_CHANNELS; c++)
+    {
+        for (size_t i = 0; i < nv; i++)
+        {
+            b->imu[c][i] = b->imu_raw[c][i] / IMU_SCALE;
+        }
+    }
+
+    b->n = n;
+}
+
+static void decode_rows(const uint8_t *buf, size_t n, struct record_batch *b)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        const uint8_t *r = buf + i * RECORD_SIZE;
+        memcpy(&b->timestamp_ms[i], r, 4);
+        memcpy(&b->pressure_raw[i], r + 4, 4);
+        b->pressure_pa[i] = b->pressure_raw[i] / 100.0f;
+        b->label[i] = r[8];
+
+        for (int c = 0; c < IMU_CHANNELS; c++)
+        {
+            memcpy(&b->imu_raw[c][i], r + 9 + 2 * c, 2);
+        }
+    }
+    decode_finish(n, b);
+}
+
+/* Each pass writes one array sequentially; better on cores that track
+ * few write streams */
+static void decode_columns(const uint8_t *buf, size_t n, struct record_batch *b)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        memcpy(&b->timestamp_ms[i], buf + i * RECORD_SIZE, 4);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        memcpy(&b->pressure_raw[i], buf + i * RECORD_SIZE + 4, 4);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        b->pressure_pa[i] = b->pressure_raw[i] / 100.0f;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        b->label[i] = buf[i * RECORD_SIZE + 8];
+    }
+    for (int c = 0; c < IMU_CHANNELS; c++)
+    {
+        const uint8_t *src = buf + 9 + 2 * c;
+        int16_t *dst = b->imu_raw[c];
+        for (size_t i = 0; i < n; i++)
+        {
+            memcpy(&dst[i], src + i * RECORD_SIZE, 2);
+        }
+    }
+    decode_finish(n, b);
+}
+
+const char *const decode_variant_names[DECODE_VARIANTS] = {"rows", "columns"};
+
+static void (*const decode_variants[DECODE_VARIANTS])(const uint8_t *, size_t,
+                                                      struct record_batch *) = {
+    decode_rows, decode_columns};
+
+static enum decode_variant decode_variant = DECODE_ROWS;
+
+void decode_select(enum decode_variant v)
+{
+    decode_variant = v;
+}
+
+void decode_batch(const uint8_t *buf, size_t n, struct record_batch *b)
+{
+    decode_variants[decode_variant](buf, n, b);
+}
+
+/* ============================ QUALITY ============================ */
+
+static int16_t range_limit(int c)
+{
+    float lim = (c < 3 ? QUALITY_ACC_MAX : QUALITY_GYR_MAX) * IMU_SCALE;
+    return lim >= INT16_MAX ? INT16_MAX : (int16_t)lim;
+}
+
+/* Saturation + range: branch-free so it vectorises */
+static void flag_limits(const int16_t *restrict v, uint8_t *restrict q,
+                        size_t nv, int16_t lim)
+{
+    for (size_t i = 0; i < nv; i++)
+    {
+        q[i] = (uint8_t)(((v[i] == INT16_MAX) | (v[i] == INT16_MIN)) * QUALITY_SATURATED |
+                         ((v[i] > lim) | (v[i] < -lim)) * QUALITY_RANGE);
+    }
+}
+
+void quality_init(struct quality_state *qs)
+{
+    memset(qs, 0, sizeof(*qs));
+}
+
+size_t quality_run(struct quality_state *qs, struct record_batch *b)
+{
+    size_t n = b->n;
+    size_t nv = (n + 15) & ~(size_t)15; /* whole vector groups */
+
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    for (int c = 0; c < IMU_CHANNELS; c++)
+    {
+        const int16_t *v = b->imu_raw[c];
+        uint8_t *q = b->quality[c];
+
+        flag_limits(v, q, nv, range_limit(c));
+
+        /* Stuck: run length of identical values, carried across batches */
+        uint32_t run = qs->have_last ? qs->run[c] : 0;
+        int16_t prev = qs->have_last ? qs->last[c] : (int16_t)~v[0];
+
+        for (size_t i = 0; i < n; i++)
+        {
+            run = (v[i] == prev) ? run + 1 : 1;
+            prev = v[i];
+            if (run >= QUALITY_STUCK_RUN)
+            {
+                q[i] |= QUALITY_STUCK;
+            }
+        }
+
+        qs->run[c] = run;
+        qs->last[c] = prev;
+
+        for (size_t i = n; i < nv; i++)
+        {
+            q[i] = 0;
+        }
+    }
+    qs->have_last = 1;
+
+    /* Per-record OR of all channels, then counters */
+    size_t bad_records = 0;
+    uint64_t bad_samples = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint8_t any = 0;
+        for (int c = 0; c < IMU_CHANNELS; c++)
+        {
+            any |= b->quality[c][i];
+            bad_samples += b->quality[c][i] != 0;
+        }
+        bad_records += any != 0;
+    }
+
+    if (bad_samples)
+    {
+        for (int c = 0; c < IMU_CHANNELS; c++)
+        {
+            const uint8_t *q = b->quality[c];
+            for (int f = 0; f < QUALITY_FLAGS; f++)
+            {
+                uint64_t cnt = 0;
+                for (size_t i = 0; i < nv; i++)
+                {
+                    cnt += (q[i] >> f) & 1;
+                }
+                qs->flagged[c][f] += cnt;
+            }
+        }
+    }
+
+    qs->records += n;
+    qs->clean += (uint64_t)n * IMU_CHANNELS - bad_samples;
+    return bad_records;
+}
+
+double quality_score(const struct quality_state *qs)
+{
+    if (qs->records == 0)
+    {
+        return 1.0;
+    }
+    return (double)qs->clean / ((double)qs->records * IMU_CHANNELS);
+}
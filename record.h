@@ -0,0 +1,134 @@
+/*
+ * record.h: firmware record format, SoA batch decode and sample quality
+ */
+
+#ifndef WEARABLE_RECORD_H
+#define WEARABLE_RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Binary record from firmware:
+ *   uint32_t timestamp_ms;
+ *   uint32_t pressure_pa;
+ *   uint8_t  label;
+ *   int16_t  imu[6];
+ */
+#define RECORD_SIZE (4 + 4 + 1 + 6 * 2)
+#define IMU_SCALE 100.0f
+#define IMU_CHANNELS 6
+
+/* The same record as a typed, unaligned view (little-endian host) */
+struct __attribute__((packed)) raw_record
+{
+    uint32_t timestamp_ms;
+    uint32_t pressure_pa; /* Pa * 100 */
+    uint8_t label;
+    int16_t imu[IMU_CHANNELS];
+};
+
+_Static_assert(sizeof(struct raw_record) == RECORD_SIZE, "raw_record must match RECORD_SIZE");
+
+/* Schema registry: the record layout as data, for readers that are not
+ * compiled against raw_record (the Python bindings build their numpy
+ * dtype from it). Bump RECORD_SCHEMA_VERSION with any layout change. */
+#define RECORD_SCHEMA_VERSION 1
+#define RECORD_FIELDS (3 + IMU_CHANNELS)
+
+enum record_type
+{
+    RECORD_U8,
+    RECORD_I16,
+    RECORD_U32,
+};
+
+struct record_field
+{
+    const char *name;
+    unsigned offset; /* bytes into the record */
+    enum record_type type;
+    float scale; /* decoded value = raw / scale, as decode_batch does */
+};
+
+extern const struct record_field record_fields[RECORD_FIELDS];
+
+/* Records decoded per batch */
+#ifndef BATCH_RECORDS
+#define BATCH_RECORDS 1024
+#endif
+
+/* Quality thresholds (physical units after IMU_SCALE) */
+#ifndef QUALITY_ACC_MAX
+#define QUALITY_ACC_MAX 160.0f /* ~16 g in m/s^2 */
+#endif
+#ifndef QUALITY_GYR_MAX
+#define QUALITY_GYR_MAX 300.0f
+#endif
+
+/* Identical consecutive samples before a channel counts as stuck */
+#ifndef QUALITY_STUCK_RUN
+#define QUALITY_STUCK_RUN 32
+#endif
+
+/* Per-sample, per-channel quality flags */
+#define QUALITY_SATURATED 0x01 /* pinned at INT16_MIN / INT16_MAX */
+#define QUALITY_STUCK 0x02     /* unchanged for QUALITY_STUCK_RUN samples */
+#define QUALITY_RANGE 0x04     /* outside the physical limit */
+#define QUALITY_FLAGS 3
+
+/* Channel order in imu[] / imu_raw[]: acc x,y,z then gyr x,y,z */
+extern const char *const imu_channel_names[IMU_CHANNELS];
+extern const char *const quality_flag_names[QUALITY_FLAGS];
+
+/* Structure-of-arrays view of up to BATCH_RECORDS decoded records */
+struct record_batch
+{
+    size_t n;
+    uint32_t timestamp_ms[BATCH_RECORDS];
+    float pressure_pa[BATCH_RECORDS];
+    uint32_t pressure_raw[BATCH_RECORDS]; /* Pa * 100, as logged */
+    uint8_t label[BATCH_RECORDS];
+    int16_t imu_raw[IMU_CHANNELS][BATCH_RECORDS];
+    float imu[IMU_CHANNELS][BATCH_RECORDS];
+    uint8_t quality[IMU_CHANNELS][BATCH_RECORDS];
+};
+
+/* Running quality state, carried across batches of one session */
+struct quality_state
+{
+    int16_t last[IMU_CHANNELS];
+    uint32_t run[IMU_CHANNELS];
+    int have_last;
+    uint64_t records;
+    uint64_t clean;                                /* channel-samples without any flag */
+    uint64_t flagged[IMU_CHANNELS][QUALITY_FLAGS]; /* per channel, per flag */
+};
+
+/* Decode n packed records from buf into b (n <= BATCH_RECORDS) */
+void decode_batch(const uint8_t *buf, size_t n, struct record_batch *b);
+
+/* decode_batch implementations, identical output: record by record, or
+ * one field at a time over the whole batch */
+enum decode_variant
+{
+    DECODE_ROWS,
+    DECODE_COLUMNS,
+    DECODE_VARIANTS
+};
+
+extern const char *const decode_variant_names[DECODE_VARIANTS];
+
+/* Implementation used by decode_batch from now on; set before decoding
+ * starts on other threads */
+void decode_select(enum decode_variant v);
+
+void quality_init(struct quality_state *qs);
+
+/* Fill b->quality and update the running counters.
+ * Returns the number of records with at least one flag. */
+size_t quality_run(struct quality_state *qs, struct record_batch *b);
+
+/* Fraction of clean channel-samples seen so far, 1.0 when empty */
+double quality_score(const struct quality_state *qs);
+
+#endif /* WEARABLE_RECORD_H */
@@ -0,0 +1,801 @@
+/*
+ * s3_upload.c: background multipart upload of archived sessions to an
+ * S3-compatible object store
+ *
+ * The queue lives on disk next to the archive, so it survives restarts:
+ *   <archive>/.s3/<session>.pending   archived, not packed yet
+ *   <archive>/.s3/<session>.tar.gz    packed object being uploaded
+ *   <archive>/.s3/<session>.state     upload id + finished parts (resume)
+ *   <archive>/.s3/<session>.done      object completed
+ *
+ * Each object is sent as an S3 multipart upload with S3_PARALLEL parts in
+ * flight, one curl handle per worker. Every part carries Content-MD5 and
+ * x-amz-content-sha256; requests are signed by libcurl (SigV4, >= 7.75).
+ */
+
+#define _GNU_SOURCE
+#include "s3_upload.h"
+#include "util.h"
+
+#include <curl/curl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define S3_QUEUE_DIR ".s3"
+#define S3_MAX_PARTS 10000
+#define S3_ETAG_MAX 80
+#define S3_PART_RETRIES 3
+#define S3_RESP_MAX (64 * 1024)
+
+/* One object being uploaded */
+struct s3_object
+{
+    int fd;
+    off_t size;
+    size_t part_size;
+    unsigned nparts;
+    unsigned next; /* next part index to hand out */
+    char url[PATH_MAX];
+    char upload_id[256]; /* URL-escaped */
+    char (*etag)[S3_ETAG_MAX];
+    FILE *state;
+    int failed; /* 0, -1 = transient, -2 = upload id gone */
+    pthread_mutex_t lock;
+};
+
+struct s3_resp
+{
+    char *body;
+    size_t len;
+    char etag[S3_ETAG_MAX];
+};
+
+static struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t kick;
+    bool running;
+    bool kicked;
+    volatile bool quit;
+    char queue_dir[PATH_MAX];
+    char archive_base[PATH_MAX];
+    char key_prefix[256];
+    char userpwd[512];
+} s3 = {.lock = PTHREAD_MUTEX_INITIALIZER, .kick = PTHREAD_COND_INITIALIZER};
+
+/* ============================= HASHES ============================ */
+
+/* md5_b64: 25 bytes, sha_hex: 65 bytes */
+static int part_digests(const void *buf, size_t len, char *md5_b64, char *sha_hex)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+
+    if (!EVP_Digest(buf, len, md, &md_len, EVP_md5(), NULL))
+    {
+        return -1;
+    }
+    EVP_EncodeBlock((unsigned char *)md5_b64, md, (int)md_len);
+
+    if (!EVP_Digest(buf, len, md, &md_len, EVP_sha256(), NULL))
+    {
+        return -1;
+    }
+    hex_encode(md, md_len, sha_hex);
+    return 0;
+}
+
+/* ============================== HTTP ============================= */
+
+static size_t resp_write(char *ptr, size_t size, size_t nmemb, void *ud)
+{
+    struct s3_resp *r = ud;
+    size_t n = size * nmemb;
+
+    if (r->len + n + 1 > S3_RESP_MAX)
+    {
+        return n; /* keep the head of large bodies only */
+    }
+    char *nb = realloc(r->body, r->len + n + 1);
+    if (!nb)
+    {
+        return 0;
+    }
+    memcpy(nb + r->len, ptr, n);
+    r->body = nb;
+    r->len += n;
+    r->body[r->len] = '\0';
+    return n;
+}
+
+static size_t resp_header(char *line, size_t size, size_t nmemb, void *ud)
+{
+    struct s3_resp *r = ud;
+    size_t n = size * nmemb;
+
+    if (n > 5 && strncasecmp(line, "ETag:", 5) == 0)
+    {
+        const char *v = line + 5;
+        while (*v == ' ')
+        {
+            v++;
+        }
+        size_t vl = n - (size_t)(v - line);
+        while (vl && (v[vl - 1] == '\r' || v[vl - 1] == '\n' || v[vl - 1] == ' '))
+        {
+            vl--;
+        }
+        if (vl < sizeof(r->etag))
+        {
+            memcpy(r->etag, v, vl);
+            r->etag[vl] = '\0';
+        }
+    }
+    return n;
+}
+
+static int xfer_abort(void *ud, curl_off_t dt, curl_off_t dn, curl_off_t ut, curl_off_t un)
+{
+    (void)ud, (void)dt, (void)dn, (void)ut, (void)un;
+    return s3.quit ? 1 : 0;
+}
+
+/* Signed request; returns the HTTP status or -1 on transport error */
+static long s3_request(CURL *c, const char *method, const char *url,
+                       const void *body, size_t len, bool with_md5,
+                       struct s3_resp *resp)
+{
+    char md5_b64[32], sha_hex[65];
+    char h_md5[64], h_sha[96];
+    struct curl_slist *hdr = NULL;
+
+    if (part_digests(body ? body : "", len, md5_b64, sha_hex) != 0)
+    {
+        return -1;
+    }
+    snprintf(h_sha, sizeof(h_sha), "x-amz-content-sha256: %s", sha_hex);
+    hdr = curl_slist_append(hdr, h_sha);
+    if (with_md5)
+    {
+        snprintf(h_md5, sizeof(h_md5), "Content-MD5: %s", md5_b64);
+        hdr = curl_slist_append(hdr, h_md5);
+    }
+    hdr = curl_slist_append(hdr, "Content-Type: application/octet-stream");
+    hdr = curl_slist_append(hdr, "Expect:");
+
+    curl_easy_reset(c);
+    curl_easy_setopt(c, CURLOPT_URL, url);
+    curl_easy_setopt(c, CURLOPT_CUSTOMREQUEST, method);
+    curl_easy_setopt(c, CURLOPT_AWS_SIGV4, "aws:amz:" S3_REGION ":s3");
+    curl_easy_setopt(c, CURLOPT_USERPWD, s3.userpwd);
+    curl_easy_setopt(c, CURLOPT_HTTPHEADER, hdr);
+    curl_easy_setopt(c, CURLOPT_POSTFIELDS, body ? body : "");
+    curl_easy_setopt(c, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)len);
+    curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, resp_write);
+    curl_easy_setopt(c, CURLOPT_WRITEDATA, resp);
+    curl_easy_setopt(c, CURLOPT_HEADERFUNCTION, resp_header);
+    curl_easy_setopt(c, CURLOPT_HEADERDATA, resp);
+    curl_easy_setopt(c, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(c, CURLOPT_XFERINFOFUNCTION, xfer_abort);
+    curl_easy_setopt(c, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(c, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(c, CURLOPT_LOW_SPEED_TIME, 60L);
+    curl_easy_setopt(c, CURLOPT_NOSIGNAL, 1L);
+    if (S3_MAX_BYTES_PER_SEC > 0)
+    {
+        curl_easy_setopt(c, CURLOPT_MAX_SEND_SPEED_LARGE,
+                         (curl_off_t)(S3_MAX_BYTES_PER_SEC / S3_PARALLEL));
+    }
+
+    CURLcode cc = curl_easy_perform(c);
+    curl_slist_free_all(hdr);
+
+    if (cc != CURLE_OK)
+    {
+        if (!s3.quit)
+        {
+            fprintf(stderr, "s3: %s %s: %s\n", method, url, curl_easy_strerror(cc));
+        }
+        return -1;
+    }
+
+    long code = 0;
+    curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &code);
+    return code;
+}
+
+/* Copy the text between <tag> and </tag> */
+static int xml_value(const char *body, const char *tag, char *out, size_t out_sz)
+{
+    char otag[64], ctag[64];
+    snprintf(otag, sizeof(otag), "<%s>", tag);
+    snprintf(ctag, sizeof(ctag), "</%s>", tag);
+
+    const char *a = body ? strstr(body, otag) : NULL;
+    const char *b = a ? strstr(a, ctag) : NULL;
+    if (!a || !b)
+    {
+        return -1;
+    }
+    a += strlen(otag);
+    if ((size_t)(b - a) >= out_sz)
+    {
+        return -1;
+    }
+    memcpy(out, a, (size_t)(b - a));
+    out[b - a] = '\0';
+    return 0;
+}
+
+/* ============================== STATE ============================ */
+
+/* State file: "object <size> <part_size>", "upload <id>", "part <n> <etag>" */
+static int state_load(struct s3_object *o, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return -1;
+    }
+
+    char line[512];
+    int valid = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        long long size;
+        size_t ps;
+        unsigned n;
+        char val[256];
+        char etag[S3_ETAG_MAX]; /* %79s below */
+
+        if (sscanf(line, "object %lld %zu", &size, &ps) == 2)
+        {
+            valid = (size == (long long)o->size && ps == o->part_size);
+        }
+        else if (sscanf(line, "upload %255s", val) == 1)
+        {
+            snprintf(o->upload_id, sizeof(o->upload_id), "%s", val);
+        }
+        else if (sscanf(line, "part %u %79s", &n, etag) == 2 && n >= 1 && n <= o->nparts)
+        {
+            snprintf(o->etag[n - 1], S3_ETAG_MAX, "%s", etag);
+        }
+    }
+    fclose(f);
+
+    if (!valid || !o->upload_id[0])
+    {
+        o->upload_id[0] = '\0';
+        memset(o->etag, 0, (size_t)o->nparts * S3_ETAG_MAX);
+        return -1;
+    }
+    return 0;
+}
+
+static void state_append(struct s3_object *o, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void state_append(struct s3_object *o, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(o->state, fmt, ap);
+    va_end(ap);
+    fflush(o->state);
+    fdatasync(fileno(o->state));
+}
+
+/* ============================== PARTS ============================ */
+
+static void *part_worker(void *arg)
+{
+    struct s3_object *o = arg;
+    CURL *c = curl_easy_init();
+    uint8_t *buf = malloc(o->part_size ? o->part_size : 1);
+
+    if (!c || !buf)
+    {
+        pthread_mutex_lock(&o->lock);
+        o->failed = -1;
+        pthread_mutex_unlock(&o->lock);
+        goto out;
+    }
+
+    for (;;)
+    {
+        unsigned i;
+
+        pthread_mutex_lock(&o->lock);
+        while (o->next < o->nparts && o->etag[o->next][0])
+        {
+            o->next++;
+        }
+        i = o->next++;
+        bool stop = i >= o->nparts || o->failed || s3.quit;
+        pthread_mutex_unlock(&o->lock);
+        if (stop)
+        {
+            break;
+        }
+
+        off_t off = (off_t)i * (off_t)o->part_size;
+        size_t len = (size_t)((o->size - off) < (off_t)o->part_size ? o->size - off : (off_t)o->part_size);
+        ssize_t got = len ? pread(o->fd, buf, len, off) : 0;
+        if (got != (ssize_t)len)
+        {
+            fprintf(stderr, "s3: short read of part %u\n", i + 1);
+            pthread_mutex_lock(&o->lock);
+            o->failed = -1;
+            pthread_mutex_unlock(&o->lock);
+            break;
+        }
+
+        char url[PATH_MAX + 320];
+        snprintf(url, sizeof(url), "%s?partNumber=%u&uploadId=%s",
+                 o->url, i + 1, o->upload_id);
+
+        int result = -1;
+        for (int attempt = 0; attempt < S3_PART_RETRIES && result == -1 && !s3.quit; attempt++)
+        {
+            struct s3_resp r = {0};
+            long code = s3_request(c, "PUT", url, buf, len, true, &r);
+            if (code == 200 && r.etag[0])
+            {
+                pthread_mutex_lock(&o->lock);
+                snprintf(o->etag[i], S3_ETAG_MAX, "%s", r.etag);
+                state_append(o, "part %u %s\n", i + 1, r.etag);
+                pthread_mutex_unlock(&o->lock);
+                result = 0;
+            }
+            else if (code == 404)
+            {
+                result = -2; /* NoSuchUpload: start over next time */
+            }
+            else if (code > 0)
+            {
+                fprintf(stderr, "s3: part %u: HTTP %ld\n", i + 1, code);
+            }
+            free(r.body);
+        }
+
+        if (result != 0)
+        {
+            pthread_mutex_lock(&o->lock);
+            o->failed = result;
+            pthread_mutex_unlock(&o->lock);
+            break;
+        }
+    }
+
+out:
+    free(buf);
+    if (c)
+    {
+        curl_easy_cleanup(c);
+    }
+    return NULL;
+}
+
+/* ============================= OBJECT ============================ */
+
+static int initiate_upload(CURL *c, struct s3_object *o)
+{
+    char url[PATH_MAX + 16];
+    snprintf(url, sizeof(url), "%s?uploads=", o->url);
+
+    struct s3_resp r = {0};
+    long code = s3_request(c, "POST", url, NULL, 0, false, &r);
+    char id[256];
+    int rc = -1;
+
+    if (code == 200 && xml_value(r.body, "UploadId", id, sizeof(id)) == 0)
+    {
+        char *esc = curl_easy_escape(c, id, 0);
+        if (esc && strlen(esc) < sizeof(o->upload_id))
+        {
+            strcpy(o->upload_id, esc);
+            rc = 0;
+        }
+        curl_free(esc);
+    }
+    else if (code > 0)
+    {
+        fprintf(stderr, "s3: initiate %s: HTTP %ld\n", o->url, code);
+    }
+    free(r.body);
+    return rc;
+}
+
+static int complete_upload(CURL *c, struct s3_object *o)
+{
+    size_t cap = 128 + (size_t)o->nparts * (64 + S3_ETAG_MAX);
+    char *xml = malloc(cap);
+    if (!xml)
+    {
+        return -1;
+    }
+
+    size_t len = (size_t)sprintf(xml, "<CompleteMultipartUpload>");
+    for (unsigned i = 0; i < o->nparts; i++)
+    {
+        len += (size_t)sprintf(xml + len,
+                               "<Part><PartNumber>%u</PartNumber><ETag>%s</ETag></Part>",
+                               i + 1, o->etag[i]);
+    }
+    len += (size_t)sprintf(xml + len, "</CompleteMultipartUpload>");
+
+    char url[PATH_MAX + 320];
+    snprintf(url, sizeof(url), "%s?uploadId=%s", o->url, o->upload_id);
+
+    struct s3_resp r = {0};
+    long code = s3_request(c, "POST", url, xml, len, false, &r);
+    int rc = (code == 200 && !(r.body && strstr(r.body, "<Error>"))) ? 0 : -1;
+
+    if (rc != 0 && code > 0)
+    {
+        fprintf(stderr, "s3: complete %s: HTTP %ld %s\n",
+                o->url, code, r.body ? r.body : "");
+    }
+    free(r.body);
+    free(xml);
+    return rc;
+}
+
+/* Upload (or resume) one packed object. Returns 0 once completed. */
+static int put_object(const char *path, const char *key, const char *state_path)
+{
+    struct s3_object o = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+    struct stat st;
+    CURL *c = NULL;
+    int rc = -1;
+
+    o.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (o.fd < 0 || fstat(o.fd, &st) != 0)
+    {
+        fprintf(stderr, "s3: cannot open %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    o.size = st.st_size;
+    o.part_size = S3_PART_SIZE;
+    while ((o.size + (off_t)o.part_size - 1) / (off_t)o.part_size > S3_MAX_PARTS)
+    {
+        o.part_size *= 2;
+    }
+    o.nparts = o.size ? (unsigned)((o.size + (off_t)o.part_size - 1) / (off_t)o.part_size) : 1;
+    o.etag = calloc(o.nparts, S3_ETAG_MAX);
+    /* A cut URL would sign and upload to the wrong key */
+    if (snprintf(o.url, sizeof(o.url), "%s/%s/%s", S3_ENDPOINT, S3_BUCKET, key) >= (int)sizeof(o.url))
+    {
+        fprintf(stderr, "s3: URL too long for %s\n", key);
+        goto out;
+    }
+
+    c = curl_easy_init();
+    if (!o.etag || !c)
+    {
+        goto out;
+    }
+
+    bool resumed = state_load(&o, state_path) == 0;
+    o.state = fopen(state_path, resumed ? "a" : "w");
+    if (!o.state)
+    {
+        fprintf(stderr, "s3: cannot write %s: %s\n", state_path, strerror(errno));
+        goto out;
+    }
+
+    if (!resumed)
+    {
+        if (initiate_upload(c, &o) != 0)
+        {
+            goto out;
+        }
+        state_append(&o, "object %lld %zu\nupload %s\n",
+                     (long long)o.size, o.part_size, o.upload_id);
+    }
+
+    unsigned done = 0;
+    for (unsigned i = 0; i < o.nparts; i++)
+    {
+        done += o.etag[i][0] != '\0';
+    }
+    printf("s3: %s %s (%u/%u parts done, %lld bytes)\n",
+           resumed ? "resuming" : "uploading", key, done, o.nparts, (long long)o.size);
+
+    unsigned nworkers = o.nparts - done < S3_PARALLEL ? o.nparts - done : S3_PARALLEL;
+    pthread_t tid[S3_PARALLEL];
+    unsigned started = 0;
+
+    for (; started < nworkers; started++)
+    {
+        if (pthread_create(&tid[started], NULL, part_worker, &o) != 0)
+        {
+            break;
+        }
+    }
+    if (started == 0 && nworkers > 0)
+    {
+        o.failed = -1;
+    }
+    for (unsigned i = 0; i < started; i++)
+    {
+        pthread_join(tid[i], NULL);
+    }
+
+    if (o.failed == -2)
+    {
+        fprintf(stderr, "s3: upload id for %s expired, restarting next round\n", key);
+        fclose(o.state);
+        o.state = NULL;
+        unlink(state_path);
+        goto out;
+    }
+    if (o.failed || s3.quit)
+    {
+        goto out;
+    }
+
+    rc = complete_upload(c, &o);
+    if (rc == 0)
+    {
+        printf("s3: uploaded %s\n", key);
+    }
+
+out:
+    if (o.state)
+    {
+        fclose(o.state);
+    }
+    if (c)
+    {
+        curl_easy_cleanup(c);
+    }
+    if (o.fd >= 0)
+    {
+        close(o.fd);
+    }
+    free(o.etag);
+    return rc;
+}
+
+/* ============================== QUEUE ============================ */
+
+static int queue_path(const char *name, const char *ext, char *out, size_t sz)
+{
+    int n = snprintf(out, sz, "%s/%s%s", s3.queue_dir, name, ext);
+    return (n < 0 || (size_t)n >= sz) ? -1 : 0;
+}
+
+static int pack_session(const char *name, const char *tarball)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", tarball) >= (int)sizeof(tmp))
+    {
+        return -1;
+    }
+
+    char *av[] = {"tar", "-C", s3.archive_base, "-czf", tmp, (char *)name, NULL};
+    int rc = run_child(av);
+    if (rc != 0)
+    {
+        fprintf(stderr, "s3: packing %s failed (rc=%d)\n", name, rc);
+        unlink(tmp);
+        return -1;
+    }
+    return rename(tmp, tarball);
+}
+
+static int upload_session(const char *name)
+{
+    char pending[PATH_MAX], tarball[PATH_MAX], state[PATH_MAX], done[PATH_MAX];
+    char key[PATH_MAX];
+
+    if (queue_path(name, ".pending", pending, sizeof(pending)) != 0 ||
+        queue_path(name, ".tar.gz", tarball, sizeof(tarball)) != 0 ||
+        queue_path(name, ".state", state, sizeof(state)) != 0 ||
+        queue_path(name, ".done", done, sizeof(done)) != 0 ||
+        snprintf(key, sizeof(key), "%s/%s.tar.gz", s3.key_prefix, name) >= (int)sizeof(key))
+    {
+        return -1;
+    }
+
+    if (access(tarball, F_OK) != 0)
+    {
+        char session_dir[PATH_MAX];
+        if (join_path(s3.archive_base, name, session_dir, sizeof(session_dir)) != 0 ||
+            access(session_dir, F_OK) != 0)
+        {
+            fprintf(stderr, "s3: %s no longer archived, dropping\n", name);
+            unlink(pending);
+            return 0;
+        }
+        unlink(state); /* a new tarball never matches an old upload */
+        if (pack_session(name, tarball) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if (put_object(tarball, key, state) != 0)
+    {
+        return -1;
+    }
+
+    int fd = open(done, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    unlink(tarball);
+    unlink(state);
+    unlink(pending);
+    return 0;
+}
+
+/* One pass over the queue directory; returns the number of failures */
+static int drain_queue(void)
+{
+    DIR *dir = opendir(s3.queue_dir);
+    if (!dir)
+    {
+        return 1;
+    }
+
+    struct dirent *de;
+    int failures = 0;
+
+    while (!s3.quit && (de = readdir(dir)) != NULL)
+    {
+        const char *dot = strrchr(de->d_name, '.');
+        if (de->d_name[0] == '.' || !dot || strcmp(dot, ".pending") != 0)
+        {
+            continue;
+        }
+
+        char name[NAME_MAX + 1];
+        snprintf(name, sizeof(name), "%.*s", (int)(dot - de->d_name), de->d_name);
+        if (upload_session(name) != 0)
+        {
+            ++failures;
+        }
+    }
+
+    closedir(dir);
+    return failures;
+}
+
+static void *uploader_main(void *arg)
+{
+    (void)arg;
+
+    while (!s3.quit)
+    {
+        int failures = drain_queue();
+
+        pthread_mutex_lock(&s3.lock);
+        if (!s3.kicked && !s3.quit)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += failures ? S3_RETRY_INTERVAL_S : 24 * 3600;
+            pthread_cond_timedwait(&s3.kick, &s3.lock, &ts);
+        }
+        s3.kicked = false;
+        pthread_mutex_unlock(&s3.lock);
+    }
+    return NULL;
+}
+
+/* ============================= PUBLIC ============================ */
+
+int s3_uploader_start(const char *archive_base, const char *key_prefix)
+{
+    if (!S3_ENDPOINT[0])
+    {
+        return 0;
+    }
+
+    const char *id = getenv("AWS_ACCESS_KEY_ID");
+    const char *secret = getenv("AWS_SECRET_ACCESS_KEY");
+    if (!id || !secret)
+    {
+        fprintf(stderr, "s3: AWS_ACCESS_KEY_ID / AWS_SECRET_ACCESS_KEY not set, uploader disabled\n");
+        return -1;
+    }
+
+    if (snprintf(s3.userpwd, sizeof(s3.userpwd), "%s:%s", id, secret) >= (int)sizeof(s3.userpwd) ||
+        snprintf(s3.archive_base, sizeof(s3.archive_base), "%s", archive_base) >= (int)sizeof(s3.archive_base) ||
+        snprintf(s3.key_prefix, sizeof(s3.key_prefix), "%s", key_prefix) >= (int)sizeof(s3.key_prefix) ||
+        join_path(archive_base, S3_QUEUE_DIR, s3.queue_dir, sizeof(s3.queue_dir)) != 0)
+    {
+        fprintf(stderr, "s3: configuration too long\n");
+        return -1;
+    }
+
+    if (ensure_dir(archive_base) != 0 || ensure_dir(s3.queue_dir) != 0)
+    {
+        return -1;
+    }
+
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK)
+    {
+        fprintf(stderr, "s3: curl_global_init failed\n");
+        return -1;
+    }
+
+    /* Signals stay with the main thread's poll loop */
+    sigset_t old;
+    block_signals(&old);
+
+    s3.quit = false;
+    int rc = pthread_create(&s3.thread, NULL, uploader_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0)
+    {
+        fprintf(stderr, "s3: cannot start uploader thread\n");
+        curl_global_cleanup();
+        return -1;
+    }
+    s3.running = true;
+    printf("s3: uploading sessions to %s/%s\n", S3_ENDPOINT, S3_BUCKET);
+    return 0;
+}
+
+void s3_uploader_enqueue(const char *session_name)
+{
+    if (!s3.running)
+    {
+        return;
+    }
+
+    char pending[PATH_MAX];
+    if (queue_path(session_name, ".pending", pending, sizeof(pending)) != 0)
+    {
+        return;
+    }
+    int fd = open(pending, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "s3: cannot queue %s: %s\n", session_name, strerror(errno));
+        return;
+    }
+    close(fd);
+
+    pthread_mutex_lock(&s3.lock);
+    s3.kicked = true;
+    pthread_cond_signal(&s3.kick);
+    pthread_mutex_unlock(&s3.lock);
+}
+
+void s3_uploader_stop(void)
+{
+    if (!s3.running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&s3.lock);
+    s3.quit = true;
+    pthread_cond_signal(&s3.kick);
+    pthread_mutex_unlock(&s3.lock);
+
+    pthread_join(s3.thread, NULL);
+    curl_global_cleanup();
+    s3.running = false;
+}
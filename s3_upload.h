@@ -0,0 +1,47 @@
+/*
+ * s3_upload.h: background multipart upload of archived sessions to an
+ * S3-compatible object store (AWS S3, MinIO, ...)
+ */
+
+#ifndef WEARABLE_S3_UPLOAD_H
+#define WEARABLE_S3_UPLOAD_H
+
+/* Endpoint incl. scheme, path-style addressing; "" disables the uploader */
+#ifndef S3_ENDPOINT
+#define S3_ENDPOINT ""
+#endif
+#ifndef S3_BUCKET
+#define S3_BUCKET "wearable-sessions"
+#endif
+#ifndef S3_REGION
+#define S3_REGION "us-east-1"
+#endif
+
+/* Multipart tuning */
+#ifndef S3_PART_SIZE
+#define S3_PART_SIZE (8u * 1024 * 1024) /* >= 5 MiB except for the last part */
+#endif
+#ifndef S3_PARALLEL
+#define S3_PARALLEL 4 /* parts in flight */
+#endif
+#ifndef S3_MAX_BYTES_PER_SEC
+#define S3_MAX_BYTES_PER_SEC 0 /* total upload budget, 0 = unlimited */
+#endif
+#ifndef S3_RETRY_INTERVAL_S
+#define S3_RETRY_INTERVAL_S 300 /* rescan of the queue after a failure */
+#endif
+
+/* Start the uploader thread for sessions under archive_base; objects are
+ * stored as <key_prefix>/<session>.tar.gz. Credentials come from the
+ * AWS_ACCESS_KEY_ID / AWS_SECRET_ACCESS_KEY environment variables.
+ * Unfinished uploads from a previous run are resumed.
+ * Returns 0 (also when disabled), -1 on error. */
+int s3_uploader_start(const char *archive_base, const char *key_prefix);
+
+/* Queue an archived session (directory name under archive_base) */
+void s3_uploader_enqueue(const char *session_name);
+
+/* Abort transfers in flight (resumable) and join the thread */
+void s3_uploader_stop(void);
+
+#endif /* WEARABLE_S3_UPLOAD_H */
@@ -0,0 +1,604 @@
+/*
+ * scrubber.c: background integrity scrub of archived sessions
+ *
+ * A coordinator thread walks the archive in name order once every
+ * SCRUB_INTERVAL_S; SCRUB_THREADS verifiers re-read each session's files
+ * against its SHA256SUMS manifest. Verifiers run at idle I/O and lowest CPU
+ * priority, share a SCRUB_BYTES_PER_SEC budget, only read inside
+ * SCRUB_WINDOW and drop cached pages first so the card itself is read.
+ */
+
+#define _GNU_SOURCE
+#include "scrubber.h"
+#include "arena.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SCRUB_STATE ".scrub_state"
+#define SCRUB_REPORT "CORRUPT"
+#define SCRUB_CHUNK (256 * 1024)
+
+/* linux/ioprio.h is not shipped everywhere */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+enum verify_result
+{
+    VERIFY_OK,
+    VERIFY_CORRUPT,
+    VERIFY_INTERRUPTED,
+};
+
+static struct
+{
+    pthread_t coordinator;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;
+    volatile bool quit;
+    char archive_base[PATH_MAX];
+    struct time_windows window;
+
+    /* current pass */
+    char **names;
+    int count;
+    int next;
+    bool *done;
+    char cursor[NAME_MAX + 1]; /* every session <= cursor is verified */
+    unsigned cycle;
+    long long next_run;
+
+    struct timespec pace; /* budget clock */
+} sc = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+/* ============================= TIMING ============================ */
+
+/* Sleep up to seconds; returns false if asked to quit */
+static bool scrub_sleep(double seconds)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += (time_t)seconds;
+    ts.tv_nsec += (long)((seconds - (double)(time_t)seconds) * 1e9);
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&sc.lock);
+    while (!sc.quit && pthread_cond_timedwait(&sc.wake, &sc.lock, &ts) != ETIMEDOUT)
+        ;
+    bool keep_going = !sc.quit;
+    pthread_mutex_unlock(&sc.lock);
+    return keep_going;
+}
+
+static bool in_window(void)
+{
+    return time_windows_contains(&sc.window, time(NULL));
+}
+
+/* Block until inside the window; false if asked to quit */
+static bool wait_for_window(void)
+{
+    while (!in_window())
+    {
+        if (!scrub_sleep(60))
+        {
+            return false;
+        }
+    }
+    return !sc.quit;
+}
+
+/* Pace reads to SCRUB_BYTES_PER_SEC across all verifiers */
+static bool throttle(size_t bytes)
+{
+    if (SCRUB_BYTES_PER_SEC == 0)
+    {
+        return !sc.quit;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&sc.lock);
+    if (sc.pace.tv_sec < now.tv_sec ||
+        (sc.pace.tv_sec == now.tv_sec && sc.pace.tv_nsec < now.tv_nsec))
+    {
+        sc.pace = now;
+    }
+    struct timespec slot = sc.pace;
+    long long ns = (long long)((double)bytes * 1e9 / SCRUB_BYTES_PER_SEC);
+    sc.pace.tv_sec += (time_t)(ns / 1000000000LL);
+    sc.pace.tv_nsec += (long)(ns % 1000000000LL);
+    if (sc.pace.tv_nsec >= 1000000000L)
+    {
+        sc.pace.tv_sec++;
+        sc.pace.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_unlock(&sc.lock);
+
+    double wait = (double)(slot.tv_sec - now.tv_sec) + (slot.tv_nsec - now.tv_nsec) / 1e9;
+    return wait > 0 ? scrub_sleep(wait) : !sc.quit;
+}
+
+/* ============================= HASHING =========================== */
+
+/* SHA-256 of a file read from the medium. Returns 0, -1 on I/O error,
+ * 1 if interrupted. */
+static int hash_file(const char *path, char hex[65])
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    /* Drop clean cached pages so we really re-read the card */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    uint8_t *buf = pool_get(SCRUB_CHUNK);
+    int rc = 0;
+
+    if (!ctx || !buf || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+    {
+        rc = -1;
+        goto out;
+    }
+
+    for (;;)
+    {
+        if (!wait_for_window() || !throttle(SCRUB_CHUNK))
+        {
+            rc = 1;
+            goto out;
+        }
+
+        ssize_t n = read(fd, buf, SCRUB_CHUNK);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            rc = -1;
+            goto out;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        EVP_DigestUpdate(ctx, buf, (size_t)n);
+    }
+
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    EVP_DigestFinal_ex(ctx, md, &md_len);
+    hex_encode(md, md_len, hex);
+
+    /* Do not leave the scrub in the page cache either */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+out:
+    pool_put(buf);
+    EVP_MD_CTX_free(ctx);
+    close(fd);
+    return rc;
+}
+
+/* ============================ REPORTING ========================== */
+
+static void report_corrupt(const char *session, const char *file, const char *why)
+{
+    fprintf(stderr, "scrub: CORRUPT %s/%s: %s\n", session, file, why);
+
+    char path[PATH_MAX];
+    if (join_path(sc.archive_base, SCRUB_REPORT, path, sizeof(path)) != 0)
+    {
+        return;
+    }
+
+    FILE *f = fopen(path, "a");
+    if (!f)
+    {
+        return;
+    }
+    fprintf(f, "%lld %s %s %s\n", (long long)time(NULL), session, file, why);
+    fclose(f);
+}
+
+/* Sessions archived before manifests existed get one now (baseline) */
+static enum verify_result adopt_session(const char *name, const char *dir, const char *manifest)
+{
+    char logs[PATH_MAX], tmp[PATH_MAX];
+    if (join_path(dir, "logs", logs, sizeof(logs)) != 0 ||
+        snprintf(tmp, sizeof(tmp), "%s.tmp", manifest) >= (int)sizeof(tmp))
+    {
+        return VERIFY_OK;
+    }
+
+    DIR *d = opendir(logs);
+    if (!d)
+    {
+        return VERIFY_OK; /* nothing to protect */
+    }
+
+    FILE *out = fopen(tmp, "w");
+    if (!out)
+    {
+        closedir(d);
+        return VERIFY_OK;
+    }
+
+    enum verify_result res = VERIFY_OK;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL && res == VERIFY_OK)
+    {
+        if (de->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        char path[PATH_MAX], hex[65];
+        if (join_path(logs, de->d_name, path, sizeof(path)) != 0)
+        {
+            continue;
+        }
+        int rc = hash_file(path, hex);
+        if (rc == 1)
+        {
+            res = VERIFY_INTERRUPTED;
+        }
+        else if (rc == 0)
+        {
+            fprintf(out, "%s  logs/%s\n", hex, de->d_name);
+        }
+    }
+    closedir(d);
+
+    if (fclose(out) != 0 || res != VERIFY_OK || rename(tmp, manifest) != 0)
+    {
+        unlink(tmp);
+        return res;
+    }
+    printf("scrub: %s had no manifest, recorded baseline hashes\n", name);
+    return VERIFY_OK;
+}
+
+static enum verify_result verify_session(const char *name)
+{
+    char dir[PATH_MAX], manifest[PATH_MAX];
+    if (join_path(sc.archive_base, name, dir, sizeof(dir)) != 0 ||
+        join_path(dir, SCRUB_MANIFEST, manifest, sizeof(manifest)) != 0)
+    {
+        return VERIFY_OK;
+    }
+
+    FILE *mf = fopen(manifest, "r");
+    if (!mf)
+    {
+        return adopt_session(name, dir, manifest);
+    }
+
+    enum verify_result res = VERIFY_OK;
+    char line[PATH_MAX + 80];
+
+    while (res != VERIFY_INTERRUPTED && fgets(line, sizeof(line), mf))
+    {
+        char want[65], rel[PATH_MAX];
+        if (sscanf(line, "%64s %4095[^\n]", want, rel) != 2)
+        {
+            continue;
+        }
+        const char *file = rel[0] == '*' ? rel + 1 : rel; /* binary-mode marker */
+
+        char path[PATH_MAX], got[65];
+        if (join_path(dir, file, path, sizeof(path)) != 0)
+        {
+            continue;
+        }
+
+        int rc = hash_file(path, got);
+        if (rc == 1)
+        {
+            res = VERIFY_INTERRUPTED;
+        }
+        else if (rc < 0)
+        {
+            report_corrupt(name, file, errno == ENOENT ? "missing" : strerror(errno));
+            res = VERIFY_CORRUPT;
+        }
+        else if (strcmp(got, want) != 0)
+        {
+            report_corrupt(name, file, "sha256 mismatch");
+            res = VERIFY_CORRUPT;
+        }
+    }
+
+    fclose(mf);
+    return res;
+}
+
+/* ============================== STATE ============================ */
+
+static int state_path(char *out, size_t sz)
+{
+    return join_path(sc.archive_base, SCRUB_STATE, out, sz);
+}
+
+static void state_load(void)
+{
+    char path[PATH_MAX];
+    if (state_path(path, sizeof(path)) != 0)
+    {
+        return;
+    }
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return;
+    }
+
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned cycle;
+        long long next_run;
+        char cursor[NAME_MAX + 1];
+
+        if (sscanf(line, "cycle %u", &cycle) == 1)
+        {
+            sc.cycle = cycle;
+        }
+        else if (sscanf(line, "next_run %lld", &next_run) == 1)
+        {
+            sc.next_run = next_run;
+        }
+        else if (sscanf(line, "cursor %255s", cursor) == 1)
+        {
+            snprintf(sc.cursor, sizeof(sc.cursor), "%s", cursor);
+        }
+    }
+    fclose(f);
+}
+
+/* Written via rename so a crash never leaves half a state file */
+static void state_save(void)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    if (state_path(path, sizeof(path)) != 0 ||
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    {
+        return;
+    }
+
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+    {
+        return;
+    }
+    fprintf(f, "cycle %u\nnext_run %lld\n", sc.cycle, sc.next_run);
+    if (sc.cursor[0])
+    {
+        fprintf(f, "cursor %s\n", sc.cursor);
+    }
+    if (fclose(f) == 0)
+    {
+        rename(tmp, path);
+    }
+    else
+    {
+        unlink(tmp);
+    }
+}
+
+/* ============================= THREADS =========================== */
+
+static void *verifier_main(void *arg)
+{
+    (void)arg;
+
+    /* Idle I/O class and nice 19, for this thread only */
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&sc.lock);
+        int i = sc.quit ? sc.count : sc.next++;
+        pthread_mutex_unlock(&sc.lock);
+        if (i >= sc.count)
+        {
+            break;
+        }
+
+        enum verify_result res = verify_session(sc.names[i]);
+        if (res == VERIFY_INTERRUPTED)
+        {
+            break;
+        }
+
+        /* Advance the persisted cursor over the contiguous done prefix */
+        pthread_mutex_lock(&sc.lock);
+        sc.done[i] = true;
+        int c = -1;
+        while (c + 1 < sc.count && sc.done[c + 1])
+        {
+            c++;
+        }
+        if (c >= 0 && strcmp(sc.names[c], sc.cursor) > 0)
+        {
+            snprintf(sc.cursor, sizeof(sc.cursor), "%s", sc.names[c]);
+            state_save();
+        }
+        pthread_mutex_unlock(&sc.lock);
+    }
+    return NULL;
+}
+
+static int is_session(const struct dirent *de)
+{
+    return de->d_name[0] != '.' && (de->d_type == DT_DIR || de->d_type == DT_UNKNOWN) &&
+           strcmp(de->d_name, SCRUB_REPORT) != 0;
+}
+
+/* One pass over the sessions after the cursor; true when finished */
+static bool run_pass(void)
+{
+    struct dirent **ents;
+    int n = scandir(sc.archive_base, &ents, is_session, alphasort);
+    if (n < 0)
+    {
+        return false;
+    }
+
+    sc.names = calloc((size_t)n + 1, sizeof(*sc.names));
+    sc.done = calloc((size_t)n + 1, sizeof(*sc.done));
+    sc.count = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (sc.names && sc.done && strcmp(ents[i]->d_name, sc.cursor) > 0)
+        {
+            sc.names[sc.count++] = strdup(ents[i]->d_name);
+        }
+        free(ents[i]);
+    }
+    free(ents);
+    sc.next = 0;
+
+    printf("scrub: pass %u, %d session(s) to verify\n", sc.cycle, sc.count);
+
+    pthread_t tid[SCRUB_THREADS];
+    int started = 0;
+    for (; started < SCRUB_THREADS && sc.names && sc.done; started++)
+    {
+        if (pthread_create(&tid[started], NULL, verifier_main, NULL) != 0)
+        {
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(tid[i], NULL);
+    }
+
+    bool finished = started > 0 && !sc.quit;
+    for (int i = 0; sc.names && i < sc.count; i++)
+    {
+        finished = finished && sc.done[i];
+        free(sc.names[i]);
+    }
+    free(sc.names);
+    free(sc.done);
+    sc.names = NULL;
+    sc.done = NULL;
+    return finished;
+}
+
+static void *coordinator_main(void *arg)
+{
+    (void)arg;
+
+    while (!sc.quit)
+    {
+        long long now = (long long)time(NULL);
+        if (now < sc.next_run)
+        {
+            double wait = (double)(sc.next_run - now);
+            if (!scrub_sleep(wait > 3600 ? 3600 : wait))
+            {
+                break;
+            }
+            continue;
+        }
+
+        if (run_pass())
+        {
+            pthread_mutex_lock(&sc.lock);
+            printf("scrub: pass %u complete\n", sc.cycle);
+            sc.cycle++;
+            sc.cursor[0] = '\0';
+            sc.next_run = (long long)time(NULL) + SCRUB_INTERVAL_S;
+            state_save();
+            pthread_mutex_unlock(&sc.lock);
+        }
+        else if (!scrub_sleep(600))
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* ============================= PUBLIC ============================ */
+
+int scrubber_start(const char *archive_base)
+{
+    if (snprintf(sc.archive_base, sizeof(sc.archive_base), "%s", archive_base) >= (int)sizeof(sc.archive_base))
+    {
+        return -1;
+    }
+    if (ensure_dir(archive_base) != 0)
+    {
+        return -1;
+    }
+
+    if (time_windows_parse(SCRUB_WINDOW, &sc.window) != 0)
+    {
+        fprintf(stderr, "scrub: bad SCRUB_WINDOW \"%s\"\n", SCRUB_WINDOW);
+        return -1;
+    }
+
+    state_load();
+
+    sigset_t old;
+    block_signals(&old);
+    sc.quit = false;
+    int rc = pthread_create(&sc.coordinator, NULL, coordinator_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0)
+    {
+        fprintf(stderr, "scrub: cannot start thread\n");
+        return -1;
+    }
+    sc.running = true;
+    return 0;
+}
+
+void scrubber_stop(void)
+{
+    if (!sc.running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&sc.lock);
+    sc.quit = true;
+    pthread_cond_broadcast(&sc.wake);
+    pthread_mutex_unlock(&sc.lock);
+
+    pthread_join(sc.coordinator, NULL);
+    sc.running = false;
+}
@@ -0,0 +1,39 @@
+/*
+ * scrubber.h: background integrity scrub of archived sessions
+ */
+
+#ifndef WEARABLE_SCRUBBER_H
+#define WEARABLE_SCRUBBER_H
+
+/* Per-session manifest written at copy time, `sha256sum -c` compatible:
+ *   <64 hex>  logs/<file>.BIN */
+#define SCRUB_MANIFEST "SHA256SUMS"
+
+/* Parallel verifiers */
+#ifndef SCRUB_THREADS
+#define SCRUB_THREADS 2
+#endif
+
+/* Read budget shared by all verifiers, 0 = unlimited */
+#ifndef SCRUB_BYTES_PER_SEC
+#define SCRUB_BYTES_PER_SEC (4u * 1024 * 1024)
+#endif
+
+/* Local time windows "HH:MM-HH:MM[,...]" (may wrap midnight), "" = any time */
+#ifndef SCRUB_WINDOW
+#define SCRUB_WINDOW ""
+#endif
+
+/* Pause between the end of one full pass and the next */
+#ifndef SCRUB_INTERVAL_S
+#define SCRUB_INTERVAL_S (7 * 24 * 3600)
+#endif
+
+/* Start scrubbing archive_base. Progress is kept in <archive_base>/.scrub_state
+ * and corrupt files are appended to <archive_base>/CORRUPT. */
+int scrubber_start(const char *archive_base);
+
+/* Interrupt the pass (progress is kept) and join the threads */
+void scrubber_stop(void);
+
+#endif /* WEARABLE_SCRUBBER_H */
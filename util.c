@@ -0,0 +1,130 @@
+/*
+ * util.c: small path / process helpers shared by the dock modules
+ */
+
+#define _GNU_SOURCE
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int join_path(const char *a, const char *b, char *out, size_t out_sz)
+{
+    int n = snprintf(out, out_sz, "%s/%s", a, b);
+    if (n < 0 || (size_t)n >= out_sz)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+void block_signals(sigset_t *old)
+{
+    sigset_t all;
+    sigfillset(&all);
+    sigdelset(&all, SIGPROF);
+    pthread_sigmask(SIG_SETMASK, &all, old);
+}
+
+int ensure_dir(const char *path)
+{
+    if (mkdir(path, 0755) == -1)
+    {
+        if (errno == EEXIST)
+        {
+            return 0;
+        }
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+int run_child(char *const argv[])
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int st;
+    if (waitpid(pid, &st, 0) < 0)
+    {
+        perror("waitpid");
+        return -1;
+    }
+    if (WIFEXITED(st))
+    {
+        return WEXITSTATUS(st);
+    }
+    return -1;
+}
+
+void hex_encode(const unsigned char *in, size_t n, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < n; i++)
+    {
+        out[2 * i] = hex[in[i] >> 4];
+        out[2 * i + 1] = hex[in[i] & 0xf];
+    }
+    out[2 * n] = '\0';
+}
+
+int time_windows_parse(const char *spec, struct time_windows *w)
+{
+    w->n = 0;
+    while (*spec)
+    {
+        int h1, m1, h2, m2, used;
+        if (w->n == TIME_WINDOWS_MAX ||
+            sscanf(spec, "%d:%d-%d:%d%n", &h1, &m1, &h2, &m2, &used) != 4 ||
+            h1 < 0 || h1 > 24 || m1 < 0 || m1 > 59 ||
+            h2 < 0 || h2 > 24 || m2 < 0 || m2 > 59)
+        {
+            return -1;
+        }
+        w->start[w->n] = (short)(h1 * 60 + m1);
+        w->end[w->n] = (short)(h2 * 60 + m2);
+        w->n++;
+
+        spec += used;
+        spec += strspn(spec, " ,");
+    }
+    return 0;
+}
+
+int time_windows_contains(const struct time_windows *w, time_t t)
+{
+    if (w->n == 0)
+    {
+        return 1;
+    }
+
+    struct tm tm;
+    localtime_r(&t, &tm);
+    int m = tm.tm_hour * 60 + tm.tm_min;
+
+    for (int i = 0; i < w->n; i++)
+    {
+        if (w->start[i] <= w->end[i] ? (m >= w->start[i] && m < w->end[i])
+                                     : (m >= w->start[i] || m < w->end[i]))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * util.h: small path / process helpers shared by the dock modules
+ */
+
+#ifndef WEARABLE_UTIL_H
+#define WEARABLE_UTIL_H
+
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/* out = a "/" b; -1 with errno = ENAMETOOLONG if it does not fit */
+int join_path(const char *a, const char *b, char *out, size_t out_sz);
+
+/* mkdir 0755, success if it already exists */
+int ensure_dir(const char *path);
+
+/* fork + execvp + wait; returns the exit status or -1 */
+int run_child(char *const argv[]);
+
+/* Mask every signal but SIGPROF in the calling thread, saving the old
+ * mask in old. Background threads are started under it, so signals stay
+ * with the main thread's poll loop while the profiler still samples them. */
+void block_signals(sigset_t *old);
+
+/* Lower-case hex of n bytes; out holds 2 * n + 1 */
+void hex_encode(const unsigned char *in, size_t n, char *out);
+
+/* Local time-of-day windows, "HH:MM-HH:MM[,HH:MM-HH:MM...]"; each may wrap
+ * midnight. An empty spec means any time. */
+#define TIME_WINDOWS_MAX 8
+
+struct time_windows
+{
+    int n;
+    short start[TIME_WINDOWS_MAX], end[TIME_WINDOWS_MAX]; /* minutes since midnight */
+};
+
+/* -1 on a malformed spec */
+int time_windows_parse(const char *spec, struct time_windows *w);
+
+/* Non-zero if local time t falls in one of the windows */
+int time_windows_contains(const struct time_windows *w, time_t t);
+
+#endif /* WEARABLE_UTIL_H */
@@ -2,7 +2,7 @@
  * wearable_dock.c: exFAT logs extractor + IMU to JSON to MQTT
  *
  * Compile:
- *   cc -Wall -DDS_HOME_DIR='"t-89-e0-5c"' -O2 wearable_dock.c -ludev -lmosquitto -o wearable_dock_run
+ *   cc -Wall -fno-omit-frame-pointer -DDS_HOME_DIR='"t-89-e0-5c"' -O2 wearable_dock.c archive_map.c arena.c block_cache.c bulk_publish.c calibrate.c canary.c control.c decoder.c fidelity.c filecopy.c filter.c gapfill.c handover.c inbox.c merkle.c profiler.c pyramid.c quant.c record.c s3_upload.c scrubber.c util.c -ludev -lmosquitto -lcurl -lcrypto -lm -ldl -pthread -o wearable_dock_run
  */
 
 #define _GNU_SOURCE
@@ -11,6 +11,7 @@
 #include <libudev.h>
 #include <mosquitto.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -18,6 +19,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -25,14 +27,30 @@
 #include <dirent.h>
 #include <limits.h>
 
-#ifndef PATH_MAX
-#define PATH_MAX 4096
-#endif
+#include "arena.h"
+#include "archive_map.h"
+#include "bulk_publish.h"
+#include "calibrate.h"
+#include "control.h"
+#include "decoder.h"
+#include "filecopy.h"
+#include "gapfill.h"
+#include "handover.h"
+#include "inbox.h"
+#include "merkle.h"
+#include "pyramid.h"
+#include "record.h"
+#include "s3_upload.h"
+#include "scrubber.h"
+#include "util.h"
 
 /* USB ID of your wearable MSC device */
 #define WEARABLE_VENDOR_HEX "0001"
 #define WEARABLE_PRODUCT_HEX "0001"
 
+/* Tag set by udev/90-wearable-dock.rules; filtered in the kernel */
+#define WEARABLE_UDEV_TAG "wearable_dock"
+
 /* Where we mount the wearable’s exFAT volume (no GUI / spaces) */
 #define MOUNT_POINT "/mnt/wearable"
 
@@ -43,6 +61,13 @@
 
 #define SESSIONS_BASE "/home/" DS_HOME_DIR "/wearable_dock/extracted"
 #define ARCHIVE_BASE SESSIONS_BASE "/archive"
+#define PROFILE_DIR SESSIONS_BASE "/profiles" /* folded stacks from the control socket */
+
+/* Card images, tarballs and .BIN files dropped here are offloaded too */
+#ifndef INBOX_DIR
+#define INBOX_DIR "/home/" DS_HOME_DIR "/wearable_dock/inbox"
+#endif
+#define INBOX_STAGING INBOX_DIR "/.staging" /* tarballs are unpacked here */
 
 /* Subdirectory created by firmware on the card */
 #define LOGS_SUBDIR "logs"
@@ -51,17 +76,30 @@
 #define MQTT_HOST "192.168.88.251"
 #define MQTT_PORT 1883
 #define MQTT_TOPIC "BORUS/extf"
+#define MQTT_QUALITY_TOPIC MQTT_TOPIC "/quality" /* per-batch quality masks */
+#define MQTT_SUMMARY_TOPIC MQTT_TOPIC "/summary" /* one message per session */
+#define MQTT_PYRAMID_TOPIC MQTT_TOPIC "/pyramid" /* preview, then coarse levels */
 
-/* Binary record from firmware:
- *   uint32_t timestamp_ms;
- *   uint32_t pressure_pa;
- *   uint8_t  label;
- *   int16_t  imu[6];
- */
-#define RECORD_SIZE (4 + 4 + 1 + 6 * 2)
-#define IMU_SCALE 100.0f
+/* Refuse to offload below this much free space in SESSIONS_BASE */
+#ifndef MIN_FREE_MB
+#define MIN_FREE_MB 512
+#endif
+
+/* A pre-warmed session not claimed by a block device within this time
+ * is thrown away and prepared again */
+#define PREWARM_MAX_AGE_S 60
 
 static volatile sig_atomic_t quit_flag = 0;
+static volatile sig_atomic_t upgrade_flag = 0;
+
+/* Carried over from the previous process after an upgrade */
+static struct handover_state handover;
+
+/* udev events that reached userspace vs those that were our device */
+static unsigned long udev_events_received;
+static unsigned long udev_events_matched;
+
+static int inbox_fd = -1;
 
 /* ======================== SIGNAL HANDLER ========================= */
 
@@ -71,58 +109,14 @@ static void handle_sigint(int sig)
     quit_flag = 1;
 }
 
-/* ========================= SMALL HELPERS ========================= */
-
-static int join_path(const char *a, const char *b, char *out, size_t out_sz)
-{
-    int n = snprintf(out, out_sz, "%s/%s", a, b);
-    if (n < 0 || (size_t)n >= out_sz)
-    {
-        errno = ENAMETOOLONG;
-        return -1;
-    }
-    return 0;
-}
-
-static int ensure_dir(const char *path)
+/* SIGHUP: re-exec the binary on disk once the current offload is done */
+static void handle_sighup(int sig)
 {
-    if (mkdir(path, 0755) == -1)
-    {
-        if (errno == EEXIST)
-        {
-            return 0;
-        }
-        perror(path);
-        return -1;
-    }
-    return 0;
+    (void)sig;
+    upgrade_flag = 1;
 }
 
-static int run_child(char *const argv[])
-{
-    pid_t pid = fork();
-    if (pid < 0)
-    {
-        perror("fork");
-        return -1;
-    }
-    if (pid == 0)
-    {
-        execvp(argv[0], argv);
-        _exit(127);
-    }
-    int st;
-    if (waitpid(pid, &st, 0) < 0)
-    {
-        perror("waitpid");
-        return -1;
-    }
-    if (WIFEXITED(st))
-    {
-        return WEXITSTATUS(st);
-    }
-    return -1;
-}
+/* ========================= SMALL HELPERS ========================= */
 
 static int make_session_dir(char *session_dir, size_t sz)
 {
@@ -142,18 +136,39 @@ static int make_session_dir(char *session_dir, size_t sz)
         return -1;
     }
 
-    int n = snprintf(session_dir, sz, "%s/%s", SESSIONS_BASE, stamp);
-    if (n < 0 || (size_t)n >= sz)
-    {
-        errno = ENAMETOOLONG;
-        return -1;
-    }
-
-    if (ensure_dir(session_dir) != 0)
+    /* Inbox items can start within the same second: never reuse a name,
+     * archived or not */
+    for (int k = 0; k < 100; k++)
     {
-        return -1;
+        char name[48];
+        char archived[PATH_MAX];
+        if (k == 0)
+        {
+            snprintf(name, sizeof(name), "%s", stamp);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "%s_%d", stamp, k);
+        }
+        if (join_path(SESSIONS_BASE, name, session_dir, sz) != 0 ||
+            join_path(ARCHIVE_BASE, name, archived, sizeof(archived)) != 0)
+        {
+            return -1;
+        }
+        if (access(archived, F_OK) == 0)
+        {
+            continue;
+        }
+        if (mkdir(session_dir, 0755) == 0)
+        {
+            return 0;
+        }
+        if (errno != EEXIST)
+        {
+            return -1;
+        }
     }
-    return 0;
+    return -1;
 }
 
 /* ====================== MOUNT / UNMOUNT HELPERS ================== */
@@ -225,68 +240,74 @@ static int mount_exfat(const char *disk_devnode, char *out_dev, size_t out_sz)
     return 0;
 }
 
-/* ===================== COPY + DELETE LOG FILES =================== */
-
-static int copy_file(const char *src, const char *dst)
+/* Card image from the inbox, read-only so the item stays as dropped */
+static int mount_image(const char *image)
 {
-    FILE *in = fopen(src, "rb");
-    if (!in)
+    if (ensure_dir(MOUNT_POINT) != 0)
     {
-        fprintf(stderr, "Failed to open %s for read: %s\n", src, strerror(errno));
         return -1;
     }
 
-    FILE *out = fopen(dst, "wb");
-    if (!out)
+    ensure_unmounted(MOUNT_POINT);
+
+    char *av[] = {"mount", "-t", "exfat", "-o", "loop,ro", (char *)image, MOUNT_POINT, NULL};
+    int rc = run_child(av);
+    if (rc != 0)
     {
-        fprintf(stderr, "Failed to open %s for write: %s\n", dst, strerror(errno));
-        fclose(in);
+        fprintf(stderr, "mount exfat image %s -> %s failed (rc=%d)\n",
+                image, MOUNT_POINT, rc);
         return -1;
     }
+    return 0;
+}
 
-    uint8_t buf[4096];
-    size_t n;
-    int rc = 0;
-
-    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
-    {
-        if (fwrite(buf, 1, n, out) != n)
-        {
-            fprintf(stderr, "Write error to %s: %s\n", dst, strerror(errno));
-            rc = -1;
-            break;
-        }
-    }
+/* ===================== COPY + DELETE LOG FILES =================== */
 
-    if (ferror(in))
+/* Copy one log file into dest_logs, appending its SHA-256 to mf for the
+ * scrubber */
+static int copy_log(const char *src_path, const char *name, const char *dest_logs, FILE *mf)
+{
+    char dst_path[PATH_MAX];
+    if (join_path(dest_logs, name, dst_path, sizeof(dst_path)) != 0)
     {
-        fprintf(stderr, "Read error from %s\n", src);
-        rc = -1;
+        fprintf(stderr, "Path too long for %s\n", name);
+        return -1;
     }
 
-    fclose(in);
-    if (fclose(out) != 0)
+    printf("  Copying %s -> %s\n", src_path, dst_path);
+    char sha_hex[65];
+    if (copy_file(src_path, dst_path, sha_hex) != 0)
     {
-        fprintf(stderr, "Close error on %s: %s\n", dst, strerror(errno));
-        rc = -1;
+        return -1;
     }
-
-    return rc;
+    fprintf(mf, "%s  " LOGS_SUBDIR "/%s\n", sha_hex, name);
+    fflush(mf);
+    return 0;
 }
 
-/* Copy all *.BIN / *.bin from src_logs into dest_logs and delete them on card */
-static int copy_and_delete_logs(const char *src_logs, const char *dest_logs)
+/* Copy all *.BIN / *.bin from src_logs into dest_logs, deleting them from
+ * the source if delete_src. Returns the number copied, -1 on error. */
+static int copy_logs(const char *src_logs, const char *dest_logs, const char *manifest,
+                     bool delete_src)
 {
     if (ensure_dir(dest_logs) != 0)
     {
         return -1;
     }
 
+    FILE *mf = fopen(manifest, "a");
+    if (!mf)
+    {
+        fprintf(stderr, "Cannot write %s: %s\n", manifest, strerror(errno));
+        return -1;
+    }
+
     DIR *dir = opendir(src_logs);
     if (!dir)
     {
         fprintf(stderr, "Cannot open logs directory %s: %s\n",
                 src_logs, strerror(errno));
+        fclose(mf);
         return -1;
     }
 
@@ -307,32 +328,47 @@ static int copy_and_delete_logs(const char *src_logs, const char *dest_logs)
         }
 
         char src_path[PATH_MAX];
-        char dst_path[PATH_MAX];
-
-        if (join_path(src_logs, de->d_name, src_path, sizeof(src_path)) != 0 ||
-            join_path(dest_logs, de->d_name, dst_path, sizeof(dst_path)) != 0)
+        if (join_path(src_logs, de->d_name, src_path, sizeof(src_path)) != 0)
         {
             fprintf(stderr, "Path too long for %s\n", de->d_name);
             continue;
         }
 
-        printf("  Copying %s -> %s\n", src_path, dst_path);
-        if (copy_file(src_path, dst_path) == 0)
+        /* Regular files only: an unpacked tarball can hold symlinks to
+         * anywhere, and copying through one would archive that file */
+        struct stat st;
+        if (de->d_type != DT_REG &&
+            (de->d_type != DT_UNKNOWN || lstat(src_path, &st) != 0 || !S_ISREG(st.st_mode)))
         {
-            ++copied;
-            if (unlink(src_path) != 0)
-            {
-                fprintf(stderr, "  Warning: failed to delete %s: %s\n",
-                        src_path, strerror(errno));
-            }
-            else
-            {
-                printf("  Deleted %s from wearable\n", src_path);
-            }
+            fprintf(stderr, "  Skipping %s: not a regular file\n", src_path);
+            continue;
+        }
+
+        if (copy_log(src_path, de->d_name, dest_logs, mf) != 0)
+        {
+            continue;
+        }
+        ++copied;
+        if (!delete_src)
+        {
+            continue;
+        }
+        if (unlink(src_path) != 0)
+        {
+            fprintf(stderr, "  Warning: failed to delete %s: %s\n",
+                    src_path, strerror(errno));
+        }
+        else
+        {
+            printf("  Deleted %s from wearable\n", src_path);
         }
     }
 
     closedir(dir);
+    if (fclose(mf) != 0)
+    {
+        fprintf(stderr, "Close error on %s: %s\n", manifest, strerror(errno));
+    }
 
     if (copied == 0)
     {
@@ -340,117 +376,480 @@ static int copy_and_delete_logs(const char *src_logs, const char *dest_logs)
     }
     else
     {
-        printf("Copied %d log file(s) from wearable.\n", copied);
+        printf("Copied %d log file(s) from %s.\n", copied, src_logs);
     }
 
-    return 0;
+    return copied;
 }
 
-/* ======================== RECORD DECODE + MQTT =================== */
+/* ======================= SESSION + PRE-WARM ====================== */
 
-static void decode_record(const uint8_t buf[RECORD_SIZE],
-                          uint32_t *timestamp_ms,
-                          float *pressure_pa,
-                          uint8_t *ml_label, 
-                          float acc[3],
-                          float gyr[3])
+/* Per-offload state. Prepared by the pre-warm thread as soon as the USB
+ * device enumerates, so it is ready when the block device appears. */
+struct session
 {
-    uint32_t ts;
-    uint32_t p;
-    uint8_t label; 
-    int16_t raw[6];
-
-    memcpy(&ts, buf, 4);
-    memcpy(&p, buf + 4, 4);
-    memcpy(&label, buf + 8, 1); 
+    char dir[PATH_MAX];
+    const char *name; /* basename of dir */
+    struct mosquitto *mqtt;
+    struct decoder *decoder; /* workers + batch ring, reused for every file */
+    struct arena arena; /* session-lifetime allocations, freed in one step */
+    int admitted; /* enough free space to take the card's logs */
+    struct timespec plug_time;
+};
+
+static struct
+{
+    pthread_t thread;
+    int active; /* thread started, result not taken yet */
+    int rc;
+    struct timespec started; /* CLOCK_MONOTONIC */
+    struct session s;
+} prewarm;
+
+static void on_mqtt_connect(struct mosquitto *m, void *ud, int rc)
+{
+    (void)m;
+    (void)ud;
+    if (rc != 0)
+    {
+        fprintf(stderr, "MQTT broker %s:%d refused connection (rc=%d)\n",
+                MQTT_HOST, MQTT_PORT, rc);
+    }
+}
 
-    for (int i = 0; i < 6; i++)
+/* Free-space admission: never take logs off a card we cannot store */
+static int check_free_space(void)
+{
+    struct statvfs vfs;
+    if (statvfs(SESSIONS_BASE, &vfs) != 0)
     {
-        memcpy(&raw[i], buf + 9 + 2 * i, 2);
+        perror("statvfs " SESSIONS_BASE);
+        return 0;
     }
 
-    *timestamp_ms = ts;
-    *pressure_pa = p / 100.0f;
-    *ml_label = label; 
+    unsigned long long free_mb =
+        (unsigned long long)vfs.f_bavail * vfs.f_frsize / (1024 * 1024);
+    if (free_mb < MIN_FREE_MB)
+    {
+        fprintf(stderr, "Only %llu MiB free in %s (need %d MiB)\n",
+                free_mb, SESSIONS_BASE, MIN_FREE_MB);
+        return 0;
+    }
+    return 1;
+}
 
-    acc[0] = raw[0] / IMU_SCALE;
-    acc[1] = raw[1] / IMU_SCALE;
-    acc[2] = raw[2] / IMU_SCALE;
+static void session_release(struct session *s)
+{
+    if (s->mqtt)
+    {
+        /* DISCONNECT goes out after everything already queued */
+        mosquitto_disconnect(s->mqtt);
+        mosquitto_loop_stop(s->mqtt, false);
+        mosquitto_destroy(s->mqtt);
+        s->mqtt = NULL;
+    }
+    decoder_free(s->decoder);
+    s->decoder = NULL;
+    arena_release(&s->arena);
+}
 
-    gyr[0] = raw[3] / IMU_SCALE;
-    gyr[1] = raw[4] / IMU_SCALE;
-    gyr[2] = raw[5] / IMU_SCALE;
+/* Release and remove the (still empty) session directory */
+static void session_discard(struct session *s)
+{
+    session_release(s);
+    if (s->dir[0])
+    {
+        char logs[PATH_MAX];
+        if (join_path(s->dir, LOGS_SUBDIR, logs, sizeof(logs)) == 0)
+        {
+            rmdir(logs);
+        }
+        rmdir(s->dir);
+    }
 }
 
-/* session_root is e.g. /home/.../extracted/20251118_102030 */
-static int convert_and_publish(const char *session_root)
+static int session_prepare(struct session *s)
 {
-    char logs_dir[PATH_MAX];
+    memset(s, 0, sizeof(*s));
+    clock_gettime(CLOCK_REALTIME, &s->plug_time);
 
-    if (join_path(session_root, LOGS_SUBDIR, logs_dir, sizeof(logs_dir)) != 0)
+    /* Session directory */
+    if (make_session_dir(s->dir, sizeof(s->dir)) != 0)
     {
-        fprintf(stderr, "Path too long for logs_dir\n");
+        fprintf(stderr, "Failed to create session directory\n");
         return -1;
     }
+    s->name = strrchr(s->dir, '/') + 1;
+    s->admitted = check_free_space();
 
-    DIR *dir = opendir(logs_dir);
-    if (!dir)
+    arena_init(&s->arena);
+
+    /* Decode workers, and their batches from the shared pool */
+    s->decoder = decoder_new();
+    if (!s->decoder)
     {
-        fprintf(stderr, "convert_and_publish: cannot open %s: %s\n",
-                logs_dir, strerror(errno));
+        fprintf(stderr, "session_prepare: out of memory\n");
+        session_discard(s);
         return -1;
     }
 
-    /* Setup MQTT */
-    mosquitto_lib_init();
-    struct mosquitto *m = mosquitto_new(NULL, true, NULL);
-    if (!m)
+    /* Broker connection, established in the background */
+    s->mqtt = mosquitto_new(NULL, true, NULL);
+    if (!s->mqtt)
     {
         fprintf(stderr, "mosquitto_new failed\n");
-        closedir(dir);
-        mosquitto_lib_cleanup();
+        session_discard(s);
         return -1;
     }
+    mosquitto_connect_callback_set(s->mqtt, on_mqtt_connect);
 
-    int rc = mosquitto_connect_async(m, MQTT_HOST, MQTT_PORT, 60);
+    int rc = mosquitto_connect_async(s->mqtt, MQTT_HOST, MQTT_PORT, 60);
     if (rc != MOSQ_ERR_SUCCESS)
     {
         fprintf(stderr, "mosquitto_connect failed: %s\n",
                 mosquitto_strerror(rc));
-        mosquitto_destroy(m);
-        closedir(dir);
-        mosquitto_lib_cleanup();
+        session_discard(s);
         return -1;
     }
+    mosquitto_loop_start(s->mqtt);
+    return 0;
+}
 
-    mosquitto_loop_start(m);
+static void *prewarm_main(void *arg)
+{
+    (void)arg;
+    prewarm.rc = session_prepare(&prewarm.s);
+    return NULL;
+}
 
-    struct dirent *de;
-    int total_files = 0;
-    int total_records = 0;
+static void prewarm_drop(void)
+{
+    if (prewarm.active)
+    {
+        pthread_join(prewarm.thread, NULL);
+        prewarm.active = 0;
+        if (prewarm.rc == 0)
+        {
+            session_discard(&prewarm.s);
+        }
+    }
+}
 
-    while ((de = readdir(dir)) != NULL)
+/* Milliseconds until the pre-warmed session goes stale, -1 if there is
+ * none */
+static int prewarm_ttl_ms(void)
+{
+    if (!prewarm.active)
     {
-        if (de->d_name[0] == '.')
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (long long)PREWARM_MAX_AGE_S * 1000 -
+                   ((long long)(now.tv_sec - prewarm.started.tv_sec) * 1000 +
+                    (now.tv_nsec - prewarm.started.tv_nsec) / 1000000);
+    return ms > 0 ? (int)ms : 0;
+}
+
+/* A USB event with no disk after it leaves a session holding a broker
+ * connection, decode workers and an empty directory: let it go */
+static void prewarm_expire(void)
+{
+    if (prewarm_ttl_ms() == 0)
+    {
+        printf("Pre-warmed session unclaimed for %d s, dropping it\n", PREWARM_MAX_AGE_S);
+        prewarm_drop();
+    }
+}
+
+/* Called on the USB enumeration event; no-op if already warming */
+static void prewarm_start(void)
+{
+    prewarm_expire();
+    if (prewarm.active)
+    {
+        return;
+    }
+
+    sigset_t old;
+    block_signals(&old);
+    int rc = pthread_create(&prewarm.thread, NULL, prewarm_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc == 0)
+    {
+        prewarm.active = 1;
+        clock_gettime(CLOCK_MONOTONIC, &prewarm.started);
+    }
+}
+
+/* Hand over the pre-warmed session, or prepare one now if there is none
+ * (or it is older than PREWARM_MAX_AGE_S, e.g. no block device followed) */
+static int prewarm_take(struct session *s)
+{
+    if (prewarm.active)
+    {
+        /* Monotonic, as the expiry: an NTP step at boot must not count */
+        bool fresh = prewarm_ttl_ms() > 0;
+        pthread_join(prewarm.thread, NULL);
+        prewarm.active = 0;
+
+        if (prewarm.rc == 0)
+        {
+            if (fresh)
+            {
+                *s = prewarm.s;
+                s->name = strrchr(s->dir, '/') + 1;
+                return 0;
+            }
+            session_discard(&prewarm.s);
+        }
+    }
+    return session_prepare(s);
+}
+
+/* ======================== RECORD DECODE + MQTT =================== */
+
+/* Publish the quality masks of one batch. Only flag/channel pairs that
+ * fired are included; each mask is hex, byte k covering records 8k..8k+7
+ * of the batch with bit 0 = record 8k. */
+static void publish_quality_masks(struct mosquitto *m,
+                                  const char *session_name,
+                                  const char *file_name,
+                                  const struct record_batch *b)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t cap = 512 + IMU_CHANNELS * QUALITY_FLAGS * (48 + BATCH_RECORDS / 4);
+    char *payload = pool_get(cap);
+    if (!payload)
+    {
+        fprintf(stderr, "publish_quality_masks: out of memory\n");
+        return;
+    }
+
+    int n = snprintf(payload, cap,
+                     "{\"session\":\"%s\",\"file\":\"%s\","
+                     "\"first_timestamp_ms\":%u,\"records\":%zu,\"masks\":{",
+                     session_name, file_name, b->timestamp_ms[0], b->n);
+    if (n < 0 || (size_t)n >= cap)
+    {
+        fprintf(stderr, "Quality payload truncated for %s\n", file_name);
+        pool_put(payload);
+        return;
+    }
+    size_t len = (size_t)n;
+    const char *ch_sep = "";
+
+    for (int c = 0; c < IMU_CHANNELS; c++)
+    {
+        uint8_t seen = 0;
+        for (size_t i = 0; i < b->n; i++)
+        {
+            seen |= b->quality[c][i];
+        }
+        if (!seen)
         {
             continue;
         }
 
-        const char *dot = strrchr(de->d_name, '.');
-        if (!dot || (strcmp(dot, ".BIN") != 0 && strcmp(dot, ".bin") != 0))
+        len += (size_t)sprintf(payload + len, "%s\"%s\":{", ch_sep, imu_channel_names[c]);
+        ch_sep = ",";
+
+        const char *flag_sep = "";
+        for (int f = 0; f < QUALITY_FLAGS; f++)
+        {
+            uint8_t bit = (uint8_t)(1u << f);
+            if (!(seen & bit))
+            {
+                continue;
+            }
+
+            len += (size_t)sprintf(payload + len, "%s\"%s\":\"", flag_sep, quality_flag_names[f]);
+            flag_sep = ",";
+
+            for (size_t k = 0; k < b->n; k += 8)
+            {
+                uint8_t byte = 0;
+                for (size_t j = 0; j < 8 && k + j < b->n; j++)
+                {
+                    byte |= (uint8_t)(((b->quality[c][k + j] & bit) != 0) << j);
+                }
+                payload[len++] = hex[byte >> 4];
+                payload[len++] = hex[byte & 0xf];
+            }
+            payload[len++] = '"';
+        }
+        payload[len++] = '}';
+    }
+    payload[len++] = '}';
+    payload[len++] = '}';
+
+    int rc = mosquitto_publish(m, NULL, MQTT_QUALITY_TOPIC,
+                               (int)len, payload, 0, false);
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+        fprintf(stderr, "mosquitto_publish(quality) failed: %s\n",
+                mosquitto_strerror(rc));
+    }
+    pool_put(payload);
+}
+
+/* One summary per session: record counts, the overall quality score and,
+ * when it was built, the Merkle root to check the session against */
+static void publish_session_summary(struct mosquitto *m,
+                                    const char *session_name,
+                                    int total_files,
+                                    int total_records,
+                                    const struct quality_state *qs,
+                                    const struct merkle *mk)
+{
+    char payload[2048];
+    size_t cap = sizeof(payload);
+    int n = snprintf(payload, cap,
+                     "{\"session\":\"%s\",\"files\":%d,\"records\":%d,"
+                     "\"quality_score\":%.6f,\"flagged\":{",
+                     session_name, total_files, total_records,
+                     quality_score(qs));
+    size_t len = (n > 0 && (size_t)n < cap) ? (size_t)n : cap;
+
+    const char *ch_sep = "";
+    for (int c = 0; c < IMU_CHANNELS && len < cap; c++)
+    {
+        n = snprintf(payload + len, cap - len,
+                     "%s\"%s\":{\"%s\":%llu,\"%s\":%llu,\"%s\":%llu}",
+                     ch_sep, imu_channel_names[c],
+                     quality_flag_names[0], (unsigned long long)qs->flagged[c][0],
+                     quality_flag_names[1], (unsigned long long)qs->flagged[c][1],
+                     quality_flag_names[2], (unsigned long long)qs->flagged[c][2]);
+        len = (n > 0 && (size_t)n < cap - len) ? len + (size_t)n : cap;
+        ch_sep = ",";
+    }
+    if (mk && len < cap)
+    {
+        char root[2 * MERKLE_HASH + 1];
+        hex_encode(mk->root, MERKLE_HASH, root);
+        n = snprintf(payload + len, cap - len,
+                     "},\"merkle\":{\"root\":\"%s\",\"blocks\":%zu,\"block_records\":%d",
+                     root, mk->nodes[0], MERKLE_BLOCK_RECORDS);
+        len = (n > 0 && (size_t)n < cap - len) ? len + (size_t)n : cap;
+    }
+    if (len + 2 >= cap)
+    {
+        fprintf(stderr, "Summary payload truncated for %s\n", session_name);
+        return;
+    }
+    payload[len++] = '}';
+    payload[len++] = '}';
+
+    printf("Session %s quality score %.4f\n", session_name, quality_score(qs));
+
+    int rc = mosquitto_publish(m, NULL, MQTT_SUMMARY_TOPIC,
+                               (int)len, payload, 0, false);
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+        fprintf(stderr, "mosquitto_publish(summary) failed: %s\n",
+                mosquitto_strerror(rc));
+    }
+}
+
+/* Dashboards get the preview and the coarse pyramid levels straight
+ * after the summary, coarsest first; finer levels stay in PYRAMID_FILE */
+static void publish_pyramid(struct mosquitto *m, const char *session_name,
+                            const struct pyramid *pyr)
+{
+    if (pyr->levels == 0)
+    {
+        return;
+    }
+    char *payload = pool_get(PYRAMID_JSON_CAP);
+    if (!payload)
+    {
+        fprintf(stderr, "Out of memory for the pyramid of %s\n", session_name);
+        return;
+    }
+
+    for (int k = pyr->levels; k >= 0; k--)
+    {
+        if (k < pyr->levels && pyr->buckets[k] > PYRAMID_PUBLISH_BUCKETS)
+        {
+            break;
+        }
+        size_t len = k == pyr->levels
+                         ? pyramid_encode_preview(pyr, session_name, payload, PYRAMID_JSON_CAP)
+                         : pyramid_encode_level(pyr, k, session_name, payload, PYRAMID_JSON_CAP);
+        if (len == 0)
         {
+            fprintf(stderr, "Pyramid payload truncated for %s\n", session_name);
             continue;
         }
 
+        int rc = mosquitto_publish(m, NULL, MQTT_PYRAMID_TOPIC, (int)len, payload, 0, false);
+        if (rc != MOSQ_ERR_SUCCESS)
+        {
+            fprintf(stderr, "mosquitto_publish(pyramid) failed: %s\n", mosquitto_strerror(rc));
+            break;
+        }
+    }
+    pool_put(payload);
+}
+
+/* Decode + quality check, publishing the quality events and the summary
+ * right away; the samples themselves go out later via bulk_publish.
+ * s->dir is e.g. /home/.../extracted/20251118_102030 */
+static int convert_and_publish(struct session *s)
+{
+    char logs_dir[PATH_MAX];
+
+    if (join_path(s->dir, LOGS_SUBDIR, logs_dir, sizeof(logs_dir)) != 0)
+    {
+        fprintf(stderr, "Path too long for logs_dir\n");
+        return -1;
+    }
+
+    char **names;
+    int nfiles = archive_list_bins(logs_dir, &names);
+    if (nfiles < 0)
+    {
+        fprintf(stderr, "convert_and_publish: cannot open %s: %s\n",
+                logs_dir, strerror(errno));
+        return -1;
+    }
+
+    /* SoA batches, decoded straight from the file mappings in parallel and
+     * handed back in record order */
+    struct decoder *dec = s->decoder;
+    struct mosquitto *m = s->mqtt;
+    const char *session_name = s->name;
+
+    struct quality_state *qs = arena_alloc(&s->arena, sizeof(*qs));
+    struct pyramid *pyr = arena_alloc(&s->arena, sizeof(*pyr));
+    struct merkle *mk = arena_alloc(&s->arena, sizeof(*mk));
+    if (!qs || !pyr || !mk)
+    {
+        fprintf(stderr, "convert_and_publish: out of memory\n");
+        archive_free_list(names, nfiles);
+        return -1;
+    }
+    quality_init(qs);
+    pyramid_init(pyr);
+    int pyr_ok = 1;
+    merkle_init(mk);
+    int mk_ok = 1;
+
+    int total_files = 0;
+    int total_records = 0;
+
+    for (int f = 0; f < nfiles; f++)
+    {
         char file_path[PATH_MAX];
-        if (join_path(logs_dir, de->d_name, file_path, sizeof(file_path)) != 0)
+        if (join_path(logs_dir, names[f], file_path, sizeof(file_path)) != 0)
         {
-            fprintf(stderr, "Path too long for %s\n", de->d_name);
+            fprintf(stderr, "Path too long for %s\n", names[f]);
             continue;
         }
 
-        FILE *fp = fopen(file_path, "rb");
-        if (!fp)
+        const struct archive_map *am = archive_map_open(file_path);
+        if (!am)
         {
             fprintf(stderr, "Failed to open %s: %s\n", file_path, strerror(errno));
             continue;
@@ -459,71 +858,50 @@ static int convert_and_publish(const char *session_root)
         printf("Decoding %s ...\n", file_path);
         ++total_files;
 
-        uint8_t buf[RECORD_SIZE];
-        size_t n;
-
-        while ((n = fread(buf, 1, RECORD_SIZE, fp)) == RECORD_SIZE)
+        decoder_open(dec, am, 0);
+        struct record_batch *batch;
+        size_t pos = 0;
+        while ((batch = decoder_next(dec)) != NULL)
         {
-            uint32_t ts_ms;
-            uint8_t ml_la; 
-            float p_pa, acc[3], gyr[3];
-
-            decode_record(buf, &ts_ms, &p_pa, &ml_la, acc, gyr);
-
-            char payload[256];
-            int len = snprintf(payload, sizeof(payload),
-                               "{\"timestamp_ms\":%u,"
-                               "\"pressure_pa\":%.2f,"
-                               "\"predicted\":%u,"
-                               "\"acceleration\":[%.2f,%.2f,%.2f],"
-                               "\"gyroscope\":[%.2f,%.2f,%.2f]}",
-                               ts_ms, p_pa, ml_la,
-                               acc[0], acc[1], acc[2],
-                               gyr[0], gyr[1], gyr[2]);
-
-            if (len < 0 || (size_t)len >= sizeof(payload))
-            {
-                fprintf(stderr, "Payload truncated for timestamp %u\n", ts_ms);
-                continue;
-            }
-
-            if (len > 0 && (size_t)len < sizeof(payload))
+            if (quality_run(qs, batch) > 0)
             {
-                /* Print the JSON we are about to publish */
-                printf("MQTT JSON -> %s\n", payload);
-                fflush(stdout); /* helpful if running under systemd */
+                publish_quality_masks(m, session_name, names[f], batch);
             }
-
-            rc = mosquitto_publish(m, NULL, MQTT_TOPIC,
-                                   (int)len, payload, 0, false);
-            if (rc != MOSQ_ERR_SUCCESS)
+            if (pyr_ok && pyramid_add(pyr, batch) != 0)
             {
-                fprintf(stderr, "mosquitto_publish failed: %s\n",
-                        mosquitto_strerror(rc));
+                fprintf(stderr, "Out of memory for the pyramid, skipping it\n");
+                pyr_ok = 0;
             }
-            else
+            if (mk_ok && merkle_add(mk, (uint32_t)f, pos, am->data + pos * RECORD_SIZE, batch->n) != 0)
             {
-                ++total_records;
+                fprintf(stderr, "Out of memory for the Merkle tree, skipping it\n");
+                mk_ok = 0;
             }
+            pos += batch->n;
+            total_records += (int)batch->n;
+            decoder_release(dec);
         }
+        decoder_close(dec);
 
-        if (ferror(fp))
-        {
-            fprintf(stderr, "Read error in %s\n", file_path);
-        }
-
-        fclose(fp);
+        archive_map_release(am);
     }
 
-    closedir(dir);
+    archive_free_list(names, nfiles);
 
-    mosquitto_loop_stop(m, true);
-    mosquitto_disconnect(m);
-    mosquitto_destroy(m);
-    mosquitto_lib_cleanup();
+    /* The summary carries the root only if the tree is on disk to answer
+     * proofs */
+    mk_ok = mk_ok && merkle_finish(mk) == 0 && merkle_write(mk, s->dir) == 0;
+    publish_session_summary(m, session_name, total_files, total_records, qs, mk_ok ? mk : NULL);
+    merkle_free(mk);
+
+    if (pyr_ok && pyramid_finish(pyr) == 0 && pyramid_write(pyr, s->dir) == 0)
+    {
+        publish_pyramid(m, session_name, pyr);
+    }
+    pyramid_free(pyr);
 
-    printf("Published %d records from %d file(s) for session %s\n",
-           total_records, total_files, session_root);
+    printf("Checked %d records from %d file(s) for session %s\n",
+           total_records, total_files, s->dir);
 
     return 0;
 }
@@ -555,19 +933,110 @@ static int archive_session(const char *session_root)
     }
 
     printf("Archived session to %s\n", dst);
+    bulk_publisher_enqueue(name);
+    s3_uploader_enqueue(name);
     return 0;
 }
 
 /* ============================= UDEV WAIT ========================= */
 
+/* Device serial as a single MQTT topic level */
+static void topic_safe_serial(const char *serial, char *out, size_t out_sz)
+{
+    size_t i = 0;
+    for (; serial && serial[i] && i + 1 < out_sz; i++)
+    {
+        unsigned char ch = (unsigned char)serial[i];
+        out[i] = (ch <= ' ' || ch >= 0x7f || ch == '/' || ch == '+' || ch == '#') ? '_' : (char)ch;
+    }
+    out[i] = '\0';
+}
+
+/* Is ev the target_action event of our block device? Starts pre-warming
+ * on the USB enumeration that precedes it. */
+static int match_event(const struct uevent *ev,
+                       const char *target_action,
+                       char *out_devnode,
+                       size_t out_sz,
+                       char *out_serial,
+                       size_t serial_sz)
+{
+    const char *action = ev->action;
+    const char *subsys = ev->subsystem;
+    const char *devtype = ev->devtype;
+    const char *vid = ev->vendor_id;
+    const char *pid = ev->model_id;
+    const char *node = ev->devnode;
+
+    int ours = vid && pid &&
+               !strcasecmp(vid, WEARABLE_VENDOR_HEX) &&
+               !strcasecmp(pid, WEARABLE_PRODUCT_HEX);
+
+    /* USB enumeration comes well before the disk: start pre-warming */
+    if (ours && !strcmp(target_action, "add") &&
+        action && !strcmp(action, "add") &&
+        subsys && !strcmp(subsys, "usb") &&
+        devtype && !strcmp(devtype, "usb_device"))
+    {
+        ++udev_events_matched;
+        printf("  udev: USB %s:%s enumerated, pre-warming pipeline\n", vid, pid);
+        prewarm_start();
+        return 0;
+    }
+
+    if (ours &&
+        action && !strcmp(action, target_action) &&
+        subsys && !strcmp(subsys, "block") &&
+        devtype && !strcmp(devtype, "disk"))
+    {
+
+        ++udev_events_matched;
+        printf("  udev: %s event for %s (VID=%s PID=%s, %lu/%lu events matched)\n",
+               target_action,
+               node ? node : "(unknown)",
+               vid, pid,
+               udev_events_matched, udev_events_received);
+
+        if (out_devnode && out_sz > 0 && node)
+        {
+            strncpy(out_devnode, node, out_sz);
+            out_devnode[out_sz - 1] = '\0';
+        }
+        if (out_serial && serial_sz > 0)
+        {
+            topic_safe_serial(ev->serial, out_serial, serial_sz);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* Returns 0 on a match, 1 if an upgrade was requested, 2 with *item set
+ * when an inbox item is ready, -1 on quit/error */
 static int wait_for_device(struct udev_monitor *mon,
                            const char *target_action,
                            char *out_devnode,
-                           size_t out_sz)
+                           size_t out_sz,
+                           char *out_serial,
+                           size_t serial_sz,
+                           struct inbox_item *item)
 {
     int fd = udev_monitor_get_fd(mon);
-    struct pollfd fds[1] = {
-        {.fd = fd, .events = POLLIN}};
+    struct pollfd fds[2] = {
+        {.fd = fd, .events = POLLIN},
+        {.fd = inbox_fd, .events = POLLIN}}; /* ignored by poll if -1 */
+
+    /* Events that were queued for the process we took over from */
+    struct uevent ev;
+    char raw[8192];
+    while (handover_next_event(&handover, &ev, raw, sizeof(raw)))
+    {
+        ++udev_events_received;
+        if (match_event(&ev, target_action, out_devnode, out_sz, out_serial, serial_sz))
+        {
+            return 0;
+        }
+    }
 
     for (;;)
     {
@@ -575,8 +1044,22 @@ static int wait_for_device(struct udev_monitor *mon,
         {
             return -1;
         }
+        if (upgrade_flag)
+        {
+            return 1;
+        }
+        if (inbox_fd >= 0 && inbox_next(item))
+        {
+            return 2;
+        }
 
-        int ret = poll(fds, 1, -1);
+        /* Wake to drop a pre-warmed session nobody claimed */
+        int ret = poll(fds, 2, prewarm_ttl_ms());
+        if (ret == 0)
+        {
+            prewarm_expire();
+            continue;
+        }
         if (ret < 0)
         {
             if (errno == EINTR && quit_flag)
@@ -591,6 +1074,10 @@ static int wait_for_device(struct udev_monitor *mon,
             return -1;
         }
 
+        if (fds[1].revents & POLLIN)
+        {
+            inbox_read();
+        }
         if (!(fds[0].revents & POLLIN))
         {
             continue;
@@ -602,50 +1089,90 @@ static int wait_for_device(struct udev_monitor *mon,
             continue;
         }
 
-        const char *action = udev_device_get_action(dev);
-        const char *subsys = udev_device_get_subsystem(dev);
-        const char *devtype = udev_device_get_devtype(dev);
-
-        const char *vid = udev_device_get_property_value(dev, "ID_VENDOR_ID");
-        const char *pid = udev_device_get_property_value(dev, "ID_MODEL_ID");
-        const char *node = udev_device_get_devnode(dev);
-
-        if (action && !strcmp(action, target_action) &&
-            subsys && !strcmp(subsys, "block") &&
-            devtype && !strcmp(devtype, "disk") &&
-            vid && pid &&
-            !strcasecmp(vid, WEARABLE_VENDOR_HEX) &&
-            !strcasecmp(pid, WEARABLE_PRODUCT_HEX))
+        ev.seqnum = udev_device_get_seqnum(dev);
+        if (ev.seqnum && ev.seqnum <= handover.last_seqnum)
         {
-
-            printf("  udev: %s event for %s (VID=%s PID=%s)\n",
-                   target_action,
-                   node ? node : "(unknown)",
-                   vid, pid);
-
-            if (out_devnode && out_sz > 0 && node)
-            {
-                strncpy(out_devnode, node, out_sz);
-                out_devnode[out_sz - 1] = '\0';
-            }
-
+            /* Already seen on the inherited socket */
             udev_device_unref(dev);
-            return 0;
+            continue;
         }
+        ++udev_events_received;
 
+        ev.action = udev_device_get_action(dev);
+        ev.subsystem = udev_device_get_subsystem(dev);
+        ev.devtype = udev_device_get_devtype(dev);
+        ev.devnode = udev_device_get_devnode(dev);
+        ev.vendor_id = udev_device_get_property_value(dev, "ID_VENDOR_ID");
+        ev.model_id = udev_device_get_property_value(dev, "ID_MODEL_ID");
+        ev.serial = udev_device_get_property_value(dev, "ID_SERIAL_SHORT");
+
+        int matched = match_event(&ev, target_action, out_devnode, out_sz, out_serial, serial_sz);
         udev_device_unref(dev);
+        if (matched)
+        {
+            return 0;
+        }
     }
 }
 
 /* ============================= HANDLER =========================== */
 
-static void handle_device(const char *disk_devnode)
+/* Kept with the session so deferred publishing knows the source device */
+static int write_session_serial(const char *session_dir, const char *serial)
+{
+    char path[PATH_MAX];
+    if (join_path(session_dir, SESSION_SERIAL_FILE, path, sizeof(path)) != 0)
+    {
+        return -1;
+    }
+    FILE *f = fopen(path, "we");
+    if (!f)
+    {
+        return -1;
+    }
+    fprintf(f, "%s\n", serial);
+    return fclose(f);
+}
+
+/* Plug-in time, for the plug-to-broker latency of the deferred samples */
+static int write_session_plugged(const char *session_dir, const struct timespec *t)
+{
+    char path[PATH_MAX];
+    if (join_path(session_dir, SESSION_PLUGGED_FILE, path, sizeof(path)) != 0)
+    {
+        return -1;
+    }
+    FILE *f = fopen(path, "we");
+    if (!f)
+    {
+        return -1;
+    }
+    fprintf(f, "%lld.%09ld\n", (long long)t->tv_sec, t->tv_nsec);
+    return fclose(f);
+}
+
+static void handle_device(const char *disk_devnode, const char *serial)
 {
+    /* 0) Session state, normally pre-warmed since USB enumeration */
+    struct session sess;
+    if (prewarm_take(&sess) != 0)
+    {
+        fprintf(stderr, "Failed to prepare session\n");
+        return;
+    }
+    if (!sess.admitted)
+    {
+        fprintf(stderr, "Not enough free space, leaving logs on the wearable\n");
+        session_discard(&sess);
+        return;
+    }
+
     /* 1) Mount exFAT from this disk */
     char mounted_dev[PATH_MAX];
     if (mount_exfat(disk_devnode, mounted_dev, sizeof(mounted_dev)) != 0)
     {
         fprintf(stderr, "Failed to mount %s as exFAT\n", disk_devnode);
+        session_discard(&sess);
         return;
     }
 
@@ -655,6 +1182,7 @@ static void handle_device(const char *disk_devnode)
     {
         fprintf(stderr, "src_logs path too long\n");
         ensure_unmounted(MOUNT_POINT);
+        session_discard(&sess);
         return;
     }
 
@@ -672,30 +1200,33 @@ static void handle_device(const char *disk_devnode)
     {
         fprintf(stderr, "Timed out waiting for %s\n", src_logs);
         ensure_unmounted(MOUNT_POINT);
+        session_discard(&sess);
         return;
     }
 
-    /* 3) Prepare destination session directory */
-    char session_dir[PATH_MAX];
-    if (make_session_dir(session_dir, sizeof(session_dir)) != 0)
+    /* 3) Destination inside the pre-made session directory */
+    char dest_logs[PATH_MAX];
+    if (join_path(sess.dir, LOGS_SUBDIR, dest_logs, sizeof(dest_logs)) != 0)
     {
-        fprintf(stderr, "Failed to create session directory\n");
+        fprintf(stderr, "dest_logs path too long\n");
         ensure_unmounted(MOUNT_POINT);
+        session_discard(&sess);
         return;
     }
 
-    char dest_logs[PATH_MAX];
-    if (join_path(session_dir, LOGS_SUBDIR, dest_logs, sizeof(dest_logs)) != 0)
+    char manifest[PATH_MAX];
+    if (join_path(sess.dir, SCRUB_MANIFEST, manifest, sizeof(manifest)) != 0)
     {
-        fprintf(stderr, "dest_logs path too long\n");
+        fprintf(stderr, "manifest path too long\n");
         ensure_unmounted(MOUNT_POINT);
+        session_discard(&sess);
         return;
     }
 
-    printf("Session dir: %s\n", session_dir);
+    printf("Session dir: %s\n", sess.dir);
 
     /* 4) Copy + delete log files from wearable */
-    if (copy_and_delete_logs(src_logs, dest_logs) != 0)
+    if (copy_logs(src_logs, dest_logs, manifest, true) < 0)
     {
         fprintf(stderr, "Error copying log files\n");
     }
@@ -703,19 +1234,250 @@ static void handle_device(const char *disk_devnode)
     /* 5) Unmount as early as possible */
     ensure_unmounted(MOUNT_POINT);
 
+    if (serial[0] && write_session_serial(sess.dir, serial) != 0)
+    {
+        fprintf(stderr, "Failed to record device serial\n");
+    }
+    if (write_session_plugged(sess.dir, &sess.plug_time) != 0)
+    {
+        fprintf(stderr, "Failed to record plug-in time\n");
+    }
+
     /* 6) Decode + publish over MQTT */
-    convert_and_publish(session_dir);
+    convert_and_publish(&sess);
+    session_release(&sess);
 
     /* 7) Archive session folder */
-    archive_session(session_dir);
+    archive_session(sess.dir);
+}
+
+/* base/logs if the drop follows the card layout, else base itself. A
+ * logs that is a symlink (from a tarball) is refused, not followed. */
+static int logs_root(const char *base, char *out, size_t sz)
+{
+    struct stat st;
+    if (join_path(base, LOGS_SUBDIR, out, sz) != 0)
+    {
+        return -1;
+    }
+    if (lstat(out, &st) == 0)
+    {
+        if (S_ISDIR(st.st_mode))
+        {
+            return 0;
+        }
+        if (S_ISLNK(st.st_mode))
+        {
+            fprintf(stderr, "%s is a symlink, not following it\n", out);
+            return -1;
+        }
+    }
+    return join_path(base, ".", out, sz);
+}
+
+/* Logs of one inbox item into the session. Returns the number copied. */
+static int copy_inbox_logs(const struct inbox_item *item, const char *dest_logs,
+                           const char *manifest)
+{
+    char src_logs[PATH_MAX];
+    int copied = -1;
+
+    switch (item->kind)
+    {
+    case INBOX_BIN:
+    {
+        if (ensure_dir(dest_logs) != 0)
+        {
+            return -1;
+        }
+        FILE *mf = fopen(manifest, "a");
+        if (!mf)
+        {
+            fprintf(stderr, "Cannot write %s: %s\n", manifest, strerror(errno));
+            return -1;
+        }
+        copied = copy_log(item->path, item->name, dest_logs, mf) == 0 ? 1 : -1;
+        fclose(mf);
+        break;
+    }
+
+    case INBOX_IMAGE:
+        if (mount_image(item->path) != 0)
+        {
+            return -1;
+        }
+        if (logs_root(MOUNT_POINT, src_logs, sizeof(src_logs)) == 0)
+        {
+            copied = copy_logs(src_logs, dest_logs, manifest, false);
+        }
+        ensure_unmounted(MOUNT_POINT);
+        break;
+
+    case INBOX_TARBALL:
+    {
+        char *rm[] = {"rm", "-rf", INBOX_STAGING, NULL};
+        char *tar[] = {"tar", "-xf", (char *)item->path, "-C", INBOX_STAGING,
+                       "--no-same-owner", "--no-same-permissions", NULL};
+        (void)run_child(rm);
+        if (ensure_dir(INBOX_STAGING) != 0)
+        {
+            fprintf(stderr, "Cannot create %s: %s\n", INBOX_STAGING, strerror(errno));
+            return -1;
+        }
+        int rc = run_child(tar);
+        if (rc != 0)
+        {
+            fprintf(stderr, "tar -xf %s failed (rc=%d)\n", item->path, rc);
+        }
+        else if (logs_root(INBOX_STAGING, src_logs, sizeof(src_logs)) == 0)
+        {
+            copied = copy_logs(src_logs, dest_logs, manifest, false);
+        }
+        (void)run_child(rm);
+        break;
+    }
+    }
+    return copied;
+}
+
+/* Same stages as handle_device, with the inbox item in place of the card.
+ * The item is left in the inbox if it cannot be taken now. */
+static void handle_inbox(const struct inbox_item *item)
+{
+    printf("Inbox: %s\n", item->name);
+
+    struct session sess;
+    if (session_prepare(&sess) != 0)
+    {
+        fprintf(stderr, "Failed to prepare session, leaving %s in the inbox\n", item->name);
+        return;
+    }
+    if (!sess.admitted)
+    {
+        fprintf(stderr, "Not enough free space, leaving %s in the inbox\n", item->name);
+        session_discard(&sess);
+        return;
+    }
+
+    char dest_logs[PATH_MAX];
+    char manifest[PATH_MAX];
+    if (join_path(sess.dir, LOGS_SUBDIR, dest_logs, sizeof(dest_logs)) != 0 ||
+        join_path(sess.dir, SCRUB_MANIFEST, manifest, sizeof(manifest)) != 0)
+    {
+        fprintf(stderr, "session path too long\n");
+        session_discard(&sess);
+        return;
+    }
+
+    printf("Session dir: %s\n", sess.dir);
+
+    if (copy_inbox_logs(item, dest_logs, manifest) <= 0)
+    {
+        fprintf(stderr, "No logs taken from %s\n", item->name);
+        unlink(manifest);
+        session_discard(&sess);
+        inbox_done(item, 0);
+        return;
+    }
+
+    /* Drop time stands in for the plug-in time */
+    if (write_session_plugged(sess.dir, &sess.plug_time) != 0)
+    {
+        fprintf(stderr, "Failed to record plug-in time\n");
+    }
+
+    convert_and_publish(&sess);
+    session_release(&sess);
+
+    if (archive_session(sess.dir) == 0)
+    {
+        inbox_done(item, 1);
+    }
+}
+
+/* ======================= SERVICES + UPGRADE ====================== */
+
+static void services_start(void)
+{
+    /* Per-record samples follow the summaries when the link allows */
+    if (bulk_publisher_start(ARCHIVE_BASE, MQTT_HOST, MQTT_PORT, MQTT_TOPIC) != 0)
+    {
+        fprintf(stderr, "Bulk publisher not started, samples stay queued\n");
+    }
+
+    /* Bulk session upload runs in the background; MQTT stays live data */
+    if (s3_uploader_start(ARCHIVE_BASE, DS_HOME_DIR) != 0)
+    {
+        fprintf(stderr, "S3 uploader not started, sessions stay local\n");
+    }
+
+    /* Re-verify the archive against its manifests while the dock is idle */
+    if (scrubber_start(ARCHIVE_BASE) != 0)
+    {
+        fprintf(stderr, "Archive scrubber not started\n");
+    }
+
+    /* Subscribers that missed samples ask for exactly the missing range */
+    if (gapfill_start(ARCHIVE_BASE, MQTT_HOST, MQTT_PORT, MQTT_TOPIC) != 0)
+    {
+        fprintf(stderr, "Gap-fill not started\n");
+    }
+
+    /* Diagnostics (the sampling profiler) for whoever has a root shell */
+    if (control_start(CONTROL_SOCKET, PROFILE_DIR) != 0)
+    {
+        fprintf(stderr, "Control socket not started\n");
+    }
+}
+
+/* Every service keeps its progress on disk, so this is a checkpoint */
+static void services_stop(void)
+{
+    control_stop();
+    gapfill_stop();
+    scrubber_stop();
+    bulk_publisher_stop();
+    s3_uploader_stop();
+}
+
+/* Hand over to the binary on disk. Offloads run to completion before we
+ * get here; a pre-warmed session is dropped and prepared again by the new
+ * process. Returns only if the exec failed. */
+static void upgrade(struct udev_monitor *mon, enum handover_phase phase)
+{
+    upgrade_flag = 0;
+    printf("Upgrade requested, checkpointing\n");
+
+    prewarm_drop();
+    services_stop();
+
+    handover.phase = phase;
+    handover.events_received = udev_events_received;
+    handover.events_matched = udev_events_matched;
+    handover_exec(&handover, udev_monitor_get_fd(mon));
+
+    fprintf(stderr, "Upgrade failed, carrying on\n");
+    services_start();
 }
 
 /* =============================== MAIN ============================ */
 
-int main(void)
+int main(int argc, char *argv[])
 {
+    (void)argc;
+    handover_init(argv);
+
     signal(SIGINT, handle_sigint);
     signal(SIGTERM, handle_sigint);
+    signal(SIGHUP, handle_sighup);
+
+    if (handover_load(&handover))
+    {
+        udev_events_received = handover.events_received;
+        udev_events_matched = handover.events_matched;
+        printf("Resumed after upgrade, %s\n",
+               handover.phase == HANDOVER_WAIT_REMOVE ? "wearable still docked" : "idle");
+    }
 
     struct udev *udev = udev_new();
     if (!udev)
@@ -733,32 +1495,82 @@ int main(void)
         return 1;
     }
 
+    /* Subsystem and tag are both matched by the socket filter, so unrelated
+     * disk activity (loop devices, SD/USB storage) never wakes us up */
     udev_monitor_filter_add_match_subsystem_devtype(mon, "block", NULL);
+    udev_monitor_filter_add_match_subsystem_devtype(mon, "usb", "usb_device");
+    udev_monitor_filter_add_match_tag(mon, WEARABLE_UDEV_TAG);
     udev_monitor_enable_receiving(mon);
 
+    mosquitto_lib_init();
+
+    /* Copy and decode engines for this board, measured once and cached */
+    if (CALIBRATE && ensure_dir(SESSIONS_BASE) == 0)
+    {
+        calibrate(SESSIONS_BASE, NULL);
+    }
+    services_start();
+
+    /* Second source next to udev; a failure only costs the inbox */
+    inbox_fd = inbox_open(INBOX_DIR);
+    if (inbox_fd < 0)
+    {
+        fprintf(stderr, "Inbox %s not watched\n", INBOX_DIR);
+    }
+
     char disk_devnode[PATH_MAX];
+    char serial[64];
+    struct inbox_item item;
+    enum handover_phase phase = handover.phase;
 
     while (!quit_flag)
     {
-        printf("Waiting for USB %s:%s ...\n",
-               WEARABLE_VENDOR_HEX, WEARABLE_PRODUCT_HEX);
-
-        if (wait_for_device(mon, "add",
-                            disk_devnode, sizeof(disk_devnode)) != 0)
+        if (phase == HANDOVER_WAIT_ADD)
         {
+            printf("Waiting for USB %s:%s ...\n",
+                   WEARABLE_VENDOR_HEX, WEARABLE_PRODUCT_HEX);
+
+            int rc = wait_for_device(mon, "add",
+                                     disk_devnode, sizeof(disk_devnode),
+                                     serial, sizeof(serial), &item);
+            if (rc == 1)
+            {
+                upgrade(mon, HANDOVER_WAIT_ADD);
+                continue;
+            }
+            if (rc == 2)
+            {
+                handle_inbox(&item);
+                continue;
+            }
+            if (rc != 0)
+            {
+                if (quit_flag)
+                    break;
+                fprintf(stderr, "wait_for_device(add) failed\n");
+                break;
+            }
             if (quit_flag)
                 break;
-            fprintf(stderr, "wait_for_device(add) failed\n");
-            break;
-        }
-        if (quit_flag)
-            break;
 
-        printf("Wearable detected - processing\n");
-        handle_device(disk_devnode);
+            printf("Wearable detected - processing\n");
+            handle_device(disk_devnode, serial);
+            phase = HANDOVER_WAIT_REMOVE;
+        }
 
         printf("Waiting for removal ...\n");
-        if (wait_for_device(mon, "remove", NULL, 0) != 0)
+        int rc = wait_for_device(mon, "remove", NULL, 0, NULL, 0, &item);
+        if (rc == 1)
+        {
+            upgrade(mon, HANDOVER_WAIT_REMOVE);
+            continue;
+        }
+        if (rc == 2)
+        {
+            handle_inbox(&item);
+            continue;
+        }
+        if (rc != 0)
         {
             if (quit_flag)
                 break;
@@ -766,8 +1578,17 @@ int main(void)
             break;
         }
         printf("Device removed, ready for next.\n");
+        phase = HANDOVER_WAIT_ADD;
     }
 
+    printf("udev: %lu event(s) received, %lu matched\n",
+           udev_events_received,
+           udev_events_matched);
+
+    prewarm_drop();
+    services_stop();
+    inbox_close();
+    mosquitto_lib_cleanup();
     udev_monitor_unref(mon);
     udev_unref(udev);
     return 0;